@@ -0,0 +1,248 @@
+/*
+ * bench_fold - Phase timings of Foldcessing on a sketch folder
+ *
+ * Copyright (C) 2025 Foldcessing Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Builds foldcessing.c into itself and runs the fold phases directly, each timed on its own:
+// collect_files, collect_git_files for a sketch in a git checkout, concatenation
+// (write_fold_range), line map indexing (build_line_index) and translate_line lookups. Never
+// starts processing-java. Results go to stdout as CSV or JSON.
+
+#define main foldcessing_main
+#include "../foldcessing.c"
+#undef main
+
+#include <time.h>
+
+#define PHASE_COUNT 5
+#define MAX_RUNS 1000
+
+typedef struct {
+    const char *name;
+    const char *unit;            // What items counts
+    double samples[MAX_RUNS];    // Milliseconds per run
+    long long items;
+} Phase;
+
+double now_ms(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1000.0 / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void print_json_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') putchar('\\');
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+void usage(void) {
+    fprintf(stderr,
+        "Usage: bench_fold <sketch folder> [options]\n"
+        "  --runs N          repetitions of every phase (5)\n"
+        "  --lookups N       translate_line calls per run (1000000)\n"
+        "  --format F        csv or json (csv)\n"
+        "  --scan-threads N  override scan_threads from .foldcessing\n"
+        "  --read-threads N  override read_threads from .foldcessing\n");
+}
+
+int main(int argc, char *argv[]) {
+    int runs = 5;
+    int lookups = 1000000;
+    int json = 0;
+    int scan_threads = -1, read_threads = -1;
+
+    if (argc < 2 || argv[1][0] == '-') {
+        usage();
+        return 1;
+    }
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lookups") == 0 && i + 1 < argc) {
+            lookups = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            json = strcmp(argv[++i], "json") == 0;
+        } else if (strcmp(argv[i], "--scan-threads") == 0 && i + 1 < argc) {
+            scan_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--read-threads") == 0 && i + 1 < argc) {
+            read_threads = atoi(argv[++i]);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (runs < 1) runs = 1;
+    if (runs > MAX_RUNS) runs = MAX_RUNS;
+
+    if (!SetCurrentDirectory(argv[1])) {
+        fprintf(stderr, "Error: Cannot open sketch folder %s\n", argv[1]);
+        return 1;
+    }
+    char current_dir[MAX_PATH_LEN];
+    GetCurrentDirectory(sizeof(current_dir), current_dir);
+    sketch = foldcessing_open(current_dir, NULL);
+    if (!sketch) {
+        fprintf(stderr, "Error: Cannot open sketch folder %s\n", argv[1]);
+        return 1;
+    }
+    if (scan_threads >= 0) sketch->config.scan_threads = scan_threads;
+    if (read_threads >= 0) sketch->config.read_threads = read_threads;
+    char output_dir[MAX_PATH_LEN];
+    make_output_dir(current_dir, output_dir, sizeof(output_dir));
+    char output_file[MAX_PATH_LEN];
+    snprintf(output_file, sizeof(output_file), "%s" PATH_SEP "output.pde", output_dir);
+
+    static Phase phases[PHASE_COUNT] = {
+        {"collect_files", "files"},
+        {"collect_git", "files"},
+        {"concatenate", "bytes"},
+        {"line_map", "lines"},
+        {"translate_line", "lookups"},
+    };
+    long long output_size = 0;
+    unsigned long long checksum = 0;
+    int git_index = 1;
+    if (sketch->config.scan == SCAN_WALK) sketch->config.scan = SCAN_GIT;
+
+    for (int run = 0; run < runs; run++) {
+        double start = now_ms();
+        reset_files(sketch);
+        collect_files(sketch, current_dir, "");
+        phases[0].samples[run] = now_ms() - start;
+        phases[0].items = sketch->file_count;
+
+        // The git index must give the files of the walk in the same order
+        if (git_index) {
+            int walked_count = sketch->file_count;
+            char **walked = malloc(sizeof(char*) * (walked_count + 1));
+            for (int i = 0; i < walked_count; i++) walked[i] = _strdup(sketch->files[i].relative);
+
+            start = now_ms();
+            reset_files(sketch);
+            git_index = collect_git_files(sketch) > 0;
+            phases[1].samples[run] = now_ms() - start;
+            phases[1].items = sketch->file_count;
+
+            if (git_index) {
+                int same = sketch->file_count == walked_count;
+                for (int i = 0; same && i < walked_count; i++) {
+                    same = strcmp(walked[i], sketch->files[i].relative) == 0;
+                }
+                if (!same) {
+                    fprintf(stderr, "Error: The git index gave %d files, not the %d of the walk in its order\n",
+                            sketch->file_count, walked_count);
+                    return 1;
+                }
+            } else {
+                collect_files(sketch, current_dir, "");
+            }
+            for (int i = 0; i < walked_count; i++) free(walked[i]);
+            free(walked);
+        }
+
+        start = now_ms();
+        HANDLE out = CreateFile(output_file, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                                CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        FoldWriter writer = {0};
+        if (out == INVALID_HANDLE_VALUE || !writer_open(&writer, out, 0)) {
+            fprintf(stderr, "Error: Cannot create output file: %s\n", output_file);
+            return 1;
+        }
+        int current_line = write_fold_range(sketch, &writer, 0, sketch->file_count, 1);
+        output_size = writer_position(&writer);
+        writer_close(&writer);
+        CloseHandle(out);
+        if (writer.failed) {
+            fprintf(stderr, "Error: Cannot write output file: %s\n", output_file);
+            return 1;
+        }
+        sketch->map.total_lines = current_line - 1;
+        phases[2].samples[run] = now_ms() - start;
+        phases[2].items = output_size;
+
+        start = now_ms();
+        build_line_index(&sketch->map);
+        phases[3].samples[run] = now_ms() - start;
+        phases[3].items = sketch->map.total_lines;
+
+        // Lines spread over the whole output, the same ones every run
+        unsigned int state = 12345;
+        char translated[MAX_PATH_LEN];
+        start = now_ms();
+        for (int i = 0; i < lookups; i++) {
+            state = state * 1103515245u + 12345u;
+            int line = 1 + (int)((state >> 8) % (unsigned int)(sketch->map.total_lines > 0 ? sketch->map.total_lines : 1));
+            checksum += translate_line(&sketch->map, line, translated, sizeof(translated));
+        }
+        phases[4].samples[run] = now_ms() - start;
+        phases[4].items = lookups;
+    }
+
+    remove_output_dir(output_dir);
+
+    if (json) {
+        printf("{\"sketch\": ");
+        print_json_string(current_dir);
+        printf(", \"files\": %d, \"lines\": %d, \"bytes\": %lld, \"runs\": %d, \"phases\": [",
+               sketch->file_count, sketch->map.total_lines, output_size, runs);
+    } else {
+        printf("phase,unit,items,runs,min_ms,median_ms,max_ms,items_per_s,files,lines,bytes\n");
+    }
+
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        Phase *phase = &phases[p];
+        if (p == 1 && !git_index) continue;  // Not in a git checkout
+        qsort(phase->samples, runs, sizeof(double), compare_doubles);
+        double median = (runs % 2) ? phase->samples[runs / 2]
+                                   : (phase->samples[runs / 2 - 1] + phase->samples[runs / 2]) / 2;
+        double rate = median > 0 ? phase->items / (median / 1000.0) : 0;
+
+        if (json) {
+            printf("%s\n  {\"phase\": \"%s\", \"unit\": \"%s\", \"items\": %lld, \"min_ms\": %.3f, "
+                   "\"median_ms\": %.3f, \"max_ms\": %.3f, \"items_per_s\": %.0f}",
+                   p ? "," : "", phase->name, phase->unit, phase->items, phase->samples[0], median,
+                   phase->samples[runs - 1], rate);
+        } else {
+            printf("%s,%s,%lld,%d,%.3f,%.3f,%.3f,%.0f,%d,%d,%lld\n",
+                   phase->name, phase->unit, phase->items, runs, phase->samples[0], median,
+                   phase->samples[runs - 1], rate, sketch->file_count, sketch->map.total_lines, output_size);
+        }
+    }
+    if (json) printf("\n]}\n");
+
+    // Keeps the lookups from being optimized away
+    if (checksum == 0 && lookups > 0 && sketch->map.total_lines > 0) {
+        fprintf(stderr, "Warning: No line translated\n");
+    }
+    return 0;
+}
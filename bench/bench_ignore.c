@@ -0,0 +1,369 @@
+/*
+ * bench_ignore - Checks and times the compiled ignore pattern matcher
+ *
+ * Copyright (C) 2025 Foldcessing Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Builds foldcessing.c into itself. First a differential check: random pattern sets and
+// paths go through the compiled matcher (should_ignore) and through two backtracking
+// matchers, the one Foldcessing used before (legacy_wildcard_match, on the cases where its
+// rules and .gitignore's agree) and a straightforward .gitignore one built the same way
+// (reference_ignore). Any disagreement is printed and fails the run. Then a benchmark of
+// --patterns generated patterns against --paths paths, old matcher against compiled one,
+// written as CSV like bench_fold.
+
+#define main foldcessing_main
+#include "../foldcessing.c"
+#undef main
+
+#include <time.h>
+
+#define MAX_RUNS 1000
+
+double now_ms(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1000.0 / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+unsigned int rng_state = 1;
+
+int random_below(int n) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return (int)(rng_state % (unsigned int)n);
+}
+
+// The matcher should_ignore used to run: every pattern against the whole path, '*' crossing '/'
+int legacy_wildcard_match(const char *pattern, const char *str) {
+    while (*pattern && *str) {
+        if (*pattern == '*') {
+            pattern++;
+            if (!*pattern) return 1;
+            while (*str) {
+                if (legacy_wildcard_match(pattern, str)) return 1;
+                str++;
+            }
+            return 0;
+        } else if (*pattern == '?' || tolower(*pattern) == tolower(*str)) {
+            pattern++;
+            str++;
+        } else {
+            return 0;
+        }
+    }
+    while (*pattern == '*') pattern++;
+    return !*pattern && !*str;
+}
+
+// The patterns under test and their compiled matcher
+Config config = {0};
+IgnoreMatcher matcher = {0};
+
+int legacy_should_ignore(const char *relative_path) {
+    for (int i = 0; i < config.ignore_count; i++) {
+        if (legacy_wildcard_match(config.ignore_patterns[i], relative_path)) return 1;
+    }
+    return 0;
+}
+
+// .gitignore glob by backtracking: pattern starts at base, '*' and '?' stop at '/'
+int reference_glob(const char *base, const char *p, const char *s) {
+    int folder_start = (p == base || p[-1] == '/');
+    if (!*p) return !*s;
+
+    if (p[0] == '*' && p[1] == '*' && folder_start && p[2] == '/') {
+        // Any number of whole folders
+        if (reference_glob(base, p + 3, s)) return 1;
+        for (const char *c = s; *c; c++) {
+            if (*c == '/' && reference_glob(base, p + 3, c + 1)) return 1;
+        }
+        return 0;
+    }
+    if (p[0] == '*' && p[1] == '*' && folder_start && !p[2]) return 1;
+    if (*p == '*') {
+        while (*p == '*') p++;
+        for (const char *c = s;; c++) {
+            if (reference_glob(base, p, c)) return 1;
+            if (!*c || *c == '/') return 0;
+        }
+    }
+    if (!*s) return 0;
+    if (*p == '?') return *s != '/' && reference_glob(base, p + 1, s + 1);
+    return tolower((unsigned char)*p) == tolower((unsigned char)*s) && reference_glob(base, p + 1, s + 1);
+}
+
+// Does one .gitignore pattern match path (a folder if is_folder)?
+int reference_pattern(const char *pattern, const char *path, int is_folder, int *negated) {
+    char text[MAX_LINE];
+    *negated = (*pattern == '!');
+    if (*negated) pattern++;
+    snprintf(text, sizeof(text), "%s", pattern);
+    for (char *c = text; *c; c++) {
+        if (*c == '\\') *c = '/';
+    }
+
+    size_t len = strlen(text);
+    int folder_only = 0;
+    while (len > 0 && text[len - 1] == '/') {
+        text[--len] = '\0';
+        folder_only = 1;
+    }
+    if (len == 0 || (folder_only && !is_folder)) return 0;
+
+    if (strchr(text, '/')) {
+        const char *anchored = (text[0] == '/') ? text + 1 : text;
+        return reference_glob(anchored, anchored, path);
+    }
+
+    // Without a '/', the pattern is tried on the name at every depth
+    for (const char *s = path; s; s = strchr(s, '/') ? strchr(s, '/') + 1 : NULL) {
+        if (reference_glob(text, text, s)) return 1;
+    }
+    return 0;
+}
+
+// The last pattern matching decides; a path under an ignored folder is ignored
+int reference_ignore(const char *path, int is_folder) {
+    char prefix[MAX_PATH_LEN];
+    size_t len = strlen(path);
+    for (size_t i = 0; i <= len; i++) {
+        if (path[i] != '/' && path[i] != '\0') continue;
+        memcpy(prefix, path, i);
+        prefix[i] = '\0';
+        int folder = (i < len) || is_folder;
+
+        int ignored = 0, negated;
+        for (int p = 0; p < config.ignore_count; p++) {
+            if (reference_pattern(config.ignore_patterns[p], prefix, folder, &negated)) ignored = !negated;
+        }
+        if (ignored) return 1;
+    }
+    return 0;
+}
+
+void set_patterns(char **patterns, int count) {
+    config.ignore_patterns = patterns;
+    config.ignore_count = count;
+    config.ignore_capacity = count;
+    compile_ignore_patterns(&matcher, &config);
+}
+
+void random_pattern(char *out, size_t size) {
+    static const char *pieces[] = {"a", "b", "B", "ab", "*", "?", "**", "/", "**/", "/**"};
+    size_t len = 0;
+    out[0] = '\0';
+    if (random_below(6) == 0) out[len++] = '!';
+    int count = 1 + random_below(5);
+    for (int i = 0; i < count && len < size - 8; i++) {
+        const char *piece = pieces[random_below(10)];
+        memcpy(out + len, piece, strlen(piece));
+        len += strlen(piece);
+    }
+    if (random_below(4) == 0) out[len++] = '/';
+    out[len] = '\0';
+}
+
+void random_path(char *out, size_t size) {
+    static const char letters[] = "abBx";
+    size_t len = 0;
+    int depth = 1 + random_below(4);
+    for (int d = 0; d < depth && len < size - 8; d++) {
+        if (d) out[len++] = '/';
+        int name = 1 + random_below(3);
+        for (int i = 0; i < name; i++) out[len++] = letters[random_below(4)];
+    }
+    out[len] = '\0';
+}
+
+// Compare the compiled matcher with both backtracking ones, returns the number of mismatches
+int differential_check(int cases) {
+    char pattern_text[5][64];
+    char *patterns[5];
+    int mismatches = 0, legacy_cases = 0;
+
+    for (int c = 0; c < cases && mismatches < 20; c++) {
+        int count = 1 + random_below(5);
+        for (int i = 0; i < count; i++) {
+            random_pattern(pattern_text[i], sizeof(pattern_text[i]));
+            patterns[i] = pattern_text[i];
+        }
+        set_patterns(patterns, count);
+
+        // Plain '*' and '?' patterns on top-level names mean the same under both rule sets
+        int legacy_comparable = 1;
+        for (int i = 0; i < count; i++) {
+            if (strpbrk(patterns[i], "/!\\")) legacy_comparable = 0;
+        }
+
+        for (int k = 0; k < 50; k++) {
+            char path[64];
+            random_path(path, sizeof(path));
+            int is_folder = random_below(2);
+
+            int compiled = should_ignore(&matcher, path, is_folder);
+            int expected = reference_ignore(path, is_folder);
+            if (compiled != expected) {
+                mismatches++;
+                printf("MISMATCH %s %s: compiled %d, reference %d, patterns:", is_folder ? "folder" : "file",
+                       path, compiled, expected);
+                for (int i = 0; i < count; i++) printf(" %s", patterns[i]);
+                printf("\n");
+            }
+
+            if (legacy_comparable && !strchr(path, '/')) {
+                legacy_cases++;
+                int legacy = legacy_should_ignore(path);
+                if (compiled != legacy) {
+                    mismatches++;
+                    printf("MISMATCH %s: compiled %d, legacy %d, patterns:", path, compiled, legacy);
+                    for (int i = 0; i < count; i++) printf(" %s", patterns[i]);
+                    printf("\n");
+                }
+            }
+        }
+    }
+
+    fprintf(stderr, "differential: %d pattern sets, %d paths (%d against the legacy matcher), %d mismatches\n",
+            cases, cases * 50, legacy_cases, mismatches);
+    return mismatches;
+}
+
+// A mix of the kinds of patterns real .foldcessing files hold
+void generate_patterns(char **patterns, int count) {
+    for (int i = 0; i < count; i++) {
+        char text[64];
+        switch (i % 5) {
+        case 0: snprintf(text, sizeof(text), "*.tmp%d.pde", i); break;
+        case 1: snprintf(text, sizeof(text), "build%d/", i); break;
+        case 2: snprintf(text, sizeof(text), "src/gen%d/**", i); break;
+        case 3: snprintf(text, sizeof(text), "**/cache%d/*.pde", i); break;
+        default: snprintf(text, sizeof(text), "lib%d_*", i); break;
+        }
+        patterns[i] = _strdup(text);
+    }
+}
+
+// Paths like a sketch tree would produce, some of them hit by the generated patterns
+void generate_paths(char **paths, int count, int pattern_count) {
+    for (int i = 0; i < count; i++) {
+        char text[MAX_PATH_LEN];
+        int module = random_below(50), folder = random_below(20), hit = random_below(pattern_count);
+        switch (random_below(8)) {
+        case 0: snprintf(text, sizeof(text), "src/mod%d/f%d.tmp%d.pde", module, i, hit); break;
+        case 1: snprintf(text, sizeof(text), "src/gen%d/f%d.pde", hit, i); break;
+        case 2: snprintf(text, sizeof(text), "src/mod%d/cache%d/f%d.pde", module, hit, i); break;
+        default: snprintf(text, sizeof(text), "src/mod%d/sub%d/File%d.pde", module, folder, i); break;
+        }
+        paths[i] = _strdup(text);
+    }
+}
+
+void usage(void) {
+    fprintf(stderr,
+        "Usage: bench_ignore [options]\n"
+        "  --cases N      random pattern sets in the differential check (20000)\n"
+        "  --patterns N   patterns in the benchmark (1000)\n"
+        "  --paths N      paths in the benchmark (5000)\n"
+        "  --runs N       repetitions of every phase (5)\n"
+        "  --seed N       random seed (1)\n"
+        "  --check-only   skip the benchmark\n");
+}
+
+int main(int argc, char *argv[]) {
+    int cases = 20000, pattern_count = 1000, path_count = 5000, runs = 5, check_only = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cases") == 0 && i + 1 < argc) {
+            cases = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--patterns") == 0 && i + 1 < argc) {
+            pattern_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--paths") == 0 && i + 1 < argc) {
+            path_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            rng_state = (unsigned int)atoi(argv[++i]);
+            if (!rng_state) rng_state = 1;
+        } else if (strcmp(argv[i], "--check-only") == 0) {
+            check_only = 1;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (runs < 1) runs = 1;
+    if (runs > MAX_RUNS) runs = MAX_RUNS;
+    if (pattern_count < 1) pattern_count = 1;
+    if (path_count < 1) path_count = 1;
+
+    if (differential_check(cases) != 0) return 1;
+    if (check_only) return 0;
+
+    char **patterns = malloc(sizeof(char*) * pattern_count);
+    char **paths = malloc(sizeof(char*) * path_count);
+    generate_patterns(patterns, pattern_count);
+    generate_paths(paths, path_count, pattern_count);
+
+    static double samples[3][MAX_RUNS];
+    static const char *names[3] = {"compile", "legacy", "compiled"};
+    static const char *units[3] = {"patterns", "paths", "paths"};
+    long long items[3] = {pattern_count, path_count, path_count};
+    int legacy_hits = 0, compiled_hits = 0;
+
+    for (int run = 0; run < runs; run++) {
+        double start = now_ms();
+        set_patterns(patterns, pattern_count);
+        samples[0][run] = now_ms() - start;
+
+        start = now_ms();
+        legacy_hits = 0;
+        for (int i = 0; i < path_count; i++) legacy_hits += legacy_should_ignore(paths[i]);
+        samples[1][run] = now_ms() - start;
+
+        // The first pass builds the DFA states the paths need, time the second
+        for (int i = 0; i < path_count; i++) should_ignore(&matcher, paths[i], 0);
+        start = now_ms();
+        compiled_hits = 0;
+        for (int i = 0; i < path_count; i++) compiled_hits += should_ignore(&matcher, paths[i], 0);
+        samples[2][run] = now_ms() - start;
+    }
+
+    printf("phase,unit,items,runs,min_ms,median_ms,max_ms,items_per_s,patterns,states,ignored\n");
+    for (int p = 0; p < 3; p++) {
+        qsort(samples[p], runs, sizeof(double), compare_doubles);
+        double median = (runs % 2) ? samples[p][runs / 2]
+                                   : (samples[p][runs / 2 - 1] + samples[p][runs / 2]) / 2;
+        double rate = median > 0 ? items[p] / (median / 1000.0) : 0;
+        printf("%s,%s,%lld,%d,%.3f,%.3f,%.3f,%.0f,%d,%d,%d\n", names[p], units[p], items[p], runs,
+               samples[p][0], median, samples[p][runs - 1], rate, pattern_count,
+               matcher.state_count, p == 1 ? legacy_hits : compiled_hits);
+    }
+    return 0;
+}
@@ -0,0 +1,216 @@
+/*
+ * bench_lookup - Checks and times the output.pde line lookup index
+ *
+ * Copyright (C) 2025 Foldcessing Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Builds foldcessing.c into itself and lays out a line map of --files files the way a fold
+// does (a header line, the file's lines, a blank line). The lines at the ends of every file,
+// and random ones, are then looked up with the linear scan translate_line used to do
+// (legacy_find_source_file) and through both kinds of index build_line_index makes, the
+// dense table and the sorted start lines; any disagreement fails the run. Then --lookups
+// random lines are timed with each, written as CSV like bench_fold.
+
+#define main foldcessing_main
+#include "../foldcessing.c"
+#undef main
+
+#include <time.h>
+
+#define MAX_RUNS 1000
+#define PHASE_COUNT 5
+
+double now_ms(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1000.0 / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+unsigned int rng_state = 1;
+
+int random_below(int n) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return (int)(rng_state % (unsigned int)n);
+}
+
+// The lookup translate_line used to do: every range in turn
+int legacy_find_source_file(const LineMap *map, int line) {
+    for (int i = 0; i < map->count; i++) {
+        if (line >= map->ranges[i].start_line && line <= map->ranges[i].end_line) return i;
+    }
+    return -1;
+}
+
+// The index build_line_index makes for sketches over DENSE_INDEX_MAX_LINES lines
+void build_sparse_index(LineMap *map) {
+    free(map->line_index);
+    free(map->line_starts);
+    map->line_index = NULL;
+    map->line_index_lines = 0;
+    map->line_starts = malloc(sizeof(int) * (map->count ? map->count : 1));
+    for (int i = 0; i < map->count; i++) map->line_starts[i] = map->ranges[i].start_line;
+}
+
+// Files of 1 to 2 * lines lines, an empty one now and then
+void generate_map(LineMap *map, int files, int lines) {
+    memset(map, 0, sizeof(*map));
+    map->ranges = malloc(sizeof(LineMapping) * files);
+    map->count = files;
+    int line = 1;
+    for (int i = 0; i < files; i++) {
+        int length = random_below(20) ? 1 + random_below(2 * lines) : 0;
+        map->ranges[i].start_line = line + 1;
+        map->ranges[i].end_line = line + length;
+        map->ranges[i].relative = "file.pde";
+        line += length + 2;
+    }
+    map->total_lines = line - 1;
+}
+
+int check_line(LineMap *dense, LineMap *sparse, int line) {
+    int expected = legacy_find_source_file(dense, line);
+    int from_dense = find_source_file(dense, line);
+    int from_sparse = find_source_file(sparse, line);
+    if (from_dense == expected && from_sparse == expected) return 0;
+    fprintf(stderr, "Line %d: linear %d, dense %d, sparse %d\n", line, expected, from_dense, from_sparse);
+    return 1;
+}
+
+// The lines around the ends of every file, where an off-by-one would show, and as many
+// random ones
+int differential_check(LineMap *dense, LineMap *sparse) {
+    int mismatches = check_line(dense, sparse, -1) + check_line(dense, sparse, 0) +
+                     check_line(dense, sparse, dense->total_lines + 1);
+    for (int i = 0; i < dense->count && mismatches < 10; i++) {
+        for (int delta = -1; delta <= 1; delta++) {
+            mismatches += check_line(dense, sparse, dense->ranges[i].start_line + delta);
+            mismatches += check_line(dense, sparse, dense->ranges[i].end_line + delta);
+        }
+        mismatches += check_line(dense, sparse, 1 + random_below(dense->total_lines));
+    }
+    return mismatches;
+}
+
+void usage(void) {
+    fprintf(stderr,
+        "Usage: bench_lookup [options]\n"
+        "  --files N      files in the line map (10000)\n"
+        "  --lines N      mean lines per file (100)\n"
+        "  --lookups N    lookups timed per phase and run (1000000)\n"
+        "  --runs N       repetitions of every phase (5)\n"
+        "  --seed N       random seed (1)\n"
+        "  --check-only   skip the benchmark\n");
+}
+
+int main(int argc, char *argv[]) {
+    int files = 10000, lines = 100, lookups = 1000000, runs = 5, check_only = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) {
+            files = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lines") == 0 && i + 1 < argc) {
+            lines = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lookups") == 0 && i + 1 < argc) {
+            lookups = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            rng_state = (unsigned int)atoi(argv[++i]);
+            if (!rng_state) rng_state = 1;
+        } else if (strcmp(argv[i], "--check-only") == 0) {
+            check_only = 1;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (runs < 1) runs = 1;
+    if (runs > MAX_RUNS) runs = MAX_RUNS;
+    if (files < 1) files = 1;
+    if (lines < 1) lines = 1;
+    if (lookups < 1) lookups = 1;
+
+    LineMap dense, sparse;
+    generate_map(&dense, files, lines);
+    sparse = dense;
+    build_line_index(&dense);
+    build_sparse_index(&sparse);
+    if (!dense.line_index) {
+        fprintf(stderr, "Error: %d lines are too many for the dense index\n", dense.total_lines);
+        return 1;
+    }
+    if (differential_check(&dense, &sparse) != 0) return 1;
+    if (check_only) return 0;
+
+    // Lines spread over the whole output, the same ones every run
+    int *targets = malloc(sizeof(int) * lookups);
+    for (int i = 0; i < lookups; i++) targets[i] = 1 + random_below(dense.total_lines);
+
+    static double samples[PHASE_COUNT][MAX_RUNS];
+    static const char *names[PHASE_COUNT] = {"build_dense", "build_sparse", "linear", "dense", "sparse"};
+    static const char *units[PHASE_COUNT] = {"lines", "files", "lookups", "lookups", "lookups"};
+    long long items[PHASE_COUNT] = {dense.total_lines, files, lookups, lookups, lookups};
+    long long checksums[PHASE_COUNT] = {0};
+
+    for (int run = 0; run < runs; run++) {
+        double start = now_ms();
+        build_line_index(&dense);
+        samples[0][run] = now_ms() - start;
+
+        start = now_ms();
+        build_sparse_index(&sparse);
+        samples[1][run] = now_ms() - start;
+
+        // The linear scan is slow enough to time on a share of the lookups only
+        int linear_lookups = lookups / 100 > 0 ? lookups / 100 : 1;
+        start = now_ms();
+        for (int i = 0; i < linear_lookups; i++) checksums[2] += legacy_find_source_file(&dense, targets[i]);
+        samples[2][run] = (now_ms() - start) * ((double)lookups / linear_lookups);
+
+        start = now_ms();
+        for (int i = 0; i < lookups; i++) checksums[3] += find_source_file(&dense, targets[i]);
+        samples[3][run] = now_ms() - start;
+
+        start = now_ms();
+        for (int i = 0; i < lookups; i++) checksums[4] += find_source_file(&sparse, targets[i]);
+        samples[4][run] = now_ms() - start;
+    }
+
+    printf("phase,unit,items,runs,min_ms,median_ms,max_ms,items_per_s,files,lines,checksum\n");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        qsort(samples[p], runs, sizeof(double), compare_doubles);
+        double median = (runs % 2) ? samples[p][runs / 2]
+                                   : (samples[p][runs / 2 - 1] + samples[p][runs / 2]) / 2;
+        double rate = median > 0 ? items[p] / (median / 1000.0) : 0;
+        printf("%s,%s,%lld,%d,%.3f,%.3f,%.3f,%.0f,%d,%d,%lld\n", names[p], units[p], items[p], runs,
+               samples[p][0], median, samples[p][runs - 1], rate, files, dense.total_lines, checksums[p]);
+    }
+    return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * bench_newlines - Times the newline counting kernels
+ *
+ * Copyright (C) 2025 Foldcessing Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Builds foldcessing.c into itself and counts the newlines of a --mb buffer of source-like
+// text with the scalar kernel and every vector kernel the processor runs, written as CSV
+// like bench_fold with the median throughput in GB/s. The buffer stays in memory, so this
+// is the kernels' speed, not the disk's; tests/test_newlines.c checks their results.
+
+#define main foldcessing_main
+#include "../foldcessing.c"
+#undef main
+
+#include <time.h>
+
+#define MAX_RUNS 1000
+
+typedef struct {
+    const char *name;
+    size_t (*count)(const char *data, size_t len);
+} Kernel;
+
+double now_ms(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1000.0 / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Lines of 1 to 2 * line_length bytes
+void fill(char *data, size_t len, int line_length) {
+    unsigned int state = 12345;
+    size_t next = 0;
+    for (size_t i = 0; i < len; i++) {
+        state = state * 1103515245u + 12345u;
+        if (i == next) {
+            data[i] = '\n';
+            next = i + 1 + (state >> 8) % (unsigned int)(2 * line_length);
+        } else {
+            data[i] = (char)('a' + (state >> 16) % 26);
+        }
+    }
+}
+
+void usage(void) {
+    fprintf(stderr,
+        "Usage: bench_newlines [options]\n"
+        "  --mb N       buffer size in MB (64)\n"
+        "  --line N     mean line length in bytes (40)\n"
+        "  --runs N     repetitions of every kernel (9)\n");
+}
+
+int main(int argc, char *argv[]) {
+    int mb = 64, line_length = 40, runs = 9;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mb") == 0 && i + 1 < argc) {
+            mb = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--line") == 0 && i + 1 < argc) {
+            line_length = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (runs < 1) runs = 1;
+    if (runs > MAX_RUNS) runs = MAX_RUNS;
+    if (mb < 1) mb = 1;
+    if (line_length < 1) line_length = 1;
+
+    size_t len = (size_t)mb * 1024 * 1024;
+    char *data = malloc(len);
+    if (!data) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+    fill(data, len, line_length);
+
+    Kernel kernels[3];
+    int kernel_count = 0;
+    kernels[kernel_count].name = "scalar";
+    kernels[kernel_count++].count = count_newlines_scalar;
+#ifdef HAVE_X86_SIMD
+    if (cpu_has_sse2()) {
+        kernels[kernel_count].name = "sse2";
+        kernels[kernel_count++].count = count_newlines_sse2;
+    }
+    if (cpu_has_avx2()) {
+        kernels[kernel_count].name = "avx2";
+        kernels[kernel_count++].count = count_newlines_avx2;
+    }
+#endif
+
+    static double samples[MAX_RUNS];
+    printf("phase,unit,items,runs,min_ms,median_ms,max_ms,items_per_s,gb_per_s,newlines\n");
+    for (int k = 0; k < kernel_count; k++) {
+        size_t newlines = kernels[k].count(data, len);  // Warm up
+        for (int run = 0; run < runs; run++) {
+            double start = now_ms();
+            newlines = kernels[k].count(data, len);
+            samples[run] = now_ms() - start;
+        }
+
+        qsort(samples, runs, sizeof(double), compare_doubles);
+        double median = (runs % 2) ? samples[runs / 2] : (samples[runs / 2 - 1] + samples[runs / 2]) / 2;
+        double rate = median > 0 ? len / (median / 1000.0) : 0;
+        printf("%s,bytes,%lu,%d,%.3f,%.3f,%.3f,%.0f,%.2f,%lu\n", kernels[k].name, (unsigned long)len, runs,
+               samples[0], median, samples[runs - 1], rate, rate / 1e9, (unsigned long)newlines);
+    }
+    free(data);
+    return 0;
+}
@@ -0,0 +1,272 @@
+/*
+ * bench_translate - Times the streaming translator of processing-java output
+ *
+ * Copyright (C) 2025 Foldcessing Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Builds foldcessing.c into itself and lays out a line map of --files files the way a fold
+// does, then makes --lines lines of output like processing-java's: plain println output,
+// compiler messages with an output.pde:LINE:COL reference and stack frames with an
+// (output.java:LINE), some of them mentioning several lines. Every phase feeds its text to
+// translator_feed in --chunk byte pieces, as the pipes deliver it, and counts what comes out;
+// a reference left untranslated or a line lost fails the run. Written as CSV like bench_fold,
+// with the median throughput in lines/s.
+
+#define main foldcessing_main
+#include "../foldcessing.c"
+#undef main
+
+#include <time.h>
+
+#define MAX_RUNS 1000
+#define PHASE_COUNT 4
+#define JAVA_LINE_OFFSET 20
+
+typedef struct {
+    size_t bytes;
+    size_t lines;
+} Counter;
+
+double now_ms(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1000.0 / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+unsigned int rng_state = 1;
+
+int random_below(int n) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return (int)(rng_state % (unsigned int)n);
+}
+
+// Files of 1 to 2 * 100 lines, named like the files of a sketch
+void generate_map(LineMap *map, int files) {
+    memset(map, 0, sizeof(*map));
+    map->ranges = malloc(sizeof(LineMapping) * files);
+    map->count = files;
+    map->java_line_offset = JAVA_LINE_OFFSET;
+    int line = 1;
+    for (int i = 0; i < files; i++) {
+        int length = 1 + random_below(200);
+        char relative[64];
+        snprintf(relative, sizeof(relative), "ui/widgets/Widget%04d.pde", i);
+        map->ranges[i].start_line = line + 1;
+        map->ranges[i].end_line = line + length;
+        map->ranges[i].relative = arena_strdup(&map->names, relative);
+        line += length + 2;
+    }
+    map->total_lines = line - 1;
+    build_line_index(map);
+}
+
+// A line inside some file, so a reference always translates (to more than one place if
+// the line wrapping guess finds some)
+int random_source_line(const LineMap *map) {
+    const LineMapping *range = &map->ranges[random_below(map->count)];
+    return range->start_line + random_below(range->end_line - range->start_line + 1);
+}
+
+// One line of output: percent of them with references, a third of those with several
+size_t generate_line(const LineMap *map, char *out, size_t size, int percent, int *refs) {
+    if (random_below(100) >= percent) {
+        *refs = 0;
+        return snprintf(out, size, "frame %d: particles=%d fps=%d.%d\n", random_below(100000),
+                        random_below(5000), random_below(60), random_below(10));
+    }
+    int line = random_source_line(map);
+    switch (random_below(3)) {
+    case 0:
+        *refs = 1;
+        return snprintf(out, size, "output.pde:%d:%d:%d:%d: Syntax Error - missing semicolon\n",
+                        line, 4 + random_below(40), line, 5 + random_below(40));
+    case 1:
+        *refs = 1;
+        return snprintf(out, size, "\tat output.drawHUD(output.java:%d)\n", line + JAVA_LINE_OFFSET);
+    default:
+        *refs = 2;
+        return snprintf(out, size, "output.pde:%d: The field x conflicts with output.pde:%d\n",
+                        line, random_source_line(map));
+    }
+}
+
+char *generate_output(const LineMap *map, int lines, int percent, size_t *len, int *refs) {
+    size_t capacity = (size_t)lines * 96 + 1;
+    char *text = malloc(capacity);
+    *len = 0;
+    *refs = 0;
+    for (int i = 0; i < lines; i++) {
+        int line_refs;
+        *len += generate_line(map, text + *len, capacity - *len, percent, &line_refs);
+        *refs += line_refs;
+    }
+    return text;
+}
+
+int count_write(void *user, const char *data, size_t len) {
+    Counter *counter = (Counter*)user;
+    const char *end = data + len;
+    counter->bytes += len;
+    for (const char *p = data; (p = memchr(p, '\n', end - p)) != NULL; p++) counter->lines++;
+    return 0;
+}
+
+int contains(const char *data, size_t len, const char *text) {
+    size_t text_len = strlen(text);
+    for (size_t i = 0; i + text_len <= len; i++) {
+        if (memcmp(data + i, text, text_len) == 0) return 1;
+    }
+    return 0;
+}
+
+// Left untranslated, a reference would still name output.pde or output.java. The translator
+// never writes part of a reference, so looking at every write alone is enough.
+int check_write(void *user, const char *data, size_t len) {
+    count_write(user, data, len);
+    if (contains(data, len, REF_PDE) || contains(data, len, REF_JAVA)) {
+        fprintf(stderr, "Untranslated reference in: %.*s\n", (int)(len < 200 ? len : 200), data);
+        return 1;
+    }
+    return 0;
+}
+
+// Feed text in chunk byte pieces, returns nonzero if write failed
+int translate(LineMap *map, const char *text, size_t len, size_t chunk, FoldcessingWrite write, Counter *counter) {
+    Translator translator = {0};
+    translator.map = map;
+    translator.write = write;
+    translator.user = counter;
+    for (size_t done = 0; done < len; done += chunk) {
+        translator_feed(&translator, text + done, (len - done < chunk) ? len - done : chunk);
+    }
+    translator_finish(&translator);
+    free(translator.buffer);
+    return translator.failed;
+}
+
+void usage(void) {
+    fprintf(stderr,
+        "Usage: bench_translate [options]\n"
+        "  --files N      files in the line map (1000)\n"
+        "  --lines N      lines of output per phase (1000000)\n"
+        "  --chunk N      bytes handed to translator_feed at once (4096)\n"
+        "  --runs N       repetitions of every phase (5)\n"
+        "  --seed N       random seed (1)\n"
+        "  --check-only   skip the benchmark\n");
+}
+
+int main(int argc, char *argv[]) {
+    int files = 1000, lines = 1000000, chunk = 4096, runs = 5, check_only = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) {
+            files = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lines") == 0 && i + 1 < argc) {
+            lines = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--chunk") == 0 && i + 1 < argc) {
+            chunk = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            rng_state = (unsigned int)atoi(argv[++i]);
+            if (!rng_state) rng_state = 1;
+        } else if (strcmp(argv[i], "--check-only") == 0) {
+            check_only = 1;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (runs < 1) runs = 1;
+    if (runs > MAX_RUNS) runs = MAX_RUNS;
+    if (files < 1) files = 1;
+    if (lines < 1) lines = 1;
+    if (chunk < 1) chunk = 1;
+
+    LineMap map;
+    generate_map(&map, files);
+
+    // Program output only, a few errors, a stack trace's worth, and references throughout
+    static const char *names[PHASE_COUNT] = {"plain", "sparse", "dense", "all"};
+    static const int percents[PHASE_COUNT] = {0, 2, 30, 100};
+    char *texts[PHASE_COUNT];
+    size_t lens[PHASE_COUNT];
+    int refs[PHASE_COUNT];
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        texts[p] = generate_output(&map, lines, percents[p], &lens[p], &refs[p]);
+    }
+
+    // Every line comes out, with every reference translated, whatever the chunk size
+    static const size_t check_chunks[] = {1, 7, 4096};
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        size_t sizes = check_only ? sizeof(check_chunks) / sizeof(check_chunks[0]) : 1;
+        for (size_t c = 0; c < sizes; c++) {
+            Counter counter = {0, 0};
+            size_t size = check_only ? check_chunks[c] : (size_t)chunk;
+            if (translate(&map, texts[p], lens[p], size, check_write, &counter) != 0) return 1;
+            if (counter.lines != (size_t)lines) {
+                fprintf(stderr, "%s in %lu byte chunks: %lu lines out of %d\n", names[p],
+                        (unsigned long)size, (unsigned long)counter.lines, lines);
+                return 1;
+            }
+        }
+    }
+    if (map.lookups_missed != 0) {
+        fprintf(stderr, "%d lookups missed\n", map.lookups_missed);
+        return 1;
+    }
+    if (check_only) return 0;
+
+    static double samples[PHASE_COUNT][MAX_RUNS];
+    size_t output_bytes[PHASE_COUNT] = {0};
+    for (int run = 0; run < runs; run++) {
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            Counter counter = {0, 0};
+            double start = now_ms();
+            translate(&map, texts[p], lens[p], chunk, count_write, &counter);
+            samples[p][run] = now_ms() - start;
+            output_bytes[p] = counter.bytes;
+        }
+    }
+
+    printf("phase,unit,items,runs,min_ms,median_ms,max_ms,items_per_s,references,input_bytes,output_bytes,mb_per_s\n");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        qsort(samples[p], runs, sizeof(double), compare_doubles);
+        double median = (runs % 2) ? samples[p][runs / 2]
+                                   : (samples[p][runs / 2 - 1] + samples[p][runs / 2]) / 2;
+        double rate = median > 0 ? lines / (median / 1000.0) : 0;
+        double bytes_rate = median > 0 ? lens[p] / (median / 1000.0) : 0;
+        printf("%s,lines,%d,%d,%.3f,%.3f,%.3f,%.0f,%d,%lu,%lu,%.1f\n", names[p], lines, runs,
+               samples[p][0], median, samples[p][runs - 1], rate, refs[p], (unsigned long)lens[p],
+               (unsigned long)output_bytes[p], bytes_rate / 1e6);
+        free(texts[p]);
+    }
+    return 0;
+}
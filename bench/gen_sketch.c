@@ -0,0 +1,250 @@
+/*
+ * gen_sketch - Synthetic sketch generator for the Foldcessing benchmarks
+ *
+ * Copyright (C) 2025 Foldcessing Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Writes a sketch folder with a main .pde file, a src/ tree of the requested depth and
+// fan-out holding the other files, and a .foldcessing whose ignore patterns match the
+// requested share of them. The same seed always gives the same tree. Asset files, which
+// are not sources, go to an assets/ and a build/ tree, the latter in a .gitignore.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define make_dir(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define make_dir(path) mkdir(path, 0777)
+#endif
+
+#define MAX_PATH_LEN 4096
+#define ASSETS_PER_FOLDER 500
+
+typedef struct {
+    int files;           // .pde files in src/, ignored ones included
+    int depth;           // Folder levels below src/
+    int fanout;          // Subfolders per folder
+    int lines;           // Mean lines per file, actual counts vary by +-50%
+    int line_min;        // Shortest non-blank line
+    int line_max;        // Longest line
+    int blank_percent;   // Share of blank lines
+    int ignored_percent; // Share of files matched by an ignore pattern
+    int assets;          // Other files, half of them under assets/, half under build/
+    unsigned int seed;
+} Options;
+
+unsigned long long rng_state;
+
+// xorshift64*, the C library rand() differs between platforms
+unsigned int next_random(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned int)((rng_state * 2685821657736338717ULL) >> 32);
+}
+
+int random_between(int low, int high) {
+    if (high <= low) return low;
+    return low + (int)(next_random() % (unsigned int)(high - low + 1));
+}
+
+void write_line(FILE *f, int length, int number) {
+    // Statement-like text padded with a comment to the requested length
+    char line[64];
+    int len = snprintf(line, sizeof(line), "  int v%d = v%d + %d;", number, number / 2, number % 97);
+    if (len > length) len = length;
+    fwrite(line, 1, len, f);
+    if (len < length) {
+        fputs(" //", f);
+        for (int i = len + 3; i < length; i++) fputc('a' + i % 26, f);
+    }
+    fputc('\n', f);
+}
+
+int write_source(const char *path, const Options *options) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot create %s\n", path);
+        return 0;
+    }
+    int lines = random_between(options->lines - options->lines / 2, options->lines + options->lines / 2);
+    for (int i = 0; i < lines; i++) {
+        if (random_between(1, 100) <= options->blank_percent) {
+            fputc('\n', f);
+        } else {
+            write_line(f, random_between(options->line_min, options->line_max), i);
+        }
+    }
+    return fclose(f) == 0;
+}
+
+// Folder i of the src/ tree, numbered breadth-first with 0 being src/ itself
+void folder_path(char *out, size_t size, const char *root, int index, int fanout) {
+    char suffix[MAX_PATH_LEN] = "";
+    while (index > 0) {
+        char part[MAX_PATH_LEN];
+        snprintf(part, sizeof(part), "/d%d%s", (index - 1) % fanout, suffix);
+        strcpy(suffix, part);
+        index = (index - 1) / fanout;
+    }
+    snprintf(out, size, "%s/src%s", root, suffix);
+}
+
+int parse_int(const char *value, int *out) {
+    char *end;
+    long n = strtol(value, &end, 10);
+    if (end == value || *end || n < 0 || n > 100000000) return 0;
+    *out = (int)n;
+    return 1;
+}
+
+void usage(void) {
+    fprintf(stderr,
+        "Usage: gen_sketch <folder> [options]\n"
+        "  --files N        .pde files under src/ (1000)\n"
+        "  --depth N        folder levels under src/ (3)\n"
+        "  --fanout N       subfolders per folder (4)\n"
+        "  --lines N        mean lines per file (200)\n"
+        "  --line-min N     shortest non-blank line (8)\n"
+        "  --line-max N     longest line (100)\n"
+        "  --blank N        percent of blank lines (15)\n"
+        "  --ignored N      percent of files matched by ignore patterns (0)\n"
+        "  --assets N       non-.pde files under assets/ and build/ (0)\n"
+        "  --seed N         random seed (1)\n");
+}
+
+int main(int argc, char *argv[]) {
+    Options options = {1000, 3, 4, 200, 8, 100, 15, 0, 0, 1};
+
+    if (argc < 2 || argv[1][0] == '-') {
+        usage();
+        return 1;
+    }
+    const char *root = argv[1];
+
+    for (int i = 2; i < argc; i++) {
+        int *target = NULL;
+        if (strcmp(argv[i], "--files") == 0) target = &options.files;
+        else if (strcmp(argv[i], "--depth") == 0) target = &options.depth;
+        else if (strcmp(argv[i], "--fanout") == 0) target = &options.fanout;
+        else if (strcmp(argv[i], "--lines") == 0) target = &options.lines;
+        else if (strcmp(argv[i], "--line-min") == 0) target = &options.line_min;
+        else if (strcmp(argv[i], "--line-max") == 0) target = &options.line_max;
+        else if (strcmp(argv[i], "--blank") == 0) target = &options.blank_percent;
+        else if (strcmp(argv[i], "--ignored") == 0) target = &options.ignored_percent;
+        else if (strcmp(argv[i], "--assets") == 0) target = &options.assets;
+        else if (strcmp(argv[i], "--seed") == 0) target = (int*)&options.seed;
+
+        if (!target || i + 1 >= argc || !parse_int(argv[++i], target)) {
+            usage();
+            return 1;
+        }
+    }
+    if (options.fanout < 1) options.fanout = 1;
+    if (options.line_max < options.line_min) options.line_max = options.line_min;
+    rng_state = 0x9E3779B97F4A7C15ULL ^ options.seed;
+
+    // Folders of a complete tree: 1 + fanout + fanout^2 + ... + fanout^depth
+    int folder_count = 1;
+    for (int level = 1, width = 1; level <= options.depth; level++) {
+        width *= options.fanout;
+        folder_count += width;
+        if (folder_count > 1000000) {
+            fprintf(stderr, "Error: More than 1000000 folders requested\n");
+            return 1;
+        }
+    }
+
+    char path[MAX_PATH_LEN];
+    make_dir(root);
+    for (int i = 0; i < folder_count; i++) {
+        folder_path(path, sizeof(path), root, i, options.fanout);
+        make_dir(path);
+    }
+
+    // Ignored files are split between *_skip.pde names and a vendor/ folder per top folder
+    snprintf(path, sizeof(path), "%s/.foldcessing", root);
+    FILE *config = fopen(path, "wb");
+    if (!config) {
+        fprintf(stderr, "Error: Cannot create %s\n", path);
+        return 1;
+    }
+    fprintf(config, "ignore=*_skip.pde, vendor/\n");
+    fclose(config);
+
+    const char *name = strrchr(root, '/');
+    name = name ? name + 1 : root;
+    snprintf(path, sizeof(path), "%s/%s.pde", root, name);
+    if (!write_source(path, &options)) return 1;
+
+    for (int i = 0; i < options.files; i++) {
+        char folder[MAX_PATH_LEN];
+        folder_path(folder, sizeof(folder), root, random_between(0, folder_count - 1), options.fanout);
+
+        if (random_between(1, 100) <= options.ignored_percent) {
+            if (i % 2) {
+                snprintf(path, sizeof(path), "%s/f%d_skip.pde", folder, i);
+            } else {
+                char vendor[MAX_PATH_LEN];
+                snprintf(vendor, sizeof(vendor), "%s/vendor", folder);
+                make_dir(vendor);
+                snprintf(path, sizeof(path), "%s/f%d.pde", vendor, i);
+            }
+        } else {
+            snprintf(path, sizeof(path), "%s/f%d.pde", folder, i);
+        }
+        if (!write_source(path, &options)) return 1;
+    }
+
+    // Assets come last and draw no random numbers, so the sources of a seed stay the same;
+    // ASSETS_PER_FOLDER of them to a folder
+    if (options.assets > 0) {
+        snprintf(path, sizeof(path), "%s/.gitignore", root);
+        FILE *gitignore = fopen(path, "wb");
+        if (!gitignore) {
+            fprintf(stderr, "Error: Cannot create %s\n", path);
+            return 1;
+        }
+        fprintf(gitignore, "build/\n");
+        fclose(gitignore);
+    }
+    for (int i = 0; i < options.assets; i++) {
+        const char *tree = (i % 2) ? "build" : "assets";
+        int folder = i / 2 / ASSETS_PER_FOLDER;
+        if (i < 2 || (i / 2) % ASSETS_PER_FOLDER == 0) {
+            snprintf(path, sizeof(path), "%s/%s", root, tree);
+            make_dir(path);
+            snprintf(path, sizeof(path), "%s/%s/a%d", root, tree, folder);
+            make_dir(path);
+        }
+        snprintf(path, sizeof(path), "%s/%s/a%d/asset%d.png", root, tree, folder, i);
+        FILE *f = fopen(path, "wb");
+        if (!f) {
+            fprintf(stderr, "Error: Cannot create %s\n", path);
+            return 1;
+        }
+        fprintf(f, "asset %d\n", i);
+        fclose(f);
+    }
+
+    printf("Generated %d files in %d folders under %s\n", options.files + 1, folder_count, root);
+    if (options.assets > 0) printf("Generated %d asset files under %s/assets and %s/build\n", options.assets, root, root);
+    return 0;
+}
@@ -17,12 +17,43 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#ifndef _WIN32
+#define _GNU_SOURCE              // pipe2, copy_file_range, posix_spawn_file_actions_addchdir_np
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef _WIN32
 #include <windows.h>
-#include <ctype.h>
 #include <io.h>
+#endif
+#include <ctype.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <fcntl.h>
+
+#include "foldcessing.h"
+
+// SSE2/AVX2 newline counting needs compiler intrinsics; TCC uses the scalar loop
+#if !defined(__TINYC__) && (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define HAVE_X86_SIMD 1
+#define TARGET_SSE2
+#define TARGET_AVX2
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+#ifdef _WIN32
+
+#define PATH_SEP "\\"
+#define PATH_SEP_CHAR '\\'
 
 // Declare missing Windows functions for TCC
 #ifndef ATTACH_PARENT_PROCESS
@@ -35,55 +66,831 @@ typedef BOOL (WINAPI *AttachConsoleFunc)(DWORD dwProcessId);
 typedef HANDLE (WINAPI *CreateJobObjectFunc)(LPSECURITY_ATTRIBUTES, LPCSTR);
 typedef BOOL (WINAPI *SetInformationJobObjectFunc)(HANDLE, int, LPVOID, DWORD);
 typedef BOOL (WINAPI *AssignProcessToJobObjectFunc)(HANDLE, HANDLE);
+typedef BOOL (WINAPI *QueryInformationJobObjectFunc)(HANDLE, int, LPVOID, DWORD, LPDWORD);
 
 #ifndef JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE
 #define JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE 0x00002000
 #endif
+#ifndef JOB_OBJECT_LIMIT_AFFINITY
+#define JOB_OBJECT_LIMIT_AFFINITY 0x00000010
+#define JOB_OBJECT_LIMIT_PRIORITY_CLASS 0x00000020
+#define JOB_OBJECT_LIMIT_JOB_MEMORY 0x00000200
+#endif
 
 #ifndef JobObjectExtendedLimitInformation
+#define JobObjectBasicAccountingInformation 1
 #define JobObjectExtendedLimitInformation 9
 #endif
 
-// Use a byte buffer to avoid struct definition conflicts
-#define JOBOBJECT_EXTENDED_LIMIT_INFO_SIZE 144
+// Use byte buffers to avoid struct definition conflicts. SIZE_T and ULONG_PTR fields follow
+// the pointer size, so the offsets in JOBOBJECT_EXTENDED_LIMIT_INFORMATION do as well.
+#define JOB_PTR_SIZE ((int)sizeof(void*))
+#define JOB_LIMIT_FLAGS 16
+#define JOB_AFFINITY (16 + 4 * JOB_PTR_SIZE)
+#define JOB_PRIORITY_CLASS (JOB_AFFINITY + JOB_PTR_SIZE)
+#define JOB_BASIC_LIMIT_SIZE ((JOB_PRIORITY_CLASS + 8 + 7) & ~7)
+#define JOB_MEMORY_LIMIT (JOB_BASIC_LIMIT_SIZE + 48 + JOB_PTR_SIZE)   // After the IO_COUNTERS
+#define JOB_PEAK_MEMORY_USED (JOB_BASIC_LIMIT_SIZE + 48 + 3 * JOB_PTR_SIZE)
+#define JOBOBJECT_EXTENDED_LIMIT_INFO_SIZE (JOB_BASIC_LIMIT_SIZE + 48 + 4 * JOB_PTR_SIZE)
+
+// JOBOBJECT_BASIC_ACCOUNTING_INFORMATION: user and kernel time in 100 ns units, then counters
+#define JOB_TOTAL_USER_TIME 0
+#define JOB_TOTAL_KERNEL_TIME 8
+#define JOB_TOTAL_PROCESSES 36
+#define JOBOBJECT_BASIC_ACCOUNTING_INFO_SIZE 48
+
+#else
+
+// POSIX platform layer
+//
+// The fold engine was written against Win32 and mostly needs files, threads, events and
+// clocks, so on POSIX those few calls are provided under their Win32 names on top of file
+// descriptors and pthreads. A HANDLE points to a PosixHandle saying which of them it is.
+// Only what this file uses is there: files are opened for plain reads or writes, waits on
+// several objects must wait for all of them (thread joins). Everything that does not map
+// one to one has a POSIX implementation of its own further down, next to the Win32 one:
+// directory listings (openat/readdir), child processes (posix_spawn into their own process
+// group, pidfd, poll), the watch (inotify), the daemon (a Unix socket) and the data link.
+
+#include <stdint.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
+
+#define PATH_SEP "/"
+#define PATH_SEP_CHAR '/'
+
+typedef int BOOL;
+typedef uint32_t DWORD;
+typedef uint16_t WORD;
+typedef long LONG;
+typedef void *HANDLE;
+typedef void *LPVOID;
+typedef pthread_mutex_t CRITICAL_SECTION;
+
+#define WINAPI
+#define TRUE 1
+#define FALSE 0
+#define INFINITE 0xFFFFFFFF
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT 258
+#define WAIT_FAILED 0xFFFFFFFF
+#define NO_ERROR 0
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+#define INVALID_FILE_ATTRIBUTES ((DWORD)-1)
+#define INVALID_FILE_SIZE ((DWORD)-1)
+#define INVALID_SET_FILE_POINTER ((DWORD)-1)
+#define FILE_ATTRIBUTE_READONLY 0x00000001
+#define FILE_ATTRIBUTE_DIRECTORY 0x00000010
+#define FILE_ATTRIBUTE_NORMAL 0x00000080
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define FILE_SHARE_READ 0x00000001
+#define FILE_SHARE_WRITE 0x00000002
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define FILE_FLAG_SEQUENTIAL_SCAN 0x08000000
+#define FILE_BEGIN 0
+#define MOVEFILE_REPLACE_EXISTING 0x00000001
+#define PAGE_READONLY 0x02
+#define FILE_MAP_READ 0x0004
+#define GetFileExInfoStandard 0
+#define STD_INPUT_HANDLE ((DWORD)-10)
+#define STD_OUTPUT_HANDLE ((DWORD)-11)
+#define STD_ERROR_HANDLE ((DWORD)-12)
+
+typedef struct {
+    long long QuadPart;
+} LARGE_INTEGER;
+
+typedef struct {
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+} FILETIME;
+
+typedef struct {
+    DWORD dwFileAttributes;
+    FILETIME ftCreationTime;
+    FILETIME ftLastAccessTime;
+    FILETIME ftLastWriteTime;
+    DWORD nFileSizeHigh;
+    DWORD nFileSizeLow;
+} WIN32_FILE_ATTRIBUTE_DATA;
+
+typedef struct {
+    WORD wYear;
+    WORD wMonth;
+    WORD wDayOfWeek;
+    WORD wDay;
+    WORD wHour;
+    WORD wMinute;
+    WORD wSecond;
+    WORD wMilliseconds;
+} SYSTEMTIME;
+
+typedef struct {
+    DWORD dwNumberOfProcessors;
+} SYSTEM_INFO;
+
+#define _strdup strdup
+#define _stricmp strcasecmp
+#define _strnicmp strncasecmp
+#define _fileno fileno
+#define _setmode(fd, mode) ((void)0)  // No text mode to leave
+#define _O_BINARY 0
+#define MessageBox(window, text, caption, type) ((void)0)  // Only for a console of our own, never here
+
+#define HANDLE_FILE 0
+#define HANDLE_EVENT 1
+#define HANDLE_THREAD 2
+#define HANDLE_MAPPING 3
+
+typedef struct {
+    int kind;
+    int fd;                      // Files and mappings
+    long long size;              // Mappings
+    pthread_t thread;
+    DWORD (*start)(LPVOID);
+    LPVOID param;
+    int joined;
+    pthread_mutex_t lock;        // Events
+    pthread_cond_t cond;
+    int set;
+    int manual;
+} PosixHandle;
+
+// A view made by MapViewOfFile, munmap needs its length back
+typedef struct MappedView {
+    void *data;
+    size_t size;
+    struct MappedView *next;
+} MappedView;
+
+static MappedView *mapped_views = NULL;
+static pthread_mutex_t mapped_views_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static PosixHandle *new_handle(int kind, int fd) {
+    PosixHandle *h = calloc(1, sizeof(PosixHandle));
+    if (!h) return NULL;
+    h->kind = kind;
+    h->fd = fd;
+    return h;
+}
+
+// File descriptor behind a file handle
+static int handle_fd(HANDLE handle) {
+    return ((PosixHandle*)handle)->fd;
+}
+
+static DWORD GetLastError(void) {
+    return (DWORD)errno;
+}
+
+// stat times in FILETIME units (100 ns), only ever compared with each other
+static unsigned long long filetime_of(const struct stat *st) {
+#ifdef __APPLE__
+    const struct timespec *t = &st->st_mtimespec;
+#else
+    const struct timespec *t = &st->st_mtim;
+#endif
+    return (unsigned long long)t->tv_sec * 10000000ULL + (unsigned long long)t->tv_nsec / 100;
+}
+
+static HANDLE CreateFile(const char *path, DWORD access, DWORD share, void *security, DWORD disposition,
+                         DWORD flags, HANDLE template_file) {
+    int mode = O_CLOEXEC;
+    if ((access & GENERIC_READ) && (access & GENERIC_WRITE)) {
+        mode |= O_RDWR;
+    } else if (access & GENERIC_WRITE) {
+        mode |= O_WRONLY;
+    } else {
+        mode |= O_RDONLY;
+    }
+    if (disposition == CREATE_ALWAYS) mode |= O_CREAT | O_TRUNC;
+
+    int fd = open(path, mode, 0666);
+    if (fd < 0) return INVALID_HANDLE_VALUE;
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (flags & FILE_FLAG_SEQUENTIAL_SCAN) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    HANDLE h = new_handle(HANDLE_FILE, fd);
+    if (!h) close(fd);
+    return h ? h : INVALID_HANDLE_VALUE;
+}
+
+static BOOL ReadFile(HANDLE handle, void *buffer, DWORD len, DWORD *done, void *overlapped) {
+    ssize_t n;
+    do {
+        n = read(handle_fd(handle), buffer, len);
+    } while (n < 0 && errno == EINTR);
+    *done = (n > 0) ? (DWORD)n : 0;
+    return n >= 0;
+}
+
+static BOOL WriteFile(HANDLE handle, const void *buffer, DWORD len, DWORD *done, void *overlapped) {
+    ssize_t n;
+    do {
+        n = write(handle_fd(handle), buffer, len);
+    } while (n < 0 && errno == EINTR);
+    *done = (n > 0) ? (DWORD)n : 0;
+    return n >= 0;
+}
+
+static DWORD SetFilePointer(HANDLE handle, LONG low, LONG *high, DWORD method) {
+    long long position = ((long long)(high ? *high : 0) << 32) | (DWORD)low;
+    off_t at = lseek(handle_fd(handle), (off_t)position, SEEK_SET);
+    if (at < 0) return INVALID_SET_FILE_POINTER;
+    errno = 0;
+    if (high) *high = (LONG)((long long)at >> 32);
+    return (DWORD)at;
+}
+
+static BOOL SetEndOfFile(HANDLE handle) {
+    off_t at = lseek(handle_fd(handle), 0, SEEK_CUR);
+    return at >= 0 && ftruncate(handle_fd(handle), at) == 0;
+}
+
+static DWORD GetFileSize(HANDLE handle, DWORD *high) {
+    struct stat st;
+    if (fstat(handle_fd(handle), &st) != 0) return INVALID_FILE_SIZE;
+    if (high) *high = (DWORD)((unsigned long long)st.st_size >> 32);
+    return (!high && (unsigned long long)st.st_size > 0xFFFFFFFEULL) ? INVALID_FILE_SIZE : (DWORD)st.st_size;
+}
+
+static HANDLE CreateFileMapping(HANDLE file, void *security, DWORD protect, DWORD high, DWORD low, const char *name) {
+    struct stat st;
+    if (fstat(handle_fd(file), &st) != 0 || st.st_size == 0) return NULL;
+    int fd = dup(handle_fd(file));
+    if (fd < 0) return NULL;
+    PosixHandle *h = new_handle(HANDLE_MAPPING, fd);
+    if (!h) {
+        close(fd);
+        return NULL;
+    }
+    h->size = st.st_size;
+    return h;
+}
+
+static void *MapViewOfFile(HANDLE mapping, DWORD access, DWORD high, DWORD low, size_t len) {
+    PosixHandle *h = (PosixHandle*)mapping;
+    MappedView *view = malloc(sizeof(MappedView));
+    if (!view) return NULL;
+    view->size = (size_t)h->size;
+    view->data = mmap(NULL, view->size, PROT_READ, MAP_PRIVATE, h->fd, 0);
+    if (view->data == MAP_FAILED) {
+        free(view);
+        return NULL;
+    }
+    pthread_mutex_lock(&mapped_views_lock);
+    view->next = mapped_views;
+    mapped_views = view;
+    pthread_mutex_unlock(&mapped_views_lock);
+    return view->data;
+}
+
+static BOOL UnmapViewOfFile(const void *data) {
+    MappedView *view = NULL;
+    pthread_mutex_lock(&mapped_views_lock);
+    for (MappedView **p = &mapped_views; *p; p = &(*p)->next) {
+        if ((*p)->data == data) {
+            view = *p;
+            *p = view->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mapped_views_lock);
+    if (!view) return FALSE;
+    munmap(view->data, view->size);
+    free(view);
+    return TRUE;
+}
+
+static HANDLE CreateEvent(void *security, BOOL manual, BOOL initial, const char *name) {
+    PosixHandle *h = new_handle(HANDLE_EVENT, -1);
+    if (!h) return NULL;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#ifndef __APPLE__
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_cond_init(&h->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    h->manual = manual;
+    h->set = initial;
+    return h;
+}
+
+static BOOL SetEvent(HANDLE event) {
+    PosixHandle *h = (PosixHandle*)event;
+    pthread_mutex_lock(&h->lock);
+    h->set = 1;
+    pthread_cond_broadcast(&h->cond);
+    pthread_mutex_unlock(&h->lock);
+    return TRUE;
+}
+
+static void *thread_start(void *param) {
+    PosixHandle *h = (PosixHandle*)param;
+    h->start(h->param);
+    return NULL;
+}
+
+static HANDLE CreateThread(void *security, size_t stack, DWORD (*start)(LPVOID), LPVOID param, DWORD flags, DWORD *id) {
+    PosixHandle *h = new_handle(HANDLE_THREAD, -1);
+    if (!h) return NULL;
+    h->start = start;
+    h->param = param;
+    if (pthread_create(&h->thread, NULL, thread_start, h) != 0) {
+        free(h);
+        return NULL;
+    }
+    return h;
+}
+
+// Events (with a timeout) and threads (joined, INFINITE only)
+static DWORD WaitForSingleObject(HANDLE handle, DWORD ms) {
+    PosixHandle *h = (PosixHandle*)handle;
+    if (h->kind == HANDLE_THREAD) {
+        if (!h->joined && pthread_join(h->thread, NULL) != 0) return WAIT_FAILED;
+        h->joined = 1;
+        return WAIT_OBJECT_0;
+    }
+
+    struct timespec deadline;
+#ifdef __APPLE__
+    clock_gettime(CLOCK_REALTIME, &deadline);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+#endif
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&h->lock);
+    int error = 0;
+    while (!h->set && error == 0) {
+        error = (ms == INFINITE) ? pthread_cond_wait(&h->cond, &h->lock)
+                                 : pthread_cond_timedwait(&h->cond, &h->lock, &deadline);
+    }
+    int signaled = h->set;
+    if (signaled && !h->manual) h->set = 0;
+    pthread_mutex_unlock(&h->lock);
+    return signaled ? WAIT_OBJECT_0 : WAIT_TIMEOUT;
+}
+
+// Only waits for all of them, which is what joining worker threads needs
+static DWORD WaitForMultipleObjects(DWORD count, const HANDLE *handles, BOOL all, DWORD ms) {
+    for (DWORD i = 0; i < count; i++) {
+        if (WaitForSingleObject(handles[i], ms) != WAIT_OBJECT_0) return WAIT_TIMEOUT;
+    }
+    return WAIT_OBJECT_0;
+}
+
+static BOOL CloseHandle(HANDLE handle) {
+    PosixHandle *h = (PosixHandle*)handle;
+    if (!h || handle == INVALID_HANDLE_VALUE) return FALSE;
+    int ok = 1;
+    if (h->kind == HANDLE_FILE || h->kind == HANDLE_MAPPING) {
+        ok = close(h->fd) == 0;
+    } else if (h->kind == HANDLE_EVENT) {
+        pthread_mutex_destroy(&h->lock);
+        pthread_cond_destroy(&h->cond);
+    } else if (h->kind == HANDLE_THREAD && !h->joined) {
+        pthread_detach(h->thread);
+    }
+    free(h);
+    return ok;
+}
+
+static void InitializeCriticalSection(CRITICAL_SECTION *lock) {
+    pthread_mutex_init(lock, NULL);
+}
+
+static void DeleteCriticalSection(CRITICAL_SECTION *lock) {
+    pthread_mutex_destroy(lock);
+}
+
+static void EnterCriticalSection(CRITICAL_SECTION *lock) {
+    pthread_mutex_lock(lock);
+}
+
+static void LeaveCriticalSection(CRITICAL_SECTION *lock) {
+    pthread_mutex_unlock(lock);
+}
+
+// Full barriers, like the Win32 originals
+static LONG InterlockedIncrement(volatile LONG *p) {
+    return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+static LONG InterlockedDecrement(volatile LONG *p) {
+    return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+static LONG InterlockedExchangeAdd(volatile LONG *p, LONG value) {
+    return __atomic_fetch_add(p, value, __ATOMIC_SEQ_CST);
+}
+
+static LONG InterlockedExchange(volatile LONG *p, LONG value) {
+    return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+}
+
+static LONG InterlockedCompareExchange(volatile LONG *p, LONG value, LONG comparand) {
+    __atomic_compare_exchange_n(p, &comparand, value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return comparand;
+}
+
+static void Sleep(DWORD ms) {
+    if (ms == 0) {
+        sched_yield();
+        return;
+    }
+    struct timespec delay = {ms / 1000, (long)(ms % 1000) * 1000000L};
+    nanosleep(&delay, NULL);
+}
+
+static BOOL QueryPerformanceFrequency(LARGE_INTEGER *frequency) {
+    frequency->QuadPart = 1000000000LL;
+    return TRUE;
+}
+
+static BOOL QueryPerformanceCounter(LARGE_INTEGER *counter) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    counter->QuadPart = (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+    return TRUE;
+}
+
+static void GetSystemInfo(SYSTEM_INFO *info) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    info->dwNumberOfProcessors = (DWORD)(processors > 0 ? processors : 1);
+}
+
+// Absolute path of an existing file or folder
+static DWORD GetFullPathName(const char *path, DWORD size, char *buffer, char **file_part) {
+    char resolved[PATH_MAX];
+    if (!realpath(path, resolved) || strlen(resolved) >= size) return 0;
+    strcpy(buffer, resolved);
+    return (DWORD)strlen(buffer);
+}
+
+static DWORD GetCurrentProcessId(void) {
+    return (DWORD)getpid();
+}
+
+static DWORD GetCurrentThreadId(void) {
+#ifdef __linux__
+    return (DWORD)syscall(SYS_gettid);
+#else
+    return (DWORD)(uintptr_t)pthread_self();
+#endif
+}
+
+static DWORD GetFileAttributes(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) return INVALID_FILE_ATTRIBUTES;
+    return S_ISDIR(st.st_mode) ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+}
+
+static BOOL GetFileAttributesEx(const char *path, int level, WIN32_FILE_ATTRIBUTE_DATA *info) {
+    struct stat st;
+    if (stat(path, &st) != 0) return FALSE;
+    memset(info, 0, sizeof(*info));
+    info->dwFileAttributes = S_ISDIR(st.st_mode) ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+    info->nFileSizeHigh = (DWORD)((unsigned long long)st.st_size >> 32);
+    info->nFileSizeLow = (DWORD)st.st_size;
+    unsigned long long mtime = filetime_of(&st);
+    info->ftLastWriteTime.dwHighDateTime = (DWORD)(mtime >> 32);
+    info->ftLastWriteTime.dwLowDateTime = (DWORD)mtime;
+    return TRUE;
+}
+
+static BOOL DeleteFile(const char *path) {
+    return unlink(path) == 0;
+}
+
+static BOOL CreateDirectory(const char *path, void *security) {
+    return mkdir(path, 0777) == 0;
+}
+
+static BOOL MoveFileEx(const char *from, const char *to, DWORD flags) {
+    return rename(from, to) == 0;
+}
+
+static BOOL CreateHardLink(const char *link_path, const char *existing, void *security) {
+    return link(existing, link_path) == 0;
+}
+
+// Contents only, inside the kernel on Linux (sharing extents where the file system can)
+static BOOL CopyFile(const char *from, const char *to, BOOL fail_if_exists) {
+    int in = open(from, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return FALSE;
+    int out = open(to, O_WRONLY | O_CREAT | O_CLOEXEC | (fail_if_exists ? O_EXCL : O_TRUNC), 0666);
+    if (out < 0) {
+        close(in);
+        return FALSE;
+    }
+
+    int copied = 0;
+#ifdef __linux__
+    ssize_t n;
+    while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0) {
+    }
+    copied = (n == 0);
+#endif
+    if (!copied) {
+        // Start over with plain reads and writes
+        char buffer[64 * 1024];
+        ssize_t got = 0;
+        copied = lseek(in, 0, SEEK_SET) == 0 && lseek(out, 0, SEEK_SET) == 0 && ftruncate(out, 0) == 0;
+        while (copied && (got = read(in, buffer, sizeof(buffer))) > 0) {
+            for (ssize_t done = 0; copied && done < got; ) {
+                ssize_t put = write(out, buffer + done, (size_t)(got - done));
+                copied = put > 0;
+                done += put;
+            }
+        }
+        copied = copied && got == 0;
+    }
+    close(in);
+    if (close(out) != 0) copied = 0;
+    return copied;
+}
+
+// Only the command line uses these
+#ifndef FOLDCESSING_LIBRARY
+static HANDLE GetStdHandle(DWORD which) {
+    static PosixHandle std_handles[3] = {{.kind = HANDLE_FILE, .fd = 0}, {.kind = HANDLE_FILE, .fd = 1},
+                                         {.kind = HANDLE_FILE, .fd = 2}};
+    if (which == STD_INPUT_HANDLE) return &std_handles[0];
+    if (which == STD_OUTPUT_HANDLE) return &std_handles[1];
+    return &std_handles[2];
+}
+
+static DWORD GetTickCount(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (DWORD)((unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+static void GetSystemTime(SYSTEMTIME *st) {
+    struct timespec now;
+    struct tm tm;
+    clock_gettime(CLOCK_REALTIME, &now);
+    gmtime_r(&now.tv_sec, &tm);
+    st->wYear = (WORD)(tm.tm_year + 1900);
+    st->wMonth = (WORD)(tm.tm_mon + 1);
+    st->wDayOfWeek = (WORD)tm.tm_wday;
+    st->wDay = (WORD)tm.tm_mday;
+    st->wHour = (WORD)tm.tm_hour;
+    st->wMinute = (WORD)tm.tm_min;
+    st->wSecond = (WORD)tm.tm_sec;
+    st->wMilliseconds = (WORD)(now.tv_nsec / 1000000);
+}
+
+static DWORD GetCurrentDirectory(DWORD size, char *buffer) {
+    return getcwd(buffer, size) ? (DWORD)strlen(buffer) : 0;
+}
+
+// For bench_fold, the tool itself never changes folder
+static __attribute__((unused)) BOOL SetCurrentDirectory(const char *path) {
+    return chdir(path) == 0;
+}
+
+static DWORD GetModuleFileName(void *module, char *buffer, DWORD size) {
+    ssize_t len = readlink("/proc/self/exe", buffer, size - 1);
+    if (len <= 0) {
+        // Without /proc, let posix_spawnp find us on the PATH
+        snprintf(buffer, size, "foldcessing");
+        return (DWORD)strlen(buffer);
+    }
+    buffer[len] = '\0';
+    return (DWORD)len;
+}
+
+// Deleting does not depend on permission bits here
+static BOOL SetFileAttributes(const char *path, DWORD attributes) {
+    return TRUE;
+}
+
+// Also removes a symbolic link to a folder, like RemoveDirectory does with a junction
+static BOOL RemoveDirectory(const char *path) {
+    if (rmdir(path) == 0) return TRUE;
+    return errno == ENOTDIR && unlink(path) == 0;
+}
+
+#endif
+
+#endif
 
 #define MAX_PATH_LEN 4096
-#define MAX_FILES 10000
 #define MAX_LINE 8192
-#define MAX_IGNORE_PATTERNS 100
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define DEFAULT_WATCH_DEBOUNCE 300  // Milliseconds without changes before --watch refolds
+#define DEFAULT_MAX_SCAN_THREADS 8   // Upper bound for scan_threads=auto
+#define DEFAULT_OUTPUT_BUFFER_MB 4   // Ring between the child's pipes and the console
+#define OVERFLOW_BLOCK 0             // output_overflow: wait for the console
+#define OVERFLOW_DROP_OLDEST 1       // Drop the oldest queued output
+#define OVERFLOW_SUMMARIZE 2         // Drop new output, then say how much
+#define DUPLICATES_WARN 0            // duplicate_symbols: report definitions clashing across files
+#define DUPLICATES_OFF 1             // Do not index symbols at all
+#define DUPLICATES_ABORT 2           // Report them and do not start processing-java
+#define SCAN_WALK 0                  // scan: list every folder of the sketch
+#define SCAN_GIT 1                   // Take the tracked files from the git index
+#define SCAN_GIT_UNTRACKED 2         // Same, plus untracked ones next to them
+#define PRIORITY_DEFAULT 0           // priority: leave processing-java at ours
+#define PRIORITY_IDLE 1
+#define PRIORITY_BELOW_NORMAL 2
+#define PRIORITY_NORMAL 3
+#define PRIORITY_ABOVE_NORMAL 4
+#define PRIORITY_HIGH 5
+
+// Bump allocator for strings that live until the whole arena is reset
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
 
 typedef struct {
-    char path[MAX_PATH_LEN];
-    char relative[MAX_PATH_LEN];
+    ArenaBlock *head;
+} Arena;
+
+// A top-level definition found by the symbol lexer
+typedef struct {
+    int kind;                      // SYMBOL_CLASS, SYMBOL_FUNCTION or SYMBOL_FIELD
+    int line;                      // In the source file
+    int name;                      // Offset in the list's names, functions with parameter types
+} Symbol;
+
+typedef struct {
+    Symbol *items;
+    int count;                     // -1 = the file was not indexed
+    int capacity;
+    char *names;
+    size_t names_used;
+    size_t names_capacity;
+} SymbolList;
+
+typedef struct {
+    const char *path;              // Interned in file_arena
+    const char *relative;          // Interned in file_arena, shared with line_map
+    unsigned long long size;       // Size on disk when collected
+    unsigned long long mtime;      // Last write time (FILETIME ticks) when collected
+    unsigned long long hash;       // FNV-1a hash of the contents, filled in while folding
+    long long offset;              // Byte offset of this file's header in output.pde
+    SymbolList symbols;            // Top-level definitions, filled in while folding
 } FileEntry;
 
 typedef struct {
     int start_line;
     int end_line;
-    char relative[MAX_PATH_LEN];
+    const char *relative;          // Same string as the matching FileEntry
 } LineMapping;
 
 typedef struct {
     char processing_path[MAX_PATH_LEN];
-    char ignore_patterns[MAX_IGNORE_PATTERNS][MAX_PATH_LEN];
+    char **ignore_patterns;        // Interned in config_arena
     int ignore_count;
+    int ignore_capacity;
     char default_action[256];
     int auto_close;
+    int incremental;
+    int watch_debounce;
+    int scan;                      // SCAN_WALK, SCAN_GIT or SCAN_GIT_UNTRACKED
+    int scan_threads;              // 0 = one per processor, up to DEFAULT_MAX_SCAN_THREADS
+    int read_threads;              // Same, for prefetching sources while folding
+    int read_buffer_mb;            // Memory for prefetched sources, 0 = DEFAULT_READ_BUFFER_MB
+    int java_line_offset;          // output.java line of output.pde line 0, -1 = leave output.java alone
+    int keep_output;               // Leave the output folder in place on exit
+    char output_root[MAX_PATH_LEN]; // Folder to keep output folders in instead of the sketch
+    char fold_cache[MAX_PATH_LEN]; // Folder of folds shared by checkouts, empty for none
+    char line_map[MAX_PATH_LEN];   // Line map sidecar every fold writes, empty for none
+    int fold_cache_mb;             // Size it is trimmed to, 0 = DEFAULT_FOLD_CACHE_MB
+    int stats;                     // Report timings and counters on exit (--stats)
+    int stats_history;             // Also append them to STATS_HISTORY_NAME
+    int output_buffer_mb;          // Ring between the pump and the console, 0 = write inline
+    int output_overflow;           // OVERFLOW_BLOCK, OVERFLOW_DROP_OLDEST or OVERFLOW_SUMMARIZE
+    char tee_log[MAX_PATH_LEN];    // Copy of the translated output, empty for none
+    char tee_raw_log[MAX_PATH_LEN]; // Copy of the child's output as it arrived
+    int duplicate_symbols;         // DUPLICATES_WARN, DUPLICATES_OFF or DUPLICATES_ABORT
+    int memory_limit_mb;           // For processing-java's whole process tree, 0 = none
+    unsigned long long cpu_affinity; // Processors it may run on, bit 0 = the first, 0 = any
+    int priority;                  // PRIORITY_DEFAULT to PRIORITY_HIGH
 } Config;
 
-FileEntry files[MAX_FILES];
-LineMapping line_map[MAX_FILES];
-int file_count = 0;
-int total_lines = 0;  // Total lines in concatenated output.pde
-Config config = {0};
+// Where the lines of output.pde came from, with an index to look them up fast.
+// Small sketches get a dense table (one entry per output line, O(1) lookups);
+// larger ones a packed array of start lines searched with a branch-free binary search.
+typedef struct FoldcessingMap {
+    LineMapping *ranges;           // One per folded file, in output.pde order
+    int count;
+    int total_lines;               // Total lines in concatenated output.pde
+    int java_line_offset;          // config.java_line_offset of the sketch, -1 = none
+    unsigned int *line_index;      // Dense: file index + 1 per output line, 0 for headers/separators
+    int *line_starts;              // Sparse: ranges[i].start_line, ascending
+    int line_index_lines;          // Lines covered by line_index
+    Arena names;                   // Paths of a map copied out of a sketch
+    const void *view;              // Mapping of a loaded line map file, paths point into it
+    int lookups_translated;
+    int lookups_ambiguous;         // Line wrapping hits more than one file
+    int lookups_missed;
+} LineMap;
+
+// Timings and counters of the fold engine for --stats, kept on every run since they cost
+// next to nothing
+typedef struct {
+    double collect_ms;             // Summed over every (re)scan
+    double fold_ms;                // Same, for writing output.pde
+    double symbol_check_ms;        // Looking for duplicate symbols, part of fold_ms like the lexing
+    int folds;
+    int files_scanned;             // Last scan
+    int files_ignored;             // Last scan, files and folders matching ignore patterns
+    int git_index;                 // Last scan read the git index instead of walking
+    long long bytes_written;       // To output.pde, not counting suffixes moved in place
+    int symbols_indexed;           // Last fold
+    int duplicate_symbols;         // Last fold
+    int files_hashed;              // Last fold, read only to hash them for fold_cache
+    int cache_hits;                // Folds taken from fold_cache
+    int cache_misses;
+    int cache_evicted;             // Folds dropped from fold_cache to stay under fold_cache_mb
+} FoldStats;
+
+// Milliseconds on the high-resolution clock, for timing phases. The frequency is fixed at
+// boot and cheap to ask for, so it is not kept anywhere threads would share.
+static double clock_ms(void) {
+    LARGE_INTEGER frequency, now;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart * 1000.0 / (double)frequency.QuadPart;
+}
+
+#define DENSE_INDEX_MAX_LINES (1 << 22)  // 16 MB of table
+
+// Copy a string into the arena, NULL if out of memory
+static const char *arena_strdup(Arena *arena, const char *str) {
+    size_t len = strlen(str) + 1;
+    ArenaBlock *block = arena->head;
+
+    if (!block || block->size - block->used < len) {
+        size_t size = (len > ARENA_BLOCK_SIZE) ? len : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + size);
+        if (!block) return NULL;
+        block->next = arena->head;
+        block->used = 0;
+        block->size = size;
+        arena->head = block;
+    }
+
+    char *copy = block->data + block->used;
+    memcpy(copy, str, len);
+    block->used += len;
+    return copy;
+}
+
+// Release every string in the arena
+static void arena_reset(Arena *arena) {
+    while (arena->head) {
+        ArenaBlock *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
 
 // Case-insensitive string comparison for sorting
-int strcasecmp_win(const char *s1, const char *s2) {
+static int strcasecmp_win(const char *s1, const char *s2) {
     return _stricmp(s1, s2);
 }
 
 // Trim whitespace from string
-void trim(char *str) {
+static void trim(char *str) {
     char *start = str;
     while (isspace(*start)) start++;
     if (start != str) {
@@ -96,369 +903,7176 @@ void trim(char *str) {
     }
 }
 
-// Simple wildcard matching (* and ?)
-int wildcard_match(const char *pattern, const char *str) {
-    while (*pattern && *str) {
-        if (*pattern == '*') {
-            pattern++;
-            if (!*pattern) return 1;
-            while (*str) {
-                if (wildcard_match(pattern, str)) return 1;
-                str++;
-            }
-            return 0;
-        } else if (*pattern == '?' || tolower(*pattern) == tolower(*str)) {
-            pattern++;
-            str++;
-        } else {
-            return 0;
-        }
-    }
-    while (*pattern == '*') pattern++;
-    return !*pattern && !*str;
-}
+// Ignore patterns
+//
+// All ignore patterns are compiled into one automaton when the config is read, so checking
+// a path costs one table lookup per character however many patterns there are. Patterns
+// follow .gitignore: a trailing '/' only matches folders, a pattern without any other '/'
+// matches at any depth (one with a '/' is anchored to the sketch folder), '*' and '?' stop at
+// '/', '**' spans folders and '!' takes an earlier match back. Case is ignored.
+//
+// The patterns form an NFA over their positions. It is turned into a DFA on the fly: a DFA
+// state stands for a set of live positions and fills in its transitions when they are first
+// taken. States never move once created, so scan threads walk them without locking and only
+// take the lock to add one. Scans carry the state reached at each folder down to its entries,
+// matching just the entry names.
 
-// Check if a path should be ignored
-int should_ignore(const char *relative_path) {
-    for (int i = 0; i < config.ignore_count; i++) {
-        if (wildcard_match(config.ignore_patterns[i], relative_path)) {
-            return 1;
+#define IGNORE_LITERAL 0         // One character, lowercased
+#define IGNORE_ONE 1             // ?: any character but '/'
+#define IGNORE_STAR 2            // *: any run of characters without '/'
+#define IGNORE_FOLDERS 3         // **/: any run of whole folders, none included
+#define IGNORE_FOLDER_NAME 4     // Inside a folder name skipped by the IGNORE_FOLDERS before
+#define IGNORE_REST 5            // /** at the end: anything below
+#define IGNORE_END 6             // The pattern matched
+
+#define IGNORE_BLOCK_STATES 256
+#define MAX_IGNORE_BLOCKS 1024   // 256K states, far beyond what real pattern sets reach
+
+typedef struct {
+    unsigned long long *live;    // NFA positions this state stands for
+    LONG *next;                  // Per byte class, -1 until first taken
+    unsigned int hash;
+    unsigned char ignore_file;   // An entry whose name ends here is ignored if it is a file
+    unsigned char ignore_folder; // Same for a folder
+} IgnoreState;
+
+typedef struct {
+    int ready;                   // Compiled, with at least one pattern
+    int failed;                  // Ran out of memory, matches can no longer be trusted
+    unsigned char *kinds;        // Per position
+    unsigned char *chars;        // Per position, for IGNORE_LITERAL
+    int *owners;                 // Per position, the pattern it belongs to
+    int position_count;
+    int position_capacity;
+    unsigned char *folder_only;  // Per pattern
+    unsigned char *negated;      // Per pattern
+    int words;                   // 64-bit words in a position set
+    unsigned char classes[256];  // Bytes that no pattern tells apart share a class
+    unsigned char class_chars[256]; // One (lowercase) byte of every class
+    int class_count;
+    int start;
+    IgnoreState *blocks[MAX_IGNORE_BLOCKS];
+    int state_count;
+    int *table;                  // States by position set, open addressing
+    int table_size;
+    unsigned long long *scratch;
+    CRITICAL_SECTION lock;
+    int lock_ready;
+} IgnoreMatcher;
+
+#define IGNORE_STATE(m, id) (&(m)->blocks[(id) / IGNORE_BLOCK_STATES][(id) % IGNORE_BLOCK_STATES])
+
+static void add_ignore_position(IgnoreMatcher *m, int kind, int ch, int owner) {
+    if (m->failed) return;
+    if (m->position_count == m->position_capacity) {
+        int capacity = m->position_capacity ? m->position_capacity * 2 : 256;
+        unsigned char *kinds = realloc(m->kinds, capacity);
+        if (kinds) m->kinds = kinds;
+        unsigned char *chars = realloc(m->chars, capacity);
+        if (chars) m->chars = chars;
+        int *owners = realloc(m->owners, sizeof(int) * capacity);
+        if (owners) m->owners = owners;
+        if (!kinds || !chars || !owners) {
+            m->failed = 1;
+            return;
         }
+        m->position_capacity = capacity;
     }
-    return 0;
+    m->kinds[m->position_count] = (unsigned char)kind;
+    m->chars[m->position_count] = (unsigned char)ch;
+    m->owners[m->position_count] = owner;
+    m->position_count++;
 }
 
-// Parse config file
-void parse_config(const char *profile) {
-    FILE *f = fopen(".foldcessing", "r");
-    if (!f) return;
+// Turn one pattern into positions, the last one IGNORE_END
+static void compile_ignore_pattern(IgnoreMatcher *m, const char *pattern, int owner) {
+    char text[MAX_LINE];
+    size_t len = 0;
 
-    char line[MAX_LINE];
-    char current_section[256] = "general";
-    int in_target_section = 1;
-    char target_section[256];
+    m->negated[owner] = (*pattern == '!');
+    if (*pattern == '!') pattern++;
+    for (; *pattern && len < sizeof(text) - 1; pattern++) {
+        text[len++] = (*pattern == '\\') ? '/' : *pattern;
+    }
+    text[len] = '\0';
 
-    if (profile) {
-        snprintf(target_section, sizeof(target_section), "profile:%s", profile);
+    m->folder_only[owner] = 0;
+    while (len > 0 && text[len - 1] == '/') {
+        text[--len] = '\0';
+        m->folder_only[owner] = 1;
+    }
+
+    // A '/' anywhere but at the end anchors the pattern, otherwise it matches at any depth
+    const char *p = text;
+    if (memchr(text, '/', len)) {
+        if (*p == '/') p++;
     } else {
-        strcpy(target_section, "general");
+        add_ignore_position(m, IGNORE_FOLDERS, 0, owner);
+        add_ignore_position(m, IGNORE_FOLDER_NAME, 0, owner);
     }
 
-    while (fgets(line, sizeof(line), f)) {
-        trim(line);
+    for (; *p; p++) {
+        int folder_start = (p == text || p[-1] == '/');
+        if (p[0] == '*' && p[1] == '*' && folder_start && p[2] == '/') {
+            add_ignore_position(m, IGNORE_FOLDERS, 0, owner);
+            add_ignore_position(m, IGNORE_FOLDER_NAME, 0, owner);
+            p += 2;
+        } else if (p[0] == '*' && p[1] == '*' && folder_start && !p[2]) {
+            add_ignore_position(m, IGNORE_REST, 0, owner);
+            p++;
+        } else if (*p == '*') {
+            add_ignore_position(m, IGNORE_STAR, 0, owner);
+            while (p[1] == '*') p++;
+        } else if (*p == '?') {
+            add_ignore_position(m, IGNORE_ONE, 0, owner);
+        } else {
+            add_ignore_position(m, IGNORE_LITERAL, tolower((unsigned char)*p), owner);
+        }
+    }
+    add_ignore_position(m, IGNORE_END, 0, owner);
+}
 
-        // Skip empty lines and comments
-        if (!line[0] || line[0] == '#' || line[0] == ';') continue;
+#define IGNORE_BIT(set, p) (((set)[(p) >> 6] >> ((p) & 63)) & 1)
+#define IGNORE_SET(set, p) ((set)[(p) >> 6] |= 1ULL << ((p) & 63))
 
-        // Check for section header
-        if (line[0] == '[') {
-            char *end = strchr(line, ']');
-            if (end) {
-                *end = '\0';
-                strcpy(current_section, line + 1);
-                in_target_section = (strcasecmp_win(current_section, "general") == 0 ||
-                                    strcasecmp_win(current_section, target_section) == 0);
+// Follow the empty moves: stars and folder runs may match nothing
+static void ignore_close(IgnoreMatcher *m, unsigned long long *set) {
+    for (int p = 0; p < m->position_count; p++) {
+        if (!IGNORE_BIT(set, p)) continue;
+        if (m->kinds[p] == IGNORE_STAR || m->kinds[p] == IGNORE_REST) IGNORE_SET(set, p + 1);
+        if (m->kinds[p] == IGNORE_FOLDERS) IGNORE_SET(set, p + 2);
+    }
+}
+
+// Positions live after reading c from the positions in from
+static void ignore_advance(IgnoreMatcher *m, const unsigned long long *from, unsigned long long *to, unsigned char c) {
+    memset(to, 0, sizeof(unsigned long long) * m->words);
+    for (int w = 0; w < m->words; w++) {
+        if (!from[w]) continue;
+        for (int b = 0; b < 64; b++) {
+            if (!((from[w] >> b) & 1)) continue;
+            int p = w * 64 + b;
+            switch (m->kinds[p]) {
+            case IGNORE_LITERAL: if (m->chars[p] == c) IGNORE_SET(to, p + 1); break;
+            case IGNORE_ONE: if (c != '/') IGNORE_SET(to, p + 1); break;
+            case IGNORE_STAR: if (c != '/') IGNORE_SET(to, p); break;
+            case IGNORE_FOLDERS: if (c != '/') IGNORE_SET(to, p + 1); break;
+            case IGNORE_FOLDER_NAME: IGNORE_SET(to, (c == '/') ? p - 1 : p); break;
+            case IGNORE_REST: IGNORE_SET(to, p); break;
             }
-            continue;
         }
+    }
+    ignore_close(m, to);
+}
 
-        if (!in_target_section) continue;
+// Find or add the DFA state for a set of positions, called with the lock held.
+// Returns -1 once MAX_IGNORE_BLOCKS are full, or with failed set if out of memory.
+static int ignore_state_for(IgnoreMatcher *m, const unsigned long long *live) {
+    unsigned long long mixed = 0;
+    for (int w = 0; w < m->words; w++) {
+        mixed = (mixed ^ live[w]) * 0x100000001B3ULL;
+    }
+    unsigned int hash = (unsigned int)(mixed ^ (mixed >> 29));
 
-        // Parse key=value
-        char *equals = strchr(line, '=');
-        if (!equals) continue;
+    unsigned int mask = m->table_size - 1;
+    unsigned int slot = hash & mask;
+    while (m->table[slot] >= 0) {
+        IgnoreState *state = IGNORE_STATE(m, m->table[slot]);
+        if (state->hash == hash && memcmp(state->live, live, sizeof(unsigned long long) * m->words) == 0) {
+            return m->table[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
 
-        *equals = '\0';
-        char *key = line;
+    int id = m->state_count;
+    if (id == MAX_IGNORE_BLOCKS * IGNORE_BLOCK_STATES) return -1;
+    if (!m->blocks[id / IGNORE_BLOCK_STATES]) {
+        m->blocks[id / IGNORE_BLOCK_STATES] = calloc(IGNORE_BLOCK_STATES, sizeof(IgnoreState));
+        if (!m->blocks[id / IGNORE_BLOCK_STATES]) {
+            m->failed = 1;
+            return -1;
+        }
+    }
+
+    // Keep the table at most half full, growing it first so a failure leaves it as it was
+    if ((m->state_count + 1) * 2 > m->table_size) {
+        int *table = malloc(sizeof(int) * m->table_size * 2);
+        if (!table) {
+            m->failed = 1;
+            return -1;
+        }
+        int old_size = m->table_size;
+        int *old_table = m->table;
+        m->table = table;
+        m->table_size *= 2;
+        for (int i = 0; i < m->table_size; i++) m->table[i] = -1;
+        for (int i = 0; i < old_size; i++) {
+            if (old_table[i] < 0) continue;
+            unsigned int s = IGNORE_STATE(m, old_table[i])->hash & (m->table_size - 1);
+            while (m->table[s] >= 0) s = (s + 1) & (m->table_size - 1);
+            m->table[s] = old_table[i];
+        }
+        free(old_table);
+        mask = m->table_size - 1;
+        slot = hash & mask;
+        while (m->table[slot] >= 0) slot = (slot + 1) & mask;
+    }
+
+    IgnoreState *state = IGNORE_STATE(m, id);
+    state->live = malloc(sizeof(unsigned long long) * m->words);
+    state->next = malloc(sizeof(LONG) * m->class_count);
+    if (!state->live || !state->next) {
+        free(state->live);
+        free(state->next);
+        state->live = NULL;
+        state->next = NULL;
+        m->failed = 1;
+        return -1;
+    }
+    state->hash = hash;
+    memcpy(state->live, live, sizeof(unsigned long long) * m->words);
+    for (int c = 0; c < m->class_count; c++) state->next[c] = -1;
+
+    // The last pattern matching decides, and folder-only patterns pass files by
+    int last_any = -1, last_file = -1;
+    for (int p = 0; p < m->position_count; p++) {
+        if (m->kinds[p] != IGNORE_END || !IGNORE_BIT(live, p)) continue;
+        last_any = m->owners[p];
+        if (!m->folder_only[last_any]) last_file = last_any;
+    }
+    state->ignore_folder = (last_any >= 0 && !m->negated[last_any]);
+    state->ignore_file = (last_file >= 0 && !m->negated[last_file]);
+
+    m->table[slot] = id;
+    m->state_count++;
+    return id;
+}
+
+// Forget the compiled patterns
+static void free_ignore_matcher(IgnoreMatcher *m) {
+    for (int id = 0; id < m->state_count; id++) {
+        free(IGNORE_STATE(m, id)->live);
+        free(IGNORE_STATE(m, id)->next);
+    }
+    for (int b = 0; b < MAX_IGNORE_BLOCKS && m->blocks[b]; b++) {
+        free(m->blocks[b]);
+        m->blocks[b] = NULL;
+    }
+    free(m->kinds);
+    free(m->chars);
+    free(m->owners);
+    free(m->folder_only);
+    free(m->negated);
+    free(m->table);
+    free(m->scratch);
+
+    CRITICAL_SECTION lock = m->lock;
+    int lock_ready = m->lock_ready;
+    memset(m, 0, sizeof(*m));
+    m->lock = lock;
+    m->lock_ready = lock_ready;
+}
+
+// Build the matcher for config->ignore_patterns, 0 if out of memory
+static int compile_ignore_patterns(IgnoreMatcher *m, const Config *config) {
+    free_ignore_matcher(m);
+    if (config->ignore_count == 0) return 1;
+
+    if (!m->lock_ready) {
+        InitializeCriticalSection(&m->lock);
+        m->lock_ready = 1;
+    }
+
+    m->folder_only = calloc(config->ignore_count, 1);
+    m->negated = calloc(config->ignore_count, 1);
+    if (!m->folder_only || !m->negated) m->failed = 1;
+    for (int i = 0; i < config->ignore_count && !m->failed; i++) {
+        compile_ignore_pattern(m, config->ignore_patterns[i], i);
+    }
+    if (m->failed) return 0;
+    m->words = m->position_count / 64 + 1;
+
+    // Class 0 is every byte no literal mentions, '/' and each literal get their own
+    unsigned char class_of[256] = {0};
+    m->class_count = 1;
+    class_of['/'] = (unsigned char)m->class_count;
+    m->class_chars[m->class_count++] = '/';
+    for (int p = 0; p < m->position_count; p++) {
+        unsigned char c = m->chars[p];
+        if (m->kinds[p] == IGNORE_LITERAL && !class_of[c]) {
+            class_of[c] = (unsigned char)m->class_count;
+            m->class_chars[m->class_count++] = c;
+        }
+    }
+    m->class_chars[0] = 0;
+    for (int c = 1; c < 256; c++) {
+        if (!class_of[c] && tolower(c) == c) {
+            m->class_chars[0] = (unsigned char)c;
+            break;
+        }
+    }
+    for (int c = 0; c < 256; c++) {
+        m->classes[c] = class_of[(unsigned char)tolower(c)];
+    }
+
+    m->table_size = 1024;
+    m->table = malloc(sizeof(int) * m->table_size);
+    m->scratch = malloc(sizeof(unsigned long long) * m->words);
+    if (!m->table || !m->scratch) {
+        m->failed = 1;
+        return 0;
+    }
+    for (int i = 0; i < m->table_size; i++) m->table[i] = -1;
+
+    // Every pattern starts at its first position
+    memset(m->scratch, 0, sizeof(unsigned long long) * m->words);
+    for (int p = 0; p < m->position_count; p++) {
+        if (p == 0 || m->kinds[p - 1] == IGNORE_END) IGNORE_SET(m->scratch, p);
+    }
+    ignore_close(m, m->scratch);
+    m->start = ignore_state_for(m, m->scratch);
+    if (m->start < 0) return 0;
+    m->ready = 1;
+    return 1;
+}
+
+// State after reading c
+static int ignore_next(IgnoreMatcher *m, int state, unsigned char c) {
+    if (!m->ready) return 0;
+
+    int cls = m->classes[c];
+    IgnoreState *current = IGNORE_STATE(m, state);
+    int next = (int)((volatile LONG*)current->next)[cls];
+    if (next >= 0) return next;
+
+    EnterCriticalSection(&m->lock);
+    next = (int)current->next[cls];
+    if (next < 0) {
+        ignore_advance(m, current->live, m->scratch, m->class_chars[cls]);
+        next = ignore_state_for(m, m->scratch);
+        if (next < 0) {
+            // Out of states (or memory, which fails the scan): stop matching below here
+            // rather than grow without bound
+            memset(m->scratch, 0, sizeof(unsigned long long) * m->words);
+            next = ignore_state_for(m, m->scratch);
+            if (next < 0) next = m->start;
+        }
+        InterlockedExchange(&current->next[cls], next);
+    }
+    LeaveCriticalSection(&m->lock);
+    return next;
+}
+
+// State after reading a whole name
+static int ignore_name(IgnoreMatcher *m, int state, const char *name) {
+    if (!m->ready) return 0;
+    while (*name) state = ignore_next(m, state, (unsigned char)*name++);
+    return state;
+}
+
+// Is the entry whose name ended in state ignored?
+static int ignore_entry(IgnoreMatcher *m, int state, int is_folder) {
+    if (!m->ready) return 0;
+    IgnoreState *entry = IGNORE_STATE(m, state);
+    return is_folder ? entry->ignore_folder : entry->ignore_file;
+}
+
+// State to match the entries of a folder with, relative to the sketch folder
+static int ignore_folder_state(IgnoreMatcher *m, const char *relative) {
+    if (!m->ready) return 0;
+    if (!relative[0]) return m->start;
+    return ignore_next(m, ignore_name(m, m->start, relative), '/');
+}
+
+// Check if a path should be ignored, itself or because a folder on the way is
+static int should_ignore(IgnoreMatcher *m, const char *relative_path, int is_folder) {
+    if (!m->ready) return 0;
+
+    int state = m->start;
+    for (const char *p = relative_path; *p; p++) {
+        if (*p == '/' && ignore_entry(m, state, 1)) return 1;
+        state = ignore_next(m, state, (unsigned char)*p);
+    }
+    return ignore_entry(m, state, is_folder);
+}
+
+// A sketch
+//
+// Everything known about one sketch folder lives in its Sketch: the config, the compiled
+// ignore patterns, the collected files and the line map of the last fold. The fold engine
+// keeps no state of its own, so sketches can be folded on different threads at once.
+
+typedef struct FoldcessingSketch {
+    char root[MAX_PATH_LEN];       // Sketch folder, absolute
+    Config config;
+    Arena config_arena;            // Strings parsed from .foldcessing
+    IgnoreMatcher ignore;
+    FileEntry *files;              // files[] and map.ranges[] grow together
+    int file_count;
+    int file_capacity;
+    Arena file_arena;              // Paths of collected files, reset on every rescan
+    LineMap map;                   // Of the last fold, its paths are those of files[]
+    FoldStats stats;
+    int rewritten;                 // Last fold: -1 written in full, else files rewritten in place
+    int cached;                    // Last fold was taken from fold_cache
+    int duplicate_count;           // Found by the last fold, and the lines reporting them
+    char *duplicate_report;
+    size_t duplicate_report_len;
+    size_t duplicate_report_capacity;
+} Sketch;
+
+// Append a collected file to the registry, 0 if out of memory
+static int add_file(Sketch *sketch, const char *path, const char *relative, unsigned long long size, unsigned long long mtime) {
+    if (sketch->file_count == sketch->file_capacity) {
+        int capacity = sketch->file_capacity ? sketch->file_capacity * 2 : 256;
+        FileEntry *new_files = realloc(sketch->files, sizeof(FileEntry) * capacity);
+        if (!new_files) return 0;
+        sketch->files = new_files;
+        LineMapping *new_map = realloc(sketch->map.ranges, sizeof(LineMapping) * capacity);
+        if (!new_map) return 0;
+        sketch->map.ranges = new_map;
+        sketch->file_capacity = capacity;
+    }
+
+    FileEntry *file = &sketch->files[sketch->file_count];
+    file->path = arena_strdup(&sketch->file_arena, path);
+    file->relative = arena_strdup(&sketch->file_arena, relative);
+    if (!file->path || !file->relative) return 0;
+    file->size = size;
+    file->mtime = mtime;
+    file->hash = 0;
+    file->offset = 0;
+    memset(&file->symbols, 0, sizeof(file->symbols));
+    file->symbols.count = -1;
+
+    LineMapping *range = &sketch->map.ranges[sketch->file_count];
+    range->start_line = 0;
+    range->end_line = -1;
+    range->relative = file->relative;
+    sketch->map.count = ++sketch->file_count;
+    return 1;
+}
+
+// Forget all collected files before scanning again
+static void reset_files(Sketch *sketch) {
+    for (int i = 0; i < sketch->file_count; i++) {
+        free(sketch->files[i].symbols.items);
+        free(sketch->files[i].symbols.names);
+    }
+    sketch->file_count = 0;
+    sketch->map.count = 0;
+    arena_reset(&sketch->file_arena);
+}
+
+// A path from the config, relative ones taken from the sketch folder
+static void sketch_path(const Sketch *sketch, const char *value, char *path) {
+    if (!value[0] || value[0] == '/' || value[0] == '\\' || value[1] == ':') {
+        snprintf(path, MAX_PATH_LEN, "%s", value);
+    } else {
+        snprintf(path, MAX_PATH_LEN, "%s" PATH_SEP "%s", sketch->root, value);
+    }
+}
+
+// Parse the sketch's config file, 0 if out of memory
+static int parse_config(Sketch *sketch, const char *profile) {
+    Config *config = &sketch->config;
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s" PATH_SEP ".foldcessing", sketch->root);
+    FILE *f = fopen(path, "r");
+    if (!f) return 1;
+
+    char line[MAX_LINE];
+    char current_section[256] = "general";
+    int in_target_section = 1;
+    char target_section[256];
+
+    if (profile) {
+        snprintf(target_section, sizeof(target_section), "profile:%s", profile);
+    } else {
+        strcpy(target_section, "general");
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        trim(line);
+
+        // Skip empty lines and comments
+        if (!line[0] || line[0] == '#' || line[0] == ';') continue;
+
+        // Check for section header
+        if (line[0] == '[') {
+            char *end = strchr(line, ']');
+            if (end) {
+                *end = '\0';
+                strcpy(current_section, line + 1);
+                in_target_section = (strcasecmp_win(current_section, "general") == 0 ||
+                                    strcasecmp_win(current_section, target_section) == 0);
+            }
+            continue;
+        }
+
+        if (!in_target_section) continue;
+
+        // Parse key=value
+        char *equals = strchr(line, '=');
+        if (!equals) continue;
+
+        *equals = '\0';
+        char *key = line;
         char *value = equals + 1;
         trim(key);
         trim(value);
 
         if (strcasecmp_win(key, "processing_path") == 0) {
             // Profile values override general
-            if (strcasecmp_win(current_section, target_section) == 0 || !config.processing_path[0]) {
-                strncpy(config.processing_path, value, MAX_PATH_LEN - 1);
+            if (strcasecmp_win(current_section, target_section) == 0 || !config->processing_path[0]) {
+                strncpy(config->processing_path, value, MAX_PATH_LEN - 1);
             }
         } else if (strcasecmp_win(key, "ignore") == 0) {
-            // Parse comma-separated ignore patterns
-            char *token = strtok(value, ",");
-            while (token && config.ignore_count < MAX_IGNORE_PATTERNS) {
+            // Parse comma-separated ignore patterns (not with strtok, sketches are opened on
+            // several threads at once)
+            char *token = value;
+            while (token) {
+                char *comma = strchr(token, ',');
+                if (comma) *comma = '\0';
                 trim(token);
                 if (token[0]) {
-                    strncpy(config.ignore_patterns[config.ignore_count++], token, MAX_PATH_LEN - 1);
+                    if (config->ignore_count == config->ignore_capacity) {
+                        int capacity = config->ignore_capacity ? config->ignore_capacity * 2 : 16;
+                        char **patterns = realloc(config->ignore_patterns, sizeof(char*) * capacity);
+                        if (!patterns) {
+                            fclose(f);
+                            return 0;
+                        }
+                        config->ignore_patterns = patterns;
+                        config->ignore_capacity = capacity;
+                    }
+                    const char *pattern = arena_strdup(&sketch->config_arena, token);
+                    if (!pattern) {
+                        fclose(f);
+                        return 0;
+                    }
+                    config->ignore_patterns[config->ignore_count++] = (char*)pattern;
                 }
-                token = strtok(NULL, ",");
+                token = comma ? comma + 1 : NULL;
             }
         } else if (strcasecmp_win(key, "default_action") == 0) {
             // Profile values override general
-            if (strcasecmp_win(current_section, target_section) == 0 || !config.default_action[0]) {
-                strncpy(config.default_action, value, sizeof(config.default_action) - 1);
+            if (strcasecmp_win(current_section, target_section) == 0 || !config->default_action[0]) {
+                strncpy(config->default_action, value, sizeof(config->default_action) - 1);
             }
         } else if (strcasecmp_win(key, "auto_close") == 0) {
             // Parse boolean value
             if (strcasecmp_win(value, "true") == 0 || strcmp(value, "1") == 0) {
-                config.auto_close = 1;
+                config->auto_close = 1;
+            } else if (strcasecmp_win(value, "false") == 0 || strcmp(value, "0") == 0) {
+                config->auto_close = 0;
+            }
+        } else if (strcasecmp_win(key, "scan_threads") == 0) {
+            // Number or "auto"
+            config->scan_threads = atoi(value);
+        } else if (strcasecmp_win(key, "read_threads") == 0) {
+            config->read_threads = atoi(value);
+        } else if (strcasecmp_win(key, "read_buffer_mb") == 0) {
+            config->read_buffer_mb = atoi(value);
+        } else if (strcasecmp_win(key, "keep_output") == 0) {
+            if (strcasecmp_win(value, "true") == 0 || strcmp(value, "1") == 0) {
+                config->keep_output = 1;
+            } else if (strcasecmp_win(value, "false") == 0 || strcmp(value, "0") == 0) {
+                config->keep_output = 0;
+            }
+        } else if (strcasecmp_win(key, "stats") == 0) {
+            if (strcasecmp_win(value, "true") == 0 || strcmp(value, "1") == 0) {
+                config->stats = 1;
+            } else if (strcasecmp_win(value, "false") == 0 || strcmp(value, "0") == 0) {
+                config->stats = 0;
+            }
+        } else if (strcasecmp_win(key, "stats_history") == 0) {
+            if (strcasecmp_win(value, "true") == 0 || strcmp(value, "1") == 0) {
+                config->stats_history = 1;
+            } else if (strcasecmp_win(value, "false") == 0 || strcmp(value, "0") == 0) {
+                config->stats_history = 0;
+            }
+        } else if (strcasecmp_win(key, "output_buffer_mb") == 0) {
+            config->output_buffer_mb = atoi(value);
+        } else if (strcasecmp_win(key, "output_overflow") == 0) {
+            if (strcasecmp_win(value, "block") == 0) {
+                config->output_overflow = OVERFLOW_BLOCK;
+            } else if (strcasecmp_win(value, "drop_oldest") == 0) {
+                config->output_overflow = OVERFLOW_DROP_OLDEST;
+            } else if (strcasecmp_win(value, "summarize") == 0) {
+                config->output_overflow = OVERFLOW_SUMMARIZE;
+            }
+        } else if (strcasecmp_win(key, "tee_log") == 0) {
+            strncpy(config->tee_log, value, MAX_PATH_LEN - 1);
+        } else if (strcasecmp_win(key, "tee_raw_log") == 0) {
+            strncpy(config->tee_raw_log, value, MAX_PATH_LEN - 1);
+        } else if (strcasecmp_win(key, "duplicate_symbols") == 0) {
+            if (strcasecmp_win(value, "warn") == 0) {
+                config->duplicate_symbols = DUPLICATES_WARN;
+            } else if (strcasecmp_win(value, "off") == 0) {
+                config->duplicate_symbols = DUPLICATES_OFF;
+            } else if (strcasecmp_win(value, "abort") == 0) {
+                config->duplicate_symbols = DUPLICATES_ABORT;
+            }
+        } else if (strcasecmp_win(key, "memory_limit_mb") == 0) {
+            config->memory_limit_mb = atoi(value);
+        } else if (strcasecmp_win(key, "cpu_affinity") == 0) {
+            // A mask like 0x0F, 0 for any processor
+            config->cpu_affinity = strtoull(value, NULL, 0);
+        } else if (strcasecmp_win(key, "priority") == 0) {
+            if (strcasecmp_win(value, "idle") == 0) {
+                config->priority = PRIORITY_IDLE;
+            } else if (strcasecmp_win(value, "below_normal") == 0) {
+                config->priority = PRIORITY_BELOW_NORMAL;
+            } else if (strcasecmp_win(value, "normal") == 0) {
+                config->priority = PRIORITY_NORMAL;
+            } else if (strcasecmp_win(value, "above_normal") == 0) {
+                config->priority = PRIORITY_ABOVE_NORMAL;
+            } else if (strcasecmp_win(value, "high") == 0) {
+                config->priority = PRIORITY_HIGH;
+            }
+        } else if (strcasecmp_win(key, "output_root") == 0) {
+            strncpy(config->output_root, value, MAX_PATH_LEN - 1);
+            // No trailing separator, folders are appended with one
+            size_t len = strlen(config->output_root);
+            while (len > 0 && (config->output_root[len - 1] == '\\' || config->output_root[len - 1] == '/')) {
+                config->output_root[--len] = '\0';
+            }
+        } else if (strcasecmp_win(key, "scan") == 0) {
+            if (strcasecmp_win(value, "walk") == 0) {
+                config->scan = SCAN_WALK;
+            } else if (strcasecmp_win(value, "git") == 0) {
+                config->scan = SCAN_GIT;
+            } else if (strcasecmp_win(value, "git_untracked") == 0) {
+                config->scan = SCAN_GIT_UNTRACKED;
+            }
+        } else if (strcasecmp_win(key, "fold_cache") == 0) {
+            // Relative to the sketch folder, like ../fold-cache for worktrees side by side
+            sketch_path(sketch, value, config->fold_cache);
+            size_t len = strlen(config->fold_cache);
+            while (len > 0 && (config->fold_cache[len - 1] == '\\' || config->fold_cache[len - 1] == '/')) {
+                config->fold_cache[--len] = '\0';
+            }
+        } else if (strcasecmp_win(key, "line_map") == 0) {
+            sketch_path(sketch, value, config->line_map);
+        } else if (strcasecmp_win(key, "fold_cache_mb") == 0) {
+            config->fold_cache_mb = atoi(value);
+        } else if (strcasecmp_win(key, "java_line_offset") == 0) {
+            config->java_line_offset = atoi(value);
+        } else if (strcasecmp_win(key, "watch_debounce") == 0) {
+            config->watch_debounce = atoi(value);
+        } else if (strcasecmp_win(key, "incremental") == 0) {
+            if (strcasecmp_win(value, "true") == 0 || strcmp(value, "1") == 0) {
+                config->incremental = 1;
             } else if (strcasecmp_win(value, "false") == 0 || strcmp(value, "0") == 0) {
-                config.auto_close = 0;
+                config->incremental = 0;
+            }
+        }
+    }
+
+    fclose(f);
+    return compile_ignore_patterns(&sketch->ignore, config);
+}
+
+// Check if string ends with suffix
+static int ends_with(const char *str, const char *suffix) {
+    size_t str_len = strlen(str);
+    size_t suffix_len = strlen(suffix);
+    if (suffix_len > str_len) return 0;
+    return strcasecmp_win(str + str_len - suffix_len, suffix) == 0;
+}
+
+// Directory scanning
+//
+// Every folder becomes a DirNode holding its sorted subfolders and .pde files. Folders are
+// scanned by a pool of scan_threads workers: each worker pushes the subfolders it finds on
+// its own queue and idle workers steal from the others, or sleep until there is something
+// to steal. Once the whole tree is scanned, emit_directory walks it depth-first on the
+// calling thread, so files[] gets exactly the alphabetical, depth-first order no matter
+// which worker scanned what.
+
+#ifndef FIND_FIRST_EX_LARGE_FETCH
+#define FIND_FIRST_EX_LARGE_FETCH 2
+#endif
+
+#define FIND_EX_INFO_BASIC 1  // FindExInfoBasic, missing from older headers
+#define MAX_SCAN_THREADS 64
+
+typedef struct DirNode {
+    char *path;
+    char *relative;
+    struct DirNode **children;   // Subfolders, sorted
+    int child_count;
+    char **pde_files;            // .pde files, sorted
+    char **pde_relatives;
+    unsigned long long *pde_sizes;
+    unsigned long long *pde_mtimes;
+    int pde_count;
+    int ignored;                 // Entries skipped by ignore patterns
+    int ignore_state;            // Ignore matcher state for the names of the entries
+    struct DirNode *parent;      // NULL for the root
+    unsigned long long device;   // Which folder this is, where the platform can tell cheaply,
+    unsigned long long inode;    // to notice a link back to one above it
+} DirNode;
+
+// Threads of a pool waiting for something that another thread guards with a lock: each
+// thread marks itself waiting with the lock held, then sleeps on its own auto-reset event
+// once the lock is released. Waking them also takes the lock, so no wakeup gets lost between
+// a thread's last look and its sleep. Condition variables would do, but not on every
+// compiler this builds with.
+typedef struct {
+    HANDLE events[MAX_SCAN_THREADS];
+    int waiting[MAX_SCAN_THREADS];
+    int count;
+} WaitList;
+
+static int wait_list_init(WaitList *list, int count) {
+    memset(list, 0, sizeof(*list));
+    for (list->count = 0; list->count < count; list->count++) {
+        list->events[list->count] = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (!list->events[list->count]) return 0;
+    }
+    return 1;
+}
+
+static void wait_list_free(WaitList *list) {
+    for (int i = 0; i < list->count; i++) CloseHandle(list->events[i]);
+    list->count = 0;
+}
+
+// With the lock held: thread will sleep in wait_list_sleep once it has let go of the lock
+static void wait_list_add(WaitList *list, int thread) {
+    list->waiting[thread] = 1;
+}
+
+static void wait_list_sleep(WaitList *list, int thread) {
+    WaitForSingleObject(list->events[thread], INFINITE);
+}
+
+// With the lock held: wake every waiting thread
+static void wait_list_wake(WaitList *list) {
+    for (int i = 0; i < list->count; i++) {
+        if (list->waiting[i]) {
+            list->waiting[i] = 0;
+            SetEvent(list->events[i]);
+        }
+    }
+}
+
+// Ring of folders: the owner pushes and takes at the back, thieves take from the front
+typedef struct {
+    DirNode **items;
+    int head;
+    int count;
+    int capacity;                // A power of two
+    CRITICAL_SECTION lock;
+} ScanQueue;
+
+typedef struct {
+    ScanQueue queues[MAX_SCAN_THREADS];
+    IgnoreMatcher *ignore;
+    int thread_count;
+    volatile LONG pending;       // Folders queued or being scanned
+    volatile LONG queued;        // Folders queued
+    volatile LONG failed;        // A folder was left out for lack of memory
+    CRITICAL_SECTION idle_lock;  // Guards idle and the last look at queued and pending
+    WaitList idle;
+} ScanPool;
+
+typedef struct {
+    ScanPool *pool;
+    int index;
+} ScanWorker;
+
+// Free a folder that was never scanned
+static void free_dir_node(DirNode *node) {
+    free(node->path);
+    free(node->relative);
+    free(node);
+}
+
+// NULL if out of memory
+static DirNode *new_dir_node(const char *path, const char *relative) {
+    DirNode *node = calloc(1, sizeof(DirNode));
+    if (!node) return NULL;
+    node->path = _strdup(path);
+    node->relative = _strdup(relative);
+    if (!node->path || !node->relative) {
+        free_dir_node(node);
+        return NULL;
+    }
+    return node;
+}
+
+// One entry of a folder listing; size and mtime only count once list_stat has run
+typedef struct {
+    const char *name;
+    int is_dir;                  // Links to folders count as folders
+    int is_link;                 // Junction or symbolic link
+    int readonly;
+    unsigned long long size;
+    unsigned long long mtime;
+} ListEntry;
+
+#ifdef _WIN32
+
+#ifndef FILE_ATTRIBUTE_REPARSE_POINT
+#define FILE_ATTRIBUTE_REPARSE_POINT 0x00000400
+#endif
+
+typedef struct {
+    HANDLE find;
+    WIN32_FIND_DATA data;
+    int started;
+    ListEntry entry;
+} DirList;
+
+// Open a directory listing, preferring the cheaper basic info level with large fetches
+static int list_open(DirList *list, const char *folder) {
+    char search_path[MAX_PATH_LEN];
+    snprintf(search_path, sizeof(search_path), "%s\\*", folder);
+
+    list->started = 0;
+    list->find = FindFirstFileEx(search_path, (FINDEX_INFO_LEVELS)FIND_EX_INFO_BASIC, &list->data,
+                                 FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (list->find == INVALID_HANDLE_VALUE && GetLastError() == ERROR_INVALID_PARAMETER) {
+        // Before Windows 7 neither the info level nor the flag exist
+        list->find = FindFirstFile(search_path, &list->data);
+    }
+    return list->find != INVALID_HANDLE_VALUE;
+}
+
+// Next entry other than . and .., or NULL at the end
+static ListEntry *list_next(DirList *list) {
+    WIN32_FIND_DATA *data = &list->data;
+    do {
+        if (list->started && !FindNextFile(list->find, data)) return NULL;
+        list->started = 1;
+    } while (strcmp(data->cFileName, ".") == 0 || strcmp(data->cFileName, "..") == 0);
+
+    ListEntry *entry = &list->entry;
+    entry->name = data->cFileName;
+    entry->is_dir = (data->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    entry->is_link = (data->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+    entry->readonly = (data->dwFileAttributes & FILE_ATTRIBUTE_READONLY) != 0;
+    entry->size = ((unsigned long long)data->nFileSizeHigh << 32) | data->nFileSizeLow;
+    entry->mtime = ((unsigned long long)data->ftLastWriteTime.dwHighDateTime << 32) |
+                   data->ftLastWriteTime.dwLowDateTime;
+    return entry;
+}
+
+// The find data already carries size and time
+static void list_stat(DirList *list, ListEntry *entry) {
+}
+
+// Telling folders apart would take opening each one, so junctions are simply followed
+static int list_identity(DirList *list, unsigned long long *device, unsigned long long *inode) {
+    return 0;
+}
+
+static void list_close(DirList *list) {
+    FindClose(list->find);
+}
+
+#else
+
+typedef struct {
+    DIR *dir;
+    ListEntry entry;
+} DirList;
+
+static int list_open(DirList *list, const char *folder) {
+    int fd = openat(AT_FDCWD, folder, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    list->dir = fdopendir(fd);
+    if (!list->dir) {
+        close(fd);
+        return 0;
+    }
+    return 1;
+}
+
+// Next entry other than . and .., or NULL at the end; d_type saves a stat per entry
+static ListEntry *list_next(DirList *list) {
+    struct dirent *found;
+    do {
+        found = readdir(list->dir);
+        if (!found) return NULL;
+    } while (strcmp(found->d_name, ".") == 0 || strcmp(found->d_name, "..") == 0);
+
+    ListEntry *entry = &list->entry;
+    memset(entry, 0, sizeof(*entry));
+    entry->name = found->d_name;
+    if (found->d_type == DT_DIR) {
+        entry->is_dir = 1;
+    } else if (found->d_type == DT_LNK || found->d_type == DT_UNKNOWN) {
+        // Links are followed to see what they point at, as junctions are on Windows
+        struct stat st;
+        entry->is_link = found->d_type == DT_LNK;
+        if (fstatat(dirfd(list->dir), found->d_name, &st, 0) == 0) {
+            entry->is_dir = S_ISDIR(st.st_mode);
+        }
+    }
+    return entry;
+}
+
+// Fill in size and modification time of a listed file
+static void list_stat(DirList *list, ListEntry *entry) {
+    struct stat st;
+    if (fstatat(dirfd(list->dir), entry->name, &st, 0) == 0) {
+        entry->size = (unsigned long long)st.st_size;
+        entry->mtime = filetime_of(&st);
+    }
+}
+
+// Device and inode of the listed folder, returns 0 if unknown
+static int list_identity(DirList *list, unsigned long long *device, unsigned long long *inode) {
+    struct stat st;
+    if (fstat(dirfd(list->dir), &st) != 0) return 0;
+    *device = (unsigned long long)st.st_dev;
+    *inode = (unsigned long long)st.st_ino;
+    return 1;
+}
+
+static void list_close(DirList *list) {
+    closedir(list->dir);
+}
+
+#endif
+
+// One listed subfolder or .pde file, with its sort key
+typedef struct {
+    char *key;                   // Lowercased name, then the name itself
+    const char *name;            // Points into key
+    DirNode *dir;                // NULL for .pde files
+    char *path;
+    char *relative;
+    unsigned long long size;
+    unsigned long long mtime;
+} ScanEntry;
+
+// Folders first, then files, each by case-insensitive name (ties by exact name)
+static int compare_scan_entries(const void *a, const void *b) {
+    const ScanEntry *x = (const ScanEntry*)a;
+    const ScanEntry *y = (const ScanEntry*)b;
+    if (!x->dir != !y->dir) return x->dir ? -1 : 1;
+    int order = strcmp(x->key, y->key);
+    return order ? order : strcmp(x->name, y->name);
+}
+
+// List one folder: fill in its subfolders (not yet scanned) and .pde files, both sorted.
+// Returns 0 if out of memory, leaving the folder empty.
+static int scan_directory(IgnoreMatcher *ignore, DirNode *node) {
+    DirList list;
+    if (!list_open(&list, node->path)) return 1;
+
+    // Links to folders are followed, but one back to a folder above this one would be
+    // scanned forever: leave it empty
+    if (list_identity(&list, &node->device, &node->inode)) {
+        for (DirNode *up = node->parent; up; up = up->parent) {
+            if (up->device == node->device && up->inode == node->inode) {
+                list_close(&list);
+                return 1;
+            }
+        }
+    }
+
+    ScanEntry *entries = NULL;
+    int entry_count = 0, entry_capacity = 0;
+    int dir_count = 0;
+    int failed = 0;
+
+    ListEntry *found;
+    while ((found = list_next(&list)) != NULL) {
+        // Skip output directory
+        if (strcasecmp_win(found->name, "output") == 0 && found->is_dir) continue;
+
+        int is_dir = found->is_dir;
+        if (!is_dir && !ends_with(found->name, ".pde")) continue;
+
+        // Check if this entry should be ignored, going on from the folder's matcher state
+        int ignore_state = ignore_name(ignore, node->ignore_state, found->name);
+        if (ignore_entry(ignore, ignore_state, is_dir)) {
+            node->ignored++;
+            continue;
+        }
+
+        char full_path[MAX_PATH_LEN];
+        snprintf(full_path, sizeof(full_path), "%s" PATH_SEP "%s", node->path, found->name);
+
+        char new_relative[MAX_PATH_LEN];
+        if (strlen(node->relative) == 0) {
+            snprintf(new_relative, sizeof(new_relative), "%s", found->name);
+        } else {
+            snprintf(new_relative, sizeof(new_relative), "%s/%s", node->relative, found->name);
+        }
+
+        if (entry_count == entry_capacity) {
+            int capacity = entry_capacity ? entry_capacity * 2 : 64;
+            ScanEntry *grown = realloc(entries, sizeof(ScanEntry) * capacity);
+            if (!grown) {
+                failed = 1;
+                break;
+            }
+            entries = grown;
+            entry_capacity = capacity;
+        }
+        ScanEntry *entry = &entries[entry_count];
+
+        // Precompute the key so sorting compares with plain strcmp, as _stricmp would
+        size_t name_len = strlen(found->name);
+        entry->key = malloc(name_len * 2 + 2);
+        if (!entry->key) {
+            failed = 1;
+            break;
+        }
+        for (size_t i = 0; i <= name_len; i++) {
+            entry->key[i] = (char)tolower((unsigned char)found->name[i]);
+        }
+        entry->name = entry->key + name_len + 1;
+        memcpy(entry->key + name_len + 1, found->name, name_len + 1);
+
+        if (is_dir) {
+            entry->dir = new_dir_node(full_path, new_relative);
+            if (!entry->dir) {
+                free(entry->key);
+                failed = 1;
+                break;
+            }
+            entry->dir->parent = node;
+            entry->dir->ignore_state = ignore_next(ignore, ignore_state, '/');
+            dir_count++;
+        } else {
+            entry->dir = NULL;
+            entry->path = _strdup(full_path);
+            entry->relative = _strdup(new_relative);
+            if (!entry->path || !entry->relative) {
+                free(entry->path);
+                free(entry->relative);
+                free(entry->key);
+                failed = 1;
+                break;
             }
+            list_stat(&list, found);
+            entry->size = found->size;
+            entry->mtime = found->mtime;
         }
+        entry_count++;
+    }
+
+    list_close(&list);
+
+    int pde_count = entry_count - dir_count;
+    if (!failed) {
+        node->children = malloc(sizeof(DirNode*) * (dir_count + 1));
+        node->pde_files = malloc(sizeof(char*) * (pde_count + 1));
+        node->pde_relatives = malloc(sizeof(char*) * (pde_count + 1));
+        node->pde_sizes = malloc(sizeof(unsigned long long) * (pde_count + 1));
+        node->pde_mtimes = malloc(sizeof(unsigned long long) * (pde_count + 1));
+        failed = !node->children || !node->pde_files || !node->pde_relatives || !node->pde_sizes ||
+                 !node->pde_mtimes;
+    }
+    if (failed) {
+        for (int i = 0; i < entry_count; i++) {
+            if (entries[i].dir) {
+                free_dir_node(entries[i].dir);
+            } else {
+                free(entries[i].path);
+                free(entries[i].relative);
+            }
+            free(entries[i].key);
+        }
+        free(entries);
+        free(node->children);
+        free(node->pde_files);
+        free(node->pde_relatives);
+        free(node->pde_sizes);
+        free(node->pde_mtimes);
+        node->children = NULL;
+        node->pde_files = node->pde_relatives = NULL;
+        node->pde_sizes = node->pde_mtimes = NULL;
+        return 0;
+    }
+
+    qsort(entries, entry_count, sizeof(ScanEntry), compare_scan_entries);
+
+    for (int i = 0; i < dir_count; i++) {
+        node->children[i] = entries[i].dir;
+        free(entries[i].key);
+    }
+    for (int i = 0; i < pde_count; i++) {
+        ScanEntry *entry = &entries[dir_count + i];
+        node->pde_files[i] = entry->path;
+        node->pde_relatives[i] = entry->relative;
+        node->pde_sizes[i] = entry->size;
+        node->pde_mtimes[i] = entry->mtime;
+        free(entry->key);
+    }
+    free(entries);
+
+    node->child_count = dir_count;
+    node->pde_count = pde_count;
+    return 1;
+}
+
+// Add the files of a scanned tree to files[] (depth-first) and free it, 0 if out of memory
+static int emit_directory(Sketch *sketch, DirNode *node) {
+    int ok = 1;
+    sketch->stats.files_ignored += node->ignored;
+
+    // Recursively process subdirectories (depth-first)
+    for (int i = 0; i < node->child_count; i++) {
+        if (!emit_directory(sketch, node->children[i])) ok = 0;
+    }
+
+    // Add .pde files from current directory
+    for (int i = 0; i < node->pde_count; i++) {
+        if (ok && !add_file(sketch, node->pde_files[i], node->pde_relatives[i], node->pde_sizes[i],
+                            node->pde_mtimes[i])) {
+            ok = 0;
+        }
+        free(node->pde_files[i]);
+        free(node->pde_relatives[i]);
+    }
+
+    free(node->children);
+    free(node->pde_files);
+    free(node->pde_relatives);
+    free(node->pde_sizes);
+    free(node->pde_mtimes);
+    free(node->path);
+    free(node->relative);
+    free(node);
+    return ok;
+}
+
+// Scan a whole tree on the calling thread, 0 if a folder was left out for lack of memory
+static int scan_tree(IgnoreMatcher *ignore, DirNode *node) {
+    int ok = scan_directory(ignore, node);
+    for (int i = 0; i < node->child_count; i++) {
+        if (!scan_tree(ignore, node->children[i])) ok = 0;
+    }
+    return ok;
+}
+
+// 0 if out of memory
+static int queue_push(ScanQueue *queue, DirNode *node) {
+    EnterCriticalSection(&queue->lock);
+    if (queue->count == queue->capacity) {
+        // Unwrap the ring into the bigger array
+        int capacity = queue->capacity ? queue->capacity * 2 : 64;
+        DirNode **items = malloc(sizeof(DirNode*) * capacity);
+        if (!items) {
+            LeaveCriticalSection(&queue->lock);
+            return 0;
+        }
+        for (int i = 0; i < queue->count; i++) {
+            items[i] = queue->items[(queue->head + i) & (queue->capacity - 1)];
+        }
+        free(queue->items);
+        queue->items = items;
+        queue->head = 0;
+        queue->capacity = capacity;
+    }
+    queue->items[(queue->head + queue->count) & (queue->capacity - 1)] = node;
+    queue->count++;
+    LeaveCriticalSection(&queue->lock);
+    return 1;
+}
+
+// Owners take the newest folder (stays close to what they just scanned),
+// thieves take the oldest (usually the biggest remaining subtree)
+static DirNode *queue_take(ScanQueue *queue, int steal) {
+    DirNode *node = NULL;
+    EnterCriticalSection(&queue->lock);
+    if (queue->count > 0) {
+        if (steal) {
+            node = queue->items[queue->head];
+            queue->head = (queue->head + 1) & (queue->capacity - 1);
+        } else {
+            node = queue->items[(queue->head + queue->count - 1) & (queue->capacity - 1)];
+        }
+        queue->count--;
+    }
+    LeaveCriticalSection(&queue->lock);
+    return node;
+}
+
+static DWORD WINAPI scan_worker(LPVOID param) {
+    ScanWorker *worker = (ScanWorker*)param;
+    ScanPool *pool = worker->pool;
+    ScanQueue *own = &pool->queues[worker->index];
+
+    while (1) {
+        DirNode *node = queue_take(own, 0);
+        for (int i = 1; !node && i < pool->thread_count; i++) {
+            node = queue_take(&pool->queues[(worker->index + i) % pool->thread_count], 1);
+        }
+
+        if (!node) {
+            // Everything left is being scanned by other workers, which may still find more:
+            // sleep until they queue some or the last one finishes
+            EnterCriticalSection(&pool->idle_lock);
+            int done = pool->pending == 0;
+            int idle = !done && pool->queued == 0;
+            if (idle) wait_list_add(&pool->idle, worker->index);
+            LeaveCriticalSection(&pool->idle_lock);
+            if (done) break;
+            if (idle) wait_list_sleep(&pool->idle, worker->index);
+            continue;
+        }
+        InterlockedDecrement(&pool->queued);
+
+        if (!scan_directory(pool->ignore, node)) InterlockedExchange(&pool->failed, 1);
+        InterlockedExchangeAdd(&pool->pending, node->child_count);
+        int queued = 0;
+        for (int i = 0; i < node->child_count; i++) {
+            if (queue_push(own, node->children[i])) {
+                queued++;
+            } else {
+                // No memory to queue it: scan that subtree here instead
+                if (!scan_tree(pool->ignore, node->children[i])) InterlockedExchange(&pool->failed, 1);
+                InterlockedDecrement(&pool->pending);
+            }
+        }
+        InterlockedExchangeAdd(&pool->queued, queued);
+        int finished = InterlockedDecrement(&pool->pending) == 0;
+
+        if (queued > 0 || finished) {
+            EnterCriticalSection(&pool->idle_lock);
+            wait_list_wake(&pool->idle);
+            LeaveCriticalSection(&pool->idle_lock);
+        }
+    }
+    return 0;
+}
+
+// Scan a whole tree with a pool of workers, falls back to the calling thread. Returns 0 if
+// a folder was left out for lack of memory.
+static int scan_tree_parallel(IgnoreMatcher *ignore, DirNode *root, int thread_count) {
+    ScanPool *pool = calloc(1, sizeof(ScanPool));
+    if (!pool) return scan_tree(ignore, root);
+    ScanWorker workers[MAX_SCAN_THREADS];
+    HANDLE threads[MAX_SCAN_THREADS];
+    int started = 0;
+
+    pool->ignore = ignore;
+    pool->thread_count = thread_count;
+    for (int i = 0; i < thread_count; i++) {
+        InitializeCriticalSection(&pool->queues[i].lock);
+    }
+    InitializeCriticalSection(&pool->idle_lock);
+    if (!wait_list_init(&pool->idle, thread_count)) thread_count = 0;
+
+    pool->pending = 1;
+    pool->queued = 1;
+    if (!queue_push(&pool->queues[0], root)) thread_count = 0;
+
+    for (int i = 0; i < thread_count; i++) {
+        workers[i].pool = pool;
+        workers[i].index = i;
+        threads[started] = CreateThread(NULL, 0, scan_worker, &workers[i], 0, NULL);
+        if (threads[started]) started++;
+    }
+
+    if (started == 0) {
+        // No threads at all: the root is still queued (if it could be), scan everything here
+        queue_take(&pool->queues[0], 0);
+        if (!scan_tree(ignore, root)) pool->failed = 1;
+    } else {
+        // Queues of workers that failed to start are drained by stealing
+        WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+        for (int i = 0; i < started; i++) {
+            CloseHandle(threads[i]);
+        }
+    }
+
+    for (int i = 0; i < pool->thread_count; i++) {
+        DeleteCriticalSection(&pool->queues[i].lock);
+        free(pool->queues[i].items);
+    }
+    wait_list_free(&pool->idle);
+    DeleteCriticalSection(&pool->idle_lock);
+    int ok = !pool->failed;
+    free(pool);
+    return ok;
+}
+
+// Number of workers used by collect_files
+static int scan_thread_count(const Config *config) {
+    int threads = config->scan_threads;
+    if (threads <= 0) {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        threads = (int)info.dwNumberOfProcessors;
+        if (threads > DEFAULT_MAX_SCAN_THREADS) threads = DEFAULT_MAX_SCAN_THREADS;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_SCAN_THREADS) threads = MAX_SCAN_THREADS;
+    return threads;
+}
+
+// Recursively collect .pde files, 0 if out of memory
+static int collect_files(Sketch *sketch, const char *dir_path, const char *relative_path) {
+    DirNode *root = new_dir_node(dir_path, relative_path);
+    if (!root) return 0;
+    root->ignore_state = ignore_folder_state(&sketch->ignore, relative_path);
+    sketch->stats.files_ignored = 0;
+
+    int threads = scan_thread_count(&sketch->config);
+    int scanned = (threads > 1) ? scan_tree_parallel(&sketch->ignore, root, threads)
+                                : scan_tree(&sketch->ignore, root);
+    return emit_directory(sketch, root) && scanned;
+}
+
+// Git index
+//
+// With scan=git, a sketch in a git checkout takes its .pde files from the checkout's index
+// (versions 2 to 4, read straight from the file) instead of listing every folder, so
+// untracked asset and build folders cost nothing. The files still go through the output
+// folder rule and the ignore patterns and come out in the order collect_files gives;
+// each is stat'ed for its size and mtime, and left out if it is gone. scan=git_untracked
+// also lists the folders holding tracked .pde files, and the sketch folder, for .pde files
+// git does not know yet; files in new folders are only found by the walk. Without an
+// index it can read (no checkout, a split or sparse index), collect_files walks as before.
+
+#define GIT_INDEX_MAGIC "DIRC"
+#define GIT_MODE_TYPE 0170000
+#define GIT_MODE_TREE 0040000        // Folder of a sparse index
+#define GIT_MODE_GITLINK 0160000     // Submodule
+
+typedef struct {
+    const char *relative;        // In the sketch, interned
+    int tracked;
+    int keep;                    // Not in an output folder, not ignored and still there
+    unsigned long long size;
+    unsigned long long mtime;
+} GitFile;
+
+typedef struct {
+    GitFile *items;
+    int count;
+    int capacity;
+    Arena names;
+} GitFileList;
+
+static unsigned int read_be32(const unsigned char *p) {
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+// The order emit_directory gives: in every folder its subfolders, then its files, each by
+// case-insensitive name with ties broken by the exact name
+static int compare_tree_paths(const char *a, const char *b) {
+    for (;;) {
+        const char *a_end = strchr(a, '/');
+        const char *b_end = strchr(b, '/');
+        if (!a_end != !b_end) return a_end ? -1 : 1;
+        size_t a_len = a_end ? (size_t)(a_end - a) : strlen(a);
+        size_t b_len = b_end ? (size_t)(b_end - b) : strlen(b);
+        size_t len = (a_len < b_len) ? a_len : b_len;
+
+        int order = 0;
+        for (size_t i = 0; i < len && !order; i++) {
+            order = tolower((unsigned char)a[i]) - tolower((unsigned char)b[i]);
+        }
+        if (!order) order = (a_len > b_len) - (a_len < b_len);
+        if (!order) order = memcmp(a, b, len);
+        if (order) return order;
+        if (!a_end) return 0;
+        a = a_end + 1;
+        b = b_end + 1;
+    }
+}
+
+static int compare_git_files(const void *a, const void *b) {
+    return compare_tree_paths(((const GitFile*)a)->relative, ((const GitFile*)b)->relative);
+}
+
+// NULL if out of memory
+static GitFile *add_git_file(GitFileList *list, const char *relative, int tracked) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        GitFile *items = realloc(list->items, sizeof(GitFile) * capacity);
+        if (!items) return NULL;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    const char *name = arena_strdup(&list->names, relative);
+    if (!name) return NULL;
+    GitFile *file = &list->items[list->count++];
+    memset(file, 0, sizeof(*file));
+    file->relative = name;
+    file->tracked = tracked;
+    return file;
+}
+
+// First line of a small file, without its line ending; 0 if it cannot be read
+static int read_first_line(const char *path, char *line, size_t size) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    int ok = fgets(line, (int)size, f) != NULL;
+    fclose(f);
+    if (ok) line[strcspn(line, "\r\n")] = '\0';
+    return ok;
+}
+
+// Resolve path relative to base unless it is absolute
+static void join_path(char *out, size_t size, const char *base, const char *path) {
+    if (path[0] == '/' || path[0] == '\\' || (path[0] && path[1] == ':')) {
+        snprintf(out, size, "%s", path);
+    } else {
+        snprintf(out, size, "%s" PATH_SEP "%s", base, path);
+    }
+}
+
+// Find the git checkout holding root: the path of its index, where root is inside it
+// ("" or "sub/folder/") and the length of object hashes. Returns 0 if there is none.
+static int find_git_index(const char *root, char *index_path, size_t size, char *prefix, size_t prefix_size,
+                          int *hash_size) {
+    char top[MAX_PATH_LEN];
+    char git_dir[MAX_PATH_LEN];
+    char line[MAX_PATH_LEN];
+    snprintf(top, sizeof(top), "%s", root);
+
+    for (;;) {
+        snprintf(git_dir, sizeof(git_dir), "%s" PATH_SEP ".git", top);
+        DWORD attributes = GetFileAttributes(git_dir);
+        if (attributes != INVALID_FILE_ATTRIBUTES) {
+            if (!(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+                // A worktree or submodule: "gitdir: <folder>"
+                if (!read_first_line(git_dir, line, sizeof(line)) || strncmp(line, "gitdir: ", 8) != 0) return 0;
+                join_path(git_dir, sizeof(git_dir), top, line + 8);
+            }
+            break;
+        }
+        char *cut = strrchr(top, PATH_SEP_CHAR);
+        if (!cut || cut == top || cut[-1] == ':') return 0;
+        *cut = '\0';
+    }
+
+    size_t top_len = strlen(top);
+    size_t len = 0;
+    prefix[0] = '\0';
+    for (const char *p = root + top_len; *p && len + 2 < prefix_size; p++) {
+        if (*p == '\\' || *p == '/') {
+            if (len) prefix[len++] = '/';
+        } else {
+            prefix[len++] = *p;
+        }
+    }
+    if (len) prefix[len++] = '/';
+    prefix[len] = '\0';
+    snprintf(index_path, size, "%s" PATH_SEP "index", git_dir);
+
+    // SHA-256 repositories say so in the config of the main checkout
+    char common_dir[MAX_PATH_LEN];
+    char config_path[MAX_PATH_LEN];
+    snprintf(common_dir, sizeof(common_dir), "%s", git_dir);
+    snprintf(config_path, sizeof(config_path), "%s" PATH_SEP "commondir", git_dir);
+    if (read_first_line(config_path, line, sizeof(line))) join_path(common_dir, sizeof(common_dir), git_dir, line);
+    snprintf(config_path, sizeof(config_path), "%s" PATH_SEP "config", common_dir);
+
+    *hash_size = 20;
+    FILE *f = fopen(config_path, "rb");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            for (char *c = line; *c; c++) *c = (char)tolower((unsigned char)*c);
+            if (strstr(line, "objectformat") && strstr(line, "sha256")) *hash_size = 32;
+        }
+        fclose(f);
+    }
+    return 1;
+}
+
+// Add the .pde files under prefix of a mapped index to list. Returns 0 for an index that
+// cannot be used, -1 if out of memory.
+static int read_git_index(const unsigned char *data, size_t size, int hash_size, const char *prefix, GitFileList *list) {
+    if (size < 12 + (size_t)hash_size || memcmp(data, GIT_INDEX_MAGIC, 4) != 0) return 0;
+    unsigned int version = read_be32(data + 4);
+    unsigned int count = read_be32(data + 8);
+    if (version < 2 || version > 4) return 0;
+
+    const unsigned char *p = data + 12;
+    const unsigned char *end = data + size - hash_size;
+    size_t prefix_len = strlen(prefix);
+    size_t fixed = 40 + (size_t)hash_size + 2;   // Stat data, object hash and flags
+    char name[MAX_PATH_LEN];
+    size_t name_len = 0;
+    char last[MAX_PATH_LEN] = "";
+
+    for (unsigned int i = 0; i < count; i++) {
+        if ((size_t)(end - p) < fixed) return 0;
+        unsigned int mode = read_be32(p + 24);
+        unsigned int flags = ((unsigned int)p[fixed - 2] << 8) | p[fixed - 1];
+        const unsigned char *q = p + fixed;
+        if (version >= 3 && (flags & 0x4000)) q += 2;  // Extended flags
+        if (q >= end) return 0;
+
+        if (version == 4) {
+            // The name is the previous one less some bytes at its end, plus a suffix
+            size_t strip = *q & 127;
+            while (*q++ & 128) {
+                if (q >= end) return 0;
+                strip = ((strip + 1) << 7) | (*q & 127);
+            }
+            const unsigned char *nul = memchr(q, '\0', (size_t)(end - q));
+            if (!nul) return 0;
+            size_t suffix_len = (size_t)(nul - q);
+            if (strip > name_len || name_len - strip + suffix_len >= sizeof(name)) return 0;
+            name_len -= strip;
+            memcpy(name + name_len, q, suffix_len + 1);
+            name_len += suffix_len;
+            p = q + suffix_len + 1;
+        } else {
+            // NUL-padded to a multiple of 8 bytes
+            const unsigned char *nul = memchr(q, '\0', (size_t)(end - q));
+            if (!nul) return 0;
+            size_t len = (size_t)(nul - q);
+            if (len >= sizeof(name)) return 0;
+            memcpy(name, q, len + 1);
+            name_len = len;
+            p += ((size_t)(q - p) + len + 8) & ~(size_t)7;
+            if (p > end) return 0;
+        }
+
+        if ((mode & GIT_MODE_TYPE) == GIT_MODE_TREE) return 0;
+        if ((mode & GIT_MODE_TYPE) == GIT_MODE_GITLINK) continue;
+        // A conflicted file has an entry per side, one after the other
+        if (strcmp(name, last) == 0) continue;
+        if (name_len >= prefix_len + 4 && strncmp(name, prefix, prefix_len) == 0 && ends_with(name, ".pde")) {
+            if (!add_git_file(list, name + prefix_len, 1)) return -1;
+            memcpy(last, name, name_len + 1);
+        }
+    }
+
+    // Entries in a shared index (split index) would be missing
+    while ((size_t)(end - p) >= 8) {
+        if (memcmp(p, "link", 4) == 0 || memcmp(p, "sdir", 4) == 0) return 0;
+        unsigned int ext_size = read_be32(p + 4);
+        if ((size_t)(end - p) - 8 < ext_size) return 0;
+        p += 8 + (size_t)ext_size;
+    }
+    return 1;
+}
+
+// Check if a path of the sketch lives in a folder collect_files never descends into
+static int in_output_folder(const char *relative) {
+    const char *component = relative;
+    while (*component) {
+        size_t len = strcspn(component, "/");
+        if (len == 6 && _strnicmp(component, "output", 6) == 0 && component[len] == '/') return 1;
+        component += len;
+        if (*component == '/') component++;
+    }
+    return 0;
+}
+
+// Whether a file of the sketch is one collect_files would take, filling in size and mtime
+static int keep_git_file(Sketch *sketch, GitFile *file) {
+    if (in_output_folder(file->relative)) return 0;
+    if (should_ignore(&sketch->ignore, file->relative, 0)) {
+        sketch->stats.files_ignored++;
+        return 0;
+    }
+
+    char path[MAX_PATH_LEN];
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    snprintf(path, sizeof(path), "%s" PATH_SEP "%s", sketch->root, file->relative);
+    for (char *c = path; *c; c++) {
+        if (*c == '/') *c = PATH_SEP_CHAR;
+    }
+    if (!GetFileAttributesEx(path, GetFileExInfoStandard, &info) || (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        return 0;
+    }
+    file->size = ((unsigned long long)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    file->mtime = ((unsigned long long)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+    return 1;
+}
+
+// Add .pde files git does not track from the folders holding tracked ones, 0 if out of memory
+static int add_untracked_files(Sketch *sketch, GitFileList *list) {
+    int tracked_count = list->count;
+    char folder[MAX_PATH_LEN] = "";
+    char path[MAX_PATH_LEN];
+    char relative[MAX_PATH_LEN];
+
+    // Tracked files are sorted, the files of a folder are next to each other
+    for (int i = -1; i < tracked_count; i++) {
+        if (i >= 0) {
+            const char *name = strrchr(list->items[i].relative, '/');
+            size_t len = name ? (size_t)(name - list->items[i].relative) : 0;
+            if (len == strlen(folder) && strncmp(folder, list->items[i].relative, len) == 0) continue;
+            if (len == 0) continue;  // The sketch folder is listed first
+            snprintf(folder, sizeof(folder), "%.*s", (int)len, list->items[i].relative);
+            if (in_output_folder(list->items[i].relative)) continue;
+        }
+
+        DirList dir;
+        join_path(path, sizeof(path), sketch->root, folder);
+        if (!list_open(&dir, folder[0] ? path : sketch->root)) continue;
+        ListEntry *found;
+        while ((found = list_next(&dir)) != NULL) {
+            if (found->is_dir || !ends_with(found->name, ".pde")) continue;
+            snprintf(relative, sizeof(relative), "%s%s%s", folder, folder[0] ? "/" : "", found->name);
+            GitFile probe;
+            probe.relative = relative;
+            if (bsearch(&probe, list->items, tracked_count, sizeof(GitFile), compare_git_files)) continue;
+
+            if (should_ignore(&sketch->ignore, relative, 0)) {
+                sketch->stats.files_ignored++;
+                continue;
+            }
+            list_stat(&dir, found);
+            GitFile *file = add_git_file(list, relative, 0);
+            if (!file) {
+                list_close(&dir);
+                return 0;
+            }
+            file->keep = 1;
+            file->size = found->size;
+            file->mtime = found->mtime;
+        }
+        list_close(&dir);
+    }
+    return 1;
+}
+
+// Collect the sketch's files from the git index, 0 if there is no index to use, -1 if out
+// of memory
+static int collect_git_files(Sketch *sketch) {
+    char index_path[MAX_PATH_LEN];
+    char prefix[MAX_PATH_LEN];
+    int hash_size;
+    if (!find_git_index(sketch->root, index_path, sizeof(index_path), prefix, sizeof(prefix), &hash_size)) return 0;
+
+    HANDLE file = CreateFile(index_path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return 0;
+    DWORD size = GetFileSize(file, NULL);
+    HANDLE mapping = (size != INVALID_FILE_SIZE && size > 0)
+                     ? CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    const unsigned char *view = mapping ? (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (mapping) CloseHandle(mapping);
+    CloseHandle(file);
+    if (!view) return 0;
+
+    GitFileList list = {0};
+    int usable = read_git_index(view, size, hash_size, prefix, &list);
+    UnmapViewOfFile(view);
+
+    if (usable > 0) {
+        sketch->stats.files_ignored = 0;
+        qsort(list.items, list.count, sizeof(GitFile), compare_git_files);
+        for (int i = 0; i < list.count; i++) {
+            list.items[i].keep = keep_git_file(sketch, &list.items[i]);
+        }
+        if (sketch->config.scan == SCAN_GIT_UNTRACKED) {
+            if (!add_untracked_files(sketch, &list)) usable = -1;
+            qsort(list.items, list.count, sizeof(GitFile), compare_git_files);
+        }
+
+        char path[MAX_PATH_LEN];
+        for (int i = 0; i < list.count && usable > 0; i++) {
+            if (!list.items[i].keep) continue;
+            snprintf(path, sizeof(path), "%s" PATH_SEP "%s", sketch->root, list.items[i].relative);
+            for (char *c = path; *c; c++) {
+                if (*c == '/') *c = PATH_SEP_CHAR;
+            }
+            if (!add_file(sketch, path, list.items[i].relative, list.items[i].size, list.items[i].mtime)) {
+                usable = -1;
+            }
+        }
+    }
+    free(list.items);
+    arena_reset(&list.names);
+    return usable;
+}
+
+// Collect the sketch's files again from scratch, from the git index if scan says so.
+// Returns 0 if out of memory, files[] may then be missing some.
+static int scan_sketch(Sketch *sketch) {
+    double started = clock_ms();
+    reset_files(sketch);
+    int git = (sketch->config.scan != SCAN_WALK) ? collect_git_files(sketch) : 0;
+    int ok = git >= 0;
+    sketch->stats.git_index = git > 0;
+    if (git == 0) ok = collect_files(sketch, sketch->root, "");
+    sketch->stats.collect_ms += clock_ms() - started;
+    sketch->stats.files_scanned = sketch->file_count;
+    // A matcher that could not grow stopped matching somewhere
+    return ok && !sketch->ignore.failed;
+}
+
+// Rebuild the line lookup index from the ranges, 0 if out of memory
+static int build_line_index(LineMap *map) {
+    free(map->line_index);
+    free(map->line_starts);
+    map->line_index = NULL;
+    map->line_starts = NULL;
+    map->line_index_lines = 0;
+
+    if (map->total_lines <= DENSE_INDEX_MAX_LINES) {
+        map->line_index = calloc(map->total_lines + 1, sizeof(unsigned int));
+        if (map->line_index) {
+            map->line_index_lines = map->total_lines;
+            for (int i = 0; i < map->count; i++) {
+                for (int line = map->ranges[i].start_line; line <= map->ranges[i].end_line; line++) {
+                    map->line_index[line] = (unsigned int)i + 1;
+                }
+            }
+            return 1;
+        }
+    }
+
+    map->line_starts = malloc(sizeof(int) * (map->count ? map->count : 1));
+    if (!map->line_starts) return 0;
+    for (int i = 0; i < map->count; i++) {
+        map->line_starts[i] = map->ranges[i].start_line;
+    }
+    return 1;
+}
+
+// Find the range containing an output.pde line, -1 for headers, separators and misses
+static int find_source_file(const LineMap *map, int line) {
+    if (line < 1 || line > map->total_lines) return -1;
+
+    if (map->line_index) {
+        return (line <= map->line_index_lines) ? (int)map->line_index[line] - 1 : -1;
+    }
+
+    if (!map->line_starts || map->count == 0) return -1;
+
+    // Last entry starting at or before line; the conditional move keeps the loop branch-free
+    const int *base = map->line_starts;
+    int n = map->count;
+    while (n > 1) {
+        int half = n / 2;
+        base = (base[half] <= line) ? base + half : base;
+        n -= half;
+    }
+
+    int i = (int)(base - map->line_starts);
+    if (line >= map->ranges[i].start_line && line <= map->ranges[i].end_line) return i;
+    return -1;
+}
+
+// Bulk copy
+//
+// Sources are read with large ReadFile calls straight into the output staging buffer and
+// written to output.pde with large WriteFile calls, so small files are batched together
+// and big ones stream through a fixed amount of memory. Lines are counted from the bytes.
+
+#define COPY_BUFFER_SIZE (1024 * 1024)
+#define FNV_OFFSET 1469598103934665603ULL
+#define FNV_PRIME 1099511628211ULL
+
+typedef struct {
+    HANDLE handle;
+    FoldcessingWrite write;  // Instead of the file, a library caller's sink
+    void *user;
+    char *buffer;        // COPY_BUFFER_SIZE bytes waiting to be written
+    size_t used;
+    long long offset;    // Position in the output file of buffer[0]
+    long long written;   // Bytes written through this writer
+    int failed;
+} FoldWriter;
+
+// FNV-1a over a block of bytes, continuing from hash
+static unsigned long long hash_bytes(unsigned long long hash, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// Case-insensitive hash of a folder path, for names that must be the same on every run
+static unsigned int path_hash(const char *path) {
+    char lower[MAX_PATH_LEN];
+    size_t len = 0;
+    for (; path[len] && len < sizeof(lower) - 1; len++) {
+        lower[len] = (char)tolower((unsigned char)path[len]);
+    }
+    unsigned long long hash = hash_bytes(FNV_OFFSET, lower, len);
+    return (unsigned int)(hash ^ (hash >> 32));
+}
+
+// Newline counting
+//
+// Only '\n' is counted: "\r\n" is one line and a lone '\r' is not a line break, the same
+// as the fgets-based counting this replaced. copy_source accounts for an unterminated last
+// line. The vector kernels accumulate compare results per byte lane for up to 255 blocks
+// and then sum the lanes with SAD, so the inner loop is a load, a compare and a subtract.
+
+static size_t count_newlines_scalar(const char *data, size_t len) {
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++) {
+        count += (data[i] == '\n');
+    }
+    return count;
+}
+
+#ifdef HAVE_X86_SIMD
+static TARGET_SSE2
+size_t count_newlines_sse2(const char *data, size_t len) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    size_t count = 0;
+    size_t i = 0;
+
+    while (len - i >= 16) {
+        size_t blocks = (len - i) / 16;
+        if (blocks > 255) blocks = 255;
+
+        __m128i lanes = zero;
+        for (size_t b = 0; b < blocks; b++, i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+            lanes = _mm_sub_epi8(lanes, _mm_cmpeq_epi8(v, newline));
+        }
+
+        __m128i sums = _mm_sad_epu8(lanes, zero);
+        count += (size_t)_mm_cvtsi128_si32(sums) + (size_t)_mm_extract_epi16(sums, 4);
+    }
+
+    return count + count_newlines_scalar(data + i, len - i);
+}
+
+static TARGET_AVX2
+size_t count_newlines_avx2(const char *data, size_t len) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    size_t count = 0;
+    size_t i = 0;
+
+    while (len - i >= 32) {
+        size_t blocks = (len - i) / 32;
+        if (blocks > 255) blocks = 255;
+
+        __m256i lanes = zero;
+        for (size_t b = 0; b < blocks; b++, i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+            lanes = _mm256_sub_epi8(lanes, _mm256_cmpeq_epi8(v, newline));
+        }
+
+        unsigned long long sums[4];
+        _mm256_storeu_si256((__m256i*)sums, _mm256_sad_epu8(lanes, zero));
+        count += (size_t)(sums[0] + sums[1] + sums[2] + sums[3]);
+    }
+
+    return count + count_newlines_scalar(data + i, len - i);
+}
+
+// Check CPU (and, for AVX2, OS register saving) support
+static int cpu_has_avx2(void) {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return 0;
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28))) return 0;  // OSXSAVE, AVX
+    if ((_xgetbv(0) & 6) != 6) return 0;                            // XMM and YMM state
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static int cpu_has_sse2(void) {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+#endif
+
+typedef struct BodyMasks BodyMasks;
+
+// The fastest kernels the processor runs, chosen once by processor_kernels
+typedef struct {
+    size_t (*count_newlines)(const char *data, size_t len);
+    void (*body_masks)(const unsigned char *block, BodyMasks *masks);
+} Kernels;
+
+static const Kernels *processor_kernels(void);
+
+// Move a file handle to an absolute position
+static int seek_handle(HANDLE handle, long long position) {
+    LONG high = (LONG)(position >> 32);
+    DWORD low = SetFilePointer(handle, (LONG)(position & 0xFFFFFFFF), &high, FILE_BEGIN);
+    return !(low == INVALID_SET_FILE_POINTER && GetLastError() != NO_ERROR);
+}
+
+// Write a whole block, looping over partial writes
+static int write_all(HANDLE handle, const char *data, size_t len) {
+    while (len > 0) {
+        DWORD chunk = (len > 0x40000000) ? 0x40000000 : (DWORD)len;
+        DWORD written;
+        if (!WriteFile(handle, data, chunk, &written, NULL) || written == 0) return 0;
+        data += written;
+        len -= written;
+    }
+    return 1;
+}
+
+// Start writing at position in an open output file
+static int writer_open(FoldWriter *writer, HANDLE handle, long long position) {
+    memset(writer, 0, sizeof(*writer));
+    writer->handle = handle;
+    writer->offset = position;
+    writer->buffer = malloc(COPY_BUFFER_SIZE);
+    return writer->buffer && seek_handle(handle, position);
+}
+
+// Start writing to a caller's sink instead of a file
+static int writer_open_sink(FoldWriter *writer, FoldcessingWrite write, void *user) {
+    memset(writer, 0, sizeof(*writer));
+    writer->write = write;
+    writer->user = user;
+    writer->buffer = malloc(COPY_BUFFER_SIZE);
+    return writer->buffer != NULL;
+}
+
+// Pass a block on to the file or the sink
+static void writer_send(FoldWriter *writer, const char *data, size_t len) {
+    if (writer->failed) return;
+    int ok = writer->write ? writer->write(writer->user, data, len) == 0
+                           : write_all(writer->handle, data, len);
+    if (ok) {
+        writer->written += len;
+    } else {
+        writer->failed = 1;
+    }
+}
+
+// Write out the staged bytes
+static void writer_flush(FoldWriter *writer) {
+    if (writer->used > 0) writer_send(writer, writer->buffer, writer->used);
+    writer->offset += writer->used;
+    writer->used = 0;
+}
+
+static void writer_close(FoldWriter *writer) {
+    writer_flush(writer);
+    free(writer->buffer);
+    writer->buffer = NULL;
+}
+
+// Current position in the output file
+static long long writer_position(const FoldWriter *writer) {
+    return writer->offset + (long long)writer->used;
+}
+
+static void writer_put(FoldWriter *writer, const char *data, size_t len) {
+    if (writer->used + len > COPY_BUFFER_SIZE) {
+        writer_flush(writer);
+        if (len > COPY_BUFFER_SIZE) {
+            writer_send(writer, data, len);
+            writer->offset += len;
+            return;
+        }
+    }
+    memcpy(writer->buffer + writer->used, data, len);
+    writer->used += len;
+}
+
+// Pre-flight symbol index
+//
+// processing-java needs seconds to start before javac can say that two tabs both define
+// drawHUD() or class Particle. Since every source passes through the fold anyway, a small
+// streaming lexer picks out what each file defines at brace depth 0: classes, interfaces and
+// enums, functions with their parameter types (overloads are fine) and global variables.
+// processing-java wraps all of output.pde in one class, so any name defined twice there is
+// an error, and it is reported right after the fold with both places in the sources.
+// Comments, strings, char literals and text blocks are skipped; bodies are only scanned for
+// the brace that ends them, and lines are only counted where a symbol is found.
+
+#define SYMBOL_CLASS 0
+#define SYMBOL_FUNCTION 1
+#define SYMBOL_FIELD 2
+#define SYMBOL_NAME_MAX 256          // Longer names and signatures are cut off
+
+#define LEX_CODE 0
+#define LEX_IDENT 1
+#define LEX_NUMBER 2
+#define LEX_SLASH 3                  // A '/' that may start a comment
+#define LEX_LINE_COMMENT 4
+#define LEX_BLOCK_COMMENT 5
+#define LEX_BLOCK_STAR 6             // A '*' that may end a block comment
+#define LEX_STRING_START 7           // Right after the opening quote
+#define LEX_STRING 8
+#define LEX_STRING_ESCAPE 9
+#define LEX_EMPTY_STRING 10          // "" that may be the start of a text block
+#define LEX_TEXT_BLOCK 11
+#define LEX_TEXT_ESCAPE 12
+#define LEX_CHAR 13
+#define LEX_CHAR_ESCAPE 14
+
+// What came last in the current top-level statement
+#define TOKEN_NONE 0
+#define TOKEN_IDENT 1
+#define TOKEN_TYPE_END 2             // ']' or '>', a declared name may follow
+#define TOKEN_COMMA 3
+#define TOKEN_OTHER 4
+
+#define FUNCTION_NONE 0
+#define FUNCTION_PARAMS 1            // Inside the parameter list
+#define FUNCTION_AWAIT 2             // After it, a '{' makes it a definition
+#define FUNCTION_THROWS 3
+
+typedef struct {
+    SymbolList *out;
+    int state;
+    int line;
+    int depth;                     // Braces
+    int body;                      // The open depth 0 brace is a class or function body
+    char ident[SYMBOL_NAME_MAX];   // Identifier being read
+    int ident_len;
+    const unsigned char *ident_at; // Where it starts in the chunk, NULL once ident_line is known
+    int ident_line;
+
+    // Top-level statement being read
+    int last_kind;
+    const char *last;              // Last identifier, in the chunk or in last_copy
+    int last_len;
+    char last_copy[SYMBOL_NAME_MAX]; // Where it is kept once its chunk is gone
+    const unsigned char *last_at;
+    int last_line;
+    int last_is_name;              // It follows a type, so it is being declared
+    int declaring;                 // The statement declared a global, more may follow a comma
+    int skipping;                  // In an initializer or import, until ',' or ';'
+    int keyword;                   // 1 = class, interface or enum seen, 2 = named
+    int parens;
+    int function;                  // FUNCTION_*
+    char function_name[SYMBOL_NAME_MAX];
+    int function_name_len;
+    const unsigned char *function_at;
+    int function_line;
+    char signature[SYMBOL_NAME_MAX];
+    int signature_len;
+    int param_start;               // Where the current parameter starts in signature
+    int param_name;                // Where its last identifier starts, -1 = none yet
+    int angles;                    // Generic arguments in a parameter type
+    int quotes;                    // Closing quotes in a row in a text block
+    const unsigned char *counted;  // line is the line here in the chunk
+    const Kernels *kernels;
+} SymbolLexer;
+
+// Byte classes for skipping what cannot change the lexer's state
+#define LEX_IDENT_CHAR 1             // Letters, digits, '_', '$' and anything non-ASCII
+#define LEX_BODY_SPECIAL 2           // Where strings, comments and braces start
+#define LEX_STRING_SPECIAL 4         // Where a string or its escape sequences end
+#define LEX_SPACE 8
+#define LEX_SKIP_SPECIAL 16          // What ends an initializer, or nests inside one
+#define LEX_IDENT_START 32           // LEX_IDENT_CHAR but digits
+
+static const unsigned char lex_class[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 8, 12, 8, 8, 8, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    8, 0, 22, 0, 33, 0, 0, 18, 16, 16, 0, 0, 16, 0, 0, 18,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 16, 0, 0, 0, 0,
+    0, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33,
+    33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 0, 4, 0, 0, 33,
+    0, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33,
+    33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 18, 0, 18, 0, 0,
+    33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33,
+    33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33,
+    33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33,
+    33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33,
+    33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33,
+    33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33,
+    33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33,
+    33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33,
+};
+
+static void symbols_free(SymbolList *list) {
+    free(list->items);
+    free(list->names);
+    memset(list, 0, sizeof(*list));
+    list->count = -1;
+}
+
+// Name of a symbol in its list
+static const char *symbol_name(const SymbolList *list, const Symbol *symbol) {
+    return list->names + symbol->name;
+}
+
+// Add the symbol named by the len bytes at name
+static void symbols_add(SymbolList *list, int kind, const char *name, size_t name_len, int line) {
+    size_t len = name_len + 1;
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 16;
+        Symbol *items = realloc(list->items, sizeof(Symbol) * capacity);
+        if (!items) return;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    if (list->names_used + len > list->names_capacity) {
+        size_t capacity = list->names_capacity ? list->names_capacity * 2 : 256;
+        while (capacity < list->names_used + len) capacity *= 2;
+        char *names = realloc(list->names, capacity);
+        if (!names) return;
+        list->names = names;
+        list->names_capacity = capacity;
+    }
+
+    Symbol *symbol = &list->items[list->count++];
+    symbol->kind = kind;
+    symbol->line = line;
+    symbol->name = (int)list->names_used;
+    memcpy(list->names + list->names_used, name, name_len);
+    list->names[list->names_used + name_len] = '\0';
+    list->names_used += len;
+}
+
+// Start indexing a file into out
+static void symbols_begin(SymbolLexer *lexer, SymbolList *out) {
+    memset(lexer, 0, sizeof(*lexer));
+    lexer->out = out;
+    lexer->line = 1;
+    lexer->last = lexer->last_copy;
+    lexer->kernels = processor_kernels();
+    symbols_free(out);
+    out->count = 0;
+}
+
+static int is_ident_char(int c) {
+    return (lex_class[c & 0xFF] & LEX_IDENT_CHAR) != 0;
+}
+
+// Bring lexer->line from counted up to p
+static void lex_count_lines(SymbolLexer *lexer, const unsigned char *p) {
+    const unsigned char *from = lexer->counted;
+    // Mostly a line or two since the last symbol, counted 8 bytes at a time: a byte of x is
+    // zero where a newline was, and the sum moves one bit per zero byte into the top byte.
+    // Past a body it pays to count in bulk.
+    if (p - from < 64) {
+        unsigned long long lines = 0;
+        for (; p - from >= 8; from += 8) {
+            unsigned long long x;
+            memcpy(&x, from, 8);
+            x ^= 0x0A0A0A0A0A0A0A0AULL;
+            x = ~(((x & 0x7F7F7F7F7F7F7F7FULL) + 0x7F7F7F7F7F7F7F7FULL) | x) & 0x8080808080808080ULL;
+            lines += ((x >> 7) * 0x0101010101010101ULL) >> 56;
+        }
+        for (; from < p; from++) lines += (*from == '\n');
+        lexer->line += (int)lines;
+    } else {
+        lexer->line += (int)lexer->kernels->count_newlines((const char*)from, p - from);
+    }
+    lexer->counted = p;
+}
+
+// Line of a name that started at *at in this chunk, counted once a symbol needs it
+static int lex_line(SymbolLexer *lexer, const unsigned char **at, int *line) {
+    if (*at) {
+        if (*at >= lexer->counted) {
+            lex_count_lines(lexer, *at);
+            *line = lexer->line;
+        } else {
+            *line = lexer->line;
+            for (const unsigned char *p = *at; p < lexer->counted; p++) *line -= (*p == '\n');
+        }
+        *at = NULL;
+    }
+    return *line;
+}
+
+static void lex_reset_statement(SymbolLexer *lexer) {
+    lexer->last_kind = TOKEN_NONE;
+    lexer->last_is_name = 0;
+    lexer->declaring = 0;
+    lexer->skipping = 0;
+    lexer->keyword = 0;
+    lexer->parens = 0;
+    lexer->function = FUNCTION_NONE;
+}
+
+static void lex_signature_put(SymbolLexer *lexer, const char *text, size_t len) {
+    if (lexer->signature_len + len >= sizeof(lexer->signature)) return;
+    memcpy(lexer->signature + lexer->signature_len, text, len);
+    lexer->signature_len += (int)len;
+}
+
+// Keep only the type of the parameter that just ended
+static void lex_end_param(SymbolLexer *lexer) {
+    if (lexer->param_name > lexer->param_start) lexer->signature_len = lexer->param_name;
+    while (lexer->signature_len > lexer->param_start && lexer->signature[lexer->signature_len - 1] == ' ') {
+        lexer->signature_len--;
+    }
+}
+
+// Whether the len bytes of name spell word
+static int lex_is(const char *name, int len, const char *word) {
+    return (size_t)len == strlen(word) && memcmp(name, word, len) == 0;
+}
+
+// An identifier at depth 0 is complete, name points at its len bytes (not terminated) in the
+// chunk or at ident
+static void lex_ident(SymbolLexer *lexer, const char *name, int len) {
+    if (lexer->function == FUNCTION_PARAMS) {
+        if (lexer->parens > 1 || lex_is(name, len, "final")) return;
+        if (lexer->signature_len > lexer->param_start &&
+            is_ident_char((unsigned char)lexer->signature[lexer->signature_len - 1])) {
+            lex_signature_put(lexer, " ", 1);
+        }
+        if (lexer->angles == 0) lexer->param_name = lexer->signature_len;
+        lex_signature_put(lexer, name, len);
+        return;
+    }
+    if (lexer->function == FUNCTION_THROWS) return;
+    if (lexer->function == FUNCTION_AWAIT) {
+        if (lex_is(name, len, "throws")) {
+            lexer->function = FUNCTION_THROWS;
+            return;
+        }
+        // A call, or an annotation with arguments before a declaration
+        lexer->function = FUNCTION_NONE;
+    }
+
+    if (lexer->skipping || lexer->parens > 0 || lexer->keyword == 2) return;
+    if (lexer->keyword == 0 && (name[0] == 'c' || name[0] == 'i' || name[0] == 'e' || name[0] == 'p')) {
+        if (lex_is(name, len, "class") || lex_is(name, len, "interface") || lex_is(name, len, "enum")) {
+            lexer->keyword = 1;
+            return;
+        }
+        if (lexer->last_kind == TOKEN_NONE && (lex_is(name, len, "import") || lex_is(name, len, "package"))) {
+            lexer->skipping = 1;
+            return;
+        }
+    }
+
+    if (len > SYMBOL_NAME_MAX - 1) len = SYMBOL_NAME_MAX - 1;
+    if (lexer->keyword == 1) {
+        symbols_add(lexer->out, SYMBOL_CLASS, name, len, lex_line(lexer, &lexer->ident_at, &lexer->ident_line));
+        lexer->keyword = 2;
+        return;
+    }
+    lexer->last_is_name = lexer->last_kind == TOKEN_IDENT || lexer->last_kind == TOKEN_TYPE_END ||
+                          (lexer->last_kind == TOKEN_COMMA && lexer->declaring);
+    // ident is reused by the next name, the chunk stays until symbols_feed returns
+    if (name == lexer->ident) {
+        memcpy(lexer->last_copy, name, len);
+        name = lexer->last_copy;
+    }
+    lexer->last = name;
+    lexer->last_len = len;
+    lexer->last_at = lexer->ident_at;
+    lexer->last_line = lexer->ident_line;
+    lexer->last_kind = TOKEN_IDENT;
+}
+
+// Any other token at depth 0, c = 0 for literals
+static void lex_punct(SymbolLexer *lexer, int c) {
+    if (c == '{') {
+        if (lexer->function == FUNCTION_AWAIT || lexer->function == FUNCTION_THROWS) {
+            // name(types), put together by hand since snprintf costs more than the lexing
+            char name[SYMBOL_NAME_MAX * 2 + 2];
+            size_t len = lexer->function_name_len;
+            memcpy(name, lexer->function_name, len);
+            name[len++] = '(';
+            memcpy(name + len, lexer->signature, lexer->signature_len);
+            len += lexer->signature_len;
+            name[len++] = ')';
+            symbols_add(lexer->out, SYMBOL_FUNCTION, name, len, lex_line(lexer, &lexer->function_at, &lexer->function_line));
+            lexer->body = 1;
+        } else {
+            // Array initializers and anonymous classes belong to the statement around them
+            lexer->body = lexer->keyword || !(lexer->skipping || lexer->parens > 0);
+        }
+        lexer->depth++;
+        return;
+    }
+    if (c == '}') {
+        // Unbalanced, start over
+        lex_reset_statement(lexer);
+        return;
+    }
+
+    if (lexer->function == FUNCTION_PARAMS) {
+        if (c == '(') {
+            lexer->parens++;
+        } else if (c == ')') {
+            if (--lexer->parens == 0) {
+                lex_end_param(lexer);
+                lexer->function = FUNCTION_AWAIT;
+                lexer->last_kind = TOKEN_OTHER;
+            }
+        } else if (lexer->parens == 1) {
+            if (c == ',' && lexer->angles == 0) {
+                lex_end_param(lexer);
+                lex_signature_put(lexer, ",", 1);
+                lexer->param_start = lexer->signature_len;
+                lexer->param_name = -1;
+            } else if (c == '<' || c == '>' || c == ',' || c == '[' || c == ']' || c == '.' || c == '?') {
+                if (c == '<') lexer->angles++;
+                if (c == '>' && lexer->angles > 0) lexer->angles--;
+                char text = (char)c;
+                lex_signature_put(lexer, &text, 1);
+            }
+        }
+        return;
+    }
+    if (lexer->function == FUNCTION_THROWS && (c == ',' || c == '.' || c == '<' || c == '>')) return;
+    lexer->function = FUNCTION_NONE;
+
+    if (c == '(') {
+        if (lexer->parens == 0 && !lexer->skipping && !lexer->keyword &&
+            lexer->last_kind == TOKEN_IDENT && lexer->last_is_name) {
+            lexer->function = FUNCTION_PARAMS;
+            memcpy(lexer->function_name, lexer->last, lexer->last_len);
+            lexer->function_name_len = lexer->last_len;
+            lexer->function_at = lexer->last_at;
+            lexer->function_line = lexer->last_line;
+            lexer->signature_len = 0;
+            lexer->param_start = 0;
+            lexer->param_name = -1;
+            lexer->angles = 0;
+        }
+        lexer->parens++;
+        lexer->last_kind = TOKEN_OTHER;
+        return;
+    }
+    if (c == ')') {
+        if (lexer->parens > 0) lexer->parens--;
+        lexer->last_kind = TOKEN_OTHER;
+        return;
+    }
+    if (lexer->parens > 0 || lexer->keyword) return;
+
+    if (lexer->skipping) {
+        if (c == ';') {
+            lex_reset_statement(lexer);
+        } else if (c == ',' && lexer->declaring) {
+            lexer->skipping = 0;
+            lexer->last_kind = TOKEN_COMMA;
+        }
+        return;
+    }
+
+    if (c == '=' || c == ',' || c == ';') {
+        if (lexer->last_kind == TOKEN_IDENT && lexer->last_is_name) {
+            symbols_add(lexer->out, SYMBOL_FIELD, lexer->last, lexer->last_len,
+                        lex_line(lexer, &lexer->last_at, &lexer->last_line));
+            lexer->declaring = 1;
+        }
+        if (c == ';') {
+            lex_reset_statement(lexer);
+        } else if (c == '=') {
+            lexer->skipping = 1;
+        } else {
+            lexer->last_kind = TOKEN_COMMA;
+        }
+        return;
+    }
+    lexer->last_kind = (c == ']' || c == '>') ? TOKEN_TYPE_END : TOKEN_OTHER;
+}
+
+static void lex_char(SymbolLexer *lexer, int c) {
+    switch (lexer->state) {
+    case LEX_IDENT:
+        if (is_ident_char(c)) {
+            if (lexer->ident_len < SYMBOL_NAME_MAX - 1) lexer->ident[lexer->ident_len++] = (char)c;
+            return;
+        }
+        lexer->state = LEX_CODE;
+        lex_ident(lexer, lexer->ident, lexer->ident_len);
+        break;
+    case LEX_NUMBER:
+        if (is_ident_char(c) || c == '.') return;
+        lexer->state = LEX_CODE;
+        break;
+    case LEX_SLASH:
+        if (c == '/') {
+            lexer->state = LEX_LINE_COMMENT;
+            return;
+        }
+        if (c == '*') {
+            lexer->state = LEX_BLOCK_COMMENT;
+            return;
+        }
+        lexer->state = LEX_CODE;
+        if (lexer->depth == 0) lex_punct(lexer, '/');
+        break;
+    case LEX_LINE_COMMENT:
+        if (c == '\n') lexer->state = LEX_CODE;
+        return;
+    case LEX_BLOCK_COMMENT:
+        if (c == '*') lexer->state = LEX_BLOCK_STAR;
+        return;
+    case LEX_BLOCK_STAR:
+        if (c == '/') {
+            lexer->state = LEX_CODE;
+        } else if (c != '*') {
+            lexer->state = LEX_BLOCK_COMMENT;
+        }
+        return;
+    case LEX_STRING_START:
+        if (c == '"') {
+            lexer->state = LEX_EMPTY_STRING;
+            return;
+        }
+        lexer->state = LEX_STRING;
+        // fall through
+    case LEX_STRING:
+        if (c == '\\') {
+            lexer->state = LEX_STRING_ESCAPE;
+        } else if (c == '"' || c == '\n') {
+            lexer->state = LEX_CODE;
+        }
+        return;
+    case LEX_STRING_ESCAPE:
+        lexer->state = LEX_STRING;
+        return;
+    case LEX_EMPTY_STRING:
+        if (c == '"') {
+            lexer->state = LEX_TEXT_BLOCK;
+            lexer->quotes = 0;
+            return;
+        }
+        lexer->state = LEX_CODE;
+        break;
+    case LEX_TEXT_BLOCK:
+        if (c == '\\') {
+            lexer->state = LEX_TEXT_ESCAPE;
+            lexer->quotes = 0;
+        } else if (c != '"') {
+            lexer->quotes = 0;
+        } else if (++lexer->quotes == 3) {
+            lexer->state = LEX_CODE;
+        }
+        return;
+    case LEX_TEXT_ESCAPE:
+        lexer->state = LEX_TEXT_BLOCK;
+        return;
+    case LEX_CHAR:
+        if (c == '\\') {
+            lexer->state = LEX_CHAR_ESCAPE;
+        } else if (c == '\'' || c == '\n') {
+            lexer->state = LEX_CODE;
+        }
+        return;
+    case LEX_CHAR_ESCAPE:
+        lexer->state = LEX_CHAR;
+        return;
+    }
+
+    // LEX_CODE
+    if (c == '/') {
+        lexer->state = LEX_SLASH;
+        return;
+    }
+    if (c == '"' || c == '\'') {
+        lexer->state = (c == '"') ? LEX_STRING_START : LEX_CHAR;
+        if (lexer->depth == 0) lex_punct(lexer, 0);
+        return;
+    }
+    if (lexer->depth > 0) {
+        if (c == '{') {
+            lexer->depth++;
+        } else if (c == '}' && --lexer->depth == 0 && lexer->body) {
+            lex_reset_statement(lexer);
+        }
+        return;
+    }
+
+    if (lex_class[c] & LEX_IDENT_START) {
+        lexer->state = LEX_IDENT;
+        lexer->ident[0] = (char)c;
+        lexer->ident_len = 1;
+    } else if (c >= '0' && c <= '9') {
+        lexer->state = LEX_NUMBER;
+        lex_punct(lexer, 0);
+    } else if (!(lex_class[c] & LEX_SPACE)) {
+        lex_punct(lexer, c);
+    }
+}
+
+// Bit masks of a 32 byte block of a body: where strings, comments and braces start, and
+// where lines end and escapes are, so that short strings and comments end inside the block.
+// The vector kernels compare the whole block against every byte at once.
+struct BodyMasks {
+    unsigned int specials;         // '{', '}', '"', '\'' and '/'
+    unsigned int braces;           // '{' and '}'
+    unsigned int closing;          // '}'
+    unsigned int quotes;
+    unsigned int newlines;
+    unsigned int escapes;          // '\\'
+};
+
+static void body_masks_scalar(const unsigned char *block, int len, BodyMasks *masks) {
+    memset(masks, 0, sizeof(*masks));
+    for (int i = 0; i < len; i++) {
+        unsigned int bit = 1u << i;
+        if (lex_class[block[i]] & LEX_BODY_SPECIAL) masks->specials |= bit;
+        if (block[i] == '{' || block[i] == '}') masks->braces |= bit;
+        if (block[i] == '}') masks->closing |= bit;
+        if (block[i] == '"') masks->quotes |= bit;
+        if (block[i] == '\n') masks->newlines |= bit;
+        if (block[i] == '\\') masks->escapes |= bit;
+    }
+}
+
+static void body_masks_scalar_block(const unsigned char *block, BodyMasks *masks) {
+    body_masks_scalar(block, 32, masks);
+}
+
+static int bit_count(unsigned int mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcount(mask);
+#else
+    int count = 0;
+    for (; mask; mask &= mask - 1) count++;
+    return count;
+#endif
+}
+
+static int lowest_bit(unsigned int mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#elif defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int index = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+#ifdef HAVE_X86_SIMD
+static TARGET_SSE2
+void body_masks_sse2(const unsigned char *block, BodyMasks *masks) {
+    memset(masks, 0, sizeof(*masks));
+    for (int half = 0; half < 2; half++) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(block + half * 16));
+        __m128i quotes = _mm_cmpeq_epi8(v, _mm_set1_epi8('"'));
+        __m128i closing = _mm_cmpeq_epi8(v, _mm_set1_epi8('}'));
+        __m128i braces = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('{')), closing);
+        __m128i others = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\'')), _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+        int shift = half * 16;
+        masks->specials |= (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(braces, others), quotes)) << shift;
+        masks->braces |= (unsigned int)_mm_movemask_epi8(braces) << shift;
+        masks->closing |= (unsigned int)_mm_movemask_epi8(closing) << shift;
+        masks->quotes |= (unsigned int)_mm_movemask_epi8(quotes) << shift;
+        masks->newlines |= (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))) << shift;
+        masks->escapes |= (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << shift;
+    }
+}
+
+static TARGET_AVX2
+void body_masks_avx2(const unsigned char *block, BodyMasks *masks) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)block);
+    __m256i quotes = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'));
+    __m256i closing = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('}'));
+    __m256i braces = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('{')), closing);
+    __m256i others = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')),
+                                     _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+    masks->specials = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(braces, others), quotes));
+    masks->braces = (unsigned int)_mm256_movemask_epi8(braces);
+    masks->closing = (unsigned int)_mm256_movemask_epi8(closing);
+    masks->quotes = (unsigned int)_mm256_movemask_epi8(quotes);
+    masks->newlines = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    masks->escapes = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+}
+#endif
+
+#define KERNELS_UNCHOSEN 0
+#define KERNELS_CHOOSING 1
+#define KERNELS_CHOSEN 2
+
+static Kernels chosen_kernels;
+static volatile LONG kernels_state;       // KERNELS_*
+
+// The first thread here asks the processor, any other one waits until it is done. Built on
+// the Interlocked functions, as InitOnceExecuteOnce is missing from TCC's headers.
+static const Kernels *processor_kernels(void) {
+    if (InterlockedCompareExchange(&kernels_state, KERNELS_CHOSEN, KERNELS_CHOSEN) == KERNELS_CHOSEN) {
+        return &chosen_kernels;
+    }
+    if (InterlockedCompareExchange(&kernels_state, KERNELS_CHOOSING, KERNELS_UNCHOSEN) == KERNELS_UNCHOSEN) {
+        chosen_kernels.count_newlines = count_newlines_scalar;
+        chosen_kernels.body_masks = body_masks_scalar_block;
+#ifdef HAVE_X86_SIMD
+        if (cpu_has_avx2()) {
+            chosen_kernels.count_newlines = count_newlines_avx2;
+            chosen_kernels.body_masks = body_masks_avx2;
+        } else if (cpu_has_sse2()) {
+            chosen_kernels.count_newlines = count_newlines_sse2;
+            chosen_kernels.body_masks = body_masks_sse2;
+        }
+#endif
+        InterlockedExchange(&kernels_state, KERNELS_CHOSEN);
+        return &chosen_kernels;
+    }
+    while (InterlockedCompareExchange(&kernels_state, KERNELS_CHOSEN, KERNELS_CHOSEN) != KERNELS_CHOSEN) {
+        Sleep(0);
+    }
+    return &chosen_kernels;
+}
+
+// Count the newlines in a block with the fastest kernel. Hot loops keep processor_kernels()
+// instead, like the symbol lexer.
+static size_t count_newlines(const char *data, size_t len) {
+    return processor_kernels()->count_newlines(data, len);
+}
+
+// Skip through a body from p as far as only its braces matter, a block of 32 bytes at a time.
+// Returns where the body ended, or the first byte that needs lex_char: one that may continue
+// past the end of the chunk, an escape sequence or a text block.
+static const unsigned char *lex_skip_body(SymbolLexer *lexer, const unsigned char *p, const unsigned char *end) {
+    while (p < end) {
+        const unsigned char *block = p;
+        int len = (end - p < 32) ? (int)(end - p) : 32;
+        BodyMasks masks;
+        if (len == 32) {
+            lexer->kernels->body_masks(block, &masks);
+        } else {
+            body_masks_scalar(block, len, &masks);
+        }
+        p = block + len;
+
+        // Nothing but braces, too few closing ones to end the body: all of them at once
+        int closing = bit_count(masks.closing);
+        if (masks.specials == masks.braces && lexer->depth > closing) {
+            lexer->depth += bit_count(masks.braces) - 2 * closing;
+            continue;
+        }
+
+        unsigned int mask = masks.specials;
+        while (mask) {
+            int at = lowest_bit(mask);
+            const unsigned char *q = block + at;
+            const unsigned char *next;
+            unsigned int after = (at == 31) ? 0 : ~0u << (at + 1);  // Bits past q
+            unsigned int stops;
+
+            switch (*q) {
+            case '{':
+                lexer->depth++;
+                next = q + 1;
+                break;
+            case '}':
+                if (--lexer->depth == 0) {
+                    if (lexer->body) lex_reset_statement(lexer);
+                    return q + 1;
+                }
+                next = q + 1;
+                break;
+            case '"':
+                // Ends at the next quote unless a line end or an escape comes first
+                stops = (masks.quotes | masks.newlines | masks.escapes) & after;
+                if (stops) {
+                    next = block + lowest_bit(stops);
+                    if (*next != '"' || next == q + 1) return q;
+                } else {
+                    next = block + len;
+                    while (next < end && !(lex_class[*next] & LEX_STRING_SPECIAL)) next++;
+                    if (next == end || *next != '"') return q;
+                }
+                next++;
+                break;
+            case '\'':
+                if (end - q < 3 || q[1] == '\\' || q[2] != '\'') return q;
+                next = q + 3;
+                break;
+            default: // '/'
+                if (end - q < 2) return q;
+                if (q[1] == '/') {
+                    stops = masks.newlines & after;
+                    next = stops ? block + lowest_bit(stops) : memchr(q + 2, '\n', end - q - 2);
+                    if (!next) return q;
+                    next++;
+                } else if (q[1] == '*') {
+                    next = q + 2;
+                    while ((next = memchr(next, '*', end - next)) != NULL && next + 1 < end && next[1] != '/') {
+                        next++;
+                    }
+                    if (!next || next + 1 >= end) return q;
+                    next += 2;
+                } else {
+                    next = q + 1;
+                }
+                break;
+            }
+
+            if (next >= block + len) {
+                p = next;
+                break;
+            }
+            mask &= ~0u << (next - block);
+        }
+    }
+    return end;
+}
+
+// Index the next chunk of a file. Runs of bytes that cannot change the state are skipped
+// in bulk, and names only note where they start: lines are counted up to there once one
+// turns out to be a symbol, and for the rest of the chunk all at once.
+static void symbols_feed(SymbolLexer *lexer, const char *data, size_t len) {
+    const unsigned char *p = (const unsigned char*)data;
+    const unsigned char *end = p + len;
+    lexer->counted = p;
+
+    while (p < end) {
+        switch (lexer->state) {
+        case LEX_CODE:
+            if (lexer->depth > 0) {
+                p = lex_skip_body(lexer, p, end);
+                if (lexer->depth == 0) continue;
+            } else if (lexer->skipping && lexer->parens == 0) {
+                while (p < end && !(lex_class[*p] & LEX_SKIP_SPECIAL)) p++;
+            } else {
+                while (p < end && (lex_class[*p] & LEX_SPACE)) p++;
+                if (p < end && (lex_class[*p] & LEX_IDENT_START)) {
+                    // A whole name at once, unless it continues in the next chunk
+                    const unsigned char *start = p;
+                    while (p < end && (lex_class[*p] & LEX_IDENT_CHAR)) p++;
+                    lexer->ident_at = start;
+                    if (p == end) {
+                        int len = (int)(p - start);
+                        if (len > SYMBOL_NAME_MAX - 1) len = SYMBOL_NAME_MAX - 1;
+                        memcpy(lexer->ident, start, len);
+                        lexer->ident_len = len;
+                        lexer->state = LEX_IDENT;
+                    } else {
+                        lex_ident(lexer, (const char*)start, (int)(p - start));
+                    }
+                    continue;
+                }
+            }
+            break;
+        case LEX_IDENT:
+            while (p < end && (lex_class[*p] & LEX_IDENT_CHAR)) {
+                if (lexer->ident_len < SYMBOL_NAME_MAX - 1) lexer->ident[lexer->ident_len++] = (char)*p;
+                p++;
+            }
+            break;
+        case LEX_LINE_COMMENT:
+            p = memchr(p, '\n', end - p);
+            if (!p) p = end;
+            break;
+        case LEX_BLOCK_COMMENT:
+            p = memchr(p, '*', end - p);
+            if (!p) p = end;
+            break;
+        case LEX_STRING:
+            while (p < end && !(lex_class[*p] & LEX_STRING_SPECIAL)) p++;
+            break;
+        }
+        if (p == end) break;
+
+        lex_char(lexer, *p);
+        if (lexer->state == LEX_IDENT && lexer->ident_len == 1) lexer->ident_at = p;
+        p++;
+    }
+
+    // Names that may still become symbols need their lines, and the last one its bytes,
+    // before the chunk goes
+    lex_line(lexer, &lexer->function_at, &lexer->function_line);
+    lex_line(lexer, &lexer->last_at, &lexer->last_line);
+    lex_line(lexer, &lexer->ident_at, &lexer->ident_line);
+    if (lexer->last != lexer->last_copy) {
+        memcpy(lexer->last_copy, lexer->last, lexer->last_len);
+        lexer->last = lexer->last_copy;
+    }
+    lexer->line += (int)lexer->kernels->count_newlines((const char*)lexer->counted, end - lexer->counted);
+}
+
+// The file is complete
+static void symbols_end(SymbolLexer *lexer) {
+    lex_char(lexer, '\n');
+}
+
+// Append a source file to the output. Returns the number of lines it contributes, counting
+// an unterminated last line, and makes sure the output ends with a newline afterwards.
+// Hashes the contents into hash and indexes the file's symbols into symbols unless they
+// are NULL.
+static int copy_source(FoldWriter *writer, const char *path, unsigned long long *hash, SymbolList *symbols) {
+    if (hash) *hash = FNV_OFFSET;
+    SymbolLexer lexer;
+    if (symbols) symbols_begin(&lexer, symbols);
+
+    HANDLE in = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                           OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (in == INVALID_HANDLE_VALUE) return 0;
+
+    size_t lines = 0;
+    char last = '\n';
+    while (1) {
+        if (writer->used == COPY_BUFFER_SIZE) writer_flush(writer);
+
+        // Read directly into the staging buffer behind whatever is already queued
+        DWORD bytes_read;
+        char *dest = writer->buffer + writer->used;
+        if (!ReadFile(in, dest, (DWORD)(COPY_BUFFER_SIZE - writer->used), &bytes_read, NULL) ||
+            bytes_read == 0) {
+            break;
+        }
+
+        lines += count_newlines(dest, bytes_read);
+        if (hash) *hash = hash_bytes(*hash, dest, bytes_read);
+        if (symbols) symbols_feed(&lexer, dest, bytes_read);
+        last = dest[bytes_read - 1];
+        writer->used += bytes_read;
+    }
+    CloseHandle(in);
+    if (symbols) symbols_end(&lexer);
+
+    // An unterminated last line still counts, and gets the newline it was missing
+    if (last != '\n') {
+        lines++;
+        writer_put(writer, "\n", 1);
+    }
+    return (int)lines;
+}
+
+// Incremental folding
+//
+// With incremental folding enabled, output/output.manifest records every folded file:
+// size, mtime, content hash, byte offset of its header in output.pde, its line range and
+// the symbols it defines.
+// On the next run the collected files are compared against it: the unchanged prefix is
+// left alone, the unchanged suffix is spliced inside output.pde to its new position and
+// only the files in between are read again.
+
+#define MANIFEST_NAME "output.manifest"
+#define MANIFEST_MAGIC "foldcessing-manifest 2"
+
+typedef struct {
+    char *relative;
+    unsigned long long size;
+    unsigned long long mtime;
+    unsigned long long hash;
+    long long offset;
+    int start_line;
+    int end_line;
+    SymbolList symbols;
+} ManifestEntry;
+
+typedef struct {
+    ManifestEntry *entries;
+    int count;
+    int total_lines;
+    long long output_size;
+} Manifest;
+
+// Hash a whole file, returns 0 if it cannot be read
+static unsigned long long hash_file(const char *path) {
+    HANDLE in = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                           OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (in == INVALID_HANDLE_VALUE) return 0;
+
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    unsigned long long hash = FNV_OFFSET;
+    DWORD bytes_read;
+    while (buffer && ReadFile(in, buffer, COPY_BUFFER_SIZE, &bytes_read, NULL) && bytes_read > 0) {
+        hash = hash_bytes(hash, buffer, bytes_read);
+    }
+    free(buffer);
+    CloseHandle(in);
+    return buffer ? hash : 0;
+}
+
+// Size of a file on disk, -1 if it does not exist
+static long long file_size_of(const char *path) {
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!GetFileAttributesEx(path, GetFileExInfoStandard, &info)) return -1;
+    return ((long long)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+}
+
+static void free_manifest(Manifest *manifest) {
+    for (int i = 0; i < manifest->count; i++) {
+        free(manifest->entries[i].relative);
+        symbols_free(&manifest->entries[i].symbols);
+    }
+    free(manifest->entries);
+    memset(manifest, 0, sizeof(*manifest));
+}
+
+// Load a manifest written by save_manifest, returns 1 on success
+static int load_manifest(const char *path, Manifest *manifest) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+
+    char line[MAX_PATH_LEN + 256];
+    int count = 0;
+    memset(manifest, 0, sizeof(*manifest));
+
+    if (!fgets(line, sizeof(line), f) || strncmp(line, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)) != 0 ||
+        sscanf(line + strlen(MANIFEST_MAGIC), "%d %d %lld",
+               &count, &manifest->total_lines, &manifest->output_size) != 3 ||
+        count < 0) {
+        fclose(f);
+        return 0;
+    }
+
+    manifest->entries = calloc(count ? count : 1, sizeof(ManifestEntry));
+    if (!manifest->entries) {
+        fclose(f);
+        return 0;
+    }
+    while (manifest->count < count && fgets(line, sizeof(line), f)) {
+        ManifestEntry *e = &manifest->entries[manifest->count];
+        int consumed = 0;
+        int symbol_count;
+        if (sscanf(line, "%llu %llu %llx %lld %d %d %d %n",
+                   &e->size, &e->mtime, &e->hash, &e->offset,
+                   &e->start_line, &e->end_line, &symbol_count, &consumed) != 7 || consumed == 0) {
+            break;
+        }
+        char *relative = line + consumed;
+        relative[strcspn(relative, "\r\n")] = '\0';
+        e->relative = _strdup(relative);
+        if (!e->relative) break;
+        e->symbols.count = -1;
+        manifest->count++;
+
+        // Followed by its symbols, one per line, unless it was not indexed
+        if (symbol_count >= 0) e->symbols.count = 0;
+        int symbols_read = 0;
+        while (symbols_read < symbol_count && fgets(line, sizeof(line), f)) {
+            int kind, line_number;
+            consumed = 0;
+            if (sscanf(line, "%d %d %n", &kind, &line_number, &consumed) != 2 || consumed == 0) break;
+            char *name = line + consumed;
+            name[strcspn(name, "\r\n")] = '\0';
+            symbols_add(&e->symbols, kind, name, strlen(name), line_number);
+            symbols_read++;
+        }
+        if (symbols_read < symbol_count) break;
+    }
+    fclose(f);
+
+    if (manifest->count != count) {
+        free_manifest(manifest);
+        return 0;
+    }
+    return 1;
+}
+
+// Write the manifest for the sketch's current files[]/map state
+static void save_manifest(const Sketch *sketch, const char *path, long long output_size) {
+    const FileEntry *files = sketch->files;
+    const LineMapping *line_map = sketch->map.ranges;
+    int file_count = sketch->file_count;
+    char temp_path[MAX_PATH_LEN];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    FILE *f = fopen(temp_path, "wb");
+    if (!f) return;
+
+    fprintf(f, "%s %d %d %lld\n", MANIFEST_MAGIC, file_count, sketch->map.total_lines, output_size);
+    for (int i = 0; i < file_count; i++) {
+        const SymbolList *symbols = &files[i].symbols;
+        fprintf(f, "%llu %llu %llx %lld %d %d %d %s\n",
+                files[i].size, files[i].mtime, files[i].hash, files[i].offset,
+                line_map[i].start_line, line_map[i].end_line, symbols->count, files[i].relative);
+        for (int j = 0; j < symbols->count; j++) {
+            fprintf(f, "%d %d %s\n", symbols->items[j].kind, symbols->items[j].line,
+                    symbol_name(symbols, &symbols->items[j]));
+        }
+    }
+
+    if (fclose(f) == 0) {
+        MoveFileEx(temp_path, path, MOVEFILE_REPLACE_EXISTING);
+    } else {
+        DeleteFile(temp_path);
+    }
+}
+
+// Check whether a collected file still matches its manifest entry.
+// Size and mtime are trusted when equal; a touched file of the same size is hashed.
+// Returns 0 if changed, 1 if unchanged, 2 if unchanged but with a new mtime.
+static int entry_unchanged(FileEntry *file, const ManifestEntry *entry, int indexing) {
+    if (strcmp(file->relative, entry->relative) != 0) return 0;
+    if (file->size != entry->size) return 0;
+    // Folded before symbols were indexed, read it again for them
+    if (entry->symbols.count < 0 && indexing) return 0;
+    file->hash = entry->hash;
+    if (file->mtime != entry->mtime) {
+        return (hash_file(file->path) == entry->hash) ? 2 : 0;
+    }
+    return 1;
+}
+
+// Hand an unchanged file the symbols indexed when it was folded
+static void take_symbols(FileEntry *file, ManifestEntry *entry) {
+    symbols_free(&file->symbols);
+    file->symbols = entry->symbols;
+    memset(&entry->symbols, 0, sizeof(entry->symbols));
+    entry->symbols.count = -1;
+}
+
+// Length of the header comment written before each file
+static long long header_length(const FileEntry *file) {
+    return (long long)strlen("//>/>/>") + strlen(file->relative) + 1;
+}
+
+// Move len bytes inside an open file from src to dst, ranges may overlap
+static int move_file_range(HANDLE f, long long src, long long dst, long long len) {
+    if (src == dst || len <= 0) return 1;
+
+#if defined(__linux__) && !defined(_WIN32)
+    // Ranges that do not overlap are copied inside the kernel (shared extents on reflink
+    // file systems); if that stops short the loop below redoes the whole range
+    if (src + len <= dst || dst + len <= src) {
+        loff_t from = src, to = dst;
+        long long left = len;
+        while (left > 0) {
+            ssize_t n = copy_file_range(handle_fd(f), &from, handle_fd(f), &to, (size_t)left, 0);
+            if (n <= 0) break;
+            left -= n;
+        }
+        if (left == 0) return 1;
+    }
+#endif
+
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    if (!buffer) return 0;
+
+    int ok = 1;
+    long long done = 0;
+    while (ok && done < len) {
+        DWORD chunk = (DWORD)((len - done < COPY_BUFFER_SIZE) ? len - done : COPY_BUFFER_SIZE);
+        // Copy back to front when moving towards the end so nothing is overwritten early
+        long long pos = (dst > src) ? len - done - (long long)chunk : done;
+        DWORD bytes_read;
+
+        ok = seek_handle(f, src + pos) &&
+             ReadFile(f, buffer, chunk, &bytes_read, NULL) && bytes_read == chunk &&
+             seek_handle(f, dst + pos) &&
+             write_all(f, buffer, chunk);
+        done += chunk;
+    }
+
+    free(buffer);
+    return ok;
+}
+
+// Pipelined reading
+//
+// While the writer appends files in order, read_threads readers claim the upcoming files
+// one by one and load them into memory, counting lines (and hashing) on the way. Loaded
+// files are limited to read_buffer_mb in total; a reader waits for the writer to free
+// memory before loading more, except for the file the writer is waiting on. Files too big
+// for half the budget, files that grew since they were collected and files that cannot be
+// opened are left to the writer, which streams them with copy_source like the serial path.
+
+#define DEFAULT_READ_BUFFER_MB 64
+#define SLOT_PENDING 0
+#define SLOT_READY 1
+#define SLOT_DIRECT 2
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t reserved;             // Budget held by data
+    int lines;
+    unsigned long long hash;
+    SymbolList symbols;
+    volatile LONG state;
+} PrefetchSlot;
+
+typedef struct FoldPipeline FoldPipeline;
+
+typedef struct {
+    FoldPipeline *pipeline;
+    int index;
+} FoldReader;
+
+struct FoldPipeline {
+    Sketch *sketch;
+    int indexing;                // Index symbols while reading
+    int hashing;                 // Hash the contents while reading
+    PrefetchSlot *slots;         // One per file in [first, last)
+    int first;
+    int last;
+    volatile LONG next;          // Next file to claim
+    volatile LONG writing;       // File the writer is on
+    size_t budget;
+    size_t used;
+    CRITICAL_SECTION lock;       // Guards used, writing and waiting
+    HANDLE ready;                // Auto-reset, a slot left SLOT_PENDING
+    WaitList waiting;            // Readers waiting for budget to be released or the writer to move on
+    FoldReader readers[MAX_SCAN_THREADS];
+    HANDLE threads[MAX_SCAN_THREADS];
+    int thread_count;
+};
+
+// Load (and index) a whole file into slot, returns 0 if the writer has to stream it instead
+static int prefetch_file(PrefetchSlot *slot, const char *path, size_t capacity, int indexing, int hashing) {
+    HANDLE in = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                           OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (in == INVALID_HANDLE_VALUE) return 0;
+
+    slot->data = malloc(capacity);
+    slot->len = 0;
+    while (slot->data && slot->len < capacity) {
+        DWORD bytes_read;
+        DWORD want = (capacity - slot->len > COPY_BUFFER_SIZE) ? COPY_BUFFER_SIZE : (DWORD)(capacity - slot->len);
+        if (!ReadFile(in, slot->data + slot->len, want, &bytes_read, NULL) || bytes_read == 0) break;
+        slot->len += bytes_read;
+    }
+    CloseHandle(in);
+
+    // capacity has one byte more than the collected size, filling it means the file grew
+    if (!slot->data || slot->len == capacity) {
+        free(slot->data);
+        slot->data = NULL;
+        return 0;
+    }
+
+    slot->lines = (int)count_newlines(slot->data, slot->len);
+    if (slot->len > 0 && slot->data[slot->len - 1] != '\n') slot->lines++;
+    if (hashing) slot->hash = hash_bytes(FNV_OFFSET, slot->data, slot->len);
+    if (indexing) {
+        SymbolLexer lexer;
+        symbols_begin(&lexer, &slot->symbols);
+        symbols_feed(&lexer, slot->data, slot->len);
+        symbols_end(&lexer);
+    }
+    return 1;
+}
+
+static DWORD WINAPI fold_reader(LPVOID param) {
+    FoldReader *reader = (FoldReader*)param;
+    FoldPipeline *pipeline = reader->pipeline;
+    const FileEntry *files = pipeline->sketch->files;
+
+    while (1) {
+        int i = (int)InterlockedIncrement(&pipeline->next) - 1;
+        if (i >= pipeline->last) break;
+
+        PrefetchSlot *slot = &pipeline->slots[i - pipeline->first];
+        size_t capacity = (size_t)files[i].size + 1;
+        int loaded = 0;
+
+        if (files[i].size <= pipeline->budget / 2) {
+            // Wait for room, the writer's current file always gets it
+            while (1) {
+                int reserved = 0;
+                EnterCriticalSection(&pipeline->lock);
+                if (pipeline->used + capacity <= pipeline->budget || i == pipeline->writing) {
+                    pipeline->used += capacity;
+                    reserved = 1;
+                } else {
+                    wait_list_add(&pipeline->waiting, reader->index);
+                }
+                LeaveCriticalSection(&pipeline->lock);
+                if (reserved) break;
+                wait_list_sleep(&pipeline->waiting, reader->index);
+            }
+
+            slot->reserved = capacity;
+            loaded = prefetch_file(slot, files[i].path, capacity, pipeline->indexing, pipeline->hashing);
+            if (!loaded) {
+                EnterCriticalSection(&pipeline->lock);
+                pipeline->used -= capacity;
+                wait_list_wake(&pipeline->waiting);
+                LeaveCriticalSection(&pipeline->lock);
+                slot->reserved = 0;
+            }
+        }
+
+        InterlockedExchange(&slot->state, loaded ? SLOT_READY : SLOT_DIRECT);
+        SetEvent(pipeline->ready);
+    }
+    return 0;
+}
+
+// Only the manifest of an incremental fold takes the hashes from the fold itself; with
+// fold_cache, hash_files has filled them in already, and nothing else reads them
+static int fold_needs_hashes(const Sketch *sketch) {
+    return sketch->config.incremental && !sketch->config.fold_cache[0];
+}
+
+// Number of reader threads, 1 means folding without a pipeline
+static int read_thread_count(const Config *config) {
+    int threads = config->read_threads;
+    if (threads <= 0) {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        threads = (int)info.dwNumberOfProcessors;
+        if (threads > DEFAULT_MAX_SCAN_THREADS) threads = DEFAULT_MAX_SCAN_THREADS;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_SCAN_THREADS) threads = MAX_SCAN_THREADS;
+    return threads;
+}
+
+// Start prefetching files[first..last), returns NULL to fold serially
+static FoldPipeline *start_pipeline(Sketch *sketch, int first, int last) {
+    const Config *config = &sketch->config;
+    int threads = read_thread_count(config);
+    if (threads < 2 || last - first < 2) return NULL;
+
+    FoldPipeline *pipeline = calloc(1, sizeof(FoldPipeline));
+    if (!pipeline) return NULL;
+    pipeline->sketch = sketch;
+    pipeline->indexing = config->duplicate_symbols != DUPLICATES_OFF;
+    pipeline->hashing = fold_needs_hashes(sketch);
+    pipeline->slots = calloc(last - first, sizeof(PrefetchSlot));
+    pipeline->first = first;
+    pipeline->last = last;
+    pipeline->next = first;
+    pipeline->writing = first;
+    pipeline->budget = (size_t)(config->read_buffer_mb > 0 ? config->read_buffer_mb : DEFAULT_READ_BUFFER_MB)
+                       * 1024 * 1024;
+    pipeline->ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+    InitializeCriticalSection(&pipeline->lock);
+
+    if (pipeline->slots && pipeline->ready && wait_list_init(&pipeline->waiting, threads)) {
+        for (int i = 0; i < threads; i++) {
+            pipeline->readers[i].pipeline = pipeline;
+            pipeline->readers[i].index = i;
+            HANDLE thread = CreateThread(NULL, 0, fold_reader, &pipeline->readers[i], 0, NULL);
+            if (thread) pipeline->threads[pipeline->thread_count++] = thread;
+        }
+    }
+
+    if (pipeline->thread_count == 0) {
+        DeleteCriticalSection(&pipeline->lock);
+        if (pipeline->ready) CloseHandle(pipeline->ready);
+        wait_list_free(&pipeline->waiting);
+        free(pipeline->slots);
+        free(pipeline);
+        return NULL;
+    }
+    return pipeline;
+}
+
+// Wait until the readers are done with file i
+static PrefetchSlot *pipeline_wait(FoldPipeline *pipeline, int i) {
+    PrefetchSlot *slot = &pipeline->slots[i - pipeline->first];
+
+    EnterCriticalSection(&pipeline->lock);
+    pipeline->writing = i;
+    wait_list_wake(&pipeline->waiting);
+    LeaveCriticalSection(&pipeline->lock);
+
+    while (InterlockedCompareExchange(&slot->state, SLOT_PENDING, SLOT_PENDING) == SLOT_PENDING) {
+        WaitForSingleObject(pipeline->ready, INFINITE);
+    }
+    return slot;
+}
+
+// Give a written slot's memory back to the readers
+static void pipeline_release(FoldPipeline *pipeline, PrefetchSlot *slot) {
+    free(slot->data);
+    slot->data = NULL;
+
+    EnterCriticalSection(&pipeline->lock);
+    pipeline->used -= slot->reserved;
+    wait_list_wake(&pipeline->waiting);
+    LeaveCriticalSection(&pipeline->lock);
+    slot->reserved = 0;
+}
+
+static void finish_pipeline(FoldPipeline *pipeline) {
+    WaitForMultipleObjects(pipeline->thread_count, pipeline->threads, TRUE, INFINITE);
+    for (int i = 0; i < pipeline->thread_count; i++) {
+        CloseHandle(pipeline->threads[i]);
+    }
+    for (int i = 0; i < pipeline->last - pipeline->first; i++) {
+        free(pipeline->slots[i].data);
+        free(pipeline->slots[i].symbols.items);
+        free(pipeline->slots[i].symbols.names);
+    }
+    DeleteCriticalSection(&pipeline->lock);
+    CloseHandle(pipeline->ready);
+    wait_list_free(&pipeline->waiting);
+    free(pipeline->slots);
+    free(pipeline);
+}
+
+// Write files[first..last) through writer, filling in the map, offsets, symbols and hashes.
+// current_line is the output line of the first header, returns the line after the last file.
+static int write_fold_range(Sketch *sketch, FoldWriter *writer, int first, int last, int current_line) {
+    FileEntry *files = sketch->files;
+    LineMapping *line_map = sketch->map.ranges;
+    FoldPipeline *pipeline = start_pipeline(sketch, first, last);
+    int indexing = sketch->config.duplicate_symbols != DUPLICATES_OFF;
+    int hashing = fold_needs_hashes(sketch);
+
+    for (int i = first; i < last; i++) {
+        files[i].offset = writer_position(writer);
+        line_map[i].start_line = current_line + 1; // +1 to skip header line
+        line_map[i].relative = files[i].relative;
+
+        // Write header comment
+        writer_put(writer, "//>/>/>", 7);
+        writer_put(writer, files[i].relative, strlen(files[i].relative));
+        writer_put(writer, "\n", 1);
+        current_line++;
+
+        // Write file contents and count lines
+        PrefetchSlot *slot = pipeline ? pipeline_wait(pipeline, i) : NULL;
+        if (slot && slot->state == SLOT_READY) {
+            writer_put(writer, slot->data, slot->len);
+            if (slot->len > 0 && slot->data[slot->len - 1] != '\n') {
+                writer_put(writer, "\n", 1);
+            }
+            current_line += slot->lines;
+            if (hashing) files[i].hash = slot->hash;
+            symbols_free(&files[i].symbols);
+            if (indexing) {
+                files[i].symbols = slot->symbols;
+                memset(&slot->symbols, 0, sizeof(slot->symbols));
+            }
+            pipeline_release(pipeline, slot);
+        } else {
+            if (!indexing) symbols_free(&files[i].symbols);
+            current_line += copy_source(writer, files[i].path, hashing ? &files[i].hash : NULL,
+                                        indexing ? &files[i].symbols : NULL);
+        }
+
+        line_map[i].end_line = current_line - 1;
+
+        // Blank line between files
+        writer_put(writer, "\n", 1);
+        current_line++;
+    }
+
+    if (pipeline) finish_pipeline(pipeline);
+    return current_line;
+}
+
+// Bring output.pde up to date using the previous manifest.
+// Returns 0 if nothing had to be written, the number of rewritten files if output.pde
+// was spliced, or -1 if a full rewrite is needed. touched is set when only mtimes changed.
+static int fold_incremental(Sketch *sketch, const char *output_file, const char *manifest_file, Manifest *old,
+                            int *touched) {
+    FileEntry *files = sketch->files;
+    LineMapping *line_map = sketch->map.ranges;
+    int file_count = sketch->file_count;
+    int indexing = sketch->config.duplicate_symbols != DUPLICATES_OFF;
+    int common = (file_count < old->count) ? file_count : old->count;
+    int unchanged;
+
+    // Unchanged files at the front stay where they are
+    int prefix = 0;
+    *touched = 0;
+    while (prefix < common && (unchanged = entry_unchanged(&files[prefix], &old->entries[prefix], indexing))) {
+        if (unchanged == 2) *touched = 1;
+        line_map[prefix].start_line = old->entries[prefix].start_line;
+        line_map[prefix].end_line = old->entries[prefix].end_line;
+        line_map[prefix].relative = files[prefix].relative;
+        files[prefix].offset = old->entries[prefix].offset;
+        take_symbols(&files[prefix], &old->entries[prefix]);
+        prefix++;
+    }
+
+    if (prefix == file_count && prefix == old->count) {
+        sketch->map.total_lines = old->total_lines;
+        return 0;
+    }
+
+    // Unchanged files at the back are spliced as one block
+    int suffix = 0;
+    while (suffix < common - prefix &&
+           entry_unchanged(&files[file_count - 1 - suffix], &old->entries[old->count - 1 - suffix], indexing)) {
+        suffix++;
+    }
+
+    int new_mid_end = file_count - suffix;
+    int old_mid_end = old->count - suffix;
+    long long mid_start = (prefix < old->count) ? old->entries[prefix].offset : old->output_size;
+    long long old_suffix_start = (old_mid_end < old->count) ? old->entries[old_mid_end].offset
+                                                            : old->output_size;
+    long long suffix_len = old->output_size - old_suffix_start;
+
+    // Upper bound for the rewritten middle, from the sizes seen by collect_files:
+    // header, contents, a possibly missing final newline and the separator
+    long long mid_bound = 0;
+    for (int i = prefix; i < new_mid_end; i++) {
+        mid_bound += header_length(&files[i]) + (long long)files[i].size + 2;
+    }
+
+    // output.pde is about to change, the old manifest no longer describes it
+    DeleteFile(manifest_file);
+
+    HANDLE out = CreateFile(output_file, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (out == INVALID_HANDLE_VALUE) return -1;
+
+    // Park the suffix past the largest possible middle before overwriting anything
+    long long suffix_at = old_suffix_start;
+    if (suffix_len > 0 && mid_start + mid_bound > old_suffix_start) {
+        suffix_at = mid_start + mid_bound;
+        if (!move_file_range(out, old_suffix_start, suffix_at, suffix_len)) {
+            CloseHandle(out);
+            return -1;
+        }
+    }
+
+    FoldWriter writer;
+    if (!writer_open(&writer, out, mid_start)) {
+        writer_close(&writer);
+        CloseHandle(out);
+        return -1;
+    }
+    int current_line = (prefix > 0) ? line_map[prefix - 1].end_line + 2 : 1;
+    current_line = write_fold_range(sketch, &writer, prefix, new_mid_end, current_line);
+    long long mid_end = writer_position(&writer);
+
+    // A source file grew after it was collected and the middle ran into the suffix
+    if (suffix_len > 0 && mid_end > suffix_at) {
+        writer_close(&writer);
+        CloseHandle(out);
+        return -1;
+    }
+    writer_close(&writer);
+    sketch->stats.bytes_written += writer.written;
+
+    if (writer.failed || (suffix_len > 0 && !move_file_range(out, suffix_at, mid_end, suffix_len))) {
+        CloseHandle(out);
+        return -1;
+    }
+
+    // Patch the spliced entries by how far they shifted
+    int old_suffix_line = (old_mid_end > 0) ? old->entries[old_mid_end - 1].end_line + 2 : 1;
+    int line_delta = current_line - old_suffix_line;
+    long long byte_delta = mid_end - old_suffix_start;
+    for (int j = 0; j < suffix; j++) {
+        ManifestEntry *e = &old->entries[old_mid_end + j];
+        int i = new_mid_end + j;
+        line_map[i].start_line = e->start_line + line_delta;
+        line_map[i].end_line = e->end_line + line_delta;
+        line_map[i].relative = files[i].relative;
+        files[i].offset = e->offset + byte_delta;
+        take_symbols(&files[i], e);
+    }
+    sketch->map.total_lines = old->total_lines + line_delta;
+
+    int truncated = seek_handle(out, mid_end + suffix_len) && SetEndOfFile(out);
+    CloseHandle(out);
+
+    return truncated ? new_mid_end - prefix : -1;
+}
+
+// Line map sidecar
+//
+// With line_map set, every fold also writes the line map to that file, so logs can be
+// translated after the output folder is gone (foldcessing --translate). The file is laid out to be used straight from a read-only mapping: a header, the line ranges of all
+// folded files in output.pde order and a table of their NUL-terminated relative paths.
+
+#define LINE_MAP_MAGIC "FLDMAP1"
+
+typedef struct {
+    char magic[8];               // LINE_MAP_MAGIC
+    unsigned int file_count;
+    unsigned int total_lines;
+    unsigned int names_size;     // Bytes of path table after the ranges
+    unsigned int reserved;
+} LineMapHeader;
+
+typedef struct {
+    unsigned int start_line;
+    unsigned int end_line;
+    unsigned int name;           // Offset of the relative path in the path table
+} LineMapRange;
+
+static void save_line_map(const LineMap *map, const char *path) {
+    const LineMapping *line_map = map->ranges;
+    char temp_path[MAX_PATH_LEN];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    FILE *f = fopen(temp_path, "wb");
+    if (!f) return;
+
+    LineMapHeader header = {LINE_MAP_MAGIC, (unsigned int)map->count, (unsigned int)map->total_lines, 0, 0};
+    for (int i = 0; i < map->count; i++) {
+        header.names_size += (unsigned int)strlen(line_map[i].relative) + 1;
+    }
+    fwrite(&header, sizeof(header), 1, f);
+
+    unsigned int name = 0;
+    for (int i = 0; i < map->count; i++) {
+        LineMapRange range = {(unsigned int)line_map[i].start_line, (unsigned int)line_map[i].end_line, name};
+        fwrite(&range, sizeof(range), 1, f);
+        name += (unsigned int)strlen(line_map[i].relative) + 1;
+    }
+    for (int i = 0; i < map->count; i++) {
+        fwrite(line_map[i].relative, strlen(line_map[i].relative) + 1, 1, f);
+    }
+
+    if (fclose(f) == 0) {
+        MoveFileEx(temp_path, path, MOVEFILE_REPLACE_EXISTING);
+    } else {
+        DeleteFile(temp_path);
+    }
+}
+
+// Release what a map holds and empty it
+static void free_line_map(LineMap *map) {
+    free(map->ranges);
+    free(map->line_index);
+    free(map->line_starts);
+    arena_reset(&map->names);
+    if (map->view) UnmapViewOfFile(map->view);
+    memset(map, 0, sizeof(*map));
+    map->java_line_offset = -1;
+}
+
+// Map a saved line map into an empty map, paths stay in the mapping
+static int load_line_map(LineMap *map, const char *path) {
+    HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return 0;
+
+    DWORD size = GetFileSize(file, NULL);
+    HANDLE mapping = (size != INVALID_FILE_SIZE && size >= sizeof(LineMapHeader))
+                     ? CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    const char *view = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (mapping) CloseHandle(mapping);
+    CloseHandle(file);
+    if (!view) return 0;
+
+    // Check everything find_source_file and translate_line rely on
+    const LineMapHeader *header = (const LineMapHeader*)view;
+    const LineMapRange *ranges = (const LineMapRange*)(view + sizeof(LineMapHeader));
+    const char *names = (const char*)(ranges + header->file_count);
+    unsigned long long expected = sizeof(LineMapHeader) +
+                                  (unsigned long long)header->file_count * sizeof(LineMapRange) +
+                                  header->names_size;
+    int valid = memcmp(header->magic, LINE_MAP_MAGIC, sizeof(header->magic)) == 0 &&
+                (int)header->total_lines >= 0 && expected == size &&
+                (header->names_size == 0 || names[header->names_size - 1] == '\0');
+    for (unsigned int i = 0; valid && i < header->file_count; i++) {
+        unsigned int previous_end = i ? ranges[i - 1].end_line : 0;
+        valid = ranges[i].start_line > previous_end && ranges[i].end_line + 1 >= ranges[i].start_line &&
+                ranges[i].end_line <= header->total_lines && ranges[i].name < header->names_size;
+    }
+    if (!valid) {
+        UnmapViewOfFile(view);
+        return 0;
+    }
+
+    map->ranges = malloc(sizeof(LineMapping) * (header->file_count ? header->file_count : 1));
+    if (!map->ranges) {
+        UnmapViewOfFile(view);
+        return 0;
+    }
+    for (unsigned int i = 0; i < header->file_count; i++) {
+        map->ranges[i].start_line = (int)ranges[i].start_line;
+        map->ranges[i].end_line = (int)ranges[i].end_line;
+        map->ranges[i].relative = names + ranges[i].name;
+    }
+    map->view = view;
+    map->count = (int)header->file_count;
+    map->total_lines = (int)header->total_lines;
+    if (!build_line_index(map)) {
+        free_line_map(map);
+        return 0;
+    }
+    return 1;
+}
+
+// Duplicate definitions
+//
+// After every fold the symbols of all files are sorted by kind and name, which puts every
+// definition of a name next to each other. Each one after the first is reported at its own
+// place in the sources, pointing back to the first.
+
+typedef struct {
+    int file;
+    const Symbol *symbol;
+    const char *name;
+} SymbolRef;
+
+static const char *symbol_kind_name(int kind) {
+    switch (kind) {
+    case SYMBOL_CLASS: return "class";
+    case SYMBOL_FUNCTION: return "function";
+    default: return "global";
+    }
+}
+
+static int compare_symbol_refs(const void *a, const void *b) {
+    const SymbolRef *x = (const SymbolRef*)a;
+    const SymbolRef *y = (const SymbolRef*)b;
+    if (x->symbol->kind != y->symbol->kind) return x->symbol->kind - y->symbol->kind;
+    int order = strcmp(x->name, y->name);
+    if (order) return order;
+    if (x->file != y->file) return x->file - y->file;
+    return x->symbol->line - y->symbol->line;
+}
+
+static void report_duplicate(Sketch *sketch, const SymbolRef *first, const SymbolRef *again) {
+    char line[MAX_PATH_LEN * 2 + SYMBOL_NAME_MAX * 2 + 64];
+    int len = snprintf(line, sizeof(line), "%s:%d: Duplicate %s %s, first defined at %s:%d\n",
+                       sketch->files[again->file].relative, again->symbol->line,
+                       symbol_kind_name(again->symbol->kind), again->name,
+                       sketch->files[first->file].relative, first->symbol->line);
+    if (len <= 0) return;
+    if (len > (int)sizeof(line) - 1) len = sizeof(line) - 1;
+
+    if (sketch->duplicate_report_len + len + 1 > sketch->duplicate_report_capacity) {
+        size_t capacity = sketch->duplicate_report_capacity ? sketch->duplicate_report_capacity * 2 : 4096;
+        while (capacity < sketch->duplicate_report_len + len + 1) capacity *= 2;
+        char *report = realloc(sketch->duplicate_report, capacity);
+        if (!report) return;
+        sketch->duplicate_report = report;
+        sketch->duplicate_report_capacity = capacity;
+    }
+    memcpy(sketch->duplicate_report + sketch->duplicate_report_len, line, len + 1);
+    sketch->duplicate_report_len += len;
+}
+
+// Look for names defined more than once in files[] and report them in duplicate_report
+static void check_symbols(Sketch *sketch) {
+    const FileEntry *files = sketch->files;
+    int file_count = sketch->file_count;
+    double started = clock_ms();
+    sketch->duplicate_count = 0;
+    sketch->duplicate_report_len = 0;
+    if (sketch->duplicate_report) sketch->duplicate_report[0] = '\0';
+    sketch->stats.symbols_indexed = 0;
+    sketch->stats.duplicate_symbols = 0;
+    if (sketch->config.duplicate_symbols == DUPLICATES_OFF) return;
+
+    int total = 0;
+    for (int i = 0; i < file_count; i++) {
+        if (files[i].symbols.count > 0) total += files[i].symbols.count;
+    }
+    SymbolRef *refs = malloc(sizeof(SymbolRef) * (total ? total : 1));
+    if (!refs) return;
+    int count = 0;
+    for (int i = 0; i < file_count; i++) {
+        for (int j = 0; j < files[i].symbols.count; j++) {
+            refs[count].file = i;
+            refs[count].symbol = &files[i].symbols.items[j];
+            refs[count].name = symbol_name(&files[i].symbols, refs[count].symbol);
+            count++;
+        }
+    }
+    qsort(refs, count, sizeof(SymbolRef), compare_symbol_refs);
+
+    int first = 0;
+    for (int i = 1; i < count; i++) {
+        if (refs[i].symbol->kind == refs[first].symbol->kind && strcmp(refs[i].name, refs[first].name) == 0) {
+            report_duplicate(sketch, &refs[first], &refs[i]);
+            sketch->duplicate_count++;
+        } else {
+            first = i;
+        }
+    }
+    free(refs);
+
+    sketch->stats.symbols_indexed = count;
+    sketch->stats.duplicate_symbols = sketch->duplicate_count;
+    sketch->stats.symbol_check_ms += clock_ms() - started;
+}
+
+// Index, save and check what was just folded, save_map also writes the line_map sidecar if set.
+// Returns 0 if there was no memory for the lookup index.
+static int finish_fold(Sketch *sketch, double started, int save_map) {
+    sketch->map.java_line_offset = sketch->config.java_line_offset;
+    if (!build_line_index(&sketch->map)) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 0;
+    }
+    if (save_map && sketch->config.line_map[0]) save_line_map(&sketch->map, sketch->config.line_map);
+    check_symbols(sketch);
+    sketch->stats.fold_ms += clock_ms() - started;
+    sketch->stats.folds++;
+    return 1;
+}
+
+// Fold cache
+//
+// With fold_cache set, folds are kept in that folder for every checkout and branch of a
+// sketch to share. A fold is keyed by a hash over the relative paths and content hashes of
+// its files in fold order, and kept as <key>.pde (output.pde) and <key>.manifest (its line
+// ranges and symbols, as in output.manifest). When the files of a sketch hash to a kept
+// key, output.pde is put in place by reflink, hard link or copy and the line map comes from
+// the manifest, no source is read. The content hashes come from <sketch>-<path hash>.hashes,
+// the size, mtime and hash of every file of the last fold in that sketch folder, so only
+// files touched since are read to hash them. Once the folds take more than fold_cache_mb,
+// the ones used longest ago are dropped; a hit touches its <key>.pde.
+//
+// output.pde may be a hard link into the cache, so it is never changed in place while it
+// has other names (unshare_file).
+
+#define DEFAULT_FOLD_CACHE_MB 512
+#define FOLD_CACHE_VERSION "foldcessing-fold 1"  // Starts every key, change with what a fold writes
+#define HASHES_MAGIC "foldcessing-hashes 1"
+
+#ifndef FILE_SHARE_DELETE
+#define FILE_SHARE_DELETE 0x00000004
+#endif
+#ifndef FILE_WRITE_ATTRIBUTES
+#define FILE_WRITE_ATTRIBUTES 0x0100
+#endif
+
+typedef struct {
+    char *relative;
+    unsigned long long size;
+    unsigned long long mtime;
+    unsigned long long hash;
+} HashEntry;
+
+// Folds kept in the cache, found while trimming it
+typedef struct {
+    char name[32];               // <key>.pde
+    unsigned long long mtime;
+    unsigned long long size;
+} CachedFold;
+
+// Path of a file in the cache
+static void fold_cache_path(const Sketch *sketch, char *path, size_t size, unsigned long long key, const char *extension) {
+    snprintf(path, size, "%s" PATH_SEP "%016llx%s", sketch->config.fold_cache, key, extension);
+}
+
+// Path of the hash index of the sketch, named like its folder under output_root
+static void hash_index_path(const Sketch *sketch, char *path, size_t size) {
+    const char *name = sketch->root;
+    for (const char *p = sketch->root; *p; p++) {
+        if (*p == '\\' || *p == '/') name = p + 1;
+    }
+    snprintf(path, size, "%s" PATH_SEP "%s-%08x.hashes", sketch->config.fold_cache, name, path_hash(sketch->root));
+}
+
+// Key of the fold of files[], their hashes filled in
+static unsigned long long fold_cache_key(const Sketch *sketch) {
+    unsigned long long key = hash_bytes(FNV_OFFSET, FOLD_CACHE_VERSION, strlen(FOLD_CACHE_VERSION));
+    for (int i = 0; i < sketch->file_count; i++) {
+        key = hash_bytes(key, sketch->files[i].relative, strlen(sketch->files[i].relative) + 1);
+        key = hash_bytes(key, (const char*)&sketch->files[i].hash, sizeof(sketch->files[i].hash));
+    }
+    return key;
+}
+
+// A name next to path for writing it before it is moved in place, unique to this thread
+static void temp_path_of(const char *path, char *temp_path, size_t size) {
+    snprintf(temp_path, size, "%s.%lu-%lu.tmp", path, (unsigned long)GetCurrentProcessId(),
+             (unsigned long)GetCurrentThreadId());
+}
+
+static int compare_hash_entries(const void *a, const void *b) {
+    return strcmp(((const HashEntry*)a)->relative, ((const HashEntry*)b)->relative);
+}
+
+// Fill in files[].hash, from the hash index where size and mtime still match. Returns 1 if
+// the index has to be saved again.
+static int hash_files(Sketch *sketch) {
+    char path[MAX_PATH_LEN];
+    char line[MAX_PATH_LEN + 128];
+    hash_index_path(sketch, path, sizeof(path));
+
+    HashEntry *entries = NULL;
+    int count = 0, expected = -1;
+    FILE *f = fopen(path, "rb");
+    if (f) {
+        if (fgets(line, sizeof(line), f) && strncmp(line, HASHES_MAGIC, strlen(HASHES_MAGIC)) == 0 &&
+            sscanf(line + strlen(HASHES_MAGIC), "%d", &expected) == 1 && expected >= 0) {
+            entries = malloc(sizeof(HashEntry) * (expected ? expected : 1));
+        }
+        while (entries && count < expected && fgets(line, sizeof(line), f)) {
+            HashEntry *e = &entries[count];
+            int consumed = 0;
+            if (sscanf(line, "%llu %llu %llx %n", &e->size, &e->mtime, &e->hash, &consumed) != 3 || consumed == 0) break;
+            char *relative = line + consumed;
+            relative[strcspn(relative, "\r\n")] = '\0';
+            e->relative = _strdup(relative);
+            if (!e->relative) break;
+            count++;
+        }
+        fclose(f);
+        if (count) qsort(entries, count, sizeof(HashEntry), compare_hash_entries);
+    }
+
+    int hashed = 0;
+    for (int i = 0; i < sketch->file_count; i++) {
+        FileEntry *file = &sketch->files[i];
+        HashEntry probe;
+        probe.relative = (char*)file->relative;
+        HashEntry *known = count ? bsearch(&probe, entries, count, sizeof(HashEntry), compare_hash_entries) : NULL;
+        if (known && known->size == file->size && known->mtime == file->mtime) {
+            file->hash = known->hash;
+        } else {
+            file->hash = hash_file(file->path);
+            hashed++;
+        }
+    }
+    sketch->stats.files_hashed = hashed;
+
+    for (int i = 0; i < count; i++) free(entries[i].relative);
+    free(entries);
+    return hashed > 0 || count != sketch->file_count || count != expected;
+}
+
+// Remember size, mtime and hash of files[] for hash_files
+static void save_hash_index(const Sketch *sketch) {
+    char path[MAX_PATH_LEN];
+    char temp_path[MAX_PATH_LEN];
+    hash_index_path(sketch, path, sizeof(path));
+    temp_path_of(path, temp_path, sizeof(temp_path));
+
+    FILE *f = fopen(temp_path, "wb");
+    if (!f) return;
+    fprintf(f, "%s %d\n", HASHES_MAGIC, sketch->file_count);
+    for (int i = 0; i < sketch->file_count; i++) {
+        const FileEntry *file = &sketch->files[i];
+        fprintf(f, "%llu %llu %llx %s\n", file->size, file->mtime, file->hash, file->relative);
+    }
+    if (fclose(f) != 0 || !MoveFileEx(temp_path, path, MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFile(temp_path);
+    }
+}
+
+// Make to a new file sharing all extents of from; 0 where the file system cannot
+static int clone_file(const char *from, const char *to) {
+#if defined(__linux__) && !defined(_WIN32)
+    int in = open(from, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return 0;
+    int out = open(to, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    int cloned = out >= 0 && ioctl(out, FICLONE, in) == 0;
+    close(in);
+    if (out >= 0) {
+        close(out);
+        if (!cloned) unlink(to);
+    }
+    return cloned;
+#else
+    // CopyFile shares blocks by itself where Windows can (block cloning on ReFS)
+    return 0;
+#endif
+}
+
+// Names the file has, 1 if that cannot be told
+static DWORD file_link_count(const char *path) {
+#ifdef _WIN32
+    BY_HANDLE_FILE_INFORMATION info;
+    DWORD links = 1;
+    HANDLE f = CreateFile(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (f != INVALID_HANDLE_VALUE) {
+        if (GetFileInformationByHandle(f, &info)) links = info.nNumberOfLinks;
+        CloseHandle(f);
+    }
+    return links;
+#else
+    struct stat st;
+    return (stat(path, &st) == 0) ? (DWORD)st.st_nlink : 1;
+#endif
+}
+
+// Put a copy of from at to by reflink, else hard link, else a plain copy, through a
+// temporary name so to is never seen half written. Returns 0 if it could not.
+static int place_file(const char *from, const char *to) {
+    char temp_path[MAX_PATH_LEN];
+    temp_path_of(to, temp_path, sizeof(temp_path));
+    DeleteFile(temp_path);
+
+    if (!clone_file(from, temp_path) && !CreateHardLink(temp_path, from, NULL) &&
+        !CopyFile(from, temp_path, FALSE)) {
+        return 0;
+    }
+    if (!MoveFileEx(temp_path, to, MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFile(temp_path);
+        return 0;
+    }
+    return 1;
+}
+
+// Give a file contents of its own before changing it in place, returns 0 if it could not
+static int unshare_file(const char *path) {
+    if (file_link_count(path) <= 1) return 1;
+
+    char temp_path[MAX_PATH_LEN];
+    temp_path_of(path, temp_path, sizeof(temp_path));
+    DeleteFile(temp_path);
+    if (!clone_file(path, temp_path) && !CopyFile(path, temp_path, FALSE)) return 0;
+    if (!MoveFileEx(temp_path, path, MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFile(temp_path);
+        return 0;
+    }
+    return 1;
+}
+
+// Mark a cached fold as just used
+static void touch_file(const char *path) {
+#ifdef _WIN32
+    HANDLE f = CreateFile(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                          NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (f == INVALID_HANDLE_VALUE) return;
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    SetFileTime(f, NULL, NULL, &now);
+    CloseHandle(f);
+#else
+    utimensat(AT_FDCWD, path, NULL, 0);
+#endif
+}
+
+// Take the fold of files[] from the cache: output.pde into output_file, line ranges,
+// offsets and symbols from its manifest. Returns 1 on a hit, with the size of output.pde.
+static int fold_cache_fetch(Sketch *sketch, const char *output_file, long long *output_size) {
+    unsigned long long key = fold_cache_key(sketch);
+    char entry_path[MAX_PATH_LEN];
+    fold_cache_path(sketch, entry_path, sizeof(entry_path), key, ".manifest");
+
+    Manifest cached;
+    if (!load_manifest(entry_path, &cached)) return 0;
+
+    // Keys could still collide, and a fold kept without symbols cannot be checked for duplicates
+    FileEntry *files = sketch->files;
+    int indexing = sketch->config.duplicate_symbols != DUPLICATES_OFF;
+    int usable = cached.count == sketch->file_count;
+    for (int i = 0; usable && i < cached.count; i++) {
+        usable = strcmp(cached.entries[i].relative, files[i].relative) == 0 &&
+                 cached.entries[i].hash == files[i].hash &&
+                 (cached.entries[i].symbols.count >= 0 || !indexing);
+    }
+
+    fold_cache_path(sketch, entry_path, sizeof(entry_path), key, ".pde");
+    if (usable && file_size_of(entry_path) == cached.output_size && place_file(entry_path, output_file)) {
+        for (int i = 0; i < cached.count; i++) {
+            sketch->map.ranges[i].start_line = cached.entries[i].start_line;
+            sketch->map.ranges[i].end_line = cached.entries[i].end_line;
+            sketch->map.ranges[i].relative = files[i].relative;
+            files[i].offset = cached.entries[i].offset;
+            take_symbols(&files[i], &cached.entries[i]);
+        }
+        sketch->map.total_lines = cached.total_lines;
+        *output_size = cached.output_size;
+        touch_file(entry_path);
+    } else {
+        usable = 0;
+    }
+    free_manifest(&cached);
+    return usable;
+}
+
+static int compare_cached_folds(const void *a, const void *b) {
+    const CachedFold *x = (const CachedFold*)a;
+    const CachedFold *y = (const CachedFold*)b;
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+// Drop the folds used longest ago until the cache fits in fold_cache_mb, except keep
+static void trim_fold_cache(Sketch *sketch, const char *keep) {
+    DirList list;
+    if (!list_open(&list, sketch->config.fold_cache)) return;
+
+    CachedFold *folds = NULL;
+    int count = 0, capacity = 0;
+    unsigned long long total = 0;
+    ListEntry *entry;
+    while ((entry = list_next(&list))) {
+        // Only <16 hex digits>.pde and .manifest count, hash indexes are left alone
+        if (entry->is_dir || strspn(entry->name, "0123456789abcdef") != 16) continue;
+        int is_fold = strcmp(entry->name + 16, ".pde") == 0;
+        if (!is_fold && strcmp(entry->name + 16, ".manifest") != 0) continue;
+
+        list_stat(&list, entry);
+        total += entry->size;
+        if (!is_fold) continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            CachedFold *grown = realloc(folds, sizeof(CachedFold) * capacity);
+            if (!grown) break;
+            folds = grown;
+        }
+        snprintf(folds[count].name, sizeof(folds[count].name), "%s", entry->name);
+        folds[count].mtime = entry->mtime;
+        folds[count].size = entry->size;
+        count++;
+    }
+    list_close(&list);
+
+    unsigned long long limit = (unsigned long long)(sketch->config.fold_cache_mb > 0
+                                                    ? sketch->config.fold_cache_mb : DEFAULT_FOLD_CACHE_MB) << 20;
+    if (total > limit) {
+        qsort(folds, count, sizeof(CachedFold), compare_cached_folds);
+        for (int i = 0; i < count && total > limit; i++) {
+            if (strcmp(folds[i].name, keep) == 0) continue;
+            char path[MAX_PATH_LEN];
+            // The manifest goes first, a fold is only ever found through it
+            snprintf(path, sizeof(path), "%s" PATH_SEP "%.16s.manifest", sketch->config.fold_cache, folds[i].name);
+            long long manifest_size = file_size_of(path);
+            DeleteFile(path);
+            snprintf(path, sizeof(path), "%s" PATH_SEP "%s", sketch->config.fold_cache, folds[i].name);
+            DeleteFile(path);
+            total -= folds[i].size + (manifest_size > 0 ? (unsigned long long)manifest_size : 0);
+            sketch->stats.cache_evicted++;
+        }
+    }
+    free(folds);
+}
+
+// Keep the fold just written to output_file and the hashes it was made of
+static void fold_cache_store(Sketch *sketch, const char *output_file, long long output_size) {
+    unsigned long long key = fold_cache_key(sketch);
+    char pde_path[MAX_PATH_LEN];
+    char manifest_path[MAX_PATH_LEN];
+    char temp_path[MAX_PATH_LEN];
+    fold_cache_path(sketch, pde_path, sizeof(pde_path), key, ".pde");
+    fold_cache_path(sketch, manifest_path, sizeof(manifest_path), key, ".manifest");
+
+    save_hash_index(sketch);
+    if (!place_file(output_file, pde_path)) return;
+    temp_path_of(manifest_path, temp_path, sizeof(temp_path));
+    save_manifest(sketch, temp_path, output_size);
+    if (!MoveFileEx(temp_path, manifest_path, MOVEFILE_REPLACE_EXISTING)) DeleteFile(temp_path);
+
+    trim_fold_cache(sketch, pde_path + strlen(sketch->config.fold_cache) + 1);
+}
+
+// Concatenate all collected files into output_dir/output.pde and build the line map.
+// Returns 0 with rewritten set to how it went, or 1 if output.pde could not be written or
+// memory ran out.
+static int fold_sketch(Sketch *sketch, const char *output_dir) {
+    double started = clock_ms();
+    char output_file[MAX_PATH_LEN];
+    char manifest_file[MAX_PATH_LEN];
+    snprintf(output_file, sizeof(output_file), "%s" PATH_SEP "output.pde", output_dir);
+    snprintf(manifest_file, sizeof(manifest_file), "%s" PATH_SEP "%s", output_dir, MANIFEST_NAME);
+    int caching = sketch->config.fold_cache[0] != '\0';
+    sketch->cached = 0;
+
+    if (caching) {
+        CreateDirectory(sketch->config.fold_cache, NULL);
+        int stale = hash_files(sketch);
+        long long output_size;
+        if (fold_cache_fetch(sketch, output_file, &output_size)) {
+            if (sketch->config.incremental) {
+                save_manifest(sketch, manifest_file, output_size);
+            } else {
+                DeleteFile(manifest_file);
+            }
+            if (stale) save_hash_index(sketch);
+            sketch->stats.cache_hits++;
+            sketch->rewritten = -1;
+            sketch->cached = 1;
+            return finish_fold(sketch, started, 1) ? 0 : 1;
+        }
+        sketch->stats.cache_misses++;
+    }
+
+    if (sketch->config.incremental) {
+        Manifest old;
+        if (load_manifest(manifest_file, &old)) {
+            int rewritten = -1;
+            int touched = 0;
+            if (file_size_of(output_file) == old.output_size && unshare_file(output_file)) {
+                rewritten = fold_incremental(sketch, output_file, manifest_file, &old, &touched);
+            }
+            free_manifest(&old);
+
+            if (rewritten >= 0) {
+                long long output_size = file_size_of(output_file);
+                if (rewritten > 0 || touched) save_manifest(sketch, manifest_file, output_size);
+                if (caching) fold_cache_store(sketch, output_file, output_size);
+                sketch->rewritten = rewritten;
+                return finish_fold(sketch, started, 1) ? 0 : 1;
+            }
+        }
+    }
+
+    DeleteFile(manifest_file);
+    // Not through a hard link into the cache
+    if (file_link_count(output_file) > 1) DeleteFile(output_file);
+
+    HANDLE out = CreateFile(output_file, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                            CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    FoldWriter writer = {0};
+    if (out == INVALID_HANDLE_VALUE || !writer_open(&writer, out, 0)) {
+        fprintf(stderr, "Error: Cannot create output file: %s\n", output_file);
+        if (out != INVALID_HANDLE_VALUE) CloseHandle(out);
+        writer_close(&writer);
+        return 1;
+    }
+
+    // Concatenate all files and build line mapping
+    int current_line = write_fold_range(sketch, &writer, 0, sketch->file_count, 1);
+    long long output_size = writer_position(&writer);
+    writer_close(&writer);
+    CloseHandle(out);
+    sketch->stats.bytes_written += writer.written;
+
+    if (writer.failed) {
+        fprintf(stderr, "Error: Cannot write output file: %s\n", output_file);
+        DeleteFile(output_file);
+        return 1;
+    }
+
+    // Store total line count for handling Java's 16-bit line number limitation
+    sketch->map.total_lines = current_line - 1;
+
+    if (sketch->config.incremental) {
+        save_manifest(sketch, manifest_file, output_size);
+    }
+    if (caching) fold_cache_store(sketch, output_file, output_size);
+    sketch->rewritten = -1;
+    return finish_fold(sketch, started, 1) ? 0 : 1;
+}
+
+// Find every place an output.pde line number may stand for, up to MAX_LINE_MATCHES
+#define LINE_WRAP 65536
+#define MAX_LINE_MATCHES 10
+
+typedef struct {
+    int file_index;
+    int original_line;
+} LineMatch;
+
+static int find_line_matches(const LineMap *map, int line_num, LineMatch *matches) {
+    // Java class file format stores line numbers as 16-bit unsigned (0-65535)
+    // If output.pde exceeds 65536 lines, reported line is actual_line % 65536
+    // Try all possible wrapped values: line_num, line_num+65536, line_num+131072, etc.
+    int match_count = 0;
+
+    // Try wrapped line numbers until we exceed total_lines
+    for (int k = 0; k * LINE_WRAP < map->total_lines && k < MAX_LINE_MATCHES; k++) {
+        int candidate_line = line_num + (k * LINE_WRAP);
+        if (candidate_line > map->total_lines) break;
+
+        // Check if this candidate falls within any file's range
+        int i = find_source_file(map, candidate_line);
+        if (i >= 0) {
+            matches[match_count].file_index = i;
+            matches[match_count].original_line = candidate_line - map->ranges[i].start_line + 1;
+            match_count++;
+        }
+    }
+    return match_count;
+}
+
+// Translate line number from output.pde to original source file, returns the number of matches
+static int translate_line(LineMap *map, int line_num, char *output, size_t output_size) {
+    LineMatch candidates[MAX_LINE_MATCHES];
+    int candidate_count = find_line_matches(map, line_num, candidates);
+
+    // Report based on number of matches
+    if (candidate_count == 0) {
+        // No match found - use literal line number
+        snprintf(output, output_size, "output.pde:%d", line_num);
+        map->lookups_missed++;
+    } else if (candidate_count == 1) {
+        // Single match - report confidently
+        map->lookups_translated++;
+        int i = candidates[0].file_index;
+        snprintf(output, output_size, "%s:%d",
+                 map->ranges[i].relative, candidates[0].original_line);
+    } else {
+        // Multiple matches - report all possibilities
+        map->lookups_ambiguous++;
+        char temp[MAX_LINE] = {0};
+        for (int j = 0; j < candidate_count; j++) {
+            int i = candidates[j].file_index;
+            char part[512];
+            snprintf(part, sizeof(part), "%s%s:%d",
+                     (j > 0) ? " or " : "",
+                     map->ranges[i].relative,
+                     candidates[j].original_line);
+            strncat(temp, part, sizeof(temp) - strlen(temp) - 1);
+        }
+        strncat(temp, " (line wrapping)", sizeof(temp) - strlen(temp) - 1);
+        snprintf(output, output_size, "%s", temp);
+    }
+    return candidate_count;
+}
+
+// Streaming translation of child output
+//
+// Output is copied into one buffer as it arrives and scanned for "output.pde:LINE" (with
+// any ":COL:LINE:COL" after it) and "output.java:LINE" in the same pass. Once a reference
+// ends, the bytes copied for it are replaced by the translation. Complete lines go to
+// the write callback once per chunk; a partial line waits for the rest so lines from stdout and
+// stderr never interleave. Empty lines are dropped and "\r" ends a line, as it always has,
+// unless raw is set for translating saved logs.
+
+#define TRANSLATE_BUFFER_SIZE 65536
+
+#define REF_TEXT 0       // Not inside a reference
+#define REF_PREFIX 1     // Matching "output.pde:" or "output.java:"
+#define REF_LINE 2       // Line number digits
+#define REF_COLON 3      // ':' after a number, not yet known to start another one
+#define REF_NUMBER 4     // Digits of a column (or of a redundant position after it)
+
+typedef struct FoldcessingTranslator {
+    LineMap *map;                // NULL translates nothing
+    FoldcessingWrite write;
+    void *user;
+    int failed;                  // write returned nonzero, or memory ran out
+    char *buffer;
+    size_t used;
+    size_t capacity;
+    size_t mark;                 // Where the reference being matched starts in buffer
+    size_t complete;             // End of the last complete line in buffer
+    int state;
+    int matched;                 // Prefix characters matched
+    int java;                    // Matching output.java rather than output.pde
+    int line;
+    int column;                  // -1 until a column was read
+    int numbers;                 // Numbers read after the line
+    int line_open;               // Something was written since the last newline
+    int raw;                     // Pass line endings through untouched
+    const char *prefix;          // Put in front of every line, NULL for none
+} Translator;
+
+#define REF_PDE "output.pde:"
+#define REF_JAVA "output.java:"
+
+// Make room for len more bytes. Out of memory, returns 0 and fails the translator; the room
+// made before is still there.
+static int translator_reserve(Translator *t, size_t len) {
+    if (t->used + len <= t->capacity) return 1;
+    size_t capacity = t->capacity;
+    while (t->used + len > capacity) {
+        capacity = capacity ? capacity * 2 : TRANSLATE_BUFFER_SIZE;
+    }
+    char *buffer = realloc(t->buffer, capacity);
+    if (!buffer) {
+        t->failed = 1;
+        return 0;
+    }
+    t->buffer = buffer;
+    t->capacity = capacity;
+    return 1;
+}
+
+static void translator_put(Translator *t, const char *data, size_t len) {
+    if (!translator_reserve(t, len)) return;
+    memcpy(t->buffer + t->used, data, len);
+    t->used += len;
+}
+
+// Something is about to be written on a new line: start it with the prefix. remaining is
+// what is left of the chunk being fed, which must still fit after it.
+static void translator_open_line(Translator *t, size_t remaining) {
+    if (t->prefix && !t->raw) {
+        size_t len = strlen(t->prefix);
+        if (translator_reserve(t, len + remaining)) translator_put(t, t->prefix, len);
+    }
+    t->line_open = 1;
+}
+
+// A reference ended: replace it with its translation if there is one, keeping room for
+// the remaining bytes of the chunk
+static void translator_resolve(Translator *t, size_t remaining) {
+    int line = t->line;
+    int colon = (t->state == REF_COLON);   // That ':' belongs to the text after the reference
+    t->state = REF_TEXT;
+
+    if (!t->map) return;
+    if (t->java) {
+        if (t->map->java_line_offset < 0) return;
+        line -= t->map->java_line_offset;
+    }
+    if (line <= 0) return;
+
+    char translated[MAX_PATH_LEN];
+    if (translate_line(t->map, line, translated, sizeof(translated)) == 0) return;
+    char column[16] = "";
+    if (t->column >= 0) snprintf(column, sizeof(column), ":%d", t->column);
+
+    // Without room for the translation, the reference stays as it was
+    size_t end = t->used;
+    t->used = t->mark;
+    if (!translator_reserve(t, strlen(translated) + strlen(column) + colon + remaining)) {
+        t->used = end;
+        return;
+    }
+    translator_put(t, translated, strlen(translated));
+    translator_put(t, column, strlen(column));
+    if (colon) translator_put(t, ":", 1);
+}
+
+// Write out complete lines (everything, with all set), keeping back an unfinished reference
+static void translator_flush(Translator *t, int all) {
+    size_t end = (t->state == REF_TEXT) ? t->used : t->mark;
+    if (!all && t->used < TRANSLATE_BUFFER_SIZE && t->complete < end) {
+        end = t->complete;
+    }
+    if (end == 0) return;
+
+    if (!t->failed && t->write(t->user, t->buffer, end) != 0) t->failed = 1;
+    memmove(t->buffer, t->buffer + end, t->used - end);
+    t->used -= end;
+    t->mark -= (t->state == REF_TEXT) ? 0 : end;
+    t->complete = (t->complete > end) ? t->complete - end : 0;
+}
+
+// Translate a chunk of child output
+static void translator_feed(Translator *t, const char *chunk, size_t len) {
+    // Every byte adds at most one, only a translation can add more
+    if (!translator_reserve(t, len)) return;
+
+    for (size_t i = 0; i < len; i++) {
+        char ch = chunk[i];
+        int digit = (ch >= '0' && ch <= '9');
+
+        switch (t->state) {
+        case REF_PREFIX: {
+            const char *pattern = t->java ? REF_JAVA : REF_PDE;
+            if (t->matched == 7 && (ch == 'p' || ch == 'j')) {
+                t->java = (ch == 'j');
+            } else if (ch != pattern[t->matched]) {
+                t->state = REF_TEXT;
+                break;
+            }
+            t->matched++;
+            t->buffer[t->used++] = ch;
+            if (!(t->java ? REF_JAVA : REF_PDE)[t->matched]) {
+                t->state = REF_LINE;
+                t->line = 0;
+                t->numbers = 0;
+                t->column = -1;
+            }
+            continue;
+        }
+        case REF_LINE:
+            if (digit) {
+                if (t->line < 100000000) t->line = t->line * 10 + (ch - '0');
+                t->numbers = 1;
+                t->buffer[t->used++] = ch;
+                continue;
+            }
+            if (!t->numbers) {
+                t->state = REF_TEXT;
+            } else if (ch == ':') {
+                t->state = REF_COLON;
+                t->buffer[t->used++] = ch;
+                continue;
+            } else {
+                translator_resolve(t, len - i);
+            }
+            break;
+        case REF_COLON:
+            if (digit) {
+                if (t->numbers++ == 1) t->column = 0;
+                t->state = REF_NUMBER;
+            } else {
+                translator_resolve(t, len - i);
+                break;
+            }
+            // Fall through to read the digit
+        case REF_NUMBER:
+            if (digit) {
+                if (t->numbers == 2 && t->column < 100000000) t->column = t->column * 10 + (ch - '0');
+                t->buffer[t->used++] = ch;
+                continue;
+            }
+            if (ch == ':') {
+                t->state = REF_COLON;
+                t->buffer[t->used++] = ch;
+                continue;
+            }
+            translator_resolve(t, len - i);
+            break;
+        }
+
+        // Plain text, which may start the next reference
+        if (ch == '\n' || ch == '\r') {
+            if (t->raw) {
+                t->buffer[t->used++] = ch;
+                if (ch == '\n') t->complete = t->used;
+            } else if (t->line_open) {
+                t->buffer[t->used++] = '\n';
+                t->complete = t->used;
+                t->line_open = 0;
+            }
+            continue;
+        }
+        if (ch == 'o') {
+            if (!t->line_open) translator_open_line(t, len - i);
+            t->state = REF_PREFIX;
+            t->matched = 1;
+            t->java = 0;
+            t->mark = t->used;
+            t->buffer[t->used++] = ch;
+            continue;
+        }
+
+        // Copy the run of text up to the next character of interest at once
+        size_t run = i + 1;
+        while (run < len && chunk[run] != 'o' && chunk[run] != '\n' && chunk[run] != '\r') run++;
+        if (!t->line_open) translator_open_line(t, len - i);
+        memcpy(t->buffer + t->used, chunk + i, run - i);
+        t->used += run - i;
+        i = run - 1;
+    }
+
+    translator_flush(t, 0);
+}
+
+// End of output: finish any reference and a trailing line that never got its newline
+static void translator_finish(Translator *t) {
+    if (t->state != REF_TEXT) translator_resolve(t, 0);
+    if (t->line_open && !t->raw) {
+        translator_put(t, "\n", 1);
+        t->line_open = 0;
+    }
+    translator_flush(t, 1);
+}
+
+// Library interface
+//
+// What foldcessing.h declares, on top of the functions the command line tool uses. Maps are
+// handed out as copies owning their paths, so they outlive later folds and the sketch.
+// Translators pass output through as it is (raw), like foldcessing --translate.
+
+void foldcessing_close(FoldcessingSketch *sketch) {
+    if (!sketch) return;
+    reset_files(sketch);
+    free(sketch->files);
+    free_line_map(&sketch->map);
+    free_ignore_matcher(&sketch->ignore);
+    if (sketch->ignore.lock_ready) DeleteCriticalSection(&sketch->ignore.lock);
+    free(sketch->config.ignore_patterns);
+    arena_reset(&sketch->config_arena);
+    free(sketch->duplicate_report);
+    free(sketch);
+}
+
+FoldcessingSketch *foldcessing_open(const char *root, const char *profile) {
+    DWORD attributes = GetFileAttributes(root);
+    if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY)) return NULL;
+
+    Sketch *sketch = calloc(1, sizeof(Sketch));
+    if (!sketch) return NULL;
+    if (!GetFullPathName(root, sizeof(sketch->root), sketch->root, NULL)) {
+        snprintf(sketch->root, sizeof(sketch->root), "%s", root);
+    }
+    sketch->config.watch_debounce = DEFAULT_WATCH_DEBOUNCE;
+    sketch->config.java_line_offset = -1;
+    sketch->config.output_buffer_mb = DEFAULT_OUTPUT_BUFFER_MB;
+    sketch->map.java_line_offset = -1;
+    sketch->rewritten = -1;
+    if (!parse_config(sketch, profile)) {
+        foldcessing_close(sketch);
+        return NULL;
+    }
+    return sketch;
+}
+
+// A copy of a map with paths of its own
+static LineMap *copy_line_map(const LineMap *from) {
+    LineMap *map = calloc(1, sizeof(LineMap));
+    if (!map) return NULL;
+    map->ranges = malloc(sizeof(LineMapping) * (from->count ? from->count : 1));
+    if (!map->ranges) {
+        free(map);
+        return NULL;
+    }
+    map->count = from->count;
+    map->total_lines = from->total_lines;
+    map->java_line_offset = from->java_line_offset;
+    int ok = 1;
+    for (int i = 0; i < from->count && ok; i++) {
+        map->ranges[i] = from->ranges[i];
+        map->ranges[i].relative = arena_strdup(&map->names, from->ranges[i].relative);
+        ok = map->ranges[i].relative != NULL;
+    }
+    if (!ok || !build_line_index(map)) {
+        free_line_map(map);
+        free(map);
+        return NULL;
+    }
+    return map;
+}
+
+FoldcessingMap *foldcessing_fold(FoldcessingSketch *sketch, FoldcessingWrite write, void *user) {
+    if (!scan_sketch(sketch)) return NULL;
+
+    double started = clock_ms();
+    FoldWriter writer;
+    int opened = writer_open_sink(&writer, write, user);
+    int current_line = opened ? write_fold_range(sketch, &writer, 0, sketch->file_count, 1) : 1;
+    writer_close(&writer);
+    sketch->stats.bytes_written += writer.written;
+    if (!opened || writer.failed) return NULL;
+
+    sketch->map.total_lines = current_line - 1;
+    sketch->rewritten = -1;
+    if (!finish_fold(sketch, started, 0)) return NULL;
+    return copy_line_map(&sketch->map);
+}
+
+int foldcessing_fold_folder(FoldcessingSketch *sketch, const char *output_dir) {
+    if (!scan_sketch(sketch)) return -1;
+    return (fold_sketch(sketch, output_dir) == 0) ? 0 : -1;
+}
+
+int foldcessing_duplicates(const FoldcessingSketch *sketch, const char **report) {
+    if (report) *report = sketch->duplicate_report ? sketch->duplicate_report : "";
+    return sketch->duplicate_count;
+}
+
+FoldcessingMap *foldcessing_map(const FoldcessingSketch *sketch) {
+    return (sketch->stats.folds > 0) ? copy_line_map(&sketch->map) : NULL;
+}
+
+FoldcessingMap *foldcessing_map_load(const char *path) {
+    LineMap *map = calloc(1, sizeof(LineMap));
+    if (!map) return NULL;
+    map->java_line_offset = -1;
+    if (!load_line_map(map, path)) {
+        free(map);
+        return NULL;
+    }
+    return map;
+}
+
+void foldcessing_map_free(FoldcessingMap *map) {
+    if (!map) return;
+    free_line_map(map);
+    free(map);
+}
+
+int foldcessing_map_lines(const FoldcessingMap *map) {
+    return map->total_lines;
+}
+
+int foldcessing_map_lookup(const FoldcessingMap *map, int line, const char **file, int *file_line) {
+    LineMatch matches[MAX_LINE_MATCHES];
+    int count = find_line_matches(map, line, matches);
+    if (count > 0) {
+        if (file) *file = map->ranges[matches[0].file_index].relative;
+        if (file_line) *file_line = matches[0].original_line;
+    }
+    return count;
+}
+
+FoldcessingTranslator *foldcessing_translator_new(FoldcessingMap *map, FoldcessingWrite write, void *user) {
+    Translator *translator = calloc(1, sizeof(Translator));
+    if (!translator) return NULL;
+    translator->map = map;
+    translator->write = write;
+    translator->user = user;
+    translator->raw = 1;
+    return translator;
+}
+
+int foldcessing_translator_feed(FoldcessingTranslator *translator, const char *data, size_t len) {
+    translator_feed(translator, data, len);
+    return translator->failed;
+}
+
+int foldcessing_translator_finish(FoldcessingTranslator *translator) {
+    translator_finish(translator);
+    int failed = translator->failed;
+    free(translator->buffer);
+    free(translator);
+    return failed;
+}
+
+int foldcessing_translate(FoldcessingMap *map, const char *data, size_t len,
+                          FoldcessingWrite write, void *user) {
+    Translator translator = {0};
+    translator.map = map;
+    translator.write = write;
+    translator.user = user;
+    translator.raw = 1;
+    translator_feed(&translator, data, len);
+    translator_finish(&translator);
+    free(translator.buffer);
+    return translator.failed;
+}
+
+#ifndef FOLDCESSING_LIBRARY
+
+// Command line tool
+//
+// Everything below runs processing-java around the fold engine: the console, the child
+// process, the watch, the daemon and batches. A process folds one sketch, kept in sketch.
+
+// Timings and counters for --stats next to the sketch's own, kept on every run since they
+// cost next to nothing
+typedef struct {
+    double parse_config_ms;
+    double data_link_ms;
+    double spawn_ms;
+    double first_output_ms;        // Launch to first child output, -1 = no output yet
+    double child_ms;
+    double child_started;          // clock_ms() when the running child was launched
+    double child_cpu_ms;           // User and kernel time of processing-java's process trees
+    long long child_peak_memory;   // Bytes, highest of any run
+    int child_processes;           // Processes in those trees
+    int children;
+    long long output_dropped_lines; // Lost to a full output ring (drop_oldest, summarize)
+    long long output_dropped_bytes;
+    long long output_peak_bytes;   // Most output queued for the console at once
+    double output_blocked_ms;      // Pump waiting for room in the ring (block)
+} Stats;
+
+static Stats stats = {0};
+static Sketch *sketch = NULL;
+
+// Daemon protocol
+//
+// A client sends its processing-java arguments to the daemon as one frame and gets back
+// the child's translated output as it arrives, then the exit code. Every frame is a
+// FrameHeader followed by length bytes.
+
+#ifdef _WIN32
+#define DAEMON_PIPE_PREFIX "\\\\.\\pipe\\foldcessing-daemon-"
+#else
+#define DAEMON_SOCKET_PREFIX "foldcessing-daemon-"
+#endif
+#define FRAME_REQUEST 1          // Arguments, each NUL terminated
+#define FRAME_OUTPUT 2           // Output for the client's stdout
+#define FRAME_EXIT 3             // DWORD exit code, ends the answer
+#define MAX_FRAME_SIZE (16 * 1024 * 1024)
+
+typedef struct {
+    DWORD type;
+    DWORD length;
+} FrameHeader;
+
+static HANDLE daemon_client = NULL;     // Client being served, gets the output instead of stdout
+
+#ifdef _WIN32
+
+// Read or write all of len bytes on a pipe, which may have been opened for overlapped I/O
+static int pipe_transfer(HANDLE pipe, void *data, size_t len, int writing) {
+    OVERLAPPED overlapped;
+    HANDLE event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!event) return 0;
+
+    char *p = (char*)data;
+    while (len > 0) {
+        DWORD chunk = (len > 0x40000000) ? 0x40000000 : (DWORD)len;
+        DWORD done = 0;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.hEvent = event;
+
+        BOOL ok = writing ? WriteFile(pipe, p, chunk, &done, &overlapped)
+                          : ReadFile(pipe, p, chunk, &done, &overlapped);
+        if (!ok && GetLastError() == ERROR_IO_PENDING) {
+            ok = GetOverlappedResult(pipe, &overlapped, &done, TRUE);
+        }
+        if (!ok || done == 0) break;
+        p += done;
+        len -= done;
+    }
+    CloseHandle(event);
+    return len == 0;
+}
+
+#else
+
+// Read or write all of len bytes on the daemon's socket
+static int pipe_transfer(HANDLE pipe, void *data, size_t len, int writing) {
+    char *p = (char*)data;
+    while (len > 0) {
+        ssize_t done = writing ? write(handle_fd(pipe), p, len) : read(handle_fd(pipe), p, len);
+        if (done < 0 && errno == EINTR) continue;
+        if (done <= 0) break;
+        p += done;
+        len -= (size_t)done;
+    }
+    return len == 0;
+}
+
+#endif
+
+static int send_frame(HANDLE pipe, DWORD type, const void *data, size_t len) {
+    FrameHeader header = {type, (DWORD)len};
+    return pipe_transfer(pipe, &header, sizeof(header), 1) &&
+           (len == 0 || pipe_transfer(pipe, (void*)data, len, 1));
+}
+
+// Read the next frame, data is malloc'ed and NUL terminated
+static int receive_frame(HANDLE pipe, FrameHeader *header, char **data) {
+    *data = NULL;
+    if (!pipe_transfer(pipe, header, sizeof(*header), 0)) return 0;
+    if (header->length > MAX_FRAME_SIZE) return 0;
+
+    *data = malloc(header->length + 1);
+    if (!*data) return 0;
+    if (header->length && !pipe_transfer(pipe, *data, header->length, 0)) {
+        free(*data);
+        *data = NULL;
+        return 0;
+    }
+    (*data)[header->length] = '\0';
+    return 1;
+}
+
+// Text for whoever asked for this run: the daemon's client, or our own stdout
+static void write_output(const char *data, size_t len) {
+    if (daemon_client) {
+        send_frame(daemon_client, FRAME_OUTPUT, data, len);
+    } else {
+        fwrite(data, 1, len, stdout);
+        fflush(stdout);
+    }
+}
+
+// Output sink
+//
+// Reading the child's pipes and writing to a slow console (a build panel, conhost, a remote
+// terminal) are decoupled by a ring buffer drained on a thread of its own, so the child's
+// println never waits for the console while there is room. The pump is the only producer
+// and the writer thread the only consumer; records are a DWORD length and the bytes, and
+// head and tail only ever grow (wrapping), indexes are taken modulo the power of two size.
+// When the ring is full, output_overflow decides: block (wait, lose nothing), drop_oldest
+// (the producer moves the tail past whole records, the consumer notices its tail moved and
+// throws away what it copied) or summarize (drop new output and say how much was lost once
+// there is room again). Optionally the translated and raw streams are also teed to log
+// files by another thread; those rings always block, a log is only useful when complete.
+
+#define MAX_OUTPUT_BUFFER_MB 256
+
+#define RECORD_HEADER sizeof(DWORD)
+
+typedef struct {
+    char *data;
+    unsigned long capacity;      // Power of two, 0 = not in use
+    volatile LONG head;          // End of the last record written, only the producer moves it
+    volatile LONG tail;          // Start of the oldest record, moved by the consumer (and by drop_oldest)
+    HANDLE ready;                // Auto-reset, set after every push
+    HANDLE space;                // Auto-reset, set after every pop
+    unsigned long long dropped_lines;   // Since the last notice, producer only
+    unsigned long long dropped_bytes;
+} OutputRing;
+
+typedef struct {
+    OutputRing console;
+    OutputRing tee;              // Translated output for tee_log
+    OutputRing tee_raw;          // Child output as it arrived, for tee_raw_log
+    FILE *tee_file;
+    FILE *tee_raw_file;
+    HANDLE tee_ready;            // Shared by both tee rings
+    HANDLE console_thread;
+    HANDLE tee_thread;
+    volatile LONG busy;          // The console thread holds records it has not written yet
+    volatile LONG stopping;
+    int running;
+} OutputSink;
+
+static OutputSink sink = {0};
+
+// Read a shared position with a full barrier
+static LONG ring_load(volatile LONG *p) {
+    return InterlockedCompareExchange((LONG*)p, 0, 0);
+}
+
+static unsigned long ring_used(OutputRing *ring) {
+    return (unsigned long)ring_load(&ring->head) - (unsigned long)ring_load(&ring->tail);
+}
+
+static void ring_copy_in(OutputRing *ring, unsigned long pos, const void *src, size_t len) {
+    unsigned long at = pos & (ring->capacity - 1);
+    size_t first = (len < ring->capacity - at) ? len : ring->capacity - at;
+    memcpy(ring->data + at, src, first);
+    memcpy(ring->data, (const char*)src + first, len - first);
+}
+
+static void ring_copy_out(OutputRing *ring, unsigned long pos, void *dest, size_t len) {
+    unsigned long at = pos & (ring->capacity - 1);
+    size_t first = (len < ring->capacity - at) ? len : ring->capacity - at;
+    memcpy(dest, ring->data + at, first);
+    memcpy((char*)dest + first, ring->data, len - first);
+}
+
+static unsigned long long ring_count_lines(OutputRing *ring, unsigned long pos, size_t len) {
+    unsigned long at = pos & (ring->capacity - 1);
+    size_t first = (len < ring->capacity - at) ? len : ring->capacity - at;
+    return count_newlines(ring->data + at, first) + count_newlines(ring->data, len - first);
+}
+
+// size_mb rounded up to a power of two; ready may be shared with other rings
+static int ring_init(OutputRing *ring, int size_mb, HANDLE ready) {
+    unsigned long wanted = (unsigned long)size_mb << 20;
+    ring->capacity = 1 << 16;
+    while (ring->capacity < wanted) ring->capacity <<= 1;
+    ring->data = malloc(ring->capacity);
+    ring->ready = ready;
+    ring->space = CreateEvent(NULL, FALSE, FALSE, NULL);
+    ring->head = ring->tail = 0;
+    if (!ring->data || !ring->space) {
+        free(ring->data);
+        if (ring->space) CloseHandle(ring->space);
+        memset(ring, 0, sizeof(*ring));
+        return 0;
+    }
+    return 1;
+}
+
+static void ring_free(OutputRing *ring) {
+    free(ring->data);
+    if (ring->space) CloseHandle(ring->space);
+    memset(ring, 0, sizeof(*ring));
+}
+
+// Queue one record of at most a quarter of the ring, returns 0 if summarize dropped it
+static int ring_push(OutputRing *ring, const char *data, size_t len, int policy) {
+    unsigned long need = (unsigned long)(RECORD_HEADER + len);
+    unsigned long head = (unsigned long)ring->head;
+
+    while (ring->capacity - (head - (unsigned long)ring_load(&ring->tail)) < need) {
+        if (policy == OVERFLOW_SUMMARIZE) {
+            unsigned long long lines = count_newlines(data, len);
+            ring->dropped_lines += lines;
+            ring->dropped_bytes += len;
+            stats.output_dropped_lines += lines;
+            stats.output_dropped_bytes += len;
+            return 0;
+        }
+        if (policy == OVERFLOW_DROP_OLDEST) {
+            // The header is stable while tail stays put, only we write the ring
+            unsigned long tail = (unsigned long)ring_load(&ring->tail);
+            DWORD oldest;
+            ring_copy_out(ring, tail, &oldest, RECORD_HEADER);
+            unsigned long long lines = ring_count_lines(ring, tail + RECORD_HEADER, oldest);
+            if (InterlockedCompareExchange((LONG*)&ring->tail, (LONG)(tail + RECORD_HEADER + oldest), (LONG)tail) == (LONG)tail) {
+                ring->dropped_lines += lines;
+                ring->dropped_bytes += oldest;
+                stats.output_dropped_lines += lines;
+                stats.output_dropped_bytes += oldest;
+            }
+            continue;
+        }
+
+        double started = clock_ms();
+        WaitForSingleObject(ring->space, INFINITE);
+        stats.output_blocked_ms += clock_ms() - started;
+    }
+
+    DWORD length = (DWORD)len;
+    ring_copy_in(ring, head, &length, RECORD_HEADER);
+    ring_copy_in(ring, head + RECORD_HEADER, data, len);
+    InterlockedExchange((LONG*)&ring->head, (LONG)(head + need));
+    SetEvent(ring->ready);
+
+    unsigned long used = ring_used(ring);
+    if ((long long)used > stats.output_peak_bytes) stats.output_peak_bytes = used;
+    return 1;
+}
+
+// Take the oldest record into buffer (capacity bytes), returns its length or 0 when empty
+static size_t ring_pop(OutputRing *ring, char *buffer) {
+    while (1) {
+        unsigned long tail = (unsigned long)ring_load(&ring->tail);
+        if ((unsigned long)ring_load(&ring->head) == tail) return 0;
+
+        DWORD len;
+        ring_copy_out(ring, tail, &len, RECORD_HEADER);
+        // A record dropped under us may have been overwritten, its length is garbage then
+        if (len > ring->capacity - RECORD_HEADER) len = 0;
+        ring_copy_out(ring, tail + RECORD_HEADER, buffer, len);
+
+        // Only keep the copy if drop_oldest did not move the tail meanwhile
+        if (InterlockedCompareExchange((LONG*)&ring->tail, (LONG)(tail + RECORD_HEADER + len), (LONG)tail) == (LONG)tail) {
+            SetEvent(ring->space);
+            if (len > 0) return len;
+        }
+    }
+}
+
+// Queue output in records the ring can take, cut after a newline where possible
+static void sink_write(OutputRing *ring, const char *data, size_t len, int policy) {
+    size_t most = ring->capacity / 4 - RECORD_HEADER;
+    while (len > 0) {
+        size_t piece = len;
+        if (piece > most) {
+            piece = most;
+            while (piece > 1 && data[piece - 1] != '\n') piece--;
+            if (data[piece - 1] != '\n') piece = most;
+        }
+        ring_push(ring, data, piece, policy);
+        data += piece;
+        len -= piece;
+    }
+}
+
+// Tell the reader about output lost to a full ring; unless policy blocks, only if it fits now
+static void sink_report_drops(int policy) {
+    OutputRing *ring = &sink.console;
+    if (ring->dropped_bytes == 0) return;
+
+    char notice[256];
+    int len = snprintf(notice, sizeof(notice),
+                       "Foldcessing: %llu lines (%llu bytes) of output dropped, the console could not keep up\n",
+                       ring->dropped_lines, ring->dropped_bytes);
+    if (policy != OVERFLOW_BLOCK && ring->capacity - ring_used(ring) < RECORD_HEADER + len) return;
+
+    ring->dropped_lines = ring->dropped_bytes = 0;
+    ring_push(ring, notice, len, OVERFLOW_BLOCK);
+}
+
+static DWORD WINAPI console_writer(LPVOID param) {
+    char *buffer = malloc(sink.console.capacity);
+    while (1) {
+        LONG stopping = ring_load(&sink.stopping);
+        InterlockedExchange(&sink.busy, 1);
+        size_t len;
+        while (buffer && (len = ring_pop(&sink.console, buffer)) > 0) {
+            write_output(buffer, len);
+        }
+        InterlockedExchange(&sink.busy, 0);
+        SetEvent(sink.console.space);
+        if (stopping) break;
+        WaitForSingleObject(sink.console.ready, INFINITE);
+    }
+    free(buffer);
+    return 0;
+}
+
+static DWORD WINAPI tee_writer(LPVOID param) {
+    unsigned long capacity = sink.tee.capacity > sink.tee_raw.capacity ? sink.tee.capacity : sink.tee_raw.capacity;
+    char *buffer = malloc(capacity);
+    while (1) {
+        LONG stopping = ring_load(&sink.stopping);
+        size_t len;
+        while (buffer && sink.tee_file && (len = ring_pop(&sink.tee, buffer)) > 0) {
+            fwrite(buffer, 1, len, sink.tee_file);
+        }
+        while (buffer && sink.tee_raw_file && (len = ring_pop(&sink.tee_raw, buffer)) > 0) {
+            fwrite(buffer, 1, len, sink.tee_raw_file);
+        }
+        if (sink.tee_file) fflush(sink.tee_file);
+        if (sink.tee_raw_file) fflush(sink.tee_raw_file);
+        if (stopping) break;
+        WaitForSingleObject(sink.tee_ready, INFINITE);
+    }
+    free(buffer);
+    return 0;
+}
+
+// Open a tee log and its ring, on failure the run goes on without it
+static FILE *open_tee(OutputRing *ring, const char *path, int size_mb) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Warning: Cannot write %s\n", path);
+        return NULL;
+    }
+    setvbuf(f, NULL, _IOFBF, COPY_BUFFER_SIZE);
+    if (!ring_init(ring, size_mb, sink.tee_ready)) {
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+// Start the writer threads, before the first child. Without a ring output is written inline.
+static void start_output_sink(void) {
+    if (sink.running) return;
+    int size_mb = sketch->config.output_buffer_mb;
+    if (size_mb > MAX_OUTPUT_BUFFER_MB) size_mb = MAX_OUTPUT_BUFFER_MB;
+    sink.stopping = 0;
+
+    if (size_mb > 0 && (sink.console.ready = CreateEvent(NULL, FALSE, FALSE, NULL))) {
+        if (ring_init(&sink.console, size_mb, sink.console.ready)) {
+            sink.console_thread = CreateThread(NULL, 0, console_writer, NULL, 0, NULL);
+        }
+        if (!sink.console_thread) {
+            CloseHandle(sink.console.ready);
+            ring_free(&sink.console);
+        }
+    }
+
+    if (sketch->config.tee_log[0] || sketch->config.tee_raw_log[0]) {
+        sink.tee_ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+        int tee_mb = (size_mb > 0) ? size_mb : DEFAULT_OUTPUT_BUFFER_MB;
+        if (sink.tee_ready && sketch->config.tee_log[0]) sink.tee_file = open_tee(&sink.tee, sketch->config.tee_log, tee_mb);
+        if (sink.tee_ready && sketch->config.tee_raw_log[0]) sink.tee_raw_file = open_tee(&sink.tee_raw, sketch->config.tee_raw_log, tee_mb);
+        if (sink.tee_file || sink.tee_raw_file) {
+            sink.tee_thread = CreateThread(NULL, 0, tee_writer, NULL, 0, NULL);
+        }
+        if (!sink.tee_thread) {
+            if (sink.tee_file) fclose(sink.tee_file);
+            if (sink.tee_raw_file) fclose(sink.tee_raw_file);
+            sink.tee_file = sink.tee_raw_file = NULL;
+            ring_free(&sink.tee);
+            ring_free(&sink.tee_raw);
+        }
+    }
+    sink.running = 1;
+}
+
+// Wait until everything queued for the console was written, so what we print next follows it
+static void flush_output_sink(void) {
+    if (!sink.console_thread) return;
+    sink_report_drops(OVERFLOW_BLOCK);
+    while (ring_used(&sink.console) > 0 || ring_load(&sink.busy)) {
+        WaitForSingleObject(sink.console.space, INFINITE);
+    }
+}
+
+// Drain both rings and stop the threads
+static void stop_output_sink(void) {
+    if (!sink.running) return;
+    if (sink.console_thread) sink_report_drops(OVERFLOW_BLOCK);
+    InterlockedExchange(&sink.stopping, 1);
+
+    if (sink.console_thread) {
+        SetEvent(sink.console.ready);
+        WaitForSingleObject(sink.console_thread, INFINITE);
+        CloseHandle(sink.console_thread);
+        CloseHandle(sink.console.ready);
+        ring_free(&sink.console);
+        sink.console_thread = NULL;
+    }
+    if (sink.tee_thread) {
+        SetEvent(sink.tee_ready);
+        WaitForSingleObject(sink.tee_thread, INFINITE);
+        CloseHandle(sink.tee_thread);
+        sink.tee_thread = NULL;
+        if (sink.tee_file) fclose(sink.tee_file);
+        if (sink.tee_raw_file) fclose(sink.tee_raw_file);
+        sink.tee_file = sink.tee_raw_file = NULL;
+        ring_free(&sink.tee);
+        ring_free(&sink.tee_raw);
+    }
+    if (sink.tee_ready) CloseHandle(sink.tee_ready);
+    sink.tee_ready = NULL;
+    sink.running = 0;
+}
+
+// Child output as read from its pipes, before translation
+static void tee_raw_output(const char *data, size_t len) {
+    if (sink.tee_raw_file && len > 0) sink_write(&sink.tee_raw, data, len, OVERFLOW_BLOCK);
+}
+
+// Translated output: teed, then queued for the writer thread (or written right away)
+static void emit_output(const char *data, size_t len) {
+    if (sink.tee_file) sink_write(&sink.tee, data, len, OVERFLOW_BLOCK);
+    if (!sink.console_thread) {
+        write_output(data, len);
+        return;
+    }
+    if (sketch->config.output_overflow == OVERFLOW_SUMMARIZE) sink_report_drops(OVERFLOW_SUMMARIZE);
+    sink_write(&sink.console, data, len, sketch->config.output_overflow);
+}
+
+// Where translators of child output write to
+static int emit_translated(void *user, const char *data, size_t len) {
+    emit_output(data, len);
+    return 0;
+}
+
+// foldcessing --translate: copy stdin to stdout, translating references on the way
+static int translate_log(const char *map_path) {
+    LineMap *map = foldcessing_map_load(map_path);
+    if (!map) {
+        fprintf(stderr, "Error: Cannot read line map %s (fold the sketch first)\n", map_path);
+        return 1;
+    }
+    map->java_line_offset = sketch->config.java_line_offset;
+
+    // Bytes go through as they are, \r\n included
+    _setmode(_fileno(stdout), _O_BINARY);
+
+    HANDLE in = GetStdHandle(STD_INPUT_HANDLE);
+    char *chunk = malloc(COPY_BUFFER_SIZE);
+    Translator translator = {0};
+    translator.map = map;
+    translator.write = emit_translated;
+    translator.raw = 1;
+
+    DWORD bytes_read;
+    while (chunk && ReadFile(in, chunk, COPY_BUFFER_SIZE, &bytes_read, NULL) && bytes_read > 0) {
+        translator_feed(&translator, chunk, bytes_read);
+    }
+    translator_finish(&translator);
+
+    free(translator.buffer);
+    free(chunk);
+    foldcessing_map_free(map);
+    return ferror(stdout) ? 1 : 0;
+}
+
+// Child resources
+//
+// What a run of processing-java cost, for --stats and capacity planning: wall and CPU time,
+// peak memory and the processes its tree ran. On Windows the job it runs in keeps count, and
+// also enforces memory_limit_mb, cpu_affinity and priority. On POSIX wait4 reports the CPU
+// time and peak resident set of the child and of everything it waited for. With --stats or
+// a memory limit the child's process group is also sampled from /proc every CHILD_SAMPLE_MS:
+// that adds up the resident memory of the whole group (killing it once over the limit) and
+// counts the processes seen in it.
+
+#define CHILD_SAMPLE_MS 250
+
+typedef struct {
+    double wall_ms;
+    double cpu_ms;                 // User and kernel time of the whole tree
+    long long peak_memory;         // Bytes: committed by the job (Windows), resident (POSIX)
+    int processes;
+} ChildUsage;
+
+// Windows priority classes and POSIX nice values for PRIORITY_IDLE to PRIORITY_HIGH
+#ifdef _WIN32
+static const DWORD priority_classes[] = {0, 0x00000040, 0x00004000, 0x00000020, 0x00008000, 0x00000080};
+#else
+static const int priority_nice[] = {0, 19, 10, 0, -5, -10};
+#endif
+
+// Add a finished run to the stats
+static void record_child_usage(const ChildUsage *usage) {
+    stats.child_cpu_ms += usage->cpu_ms;
+    if (usage->peak_memory > stats.child_peak_memory) stats.child_peak_memory = usage->peak_memory;
+    stats.child_processes += usage->processes;
+}
+
+// One line on what a finished run cost, after its output
+static void report_child_usage(const ChildUsage *usage) {
+    char text[256];
+    int len = snprintf(text, sizeof(text),
+                       "Foldcessing: processing-java ran %.1f s, %.1f s CPU, %lld MB peak memory, %d processes.\n",
+                       usage->wall_ms / 1000.0, usage->cpu_ms / 1000.0,
+                       usage->peak_memory / (1024 * 1024), usage->processes);
+    emit_output(text, len);
+}
+
+// Child output is translated with the sketch's line map on its way to the console
+static void attach_translator(Translator *translator) {
+    translator->map = &sketch->map;
+    translator->write = emit_translated;
+}
+
+// duplicate_symbols=abort: processing-java is not started on a sketch that cannot compile
+static int launch_blocked(const Sketch *sketch) {
+    return sketch->config.duplicate_symbols == DUPLICATES_ABORT && sketch->duplicate_count > 0;
+}
+
+#ifdef _WIN32
+
+// Child process handling
+//
+// The child's stdout and stderr are named pipes opened for overlapped reads, so the main
+// thread can block on the process, both pipes and the watch at once and translate output
+// the moment it arrives. Anonymous pipes from CreatePipe cannot be read asynchronously.
+
+#ifndef FILE_FLAG_FIRST_PIPE_INSTANCE
+#define FILE_FLAG_FIRST_PIPE_INSTANCE 0x00080000
+#endif
+
+#define PIPE_BUFFER_SIZE 65536
+
+typedef struct {
+    HANDLE pipe;
+    HANDLE event;                // Signaled when the pending read completes
+    OVERLAPPED overlapped;
+    int pending;                 // A read is in flight
+    char chunk[4096];
+    Translator translator;
+} OutputStream;
+
+typedef struct {
+    PROCESS_INFORMATION pi;
+    HANDLE job;
+    OutputStream out;
+    OutputStream err;
+    double started;              // clock_ms() at launch
+    ChildUsage usage;            // Filled in by finish_child
+} ChildProcess;
+
+static volatile LONG pipe_serial = 0;
+
+// Create a pipe we read asynchronously, write_end is inheritable for the child
+static int open_output_pipe(OutputStream *stream, HANDLE *write_end) {
+    char name[128];
+    snprintf(name, sizeof(name), "\\\\.\\pipe\\foldcessing-%lu-%ld",
+             (unsigned long)GetCurrentProcessId(), (long)InterlockedIncrement(&pipe_serial));
+
+    stream->pipe = CreateNamedPipe(name, PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                   PIPE_TYPE_BYTE | PIPE_WAIT, 1, PIPE_BUFFER_SIZE, PIPE_BUFFER_SIZE, 0, NULL);
+    if (stream->pipe == INVALID_HANDLE_VALUE) return 0;
+
+    SECURITY_ATTRIBUTES sa = {sizeof(SECURITY_ATTRIBUTES), NULL, TRUE};
+    *write_end = CreateFile(name, GENERIC_WRITE, 0, &sa, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    stream->event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (*write_end == INVALID_HANDLE_VALUE || !stream->event) {
+        if (*write_end != INVALID_HANDLE_VALUE) CloseHandle(*write_end);
+        if (stream->event) CloseHandle(stream->event);
+        CloseHandle(stream->pipe);
+        return 0;
+    }
+    return 1;
+}
+
+// Start the next read, leaves pending clear once the pipe is closed
+static void arm_output(OutputStream *stream) {
+    ResetEvent(stream->event);
+    memset(&stream->overlapped, 0, sizeof(stream->overlapped));
+    stream->overlapped.hEvent = stream->event;
+    stream->pending = ReadFile(stream->pipe, stream->chunk, sizeof(stream->chunk), NULL, &stream->overlapped) ||
+                      GetLastError() == ERROR_IO_PENDING;
+}
+
+// Translate a completed read and start the next one, returns 1 if anything was read
+static int read_output(OutputStream *stream) {
+    DWORD bytes_read;
+
+    if (!stream->pending) return 0;
+    if (!GetOverlappedResult(stream->pipe, &stream->overlapped, &bytes_read, FALSE)) {
+        // Still waiting, or the child side is gone (ERROR_BROKEN_PIPE)
+        if (GetLastError() != ERROR_IO_INCOMPLETE) stream->pending = 0;
+        return 0;
+    }
+
+    if (bytes_read > 0 && stats.first_output_ms < 0) {
+        stats.first_output_ms = clock_ms() - stats.child_started;
+    }
+    tee_raw_output(stream->chunk, bytes_read);
+    translator_feed(&stream->translator, stream->chunk, bytes_read);
+    arm_output(stream);
+    return 1;
+}
+
+// Give up on a read nothing will complete anymore and release the pipe
+static void close_output(OutputStream *stream) {
+    if (stream->pending) {
+        DWORD bytes_read;
+        CancelIo(stream->pipe);
+        GetOverlappedResult(stream->pipe, &stream->overlapped, &bytes_read, TRUE);
+        stream->pending = 0;
+    }
+    CloseHandle(stream->pipe);
+    CloseHandle(stream->event);
+    free(stream->translator.buffer);
+}
+
+// Fill in the limits from .foldcessing, returns their JOB_OBJECT_LIMIT_* flags
+static DWORD job_limits(char *info) {
+    DWORD flags = 0;
+    if (sketch->config.memory_limit_mb > 0) {
+        *(SIZE_T*)(info + JOB_MEMORY_LIMIT) = (SIZE_T)sketch->config.memory_limit_mb * 1024 * 1024;
+        flags |= JOB_OBJECT_LIMIT_JOB_MEMORY;
+    }
+    if (sketch->config.cpu_affinity) {
+        *(ULONG_PTR*)(info + JOB_AFFINITY) = (ULONG_PTR)sketch->config.cpu_affinity;
+        flags |= JOB_OBJECT_LIMIT_AFFINITY;
+    }
+    if (sketch->config.priority != PRIORITY_DEFAULT) {
+        *(DWORD*)(info + JOB_PRIORITY_CLASS) = priority_classes[sketch->config.priority];
+        flags |= JOB_OBJECT_LIMIT_PRIORITY_CLASS;
+    }
+    return flags;
+}
+
+// Launch processing-java inside a kill-on-close job with its output piped back to us,
+// in working_dir (NULL for ours)
+static int start_child(char *command, const char *working_dir, ChildProcess *child) {
+    memset(child, 0, sizeof(*child));
+    child->started = clock_ms();
+    attach_translator(&child->out.translator);
+    attach_translator(&child->err.translator);
+
+    // Create pipes for stdout and stderr
+    HANDLE hStdoutWrite, hStderrWrite;
+
+    if (!open_output_pipe(&child->out, &hStdoutWrite)) return 0;
+    if (!open_output_pipe(&child->err, &hStderrWrite)) {
+        CloseHandle(hStdoutWrite);
+        close_output(&child->out);
+        return 0;
+    }
+
+    // Spawn processing-java
+    STARTUPINFO si = {0};
+    si.cb = sizeof(si);
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdOutput = hStdoutWrite;
+    si.hStdError = hStderrWrite;
+    si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+
+    // Create a Job Object to ensure all child processes are killed if foldcessing exits
+    // Load functions dynamically for TCC compatibility
+    HMODULE hKernel32 = GetModuleHandle("kernel32.dll");
+    CreateJobObjectFunc pCreateJobObject = (CreateJobObjectFunc)GetProcAddress(hKernel32, "CreateJobObjectA");
+    SetInformationJobObjectFunc pSetInformationJobObject = (SetInformationJobObjectFunc)GetProcAddress(hKernel32, "SetInformationJobObject");
+    AssignProcessToJobObjectFunc pAssignProcessToJobObject = (AssignProcessToJobObjectFunc)GetProcAddress(hKernel32, "AssignProcessToJobObject");
+
+    if (pCreateJobObject && pSetInformationJobObject && pAssignProcessToJobObject) {
+        child->job = pCreateJobObject(NULL, NULL);
+        if (child->job) {
+            // Use a byte buffer to avoid struct definition issues
+            char jeli[JOBOBJECT_EXTENDED_LIMIT_INFO_SIZE] = {0};
+            *(DWORD*)(jeli + JOB_LIMIT_FLAGS) = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE | job_limits(jeli);
+            if (!pSetInformationJobObject(child->job, JobObjectExtendedLimitInformation, &jeli, sizeof(jeli))) {
+                // Such as an affinity outside our own, the tree must still die with the job
+                fprintf(stderr, "Warning: Cannot apply memory_limit_mb, cpu_affinity or priority\n");
+                memset(jeli, 0, sizeof(jeli));
+                *(DWORD*)(jeli + JOB_LIMIT_FLAGS) = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+                pSetInformationJobObject(child->job, JobObjectExtendedLimitInformation, &jeli, sizeof(jeli));
+            }
+        }
+    }
+
+    if (!CreateProcess(NULL, command, NULL, NULL, TRUE, CREATE_SUSPENDED, NULL, working_dir, &si, &child->pi)) {
+        CloseHandle(hStdoutWrite);
+        CloseHandle(hStderrWrite);
+        close_output(&child->out);
+        close_output(&child->err);
+        if (child->job) CloseHandle(child->job);
+        return 0;
+    }
+
+    // Assign the process to the job, then resume it
+    if (child->job && pAssignProcessToJobObject) {
+        pAssignProcessToJobObject(child->job, child->pi.hProcess);
+    }
+    ResumeThread(child->pi.hThread);
+
+    CloseHandle(hStdoutWrite);
+    CloseHandle(hStderrWrite);
+    arm_output(&child->out);
+    arm_output(&child->err);
+    return 1;
+}
+
+// Check without waiting if the child is gone
+static int child_exited(ChildProcess *child) {
+    return WaitForSingleObject(child->pi.hProcess, 0) != WAIT_TIMEOUT;
+}
+
+// The job enforces the limits and keeps count by itself
+static DWORD watch_child_resources(ChildProcess *child) {
+    (void)child;
+    return INFINITE;
+}
+
+// Read what the job's processes used, while the job is still open
+static void read_job_usage(ChildProcess *child) {
+    QueryInformationJobObjectFunc pQueryInformationJobObject = (QueryInformationJobObjectFunc)
+        GetProcAddress(GetModuleHandle("kernel32.dll"), "QueryInformationJobObject");
+    if (!child->job || !pQueryInformationJobObject) return;
+
+    char basic[JOBOBJECT_BASIC_ACCOUNTING_INFO_SIZE] = {0};
+    if (pQueryInformationJobObject(child->job, JobObjectBasicAccountingInformation, basic, sizeof(basic), NULL)) {
+        unsigned long long user_time, kernel_time;
+        memcpy(&user_time, basic + JOB_TOTAL_USER_TIME, sizeof(user_time));
+        memcpy(&kernel_time, basic + JOB_TOTAL_KERNEL_TIME, sizeof(kernel_time));
+        child->usage.cpu_ms = (double)(user_time + kernel_time) / 10000.0;
+        child->usage.processes = (int)*(DWORD*)(basic + JOB_TOTAL_PROCESSES);
+    }
+
+    char jeli[JOBOBJECT_EXTENDED_LIMIT_INFO_SIZE] = {0};
+    if (pQueryInformationJobObject(child->job, JobObjectExtendedLimitInformation, jeli, sizeof(jeli), NULL)) {
+        child->usage.peak_memory = (long long)*(SIZE_T*)(jeli + JOB_PEAK_MEMORY_USED);
+    }
+}
+
+// Wait for the child to finish (or for it to be killed), translate the rest of its output
+// and release everything. With kill set, the job is closed first, taking down the whole tree.
+static DWORD finish_child(ChildProcess *child, int kill) {
+    if (kill && child->job) {
+        read_job_usage(child);
+        CloseHandle(child->job);
+        child->job = NULL;
+        WaitForSingleObject(child->pi.hProcess, INFINITE);
+    }
+
+    // Read any remaining output, up to whatever a surviving grandchild has not written yet
+    while (read_output(&child->out));
+    while (read_output(&child->err));
+
+    // Flush any remaining partial lines
+    translator_finish(&child->out.translator);
+    translator_finish(&child->err.translator);
+    flush_output_sink();
+
+    DWORD exit_code;
+    GetExitCodeProcess(child->pi.hProcess, &exit_code);
+
+    close_output(&child->out);
+    close_output(&child->err);
+    CloseHandle(child->pi.hProcess);
+    CloseHandle(child->pi.hThread);
+
+    // Close the job object - this will kill all child processes if any are still running
+    if (child->job) {
+        read_job_usage(child);
+        CloseHandle(child->job);
+    }
+    child->usage.wall_ms = clock_ms() - child->started;
+    record_child_usage(&child->usage);
+
+    return exit_code;
+}
+
+#else
+
+// Child process handling
+//
+// The child's stdout and stderr are non-blocking pipes, polled together with the process
+// (through a pidfd where the kernel has them) and the watch, so output is translated the
+// moment it arrives. The child leads a process group of its own: killing the group takes
+// down everything it started, like closing the job does on Windows.
+
+#define CHILD_POLL_MS 50         // How often to look for an exit without a pidfd
+#define MAX_CHILD_GROUPS 32
+
+typedef struct {
+    int fd;
+    int pending;                 // Open and not at end of file yet
+    char chunk[4096];
+    Translator translator;
+} OutputStream;
+
+typedef struct {
+    pid_t pid;                   // Also the id of its process group
+    int pidfd;                   // Readable once the child exits, -1 when unavailable
+    OutputStream out;
+    OutputStream err;
+    double started;              // clock_ms() at launch
+    ChildUsage usage;            // Filled in by finish_child
+    double next_sample;          // clock_ms() when the group is sampled next
+    pid_t *seen;                 // Processes sampled in the group so far
+    int seen_count;
+    int seen_capacity;
+    int over_limit;              // Killed for going over memory_limit_mb
+} ChildProcess;
+
+extern char **environ;
+
+// Process groups of running children, killed when we are interrupted
+static volatile pid_t child_groups[MAX_CHILD_GROUPS];
+
+static void track_child_group(pid_t pid, int running) {
+    for (int i = 0; i < MAX_CHILD_GROUPS; i++) {
+        if (child_groups[i] == (running ? 0 : pid)) {
+            child_groups[i] = running ? pid : 0;
+            return;
+        }
+    }
+}
+
+// Create a pipe we read without blocking, write_end is left for the child
+static int open_output_pipe(OutputStream *stream, int *write_end) {
+    int fds[2];
+    if (pipe(fds) != 0) return 0;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    stream->fd = fds[0];
+    stream->pending = 1;
+    *write_end = fds[1];
+    return 1;
+}
+
+// Translate what the pipe has, returns 1 if anything was read
+static int read_output(OutputStream *stream) {
+    if (!stream->pending) return 0;
+
+    ssize_t bytes_read = read(stream->fd, stream->chunk, sizeof(stream->chunk));
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+    if (bytes_read <= 0) {
+        // The child side is gone
+        stream->pending = 0;
+        return 0;
+    }
+
+    if (stats.first_output_ms < 0) {
+        stats.first_output_ms = clock_ms() - stats.child_started;
+    }
+    tee_raw_output(stream->chunk, (size_t)bytes_read);
+    translator_feed(&stream->translator, stream->chunk, (size_t)bytes_read);
+    return 1;
+}
+
+static void close_output(OutputStream *stream) {
+    if (stream->fd >= 0) close(stream->fd);
+    stream->fd = -1;
+    stream->pending = 0;
+    free(stream->translator.buffer);
+}
+
+// Split a command line built for CreateProcess into arguments: blanks separate them
+// except inside quotes, the quotes themselves are dropped
+static char **split_command(const char *command) {
+    size_t len = strlen(command);
+    char **args = malloc(sizeof(char*) * (len / 2 + 2) + len + 1);
+    if (!args) return NULL;
+    char *text = (char*)(args + len / 2 + 2);
+
+    int count = 0;
+    const char *p = command;
+    while (1) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (!*p) break;
+        args[count++] = text;
+        int quoted = 0;
+        while (*p && (quoted || (*p != ' ' && *p != '\t'))) {
+            if (*p == '"') {
+                quoted = !quoted;
+            } else {
+                *text++ = *p;
+            }
+            p++;
+        }
+        *text++ = '\0';
+    }
+    args[count] = NULL;
+    return args;
+}
+
+#if (defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))) || defined(__APPLE__)
+#define HAVE_SPAWN_CHDIR 1
+#endif
+
+// Launch processing-java as the leader of a new process group with its output piped back
+// to us, in working_dir (NULL for ours)
+static int start_child(char *command, const char *working_dir, ChildProcess *child) {
+    memset(child, 0, sizeof(*child));
+    child->started = clock_ms();
+    attach_translator(&child->out.translator);
+    attach_translator(&child->err.translator);
+    child->pidfd = -1;
+    child->out.fd = child->err.fd = -1;
+
+    int out_write, err_write;
+    if (!open_output_pipe(&child->out, &out_write)) return 0;
+    if (!open_output_pipe(&child->err, &err_write)) {
+        close(out_write);
+        close_output(&child->out);
+        return 0;
+    }
+
+    char **args = split_command(command);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, out_write, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err_write, STDERR_FILENO);
+    // Outside the terminal's foreground group a read would stop the child for good
+    if (isatty(STDIN_FILENO)) {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    }
+#ifdef HAVE_SPAWN_CHDIR
+    if (working_dir) posix_spawn_file_actions_addchdir_np(&actions, working_dir);
+#endif
+
+    // SIGPIPE is ignored here, the child gets the default back
+    posix_spawnattr_t attributes;
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attributes, 0);
+    posix_spawnattr_setsigdefault(&attributes, &defaults);
+
+#ifdef __linux__
+    // The child inherits the affinity of the thread starting it, ours is put back afterwards
+    cpu_set_t previous_cpus;
+    int pinned = 0;
+    if (sketch->config.cpu_affinity) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int i = 0; i < 64; i++) {
+            if (sketch->config.cpu_affinity >> i & 1) CPU_SET(i, &cpus);
+        }
+        pinned = sched_getaffinity(0, sizeof(previous_cpus), &previous_cpus) == 0 &&
+                 sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+        if (!pinned) fprintf(stderr, "Warning: Cannot apply cpu_affinity\n");
+    }
+#endif
+
+    int error = ENOENT;
+    if (args && args[0]) {
+#ifndef HAVE_SPAWN_CHDIR
+        // Only the main thread starts children, and nothing else uses relative paths meanwhile
+        char previous_dir[MAX_PATH_LEN];
+        int moved = working_dir && getcwd(previous_dir, sizeof(previous_dir)) && chdir(working_dir) == 0;
+#endif
+        error = posix_spawnp(&child->pid, args[0], &actions, &attributes, args, environ);
+#ifndef HAVE_SPAWN_CHDIR
+        if (moved && chdir(previous_dir) != 0) error = errno;
+#endif
+    }
+
+#ifdef __linux__
+    if (pinned) sched_setaffinity(0, sizeof(previous_cpus), &previous_cpus);
+#endif
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    free(args);
+    close(out_write);
+    close(err_write);
+
+    if (error != 0) {
+        close_output(&child->out);
+        close_output(&child->err);
+        return 0;
+    }
+    track_child_group(child->pid, 1);
+
+    // Before it starts anything else, which then inherits the niceness (raising it needs privileges)
+    if (sketch->config.priority != PRIORITY_DEFAULT &&
+        setpriority(PRIO_PGRP, (id_t)child->pid, priority_nice[sketch->config.priority]) != 0) {
+        fprintf(stderr, "Warning: Cannot apply priority\n");
+    }
+
+#ifdef SYS_pidfd_open
+    child->pidfd = (int)syscall(SYS_pidfd_open, child->pid, 0);
+#endif
+    return 1;
+}
+
+// Check without waiting if the child is gone, leaving it to be reaped by finish_child
+static int child_exited(ChildProcess *child) {
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    if (waitid(P_PID, (id_t)child->pid, &info, WEXITED | WNOHANG | WNOWAIT) != 0) return 1;
+    return info.si_pid != 0;
+}
+
+// Add up the resident memory of the child's process group and note the processes in it,
+// returns the bytes
+static long long sample_child(ChildProcess *child) {
+    long long resident = 0;
+#ifdef __linux__
+    DIR *proc = opendir("/proc");
+    if (!proc) return 0;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    struct dirent *entry;
+    while ((entry = readdir(proc))) {
+        if (entry->d_name[0] < '1' || entry->d_name[0] > '9') continue;
+        char path[64], line[1024];
+        snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        ssize_t len = read(fd, line, sizeof(line) - 1);
+        close(fd);
+        if (len <= 0) continue;
+        line[len] = '\0';
+
+        // The command in parentheses may hold anything, fields 5 (pgrp) and 24 (rss) follow it
+        char *fields = strrchr(line, ')');
+        int group;
+        long pages;
+        if (!fields || sscanf(fields + 1, " %*c %*d %d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u"
+                                          " %*d %*d %*d %*d %*d %*d %*u %*u %ld", &group, &pages) != 2 ||
+            group != child->pid) {
+            continue;
+        }
+        resident += (long long)pages * page_size;
+
+        pid_t pid = (pid_t)atoi(entry->d_name);
+        int known = 0;
+        for (int i = 0; i < child->seen_count && !known; i++) known = child->seen[i] == pid;
+        if (!known) {
+            if (child->seen_count == child->seen_capacity) {
+                child->seen_capacity = child->seen_capacity ? child->seen_capacity * 2 : 16;
+                child->seen = realloc(child->seen, sizeof(pid_t) * child->seen_capacity);
+            }
+            child->seen[child->seen_count++] = pid;
+        }
+    }
+    closedir(proc);
+#else
+    (void)child;
+#endif
+    return resident;
+}
+
+// Sample the child's group when due, killing it once over memory_limit_mb; returns how many
+// ms until the next sample
+static DWORD watch_child_resources(ChildProcess *child) {
+    if (!sketch->config.stats && sketch->config.memory_limit_mb <= 0) return INFINITE;
+
+    double now = clock_ms();
+    if (now >= child->next_sample && !child->over_limit) {
+        long long resident = sample_child(child);
+        if (resident > child->usage.peak_memory) child->usage.peak_memory = resident;
+        if (sketch->config.memory_limit_mb > 0 && resident > (long long)sketch->config.memory_limit_mb * 1024 * 1024) {
+            child->over_limit = 1;
+            kill(-child->pid, SIGKILL);
+            char text[128];
+            int len = snprintf(text, sizeof(text), "Foldcessing: processing-java went over memory_limit_mb=%d, killed.\n",
+                               sketch->config.memory_limit_mb);
+            emit_output(text, len);
+        }
+        child->next_sample = now + CHILD_SAMPLE_MS;
+    }
+    return child->over_limit ? INFINITE : (DWORD)(child->next_sample - now);
+}
+
+// Wait for the child to finish (or for it to be killed), translate the rest of its output
+// and release everything. With kill_tree set, the group is killed first; whatever the child
+// left running in its group is killed afterwards either way.
+static DWORD finish_child(ChildProcess *child, int kill_tree) {
+    if (kill_tree) kill(-child->pid, SIGKILL);
+
+    int status = 0;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    while (wait4(child->pid, &status, 0, &usage) < 0 && errno == EINTR);
+    kill(-child->pid, SIGKILL);
+    track_child_group(child->pid, 0);
+
+    child->usage.wall_ms = clock_ms() - child->started;
+    child->usage.cpu_ms = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+                          (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+#ifdef __APPLE__
+    long long peak = usage.ru_maxrss;                 // Bytes
+#else
+    long long peak = (long long)usage.ru_maxrss * 1024;
+#endif
+    if (peak > child->usage.peak_memory) child->usage.peak_memory = peak;
+    child->usage.processes = child->seen_count > 0 ? child->seen_count : 1;
+    free(child->seen);
+    record_child_usage(&child->usage);
+
+    // Read any remaining output
+    while (read_output(&child->out));
+    while (read_output(&child->err));
+
+    // Flush any remaining partial lines
+    translator_finish(&child->out.translator);
+    translator_finish(&child->err.translator);
+    flush_output_sink();
+
+    close_output(&child->out);
+    close_output(&child->err);
+    if (child->pidfd >= 0) close(child->pidfd);
+
+    if (WIFEXITED(status)) return (DWORD)WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return (DWORD)(128 + WTERMSIG(status));
+    return 1;
+}
+
+#endif
+
+// Watch mode
+//
+// The sketch root is watched recursively with ReadDirectoryChangesW, or on Linux with an
+// inotify watch per folder. Edits to known .pde files are queued by name so only those
+// files are re-checked; anything that can change the file list (adds, removes, renames,
+// lost notifications) asks for a full rescan. A batch is considered complete once no
+// relevant change arrived for watch_debounce ms.
+
+#ifndef FILE_ACTION_MODIFIED
+#define FILE_ACTION_ADDED 0x00000001
+#define FILE_ACTION_REMOVED 0x00000002
+#define FILE_ACTION_MODIFIED 0x00000003
+#endif
+
+#ifdef _WIN32
+
+typedef BOOL (WINAPI *ReadDirectoryChangesWFunc)(HANDLE, LPVOID, DWORD, BOOL, DWORD, LPDWORD,
+                                                 LPOVERLAPPED, LPVOID);
+
+#ifndef FILE_NOTIFY_CHANGE_FILE_NAME
+#define FILE_NOTIFY_CHANGE_FILE_NAME 0x00000001
+#define FILE_NOTIFY_CHANGE_DIR_NAME 0x00000002
+#define FILE_NOTIFY_CHANGE_LAST_WRITE 0x00000010
+#endif
+
+#define WATCH_BUFFER_SIZE 65536
+
+// Same layout as FILE_NOTIFY_INFORMATION, declared here for TCC compatibility
+typedef struct {
+    DWORD next_entry_offset;
+    DWORD action;
+    DWORD file_name_length;
+    WCHAR file_name[1];
+} NotifyInformation;
+
+typedef struct {
+    HANDLE dir;
+    HANDLE event;
+    OVERLAPPED overlapped;
+    ReadDirectoryChangesWFunc read_changes;
+    DWORD buffer[WATCH_BUFFER_SIZE / sizeof(DWORD)];  // Must be DWORD aligned
+    char **changed;        // Relative paths of modified .pde files in this batch
+    int changed_count;
+    int changed_capacity;
+    int rescan;            // The file list itself may have changed
+    DWORD last_change;     // Tick count of the last relevant change, 0 when idle
+} DirectoryWatch;
+
+// Queue (or re-queue) a read of directory changes
+static int watch_arm(DirectoryWatch *watch) {
+    memset(&watch->overlapped, 0, sizeof(watch->overlapped));
+    watch->overlapped.hEvent = watch->event;
+    return watch->read_changes(watch->dir, watch->buffer, sizeof(watch->buffer), TRUE,
+                               FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
+                               FILE_NOTIFY_CHANGE_LAST_WRITE,
+                               NULL, &watch->overlapped, NULL);
+}
+
+static int watch_start(DirectoryWatch *watch, const char *root) {
+    memset(watch, 0, sizeof(*watch));
+
+    HMODULE hKernel32 = GetModuleHandle("kernel32.dll");
+    watch->read_changes = (ReadDirectoryChangesWFunc)GetProcAddress(hKernel32, "ReadDirectoryChangesW");
+    if (!watch->read_changes) return 0;
+
+    watch->dir = CreateFile(root, FILE_LIST_DIRECTORY,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                            OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    if (watch->dir == INVALID_HANDLE_VALUE) return 0;
+
+    watch->event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!watch->event || !watch_arm(watch)) {
+        CloseHandle(watch->dir);
+        if (watch->event) CloseHandle(watch->event);
+        return 0;
+    }
+    return 1;
+}
+
+#else
+
+#define WATCH_BUFFER_SIZE 65536
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO)
+
+typedef struct {
+    int fd;                // inotify instance, -1 without one
+    char *root;
+    char **folders;        // Relative path of the folder behind each watch descriptor
+    int folder_capacity;
+    char **changed;        // Relative paths of modified .pde files in this batch
+    int changed_count;
+    int changed_capacity;
+    int rescan;            // The file list itself may have changed
+    DWORD last_change;     // Tick count of the last relevant change, 0 when idle
+} DirectoryWatch;
+
+#ifdef __linux__
+
+// inotify is not recursive: watch relative and every folder below it that collect_files
+// would descend into (links are not followed, they may lead anywhere)
+static void watch_add_tree(DirectoryWatch *watch, const char *relative) {
+    char path[MAX_PATH_LEN];
+    if (relative[0]) {
+        snprintf(path, sizeof(path), "%s/%s", watch->root, relative);
+    } else {
+        snprintf(path, sizeof(path), "%s", watch->root);
+    }
+
+    int wd = inotify_add_watch(watch->fd, path, WATCH_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0) {
+        // Out of watches, or the folder is already gone; a rescan sorts out the files
+        watch->rescan = 1;
+        watch->last_change = GetTickCount();
+        return;
+    }
+    if (wd >= watch->folder_capacity) {
+        int capacity = watch->folder_capacity ? watch->folder_capacity : 64;
+        while (capacity <= wd) capacity *= 2;
+        watch->folders = realloc(watch->folders, sizeof(char*) * capacity);
+        memset(watch->folders + watch->folder_capacity, 0, sizeof(char*) * (capacity - watch->folder_capacity));
+        watch->folder_capacity = capacity;
+    }
+    free(watch->folders[wd]);
+    watch->folders[wd] = _strdup(relative);
+
+    DirList list;
+    if (!list_open(&list, path)) return;
+    ListEntry *found;
+    while ((found = list_next(&list)) != NULL) {
+        if (!found->is_dir || found->is_link || strcasecmp_win(found->name, "output") == 0) continue;
+
+        char child[MAX_PATH_LEN];
+        if (relative[0]) {
+            snprintf(child, sizeof(child), "%s/%s", relative, found->name);
+        } else {
+            snprintf(child, sizeof(child), "%s", found->name);
+        }
+        if (!should_ignore(&sketch->ignore, child, 1)) watch_add_tree(watch, child);
+    }
+    list_close(&list);
+}
+
+static int watch_start(DirectoryWatch *watch, const char *root) {
+    memset(watch, 0, sizeof(*watch));
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd < 0) return 0;
+
+    watch->root = _strdup(root);
+    watch_add_tree(watch, "");
+    watch->rescan = 0;
+    watch->last_change = 0;
+    return watch->folder_capacity > 0;
+}
+
+#else
+
+// No recursive change notifications to build on here
+static int watch_start(DirectoryWatch *watch, const char *root) {
+    memset(watch, 0, sizeof(*watch));
+    watch->fd = -1;
+    return 0;
+}
+
+#endif
+
+#endif
+
+static void watch_record(DirectoryWatch *watch, DWORD action, const char *relative) {
+    const char *name = strrchr(relative, '/');
+    name = name ? name + 1 : relative;
+
+    if (in_output_folder(relative) || should_ignore(&sketch->ignore, relative, !ends_with(name, ".pde"))) return;
+
+    if (ends_with(name, ".pde")) {
+        if (action == FILE_ACTION_MODIFIED) {
+            for (int i = 0; i < watch->changed_count; i++) {
+                if (strcmp(watch->changed[i], relative) == 0) {
+                    watch->last_change = GetTickCount();
+                    return;
+                }
+            }
+            if (watch->changed_count == watch->changed_capacity) {
+                watch->changed_capacity = watch->changed_capacity ? watch->changed_capacity * 2 : 16;
+                watch->changed = realloc(watch->changed, sizeof(char*) * watch->changed_capacity);
+            }
+            watch->changed[watch->changed_count++] = _strdup(relative);
+        } else {
+            watch->rescan = 1;
+        }
+    } else if (!strchr(name, '.')) {
+        // Probably a folder: only its creation, removal or renaming matters
+        if (action == FILE_ACTION_MODIFIED) return;
+        watch->rescan = 1;
+    } else {
+        return;
+    }
+
+    watch->last_change = GetTickCount();
+}
+
+#ifdef _WIN32
+
+// Collect completed change notifications without blocking
+static void watch_poll(DirectoryWatch *watch) {
+    DWORD bytes;
+    if (!GetOverlappedResult(watch->dir, &watch->overlapped, &bytes, FALSE)) return;
+
+    if (bytes == 0) {
+        // Too many changes to fit in the buffer, we lost track of them
+        watch->rescan = 1;
+        watch->last_change = GetTickCount();
+    } else {
+        char *entry = (char*)watch->buffer;
+        while (1) {
+            NotifyInformation *info = (NotifyInformation*)entry;
+            char relative[MAX_PATH_LEN];
+            int len = WideCharToMultiByte(CP_ACP, 0, info->file_name,
+                                          info->file_name_length / sizeof(WCHAR),
+                                          relative, sizeof(relative) - 1, NULL, NULL);
+            relative[len] = '\0';
+            for (char *p = relative; *p; p++) {
+                if (*p == '\\') *p = '/';
+            }
+            watch_record(watch, info->action, relative);
+
+            if (!info->next_entry_offset) break;
+            entry += info->next_entry_offset;
+        }
+    }
+
+    ResetEvent(watch->event);
+    if (!watch_arm(watch)) {
+        watch->rescan = 1;
+        watch->last_change = GetTickCount();
+    }
+}
+
+// Block until a complete batch of changes is available
+static void watch_wait(DirectoryWatch *watch) {
+    while (1) {
+        watch_poll(watch);
+
+        DWORD timeout = INFINITE;
+        if (watch->last_change) {
+            DWORD elapsed = GetTickCount() - watch->last_change;
+            if (elapsed >= (DWORD)sketch->config.watch_debounce) return;
+            timeout = sketch->config.watch_debounce - elapsed;
+        }
+        WaitForSingleObject(watch->event, timeout);
+    }
+}
+
+#else
+
+// Collect pending change notifications without blocking
+static void watch_poll(DirectoryWatch *watch) {
+#ifdef __linux__
+    char buffer[WATCH_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t len = read(watch->fd, buffer, sizeof(buffer));
+        if (len <= 0) return;
+
+        for (char *p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct inotify_event *event = (struct inotify_event*)p;
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Too many changes for the queue, we lost track of them
+                watch->rescan = 1;
+                watch->last_change = GetTickCount();
+                continue;
+            }
+            if (event->wd < 0 || event->wd >= watch->folder_capacity || !watch->folders[event->wd]) continue;
+            if (event->mask & IN_IGNORED) {
+                free(watch->folders[event->wd]);
+                watch->folders[event->wd] = NULL;
+                continue;
+            }
+            if (!event->len) continue;
+
+            const char *folder = watch->folders[event->wd];
+            char relative[MAX_PATH_LEN];
+            if (folder[0]) {
+                snprintf(relative, sizeof(relative), "%s/%s", folder, event->name);
+            } else {
+                snprintf(relative, sizeof(relative), "%s", event->name);
+            }
+
+            DWORD action = FILE_ACTION_MODIFIED;
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) action = FILE_ACTION_ADDED;
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM)) action = FILE_ACTION_REMOVED;
+
+            if (!(event->mask & IN_ISDIR)) {
+                watch_record(watch, action, relative);
+            } else if (!in_output_folder(relative) && strcasecmp_win(event->name, "output") != 0 &&
+                       !should_ignore(&sketch->ignore, relative, 1)) {
+                // Folders are known as such here, dots in their names or not; new ones need
+                // watches of their own
+                if (action == FILE_ACTION_ADDED) watch_add_tree(watch, relative);
+                watch->rescan = 1;
+                watch->last_change = GetTickCount();
+            }
+        }
+    }
+#endif
+}
+
+// Block until a complete batch of changes is available
+static void watch_wait(DirectoryWatch *watch) {
+    while (1) {
+        watch_poll(watch);
+
+        int timeout = -1;
+        if (watch->last_change) {
+            DWORD elapsed = GetTickCount() - watch->last_change;
+            if (elapsed >= (DWORD)sketch->config.watch_debounce) return;
+            timeout = (int)(sketch->config.watch_debounce - elapsed);
+        }
+        struct pollfd changes = {watch->fd, POLLIN, 0};
+        poll(&changes, 1, timeout);
+    }
+}
+
+#endif
+
+// Forget the batch that was just handled
+static void watch_reset(DirectoryWatch *watch) {
+    for (int i = 0; i < watch->changed_count; i++) {
+        free(watch->changed[i]);
+    }
+    watch->changed_count = 0;
+    watch->rescan = 0;
+    watch->last_change = 0;
+}
+
+// Sleep until one of the children exits or has output, the watch has news or timeout ms pass
+#ifdef _WIN32
+
+static void wait_children(ChildProcess **children, int count, DirectoryWatch *watch, DWORD timeout) {
+    HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+    DWORD handle_count = 0;
+    for (int i = 0; i < count; i++) {
+        handles[handle_count++] = children[i]->pi.hProcess;
+        if (children[i]->out.pending) handles[handle_count++] = children[i]->out.event;
+        if (children[i]->err.pending) handles[handle_count++] = children[i]->err.event;
+    }
+    if (watch) handles[handle_count++] = watch->event;
+    WaitForMultipleObjects(handle_count, handles, FALSE, timeout);
+}
+
+#else
+
+static void wait_children(ChildProcess **children, int count, DirectoryWatch *watch, DWORD timeout) {
+    struct pollfd fds[MAX_CHILD_GROUPS * 3 + 1];
+    nfds_t fd_count = 0;
+    int exits_pollable = 1;
+    for (int i = 0; i < count; i++) {
+        if (children[i]->out.pending) fds[fd_count++] = (struct pollfd){children[i]->out.fd, POLLIN, 0};
+        if (children[i]->err.pending) fds[fd_count++] = (struct pollfd){children[i]->err.fd, POLLIN, 0};
+        if (children[i]->pidfd >= 0) {
+            fds[fd_count++] = (struct pollfd){children[i]->pidfd, POLLIN, 0};
+        } else {
+            exits_pollable = 0;
+        }
+    }
+    if (watch && watch->fd >= 0) fds[fd_count++] = (struct pollfd){watch->fd, POLLIN, 0};
+
+    int ms = (timeout == INFINITE) ? -1 : (int)timeout;
+    if (!exits_pollable && (ms < 0 || ms > CHILD_POLL_MS)) ms = CHILD_POLL_MS;
+    poll(fds, fd_count, ms);
+}
+
+#endif
+
+// Pump the child's output until it exits (returns 1) or a batch of changes settles (returns 0)
+static int pump_child(ChildProcess *child, DirectoryWatch *watch) {
+    while (1) {
+        // Sleep until something happens, or until a pending batch of changes settles
+        DWORD timeout = watch_child_resources(child);
+        if (watch && watch->last_change) {
+            DWORD elapsed = GetTickCount() - watch->last_change;
+            if (elapsed >= (DWORD)sketch->config.watch_debounce) return 0;
+            if (sketch->config.watch_debounce - elapsed < timeout) timeout = sketch->config.watch_debounce - elapsed;
+        }
+        wait_children(&child, 1, watch, timeout);
+
+        read_output(&child->out);
+        read_output(&child->err);
+        if (watch) watch_poll(watch);
+
+        if (child_exited(child)) return 1;
+    }
+}
+
+// Say what the last fold did, and print the duplicate definitions it found
+static void report_fold(void) {
+    if (sketch->cached) {
+        printf("Foldcessing: Folded %d source files (from cache).\n\n\n", sketch->file_count);
+    } else if (sketch->rewritten < 0) {
+        printf("Foldcessing: Folded %d source files.\n\n\n", sketch->file_count);
+    } else if (sketch->rewritten == 0) {
+        printf("Foldcessing: Folded %d source files (unchanged).\n\n\n", sketch->file_count);
+    } else {
+        printf("Foldcessing: Folded %d source files (%d rewritten).\n\n\n", sketch->file_count, sketch->rewritten);
+    }
+    if (sketch->duplicate_count) {
+        fflush(stdout);
+        fputs(sketch->duplicate_report, stderr);
+        fflush(stderr);
+    }
+}
+
+// Bring files[] and output.pde up to date after a batch of changes
+static int refold(const char *output_dir, DirectoryWatch *watch) {
+    FileEntry *files = sketch->files;
+    int file_count = sketch->file_count;
+
+    // Modified files only need their size and time refreshed, fold_sketch does the rest
+    for (int c = 0; c < watch->changed_count && !watch->rescan; c++) {
+        int found = 0;
+        for (int i = 0; i < file_count; i++) {
+            if (strcmp(files[i].relative, watch->changed[c]) == 0) {
+                WIN32_FILE_ATTRIBUTE_DATA info;
+                if (!GetFileAttributesEx(files[i].path, GetFileExInfoStandard, &info)) break;
+                files[i].size = ((unsigned long long)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+                files[i].mtime = ((unsigned long long)info.ftLastWriteTime.dwHighDateTime << 32) |
+                                 info.ftLastWriteTime.dwLowDateTime;
+                found = 1;
+                break;
+            }
+        }
+        if (!found) watch->rescan = 1;
+    }
+
+    if (watch->rescan && !scan_sketch(sketch)) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+
+    watch_reset(watch);
+    if (fold_sketch(sketch, output_dir) != 0) return 1;
+    report_fold();
+    return 0;
+}
+
+// Output folder
+//
+// The output folder and the junction to data/ are handled with file APIs instead of running
+// mklink and rmdir through cmd.exe (on POSIX data/ is a symbolic link). The folder can be
+// kept between runs (keep_output) and placed under output_root, a RAM disk for example.
+// processing-java wants the folder named after output.pde, so there each sketch gets
+// <output_root>\<sketch>-<hash>\output.
+
+#ifdef _WIN32
+
+#ifndef FSCTL_SET_REPARSE_POINT
+#define FSCTL_SET_REPARSE_POINT 0x000900A4
+#endif
+
+#ifndef IO_REPARSE_TAG_MOUNT_POINT
+#define IO_REPARSE_TAG_MOUNT_POINT 0xA0000003
+#endif
+
+#ifndef FILE_FLAG_OPEN_REPARSE_POINT
+#define FILE_FLAG_OPEN_REPARSE_POINT 0x00200000
+#endif
+
+#define REPARSE_HEADER_SIZE 8    // Tag and length fields, not counted in reparse_data_length
+
+// Same layout as the mount point variant of REPARSE_DATA_BUFFER, declared here for TCC
+typedef struct {
+    DWORD reparse_tag;
+    WORD reparse_data_length;
+    WORD reserved;
+    WORD substitute_name_offset;
+    WORD substitute_name_length;
+    WORD print_name_offset;
+    WORD print_name_length;
+    WCHAR path_buffer[1];        // Substitute name, then print name, each NUL terminated
+} MountPointReparseBuffer;
+
+// Make link a junction to the absolute folder target, like mklink /J
+static int create_junction(const char *link, const char *target) {
+    static const WCHAR nt_prefix[] = {'\\', '?', '?', '\\'};
+    WCHAR wide_target[MAX_PATH_LEN];
+    int target_len = MultiByteToWideChar(CP_ACP, 0, target, -1, wide_target, MAX_PATH_LEN) - 1;
+    if (target_len <= 0) return 0;
+
+    // Substitute name \??\C:\dir, print name C:\dir
+    int substitute_len = 4 + target_len;
+    size_t size = offsetof(MountPointReparseBuffer, path_buffer) +
+                  (substitute_len + 1 + target_len + 1) * sizeof(WCHAR);
+    MountPointReparseBuffer *reparse = calloc(1, size);
+    if (!reparse) return 0;
+
+    reparse->reparse_tag = IO_REPARSE_TAG_MOUNT_POINT;
+    reparse->reparse_data_length = (WORD)(size - REPARSE_HEADER_SIZE);
+    reparse->substitute_name_offset = 0;
+    reparse->substitute_name_length = (WORD)(substitute_len * sizeof(WCHAR));
+    reparse->print_name_offset = (WORD)((substitute_len + 1) * sizeof(WCHAR));
+    reparse->print_name_length = (WORD)(target_len * sizeof(WCHAR));
+    memcpy(reparse->path_buffer, nt_prefix, sizeof(nt_prefix));
+    memcpy(reparse->path_buffer + 4, wide_target, target_len * sizeof(WCHAR));
+    memcpy(reparse->path_buffer + substitute_len + 1, wide_target, target_len * sizeof(WCHAR));
+
+    int ok = 0;
+    if (CreateDirectory(link, NULL)) {
+        HANDLE dir = CreateFile(link, GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+                                FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+        if (dir != INVALID_HANDLE_VALUE) {
+            DWORD returned;
+            ok = DeviceIoControl(dir, FSCTL_SET_REPARSE_POINT, reparse, (DWORD)size,
+                                 NULL, 0, &returned, NULL) != 0;
+            CloseHandle(dir);
+        }
+        if (!ok) RemoveDirectory(link);
+    }
+
+    free(reparse);
+    return ok;
+}
+
+#else
+
+// Make link a symbolic link to the absolute folder target
+static int create_junction(const char *link, const char *target) {
+    return symlink(target, link) == 0;
+}
+
+#endif
+
+// Delete a folder with everything in it; junctions and links are removed, never followed
+static int remove_tree(const char *path) {
+    DirList list;
+    if (list_open(&list, path)) {
+        ListEntry *found;
+        while ((found = list_next(&list)) != NULL) {
+            char child[MAX_PATH_LEN];
+            snprintf(child, sizeof(child), "%s" PATH_SEP "%s", path, found->name);
+
+            if (found->readonly) {
+                SetFileAttributes(child, FILE_ATTRIBUTE_NORMAL);
+            }
+
+            if (found->is_dir && !found->is_link) {
+                remove_tree(child);
+            } else if (found->is_dir) {
+                RemoveDirectory(child);
+            } else {
+                DeleteFile(child);
+            }
+        }
+        list_close(&list);
+    }
+
+    return RemoveDirectory(path);
+}
+
+// Pick (and create) the output folder of the sketch in current_dir
+static void make_output_dir(const char *current_dir, char *output_dir, size_t size) {
+    if (!sketch->config.output_root[0]) {
+        snprintf(output_dir, size, "%s" PATH_SEP "output", current_dir);
+        CreateDirectory(output_dir, NULL);
+        return;
+    }
+
+    const char *name = current_dir;
+    for (const char *p = current_dir; *p; p++) {
+        if (*p == '\\' || *p == '/') name = p + 1;
+    }
+
+    char sketch_dir[MAX_PATH_LEN];
+    // Sketches sharing a name are told apart by a hash of their full path
+    snprintf(sketch_dir, sizeof(sketch_dir), "%s" PATH_SEP "%s-%08x", sketch->config.output_root, name, path_hash(current_dir));
+    CreateDirectory(sketch_dir, NULL);
+    snprintf(output_dir, size, "%s" PATH_SEP "output", sketch_dir);
+    CreateDirectory(output_dir, NULL);
+}
+
+// Delete the output folder, and under output_root the sketch's folder around it
+static void remove_output_dir(const char *output_dir) {
+    remove_tree(output_dir);
+    if (sketch->config.output_root[0]) {
+        char sketch_dir[MAX_PATH_LEN];
+        snprintf(sketch_dir, sizeof(sketch_dir), "%s", output_dir);
+        char *slash = strrchr(sketch_dir, PATH_SEP_CHAR);
+        if (slash) {
+            *slash = '\0';
+            RemoveDirectory(sketch_dir);
+        }
+    }
+}
+
+// Build the processing-java command line for output_dir from the arguments after ours
+static void build_command(const char *output_dir, int argc, char *argv[], int first_arg,
+                          char *processing_path, char *command, size_t command_size) {
+    // Get processing-java path (already validated to exist)
+    if (first_arg < argc && argv[first_arg][0] != '-') {
+        snprintf(processing_path, MAX_PATH_LEN, "%s", argv[first_arg]);
+        first_arg++;
+    } else {
+        snprintf(processing_path, MAX_PATH_LEN, "%s", sketch->config.processing_path);
+    }
+
+    // Try adding .exe if needed
+    DWORD attribs = GetFileAttributes(processing_path);
+    if (attribs == INVALID_FILE_ATTRIBUTES && !ends_with(processing_path, ".exe")) {
+        char with_exe[MAX_PATH_LEN];
+        snprintf(with_exe, sizeof(with_exe), "%s.exe", processing_path);
+        if (GetFileAttributes(with_exe) != INVALID_FILE_ATTRIBUTES) {
+            strcpy(processing_path, with_exe);
+        }
+    }
+
+    int cmd_len = snprintf(command, command_size, "\"%s\" --sketch=\"%s\"", processing_path, output_dir);
+
+    // Append remaining arguments (--run, --present, etc.)
+    if (argc > first_arg) {
+        // Use command line arguments
+        for (int i = first_arg; i < argc && cmd_len < (int)command_size; i++) {
+            cmd_len += snprintf(command + cmd_len, command_size - cmd_len, " %s", argv[i]);
+        }
+    } else if (sketch->config.default_action[0]) {
+        // Use default action from config
+        snprintf(command + cmd_len, command_size - cmd_len, " %s", sketch->config.default_action);
+    }
+}
+
+// Run statistics
+//
+// --stats prints where the time of a run went and what was folded, and writes the same
+// numbers as one JSON object to STATS_NAME in the sketch folder. With stats_history each
+// run is also appended as a line to STATS_HISTORY_NAME, so trends can be graphed later.
+
+#define STATS_NAME ".foldcessing-stats.json"
+#define STATS_HISTORY_NAME ".foldcessing-stats.jsonl"
+
+// Print a phase time, or a dash when it never happened
+static void print_stats_time(const char *label, double ms, int happened) {
+    if (happened) {
+        printf("  %-16s %10.1f ms\n", label, ms);
+    } else {
+        printf("  %-16s %10s\n", label, "-");
+    }
+}
+
+// Human-readable summary on stdout
+static void print_stats(void) {
+    const FoldStats *folding = &sketch->stats;
+    printf("\nFoldcessing stats:\n");
+    print_stats_time("parse_config", stats.parse_config_ms, 1);
+    print_stats_time("collect_files", folding->collect_ms, 1);
+    print_stats_time("concatenation", folding->fold_ms, folding->folds > 0);
+    print_stats_time("symbol check", folding->symbol_check_ms, folding->folds > 0 && sketch->config.duplicate_symbols != DUPLICATES_OFF);
+    print_stats_time("data link", stats.data_link_ms, 1);
+    print_stats_time("child spawn", stats.spawn_ms, stats.children > 0);
+    print_stats_time("first output", stats.first_output_ms, stats.first_output_ms >= 0);
+    print_stats_time("child runtime", stats.child_ms, stats.children > 0);
+    print_stats_time("child CPU", stats.child_cpu_ms, stats.children > 0);
+    printf("  %d files scanned, %d ignored%s\n", folding->files_scanned, folding->files_ignored,
+           folding->git_index ? " (git index)" : "");
+    printf("  %lld bytes peak child memory, %d child processes\n", stats.child_peak_memory, stats.child_processes);
+    printf("  %d folds, %lld bytes written, %d lines\n", folding->folds, folding->bytes_written, sketch->map.total_lines);
+    printf("  %d symbols indexed, %d duplicate definitions\n", folding->symbols_indexed, folding->duplicate_symbols);
+    if (sketch->config.fold_cache[0]) {
+        printf("  %d folds from cache, %d missed, %d evicted, %d files hashed\n",
+               folding->cache_hits, folding->cache_misses, folding->cache_evicted, folding->files_hashed);
+    }
+    printf("  %d lookups translated, %d ambiguous (line wrapping), %d unmatched\n",
+           sketch->map.lookups_translated, sketch->map.lookups_ambiguous, sketch->map.lookups_missed);
+    printf("  %lld bytes peak output queued, %.1f ms blocked, %lld lines (%lld bytes) dropped\n",
+           stats.output_peak_bytes, stats.output_blocked_ms, stats.output_dropped_lines, stats.output_dropped_bytes);
+    fflush(stdout);
+}
+
+// The stats as one line of JSON; times that never happened are null
+static void write_stats_json(FILE *f) {
+    const FoldStats *folding = &sketch->stats;
+    SYSTEMTIME now;
+    GetSystemTime(&now);
+
+    char first_output[32];
+    if (stats.first_output_ms >= 0) {
+        snprintf(first_output, sizeof(first_output), "%.3f", stats.first_output_ms);
+    } else {
+        strcpy(first_output, "null");
+    }
+
+    fprintf(f, "{\"time\":\"%04d-%02d-%02dT%02d:%02d:%02dZ\","
+               "\"parse_config_ms\":%.3f,\"collect_files_ms\":%.3f,\"concatenation_ms\":%.3f,"
+               "\"data_link_ms\":%.3f,\"child_spawn_ms\":%.3f,\"first_output_ms\":%s,"
+               "\"child_runtime_ms\":%.3f,\"child_cpu_ms\":%.3f,\"child_peak_memory_bytes\":%lld,"
+               "\"child_processes\":%d,\"folds\":%d,\"children\":%d,"
+               "\"files_scanned\":%d,\"files_ignored\":%d,\"bytes_written\":%lld,"
+               "\"total_lines\":%d,\"symbol_check_ms\":%.3f,\"symbols_indexed\":%d,"
+               "\"duplicate_symbols\":%d,\"lookups_translated\":%d,\"lookups_ambiguous\":%d,"
+               "\"lookups_unmatched\":%d,\"output_peak_bytes\":%lld,\"output_blocked_ms\":%.3f,"
+               "\"output_dropped_lines\":%lld,\"output_dropped_bytes\":%lld,\"fold_cache_hits\":%d,"
+               "\"fold_cache_misses\":%d,\"fold_cache_evicted\":%d,\"files_hashed\":%d,\"git_index\":%s}\n",
+            now.wYear, now.wMonth, now.wDay, now.wHour, now.wMinute, now.wSecond,
+            stats.parse_config_ms, folding->collect_ms, folding->fold_ms,
+            stats.data_link_ms, stats.spawn_ms, first_output,
+            stats.child_ms, stats.child_cpu_ms, stats.child_peak_memory,
+            stats.child_processes, folding->folds, stats.children,
+            folding->files_scanned, folding->files_ignored, folding->bytes_written,
+            sketch->map.total_lines, folding->symbol_check_ms, folding->symbols_indexed,
+            folding->duplicate_symbols, sketch->map.lookups_translated, sketch->map.lookups_ambiguous,
+            sketch->map.lookups_missed, stats.output_peak_bytes, stats.output_blocked_ms,
+            stats.output_dropped_lines, stats.output_dropped_bytes, folding->cache_hits,
+            folding->cache_misses, folding->cache_evicted, folding->files_hashed,
+            folding->git_index ? "true" : "false");
+}
+
+// Print the summary and save the JSON next to the sketch
+static void report_stats(void) {
+    if (!sketch->config.stats) return;
+    print_stats();
+
+    FILE *f = fopen(STATS_NAME, "w");
+    if (f) {
+        write_stats_json(f);
+        fclose(f);
+    } else {
+        fprintf(stderr, "Warning: Cannot write %s\n", STATS_NAME);
+    }
+
+    if (sketch->config.stats_history) {
+        f = fopen(STATS_HISTORY_NAME, "a");
+        if (f) {
+            write_stats_json(f);
+            fclose(f);
+        } else {
+            fprintf(stderr, "Warning: Cannot append to %s\n", STATS_HISTORY_NAME);
+        }
+    }
+}
+
+// Resident daemon
+//
+// --daemon folds once and then stays up with the config, files[], line_map and a watch of
+// the sketch folder in memory, refolding in the background as sources change. A plain
+// foldcessing run in the same folder finds it through a pipe (a Unix socket on POSIX) named
+// after the sketch path, hands over its arguments and streams back the translated output,
+// so a build on save costs a pipe round trip plus whatever changed. One client is served
+// at a time; a client finding the daemon busy (running a sketch) folds on its own.
+
+// Send formatted text to the client
+static void client_printf(const char *format, ...) {
+    char text[MAX_LINE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (len > (int)sizeof(text) - 1) len = sizeof(text) - 1;
+    if (len > 0) emit_output(text, len);
+}
+
+// Fold what changed and run processing-java with the client's arguments
+static DWORD serve_request(HANDLE pipe, const char *current_dir, const char *output_dir, DirectoryWatch *watch) {
+    FrameHeader header;
+    char *request;
+    if (!receive_frame(pipe, &header, &request)) return 1;
+    if (header.type != FRAME_REQUEST) {
+        free(request);
+        return 1;
+    }
+
+    // Arguments arrive NUL terminated, one after the other
+    int argc = 0;
+    for (DWORD i = 0; i < header.length; i++) {
+        if (request[i] == '\0') argc++;
+    }
+    char **argv = malloc(sizeof(char*) * (argc + 1));
+    char *arg = request;
+    for (int i = 0; i < argc; i++) {
+        argv[i] = arg;
+        arg += strlen(arg) + 1;
+    }
+    argv[argc] = NULL;
+
+    daemon_client = pipe;
+    DWORD exit_code = 0;
+
+    // Pick up changes not folded yet, such as the save that triggered this build
+    watch_poll(watch);
+    if ((watch->changed_count || watch->rescan) && refold(output_dir, watch) != 0) {
+        client_printf("Error: Folding failed, see the daemon's console\n");
+        exit_code = 1;
+    } else {
+        client_printf("Foldcessing: Folded %d source files.\n", sketch->file_count);
+        if (sketch->duplicate_count) emit_output(sketch->duplicate_report, sketch->duplicate_report_len);
+    }
+
+    int wants_processing = (argc > 0) || (sketch->config.processing_path[0] && sketch->config.default_action[0]);
+    if (exit_code == 0 && wants_processing && launch_blocked(sketch)) {
+        client_printf("Foldcessing: Not starting processing-java, %d duplicate definitions.\n", sketch->duplicate_count);
+        exit_code = 1;
+    } else if (exit_code == 0 && wants_processing) {
+        char processing_path[MAX_PATH_LEN];
+        char command[8192];
+        build_command(output_dir, argc, argv, 0, processing_path, command, sizeof(command));
+
+        ChildProcess child;
+        if (start_child(command, NULL, &child)) {
+            pump_child(&child, NULL);
+            exit_code = finish_child(&child, 0);
+            if (sketch->config.stats) report_child_usage(&child.usage);
+        } else {
+            client_printf("Failed to launch processing-java: %s\n", processing_path);
+            exit_code = 1;
+        }
+    }
+
+    flush_output_sink();
+    daemon_client = NULL;
+    send_frame(pipe, FRAME_EXIT, &exit_code, sizeof(exit_code));
+    free(argv);
+    free(request);
+    return exit_code;
+}
+
+#ifdef _WIN32
+
+#ifndef PIPE_REJECT_REMOTE_CLIENTS
+#define PIPE_REJECT_REMOTE_CLIENTS 0x00000008
+#endif
+
+static int daemon_pipe_name(const char *current_dir, char *name, size_t size) {
+    snprintf(name, size, "%s%08x", DAEMON_PIPE_PREFIX, path_hash(current_dir));
+    return 1;
+}
+
+// Serve clients until killed, refolding whenever a batch of changes settles
+static int serve_daemon(const char *current_dir, const char *output_dir, DirectoryWatch *watch) {
+    char name[128];
+    daemon_pipe_name(current_dir, name, sizeof(name));
+
+    HANDLE pipe = CreateNamedPipe(name, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                  PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                  1, PIPE_BUFFER_SIZE, PIPE_BUFFER_SIZE, 0, NULL);
+    if (pipe == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Error: Another daemon is already serving %s\n", current_dir);
+        return 1;
+    }
+    HANDLE connected = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    printf("Foldcessing: Daemon serving %s\n", current_dir);
+    fflush(stdout);
+    start_output_sink();
+
+    while (1) {
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.hEvent = connected;
+        ResetEvent(connected);
+
+        int waiting = 0;
+        if (!ConnectNamedPipe(pipe, &overlapped)) {
+            DWORD error = GetLastError();
+            if (error == ERROR_IO_PENDING) {
+                waiting = 1;
+            } else if (error != ERROR_PIPE_CONNECTED) {
+                DisconnectNamedPipe(pipe);
+                continue;
+            }
+        }
+
+        // Keep output.pde current while nobody is asking
+        while (waiting) {
+            DWORD timeout = INFINITE;
+            if (watch->last_change) {
+                DWORD elapsed = GetTickCount() - watch->last_change;
+                if (elapsed >= (DWORD)sketch->config.watch_debounce) {
+                    printf("Foldcessing: Changes detected, refolding.\n");
+                    fflush(stdout);
+                    refold(output_dir, watch);
+                    continue;
+                }
+                timeout = sketch->config.watch_debounce - elapsed;
+            }
+
+            HANDLE handles[2] = {connected, watch->event};
+            DWORD result = WaitForMultipleObjects(2, handles, FALSE, timeout);
+            watch_poll(watch);
+            if (result == WAIT_OBJECT_0) {
+                DWORD unused;
+                waiting = 0;
+                if (!GetOverlappedResult(pipe, &overlapped, &unused, FALSE)) {
+                    DisconnectNamedPipe(pipe);
+                    break;
+                }
+            }
+        }
+        if (waiting) continue;
+
+        serve_request(pipe, current_dir, output_dir, watch);
+        FlushFileBuffers(pipe);
+        DisconnectNamedPipe(pipe);
+    }
+}
+
+#else
+
+// Socket path of the daemon serving current_dir, in a folder only the user can get into:
+// foldcessing-daemon-UID under XDG_RUNTIME_DIR, or under /tmp without one. Returns 0 if
+// that folder cannot be made, or belongs to or is open to someone else.
+static int daemon_pipe_name(const char *current_dir, char *name, size_t size) {
+    const char *base = getenv("XDG_RUNTIME_DIR");
+    struct sockaddr_un address;
+    if (!base || !base[0] || strlen(base) + 60 > sizeof(address.sun_path)) base = "/tmp";
+
+    char dir[MAX_PATH_LEN];
+    struct stat st;
+    snprintf(dir, sizeof(dir), "%s/%s%lu", base, DAEMON_SOCKET_PREFIX, (unsigned long)getuid());
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) return 0;
+    if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+        return 0;
+    }
+    snprintf(name, size, "%s/%08x.sock", dir, path_hash(current_dir));
+    return 1;
+}
+
+// The process at the other end of a daemon connection runs as the same user
+static int peer_is_user(int fd) {
+#ifdef SO_PEERCRED
+    struct ucred credentials;
+    socklen_t len = sizeof(credentials);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &len) == 0 && credentials.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+// Socket a running daemon listens on, removed again when we are interrupted
+static char daemon_socket[128];
+
+// Connect to the daemon at name, returns the socket or -1 (also for another user's daemon)
+static int connect_daemon(const char *name) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", name);
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || !peer_is_user(fd)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Serve clients until killed, refolding whenever a batch of changes settles
+static int serve_daemon(const char *current_dir, const char *output_dir, DirectoryWatch *watch) {
+    char name[128];
+    if (!daemon_pipe_name(current_dir, name, sizeof(name))) {
+        fprintf(stderr, "Error: No private folder for the daemon socket, see XDG_RUNTIME_DIR\n");
+        return 1;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", name);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        fprintf(stderr, "Error: Cannot create the daemon socket %s\n", name);
+        return 1;
+    }
+    fcntl(listener, F_SETFD, FD_CLOEXEC);
+
+    int bound = bind(listener, (struct sockaddr*)&address, sizeof(address)) == 0;
+    if (!bound && errno == EADDRINUSE) {
+        // A socket nobody answers on was left behind by a daemon that died, take it over
+        int other = connect_daemon(name);
+        if (other >= 0) {
+            close(other);
+        } else if (unlink(name) == 0) {
+            bound = bind(listener, (struct sockaddr*)&address, sizeof(address)) == 0;
+        }
+    }
+    if (!bound || listen(listener, 8) != 0) {
+        fprintf(stderr, "Error: Another daemon is already serving %s\n", current_dir);
+        close(listener);
+        return 1;
+    }
+    snprintf(daemon_socket, sizeof(daemon_socket), "%s", name);
+
+    printf("Foldcessing: Daemon serving %s\n", current_dir);
+    fflush(stdout);
+    start_output_sink();
+
+    while (1) {
+        // Keep output.pde current while nobody is asking
+        int timeout = -1;
+        if (watch->last_change) {
+            DWORD elapsed = GetTickCount() - watch->last_change;
+            if (elapsed >= (DWORD)sketch->config.watch_debounce) {
+                printf("Foldcessing: Changes detected, refolding.\n");
+                fflush(stdout);
+                refold(output_dir, watch);
+                continue;
+            }
+            timeout = (int)(sketch->config.watch_debounce - elapsed);
+        }
+
+        struct pollfd fds[2] = {{listener, POLLIN, 0}, {watch->fd, POLLIN, 0}};
+        poll(fds, 2, timeout);
+        watch_poll(watch);
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        int client = accept(listener, NULL, NULL);
+        if (client < 0) continue;
+        fcntl(client, F_SETFD, FD_CLOEXEC);
+        if (!peer_is_user(client)) {
+            close(client);
+            continue;
+        }
+
+        HANDLE pipe = new_handle(HANDLE_FILE, client);
+        if (!pipe) {
+            close(client);
+            continue;
+        }
+        serve_request(pipe, current_dir, output_dir, watch);
+        CloseHandle(pipe);
+    }
+}
+
+#endif
+
+// Hand our arguments to a daemon serving current_dir and relay its answer, waiting while it
+// serves someone else. Returns -1 when no daemon is running there.
+static int run_client(const char *current_dir, int argc, char *argv[], int first_arg) {
+    char name[128];
+    if (!daemon_pipe_name(current_dir, name, sizeof(name))) return -1;
+
+#ifdef _WIN32
+    HANDLE pipe;
+    while (1) {
+        pipe = CreateFile(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        if (pipe != INVALID_HANDLE_VALUE) break;
+        if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipe(name, NMPWAIT_WAIT_FOREVER)) return -1;
+    }
+#else
+    // A busy daemon leaves us in its listen queue until it is done
+    int fd = connect_daemon(name);
+    if (fd < 0) return -1;
+    HANDLE pipe = new_handle(HANDLE_FILE, fd);
+    if (!pipe) {
+        close(fd);
+        return -1;
+    }
+#endif
+
+    size_t request_size = 0;
+    for (int i = first_arg; i < argc; i++) {
+        request_size += strlen(argv[i]) + 1;
+    }
+    char *request = malloc(request_size + 1);
+    char *p = request;
+    for (int i = first_arg; i < argc; i++) {
+        size_t len = strlen(argv[i]) + 1;
+        memcpy(p, argv[i], len);
+        p += len;
+    }
+
+    int exit_code = 1;
+    int finished = 0;
+    if (send_frame(pipe, FRAME_REQUEST, request, request_size)) {
+        FrameHeader header;
+        char *data;
+        while (!finished && receive_frame(pipe, &header, &data)) {
+            if (header.type == FRAME_OUTPUT) {
+                fwrite(data, 1, header.length, stdout);
+                fflush(stdout);
+            } else if (header.type == FRAME_EXIT && header.length == sizeof(DWORD)) {
+                exit_code = (int)*(DWORD*)data;
+                finished = 1;
+            }
+            free(data);
+        }
+    }
+    if (!finished) {
+        fprintf(stderr, "Error: Lost connection to the foldcessing daemon\n");
+        exit_code = 1;
     }
 
-    fclose(f);
+    free(request);
+    CloseHandle(pipe);
+    return exit_code;
 }
 
-// Check if string ends with suffix
-int ends_with(const char *str, const char *suffix) {
-    size_t str_len = strlen(str);
-    size_t suffix_len = strlen(suffix);
-    if (suffix_len > str_len) return 0;
-    return strcasecmp_win(str + str_len - suffix_len, suffix) == 0;
-}
+// Batch mode
+//
+// --batch folds and builds many sketches at once. Every sketch root gets a foldcessing
+// process of its own (this executable, started there with --no-daemon), so each keeps its
+// own .foldcessing and output folder, inside a kill-on-close job like any child. At most
+// `jobs` run at a time; their output is relayed line by line behind a [root] prefix and a
+// pass/fail summary with timings closes the run.
 
-// Recursively collect .pde files
-void collect_files(const char *dir_path, const char *relative_path) {
-    WIN32_FIND_DATA find_data;
-    HANDLE hFind;
-    char search_path[MAX_PATH_LEN];
+#define MAX_BATCH_JOBS 16                // Three wait handles each, WaitForMultipleObjects takes 64
+#define DEFAULT_BATCH_ACTION "--build"
 
-    snprintf(search_path, sizeof(search_path), "%s\\*", dir_path);
+#define BATCH_WAITING 0
+#define BATCH_RUNNING 1
+#define BATCH_DONE 2
 
-    hFind = FindFirstFile(search_path, &find_data);
-    if (hFind == INVALID_HANDLE_VALUE) return;
+typedef struct {
+    char *root;                  // As listed or found, relative to the current folder
+    char *prefix;                // "[root] "
+    ChildProcess child;
+    int state;
+    DWORD exit_code;
+    double started;              // clock_ms() at launch
+    double ms;
+} BatchJob;
 
-    // Collect directories and files separately
-    char **directories = malloc(sizeof(char*) * 1000);
-    char **dir_relatives = malloc(sizeof(char*) * 1000);
-    char **pde_files = malloc(sizeof(char*) * 1000);
-    char **pde_relatives = malloc(sizeof(char*) * 1000);
-    int dir_count = 0, pde_count = 0;
+typedef struct {
+    BatchJob *items;
+    int count;
+    int capacity;
+} BatchList;
 
-    do {
-        if (strcmp(find_data.cFileName, ".") == 0 ||
-            strcmp(find_data.cFileName, "..") == 0) continue;
+static void add_batch_job(BatchList *list, const char *root) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->items = realloc(list->items, sizeof(BatchJob) * list->capacity);
+    }
+    BatchJob *job = &list->items[list->count++];
+    memset(job, 0, sizeof(*job));
+    job->root = _strdup(root);
+    job->prefix = malloc(strlen(root) + 4);
+    sprintf(job->prefix, "[%s] ", root);
+}
 
-        // Skip output directory
-        if (strcasecmp_win(find_data.cFileName, "output") == 0 &&
-            (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) continue;
+static int compare_batch_jobs(const void *a, const void *b) {
+    return _stricmp(((const BatchJob*)a)->root, ((const BatchJob*)b)->root);
+}
 
-        char full_path[MAX_PATH_LEN];
-        snprintf(full_path, sizeof(full_path), "%s\\%s", dir_path, find_data.cFileName);
+// Add every folder below relative holding a .foldcessing, without looking inside those
+static void find_sketch_roots(BatchList *list, const char *relative) {
+    DirList listing;
+    if (!list_open(&listing, relative)) return;
 
-        char new_relative[MAX_PATH_LEN];
-        if (strlen(relative_path) == 0) {
-            snprintf(new_relative, sizeof(new_relative), "%s", find_data.cFileName);
+    ListEntry *found;
+    while ((found = list_next(&listing)) != NULL) {
+        if (!found->is_dir || found->is_link) continue;
+        if (found->name[0] == '.') continue;  // .git and the like
+        if (strcasecmp_win(found->name, "output") == 0) continue;
+
+        char child[MAX_PATH_LEN];
+        if (strcmp(relative, ".") == 0) {
+            snprintf(child, sizeof(child), "%s", found->name);
         } else {
-            snprintf(new_relative, sizeof(new_relative), "%s/%s", relative_path, find_data.cFileName);
+            snprintf(child, sizeof(child), "%s" PATH_SEP "%s", relative, found->name);
         }
 
-        // Check if this path should be ignored
-        if (should_ignore(new_relative)) continue;
-
-        if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-            directories[dir_count] = _strdup(full_path);
-            dir_relatives[dir_count] = _strdup(new_relative);
-            dir_count++;
-        } else if (ends_with(find_data.cFileName, ".pde")) {
-            pde_files[pde_count] = _strdup(full_path);
-            pde_relatives[pde_count] = _strdup(new_relative);
-            pde_count++;
+        char config_path[MAX_PATH_LEN];
+        snprintf(config_path, sizeof(config_path), "%s" PATH_SEP ".foldcessing", child);
+        if (GetFileAttributes(config_path) != INVALID_FILE_ATTRIBUTES) {
+            add_batch_job(list, child);
+        } else {
+            find_sketch_roots(list, child);
         }
-    } while (FindNextFile(hFind, &find_data));
+    }
 
-    FindClose(hFind);
+    list_close(&listing);
+}
 
-    // Sort directories alphabetically
-    for (int i = 0; i < dir_count - 1; i++) {
-        for (int j = i + 1; j < dir_count; j++) {
-            char *name_i = strrchr(directories[i], '\\');
-            char *name_j = strrchr(directories[j], '\\');
-            if (name_i && name_j && strcasecmp_win(name_i + 1, name_j + 1) > 0) {
-                char *temp = directories[i];
-                directories[i] = directories[j];
-                directories[j] = temp;
-                temp = dir_relatives[i];
-                dir_relatives[i] = dir_relatives[j];
-                dir_relatives[j] = temp;
-            }
-        }
-    }
+// Read sketch roots from a file, one per line; blank lines and # comments are skipped
+static int read_sketch_list(BatchList *list, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
 
-    // Sort pde files alphabetically
-    for (int i = 0; i < pde_count - 1; i++) {
-        for (int j = i + 1; j < pde_count; j++) {
-            char *name_i = strrchr(pde_files[i], '\\');
-            char *name_j = strrchr(pde_files[j], '\\');
-            if (name_i && name_j && strcasecmp_win(name_i + 1, name_j + 1) > 0) {
-                char *temp = pde_files[i];
-                pde_files[i] = pde_files[j];
-                pde_files[j] = temp;
-                temp = pde_relatives[i];
-                pde_relatives[i] = pde_relatives[j];
-                pde_relatives[j] = temp;
-            }
-        }
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), f)) {
+        trim(line);
+        if (line[0] == '\0' || line[0] == '#') continue;
+        add_batch_job(list, line);
     }
+    fclose(f);
+    return 1;
+}
 
-    // Recursively process subdirectories (depth-first)
-    for (int i = 0; i < dir_count; i++) {
-        collect_files(directories[i], dir_relatives[i]);
-        free(directories[i]);
-        free(dir_relatives[i]);
+// Launch the foldcessing process of one sketch
+static void start_batch_job(BatchJob *job, const char *command) {
+    char working_dir[MAX_PATH_LEN];
+    if (!GetFullPathName(job->root, sizeof(working_dir), working_dir, NULL)) {
+        snprintf(working_dir, sizeof(working_dir), "%s", job->root);
     }
 
-    // Add .pde files from current directory
-    for (int i = 0; i < pde_count; i++) {
-        if (file_count < MAX_FILES) {
-            strcpy(files[file_count].path, pde_files[i]);
-            strcpy(files[file_count].relative, pde_relatives[i]);
-            file_count++;
-        }
-        free(pde_files[i]);
-        free(pde_relatives[i]);
+    job->started = clock_ms();
+    if (!start_child((char*)command, working_dir, &job->child)) {
+        printf("%sFailed to start foldcessing in %s\n", job->prefix, working_dir);
+        fflush(stdout);
+        job->state = BATCH_DONE;
+        job->exit_code = 1;
+        return;
     }
-
-    free(directories);
-    free(dir_relatives);
-    free(pde_files);
-    free(pde_relatives);
+    job->child.out.translator.prefix = job->prefix;
+    job->child.err.translator.prefix = job->prefix;
+    job->state = BATCH_RUNNING;
 }
 
-// Translate line number from output.pde to original source file
-void translate_line(int line_num, char *output, size_t output_size) {
-    // Java class file format stores line numbers as 16-bit unsigned (0-65535)
-    // If output.pde exceeds 65536 lines, reported line is actual_line % 65536
-    // Try all possible wrapped values: line_num, line_num+65536, line_num+131072, etc.
+static int run_batch(const char *list_path, int jobs, int argc, char *argv[], int first_arg) {
+    BatchList list = {0};
+    if (list_path) {
+        if (!read_sketch_list(&list, list_path)) {
+            fprintf(stderr, "Error: Cannot read sketch list %s\n", list_path);
+            return 1;
+        }
+    } else {
+        find_sketch_roots(&list, ".");
+        qsort(list.items, list.count, sizeof(BatchJob), compare_batch_jobs);
+    }
+    if (list.count == 0) {
+        fprintf(stderr, "Error: No sketches to build (folders holding a .foldcessing file)\n");
+        return 1;
+    }
 
-    #define LINE_WRAP 65536
+    if (jobs <= 0) {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        jobs = (int)info.dwNumberOfProcessors;
+    }
+    if (jobs > MAX_BATCH_JOBS) jobs = MAX_BATCH_JOBS;
+    if (jobs < 1) jobs = 1;
 
-    typedef struct {
-        int file_index;
-        int actual_line;
-        int original_line;
-    } MatchCandidate;
+    // Every sketch runs this executable with our processing-java arguments
+    char self[MAX_PATH_LEN];
+    GetModuleFileName(NULL, self, sizeof(self));
+    char command[8192];
+    int cmd_len = snprintf(command, sizeof(command), "\"%s\" --no-daemon", self);
+    if (argc > first_arg) {
+        for (int i = first_arg; i < argc && cmd_len < (int)sizeof(command); i++) {
+            cmd_len += snprintf(command + cmd_len, sizeof(command) - cmd_len, " %s", argv[i]);
+        }
+    } else {
+        snprintf(command + cmd_len, sizeof(command) - cmd_len, " %s", DEFAULT_BATCH_ACTION);
+    }
 
-    MatchCandidate candidates[10];  // Store up to 10 possible matches
-    int candidate_count = 0;
+    printf("Foldcessing: Building %d sketches, %d at a time.\n", list.count, jobs);
+    fflush(stdout);
 
-    // Try wrapped line numbers until we exceed total_lines
-    for (int k = 0; k * LINE_WRAP < total_lines && k < 10; k++) {
-        int candidate_line = line_num + (k * LINE_WRAP);
-        if (candidate_line > total_lines) break;
+    double batch_started = clock_ms();
+    int next = 0, running = 0;
+    start_output_sink();
+    while (1) {
+        while (running < jobs && next < list.count) {
+            start_batch_job(&list.items[next], command);
+            if (list.items[next].state == BATCH_RUNNING) running++;
+            next++;
+        }
+        if (running == 0) break;
 
-        // Check if this candidate falls within any file's range
-        for (int i = 0; i < file_count; i++) {
-            if (candidate_line >= line_map[i].start_line &&
-                candidate_line <= line_map[i].end_line) {
-                candidates[candidate_count].file_index = i;
-                candidates[candidate_count].actual_line = candidate_line;
-                candidates[candidate_count].original_line = candidate_line - line_map[i].start_line + 1;
-                candidate_count++;
-                break;  // Found match for this k, move to next
-            }
+        ChildProcess *children[MAX_BATCH_JOBS];
+        int count = 0;
+        for (int i = 0; i < next; i++) {
+            if (list.items[i].state == BATCH_RUNNING) children[count++] = &list.items[i].child;
         }
-    }
+        wait_children(children, count, NULL, INFINITE);
 
-    // Report based on number of matches
-    if (candidate_count == 0) {
-        // No match found - use literal line number
-        snprintf(output, output_size, "output.pde:%d", line_num);
-    } else if (candidate_count == 1) {
-        // Single match - report confidently
-        int i = candidates[0].file_index;
-        snprintf(output, output_size, "%s:%d",
-                 line_map[i].relative, candidates[0].original_line);
-    } else {
-        // Multiple matches - report all possibilities
-        char temp[MAX_LINE] = {0};
-        for (int j = 0; j < candidate_count; j++) {
-            int i = candidates[j].file_index;
-            char part[512];
-            snprintf(part, sizeof(part), "%s%s:%d",
-                     (j > 0) ? " or " : "",
-                     line_map[i].relative,
-                     candidates[j].original_line);
-            strncat(temp, part, sizeof(temp) - strlen(temp) - 1);
+        for (int i = 0; i < next; i++) {
+            BatchJob *job = &list.items[i];
+            if (job->state != BATCH_RUNNING) continue;
+            read_output(&job->child.out);
+            read_output(&job->child.err);
+            if (child_exited(&job->child)) {
+                job->exit_code = finish_child(&job->child, 0);
+                job->ms = clock_ms() - job->started;
+                job->state = BATCH_DONE;
+                running--;
+            }
         }
-        strncat(temp, " (line wrapping)", sizeof(temp) - strlen(temp) - 1);
-        snprintf(output, output_size, "%s", temp);
     }
-}
-
-// Process and translate a line of output from processing-java
-void process_output_line(const char *line) {
-    char buffer[MAX_LINE];
-    strcpy(buffer, line);
 
-    // Look for patterns like "output.pde:36" or "output.pde:36:4:36:4"
-    char *ptr = buffer;
-    while ((ptr = strstr(ptr, "output.pde:")) != NULL) {
-        ptr += 11; // Skip "output.pde:"
+    stop_output_sink();
 
-        char *end_ptr;
-        int line_num = strtol(ptr, &end_ptr, 10);
+    int failed = 0;
+    size_t width = 0;
+    for (int i = 0; i < list.count; i++) {
+        if (list.items[i].exit_code != 0) failed++;
+        if (strlen(list.items[i].root) > width) width = strlen(list.items[i].root);
+    }
 
-        if (end_ptr != ptr && line_num > 0) {
-            // Found a line number, translate it
-            char translated[MAX_PATH_LEN];
-            translate_line(line_num, translated, sizeof(translated));
+    printf("\nFoldcessing: %d of %d sketches passed in %.1f s\n",
+           list.count - failed, list.count, (clock_ms() - batch_started) / 1000.0);
+    for (int i = 0; i < list.count; i++) {
+        BatchJob *job = &list.items[i];
+        printf("  %s  %-*s %8.1f s %8.1f s CPU %6lld MB", job->exit_code ? "FAIL" : "PASS", (int)width, job->root,
+               job->ms / 1000.0, job->child.usage.cpu_ms / 1000.0, job->child.usage.peak_memory / (1024 * 1024));
+        if (job->exit_code) printf("  (exit code %lu)", (unsigned long)job->exit_code);
+        printf("\n");
+        free(job->root);
+        free(job->prefix);
+    }
+    fflush(stdout);
+    free(list.items);
 
-            // Parse optional column number
-            int col_num = -1;
-            if (*end_ptr == ':') {
-                char *col_end;
-                col_num = strtol(end_ptr + 1, &col_end, 10);
-                if (col_end != end_ptr + 1) {
-                    end_ptr = col_end;
-                }
-            }
+    return failed ? 1 : 0;
+}
 
-            // Skip any remaining :number:number patterns (redundant position info)
-            while (*end_ptr == ':') {
-                char *skip_end;
-                strtol(end_ptr + 1, &skip_end, 10);
-                if (skip_end == end_ptr + 1) break; // Not a number
-                end_ptr = skip_end;
-            }
+#ifndef _WIN32
 
-            // Print everything before "output.pde:"
-            char *start = strstr(buffer, "output.pde:");
-            *start = '\0';
-            printf("%s%s", buffer, translated);
-            if (col_num >= 0) {
-                printf(":%d", col_num);
-            }
-            printf("%s", end_ptr);
-            return;
-        }
+// Interrupted: take the children's process groups down too, as closing their jobs would,
+// and give the daemon's socket back. SIGTERM lets a batch's foldcessing do the same.
+static void handle_exit_signal(int sig) {
+    for (int i = 0; i < MAX_CHILD_GROUPS; i++) {
+        if (child_groups[i]) kill(-child_groups[i], SIGTERM);
     }
+    if (daemon_socket[0]) unlink(daemon_socket);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void install_signal_handlers(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_exit_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGHUP, &action, NULL);
 
-    // No translation needed, print as-is
-    printf("%s", line);
+    // A reader going away shows up as a failed write, like on Windows
+    signal(SIGPIPE, SIG_IGN);
 }
 
+#endif
+
 int main(int argc, char *argv[]) {
-    // Parse arguments for --profile
+    // Parse leading foldcessing arguments, everything after them is for processing-java
     char *profile = NULL;
+    int incremental = 0;
+    int stats_mode = 0;
+    int daemon_mode = 0;
+    int batch_mode = 0;
+    int batch_jobs = 0;
+    const char *sketch_list = NULL;
+    int watch_mode = 0;
+    int translate_mode = 0;
+    const char *map_path = NULL;
     int first_processing_arg = 1;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
-            profile = argv[i + 1];
-            first_processing_arg = i + 2;
+            profile = argv[++i];
+        } else if (strcmp(argv[i], "--incremental") == 0) {
+            incremental = 1;
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            watch_mode = 1;
+        } else if (strcmp(argv[i], "--translate") == 0) {
+            translate_mode = 1;
+        } else if (strcmp(argv[i], "--map") == 0 && i + 1 < argc) {
+            map_path = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats_mode = 1;
+        } else if (strcmp(argv[i], "--daemon") == 0) {
+            daemon_mode = 1;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch_mode = 1;
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            batch_jobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sketches") == 0 && i + 1 < argc) {
+            sketch_list = argv[++i];
+        } else if (strcmp(argv[i], "--no-daemon") == 0) {
+            // Like any of our arguments, keeps this run away from a daemon
+        } else {
             break;
         }
+        first_processing_arg = i + 1;
+    }
+
+#ifndef _WIN32
+    install_signal_handlers();
+#endif
+
+    // Plain runs go to a daemon serving this folder if there is one, it has everything loaded
+    if (first_processing_arg == 1) {
+        char current_dir[MAX_PATH_LEN];
+        GetCurrentDirectory(sizeof(current_dir), current_dir);
+        int exit_code = run_client(current_dir, argc, argv, first_processing_arg);
+        if (exit_code >= 0) return exit_code;
+    }
+
+    // Open the sketch in the current folder, which loads its config file
+    char current_dir[MAX_PATH_LEN];
+    GetCurrentDirectory(sizeof(current_dir), current_dir);
+    stats.first_output_ms = -1;
+    double phase_start = clock_ms();
+    sketch = foldcessing_open(current_dir, profile);
+    if (!sketch) {
+        fprintf(stderr, "Error: Cannot open the sketch in %s\n", current_dir);
+        return 1;
+    }
+    stats.parse_config_ms = clock_ms() - phase_start;
+    if (incremental) sketch->config.incremental = 1;
+    if (stats_mode) sketch->config.stats = 1;
+
+    // Watch mode refolds into the same output folder over and over, and so does the daemon
+    if (daemon_mode) watch_mode = 1;
+    if (watch_mode) sketch->config.incremental = 1;
+
+    // Translating a saved log needs nothing but the line map
+    if (translate_mode) {
+        if (!map_path && !sketch->config.line_map[0]) {
+            fprintf(stderr, "Error: No line map, set line_map in .foldcessing or use --map\n");
+            return 1;
+        }
+        return translate_log(map_path ? map_path : sketch->config.line_map);
+    }
+
+    // Batch mode only hands the sketches to foldcessing processes of their own
+    if (batch_mode) {
+        return run_batch(sketch_list, batch_jobs, argc, argv, first_processing_arg);
     }
 
-    // Load config file
-    parse_config(profile);
+    int has_console = 0;  // Default: assume command line or redirected
 
+#ifdef _WIN32
     // Detect if running from command line vs double-clicked
     // Try to attach to parent's console. If we can, we were launched from a terminal.
     // Load functions dynamically for TCC compatibility
     HMODULE kernel32 = GetModuleHandle("kernel32.dll");
     AttachConsoleFunc pAttachConsole = (AttachConsoleFunc)GetProcAddress(kernel32, "AttachConsole");
 
-    int has_console = 0;  // Default: assume command line or redirected
     if (pAttachConsole) {
         // Try to attach to parent - if this succeeds, we're from command line
         BOOL attached = pAttachConsole(ATTACH_PARENT_PROCESS);
@@ -497,10 +8111,11 @@ int main(int argc, char *argv[]) {
             // else: stdout is redirected (pipe/file) by build system - use existing handles
         }
     }
+#endif
 
     // Pre-validate: if we'll need processing-java, check it exists BEFORE folding
     int will_need_processing = (argc > first_processing_arg) ||
-                               (config.processing_path[0] && config.default_action[0]);
+                               (sketch->config.processing_path[0] && sketch->config.default_action[0]);
 
     if (will_need_processing) {
         // Get processing-java path
@@ -508,8 +8123,8 @@ int main(int argc, char *argv[]) {
 
         if (first_processing_arg < argc && argv[first_processing_arg][0] != '-') {
             snprintf(processing_path, sizeof(processing_path), "%s", argv[first_processing_arg]);
-        } else if (config.processing_path[0]) {
-            snprintf(processing_path, sizeof(processing_path), "%s", config.processing_path);
+        } else if (sketch->config.processing_path[0]) {
+            snprintf(processing_path, sizeof(processing_path), "%s", sketch->config.processing_path);
         } else {
             fprintf(stderr, "Error: processing-java path not specified\n");
             fprintf(stderr, "Either provide it on command line or add 'processing_path' to .foldcessing config\n");
@@ -565,87 +8180,69 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    // Get current directory
-    char current_dir[MAX_PATH_LEN];
-    GetCurrentDirectory(sizeof(current_dir), current_dir);
-
     // Collect all .pde files
-    collect_files(current_dir, "");
+    if (!scan_sketch(sketch)) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
 
     // Create output directory
     char output_dir[MAX_PATH_LEN];
-    snprintf(output_dir, sizeof(output_dir), "%s\\output", current_dir);
-    CreateDirectory(output_dir, NULL);
+    make_output_dir(current_dir, output_dir, sizeof(output_dir));
 
     // Check if data folder exists in project root and create junction in output folder
+    phase_start = clock_ms();
     char data_dir[MAX_PATH_LEN];
-    snprintf(data_dir, sizeof(data_dir), "%s\\data", current_dir);
+    snprintf(data_dir, sizeof(data_dir), "%s" PATH_SEP "data", current_dir);
     DWORD data_attribs = GetFileAttributes(data_dir);
     if (data_attribs != INVALID_FILE_ATTRIBUTES && (data_attribs & FILE_ATTRIBUTE_DIRECTORY)) {
         // Data folder exists, create junction in output folder
         char output_data_link[MAX_PATH_LEN];
-        snprintf(output_data_link, sizeof(output_data_link), "%s\\data", output_dir);
+        snprintf(output_data_link, sizeof(output_data_link), "%s" PATH_SEP "data", output_dir);
 
         // Remove old link/folder if it exists
         RemoveDirectory(output_data_link);
 
-        // Create junction using mklink command
-        char mklink_cmd[MAX_PATH_LEN * 2];
-        snprintf(mklink_cmd, sizeof(mklink_cmd), "cmd /c mklink /J \"%s\" \"%s\" >\\\\.\\NUL 2>&1",
-                 output_data_link, data_dir);
-        system(mklink_cmd);
+        create_junction(output_data_link, data_dir);
     }
+    stats.data_link_ms = clock_ms() - phase_start;
 
     // Create output file and build line mapping
-    char output_file[MAX_PATH_LEN];
-    snprintf(output_file, sizeof(output_file), "%s\\output.pde", output_dir);
-
-    FILE *out = fopen(output_file, "w");
-    if (!out) {
-        fprintf(stderr, "Error: Cannot create output file: %s\n", output_file);
+    if (fold_sketch(sketch, output_dir) != 0) {
         return 1;
     }
+    report_fold();
 
-    int current_line = 1;
-
-    // Concatenate all files and build line mapping
-    for (int i = 0; i < file_count; i++) {
-        line_map[i].start_line = current_line + 1; // +1 to skip header line
-        strcpy(line_map[i].relative, files[i].relative);
-
-        // Write header comment
-        fprintf(out, "//>/>/>%s\n", files[i].relative);
-        current_line++;
-
-        // Write file contents and count lines
-        FILE *in = fopen(files[i].path, "r");
-        if (in) {
-            char line[MAX_LINE];
-            while (fgets(line, sizeof(line), in)) {
-                fputs(line, out);
-                current_line++;
-            }
-            fclose(in);
+    // Start watching for changes before anything else can be edited
+    DirectoryWatch *watch = NULL;
+    if (watch_mode) {
+        watch = malloc(sizeof(DirectoryWatch));
+        if (!watch || !watch_start(watch, current_dir)) {
+            fprintf(stderr, "Error: Cannot watch %s for changes\n", current_dir);
+            return 1;
         }
-
-        line_map[i].end_line = current_line - 1;
-
-        // Blank line between files
-        fprintf(out, "\n");
-        current_line++;
     }
 
-    fclose(out);
-
-    // Store total line count for handling Java's 16-bit line number limitation
-    total_lines = current_line - 1;
+    if (daemon_mode) {
+        return serve_daemon(current_dir, output_dir, watch);
+    }
 
-    printf("Foldcessing: Folded %d source files.\n\n\n", file_count);
+    // Without processing-java, watch mode just keeps output.pde up to date
+    while (watch && !will_need_processing) {
+        printf("Foldcessing: Waiting for changes...\n");
+        fflush(stdout);
+        watch_wait(watch);
+        if (refold(output_dir, watch) != 0) {
+            return 1;
+        }
+    }
 
     // Determine if we should run processing-java (already validated above)
     if (!will_need_processing) {
+        report_stats();
+
         // If double-clicked and auto_close not enabled, pause before closing
-        if (has_console && !config.auto_close) {
+        if (has_console && !sketch->config.auto_close) {
             printf("\nPress Enter to continue...");
             fflush(stdout);
             getchar();
@@ -653,234 +8250,59 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
-    // Get processing-java path (already validated to exist)
-    char processing_path[MAX_PATH_LEN] = {0};
-
-    if (first_processing_arg < argc && argv[first_processing_arg][0] != '-') {
-        snprintf(processing_path, sizeof(processing_path), "%s", argv[first_processing_arg]);
-        first_processing_arg++;
-    } else {
-        snprintf(processing_path, sizeof(processing_path), "%s", config.processing_path);
-    }
-
-    // Try adding .exe if needed
-    DWORD attribs = GetFileAttributes(processing_path);
-    if (attribs == INVALID_FILE_ATTRIBUTES && !ends_with(processing_path, ".exe")) {
-        char with_exe[MAX_PATH_LEN];
-        snprintf(with_exe, sizeof(with_exe), "%s.exe", processing_path);
-        if (GetFileAttributes(with_exe) != INVALID_FILE_ATTRIBUTES) {
-            strcpy(processing_path, with_exe);
-        }
-    }
-
+    char processing_path[MAX_PATH_LEN];
     char command[8192];
-    int cmd_len = snprintf(command, sizeof(command), "\"%s\" --sketch=\"%s\"", processing_path, output_dir);
-
-    // Append remaining arguments (--run, --present, etc.)
-    if (argc > first_processing_arg) {
-        // Use command line arguments
-        for (int i = first_processing_arg; i < argc; i++) {
-            cmd_len += snprintf(command + cmd_len, sizeof(command) - cmd_len, " %s", argv[i]);
-        }
-    } else if (config.default_action[0]) {
-        // Use default action from config
-        cmd_len += snprintf(command + cmd_len, sizeof(command) - cmd_len, " %s", config.default_action);
-    }
-
-    // Create pipes for stdout and stderr
-    HANDLE hStdoutRead, hStdoutWrite;
-    HANDLE hStderrRead, hStderrWrite;
-    SECURITY_ATTRIBUTES sa = {sizeof(SECURITY_ATTRIBUTES), NULL, TRUE};
-
-    CreatePipe(&hStdoutRead, &hStdoutWrite, &sa, 0);
-    CreatePipe(&hStderrRead, &hStderrWrite, &sa, 0);
-    SetHandleInformation(hStdoutRead, HANDLE_FLAG_INHERIT, 0);
-    SetHandleInformation(hStderrRead, HANDLE_FLAG_INHERIT, 0);
-
-    // Spawn processing-java
-    STARTUPINFO si = {0};
-    si.cb = sizeof(si);
-    si.dwFlags = STARTF_USESTDHANDLES;
-    si.hStdOutput = hStdoutWrite;
-    si.hStdError = hStderrWrite;
-    si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
-
-    PROCESS_INFORMATION pi = {0};
-
-    // Create a Job Object to ensure all child processes are killed if foldcessing exits
-    // Load functions dynamically for TCC compatibility
-    HMODULE hKernel32 = GetModuleHandle("kernel32.dll");
-    CreateJobObjectFunc pCreateJobObject = (CreateJobObjectFunc)GetProcAddress(hKernel32, "CreateJobObjectA");
-    SetInformationJobObjectFunc pSetInformationJobObject = (SetInformationJobObjectFunc)GetProcAddress(hKernel32, "SetInformationJobObject");
-    AssignProcessToJobObjectFunc pAssignProcessToJobObject = (AssignProcessToJobObjectFunc)GetProcAddress(hKernel32, "AssignProcessToJobObject");
-
-    HANDLE hJob = NULL;
-    if (pCreateJobObject && pSetInformationJobObject && pAssignProcessToJobObject) {
-        hJob = pCreateJobObject(NULL, NULL);
-        if (hJob) {
-            // Use a byte buffer to avoid struct definition issues
-            char jeli[JOBOBJECT_EXTENDED_LIMIT_INFO_SIZE] = {0};
-            // LimitFlags is at offset 16 (after two LARGE_INTEGER fields)
-            *(DWORD*)(jeli + 16) = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
-            pSetInformationJobObject(hJob, JobObjectExtendedLimitInformation, &jeli, sizeof(jeli));
-        }
-    }
-
-    if (!CreateProcess(NULL, command, NULL, NULL, TRUE, CREATE_SUSPENDED, NULL, NULL, &si, &pi)) {
-        fprintf(stderr, "Failed to launch processing-java: %s\n", processing_path);
-        fprintf(stderr, "The file exists but cannot be executed.\n");
-        if (hJob) CloseHandle(hJob);
-        return 1;
-    }
-
-    // Assign the process to the job, then resume it
-    if (hJob && pAssignProcessToJobObject) {
-        pAssignProcessToJobObject(hJob, pi.hProcess);
-    }
-    ResumeThread(pi.hThread);
-
-    CloseHandle(hStdoutWrite);
-    CloseHandle(hStderrWrite);
+    build_command(output_dir, argc, argv, first_processing_arg, processing_path, command, sizeof(command));
 
-    // Read and translate output in real-time (chunk-based)
-    char stdout_line_buffer[MAX_LINE] = {0};
-    char stderr_line_buffer[MAX_LINE] = {0};
-    int stdout_pos = 0;
-    int stderr_pos = 0;
-    DWORD bytes_read;
-    DWORD avail;
-    char chunk[4096];
+    ChildProcess child;
+    DWORD exit_code = 0;
+    start_output_sink();
 
     while (1) {
-        int activity = 0;
-
-        // Read from stdout in chunks
-        if (PeekNamedPipe(hStdoutRead, NULL, 0, NULL, &avail, NULL) && avail > 0) {
-            DWORD to_read = (avail < sizeof(chunk)) ? avail : sizeof(chunk);
-            if (ReadFile(hStdoutRead, chunk, to_read, &bytes_read, NULL) && bytes_read > 0) {
-                activity = 1;
-                for (DWORD i = 0; i < bytes_read; i++) {
-                    char ch = chunk[i];
-                    if (ch == '\n' || ch == '\r') {
-                        if (stdout_pos > 0) {
-                            stdout_line_buffer[stdout_pos] = '\0';
-                            process_output_line(stdout_line_buffer);
-                            printf("\n");
-                            stdout_pos = 0;
-                        }
-                    } else if (stdout_pos < MAX_LINE - 1) {
-                        stdout_line_buffer[stdout_pos++] = ch;
-                    }
-                }
-                fflush(stdout);
-            }
-        }
-
-        // Read from stderr in chunks
-        if (PeekNamedPipe(hStderrRead, NULL, 0, NULL, &avail, NULL) && avail > 0) {
-            DWORD to_read = (avail < sizeof(chunk)) ? avail : sizeof(chunk);
-            if (ReadFile(hStderrRead, chunk, to_read, &bytes_read, NULL) && bytes_read > 0) {
-                activity = 1;
-                for (DWORD i = 0; i < bytes_read; i++) {
-                    char ch = chunk[i];
-                    if (ch == '\n' || ch == '\r') {
-                        if (stderr_pos > 0) {
-                            stderr_line_buffer[stderr_pos] = '\0';
-                            process_output_line(stderr_line_buffer);
-                            printf("\n");
-                            stderr_pos = 0;
-                        }
-                    } else if (stderr_pos < MAX_LINE - 1) {
-                        stderr_line_buffer[stderr_pos++] = ch;
-                    }
-                }
-                fflush(stdout);
+        int exited = 1;
+        if (launch_blocked(sketch)) {
+            fprintf(stderr, "Foldcessing: Not starting processing-java, %d duplicate definitions.\n",
+                    sketch->duplicate_count);
+            exit_code = 1;
+        } else {
+            stats.child_started = clock_ms();
+            if (!start_child(command, NULL, &child)) {
+                fprintf(stderr, "Failed to launch processing-java: %s\n", processing_path);
+                fprintf(stderr, "The file exists but cannot be executed.\n");
+                return 1;
             }
-        }
+            stats.spawn_ms += clock_ms() - stats.child_started;
+            stats.children++;
 
-        DWORD exit_code;
-        if (GetExitCodeProcess(pi.hProcess, &exit_code) && exit_code != STILL_ACTIVE) {
-            break;
-        }
-
-        if (!activity) {
-            Sleep(10);
+            exited = pump_child(&child, watch);
+            exit_code = finish_child(&child, !exited);
+            stats.child_ms += clock_ms() - stats.child_started;
+            if (sketch->config.stats) report_child_usage(&child.usage);
         }
-    }
+        if (!watch) break;
 
-    // Read any remaining output
-    while (PeekNamedPipe(hStdoutRead, NULL, 0, NULL, &avail, NULL) && avail > 0) {
-        DWORD to_read = (avail < sizeof(chunk)) ? avail : sizeof(chunk);
-        if (ReadFile(hStdoutRead, chunk, to_read, &bytes_read, NULL) && bytes_read > 0) {
-            for (DWORD i = 0; i < bytes_read; i++) {
-                char ch = chunk[i];
-                if (ch == '\n' || ch == '\r') {
-                    if (stdout_pos > 0) {
-                        stdout_line_buffer[stdout_pos] = '\0';
-                        process_output_line(stdout_line_buffer);
-                        printf("\n");
-                        stdout_pos = 0;
-                    }
-                } else if (stdout_pos < MAX_LINE - 1) {
-                    stdout_line_buffer[stdout_pos++] = ch;
-                }
-            }
+        if (exited) {
+            printf("\nFoldcessing: Waiting for changes...\n");
+            fflush(stdout);
+            watch_wait(watch);
         }
-    }
 
-    while (PeekNamedPipe(hStderrRead, NULL, 0, NULL, &avail, NULL) && avail > 0) {
-        DWORD to_read = (avail < sizeof(chunk)) ? avail : sizeof(chunk);
-        if (ReadFile(hStderrRead, chunk, to_read, &bytes_read, NULL) && bytes_read > 0) {
-            for (DWORD i = 0; i < bytes_read; i++) {
-                char ch = chunk[i];
-                if (ch == '\n' || ch == '\r') {
-                    if (stderr_pos > 0) {
-                        stderr_line_buffer[stderr_pos] = '\0';
-                        process_output_line(stderr_line_buffer);
-                        printf("\n");
-                        stderr_pos = 0;
-                    }
-                } else if (stderr_pos < MAX_LINE - 1) {
-                    stderr_line_buffer[stderr_pos++] = ch;
-                }
-            }
+        printf("\nFoldcessing: Changes detected, refolding.\n");
+        if (refold(output_dir, watch) != 0) {
+            return 1;
         }
     }
+    stop_output_sink();
 
-    // Flush any remaining partial lines
-    if (stdout_pos > 0) {
-        stdout_line_buffer[stdout_pos] = '\0';
-        process_output_line(stdout_line_buffer);
-        printf("\n");
-        fflush(stdout);
-    }
-    if (stderr_pos > 0) {
-        stderr_line_buffer[stderr_pos] = '\0';
-        process_output_line(stderr_line_buffer);
-        printf("\n");
-        fflush(stdout);
-    }
-
-    DWORD exit_code;
-    GetExitCodeProcess(pi.hProcess, &exit_code);
-
-    CloseHandle(hStdoutRead);
-    CloseHandle(hStderrRead);
-    CloseHandle(pi.hProcess);
-    CloseHandle(pi.hThread);
-
-    // Close the job object - this will kill all child processes if any are still running
-    if (hJob) {
-        CloseHandle(hJob);
+    // Cleanup: Delete the entire output folder, unless it is kept or the next run folds incrementally from it
+    if (!sketch->config.incremental && !sketch->config.keep_output) {
+        remove_output_dir(output_dir);
     }
 
-    // Cleanup: Delete the entire output folder
-    char rmdir_cmd[MAX_PATH_LEN + 50];
-    snprintf(rmdir_cmd, sizeof(rmdir_cmd), "rmdir /s /q \"%s\" >\\\\.\\NUL 2>&1", output_dir);
-    system(rmdir_cmd);
+    report_stats();
 
     // If double-clicked and auto_close not enabled, pause before closing
-    if (has_console && !config.auto_close) {
+    if (has_console && !sketch->config.auto_close) {
         printf("\nPress Enter to continue...");
         fflush(stdout);
         getchar();
@@ -888,3 +8310,5 @@ int main(int argc, char *argv[]) {
 
     return exit_code;
 }
+
+#endif
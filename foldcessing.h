@@ -0,0 +1,114 @@
+/*
+ * libfoldcessing - The Foldcessing fold engine as a library
+ *
+ * Copyright (C) 2025 Foldcessing Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Folds a sketch folder in-process, for IDE plugins and build servers that would rather not
+// start a foldcessing process per build:
+//
+//   FoldcessingSketch *sketch = foldcessing_open("path/to/sketch", NULL);
+//   FoldcessingMap *map = foldcessing_fold(sketch, write_source, &source);
+//   ... compile the source, then translate what the compiler said ...
+//   foldcessing_translate(map, log, log_len, write_log, &translated);
+//   foldcessing_map_free(map);
+//   foldcessing_close(sketch);
+//
+// The library keeps no state of its own. A sketch, a map or a translator may only be used by
+// one thread at a time, but any number of them can be used by different threads at once.
+// Running out of memory fails the call like any other error, with NULL, -1 or nonzero.
+
+#ifndef FOLDCESSING_H
+#define FOLDCESSING_H
+
+#include <stddef.h>
+
+// FOLDCESSING_SHARED is defined when building or using the shared library, FOLDCESSING_BUILD
+// only when building it
+#if defined(FOLDCESSING_SHARED) && defined(_WIN32)
+#ifdef FOLDCESSING_BUILD
+#define FOLDCESSING_API __declspec(dllexport)
+#else
+#define FOLDCESSING_API __declspec(dllimport)
+#endif
+#elif defined(FOLDCESSING_SHARED) && defined(__GNUC__)
+#define FOLDCESSING_API __attribute__((visibility("default")))
+#else
+#define FOLDCESSING_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct FoldcessingSketch FoldcessingSketch;
+typedef struct FoldcessingMap FoldcessingMap;
+typedef struct FoldcessingTranslator FoldcessingTranslator;
+
+// Receives folded source or translated output in pieces; return nonzero to fail the call
+typedef int (*FoldcessingWrite)(void *user, const char *data, size_t len);
+
+// Open the sketch in root with its .foldcessing (and [profile:NAME] section unless profile
+// is NULL), NULL if root is not a folder or out of memory
+FOLDCESSING_API FoldcessingSketch *foldcessing_open(const char *root, const char *profile);
+FOLDCESSING_API void foldcessing_close(FoldcessingSketch *sketch);
+
+// Scan the sketch folder and fold its sources into write, as output.pde would hold them.
+// Returns the line map of the fold, NULL if write failed or out of memory.
+FOLDCESSING_API FoldcessingMap *foldcessing_fold(FoldcessingSketch *sketch, FoldcessingWrite write, void *user);
+
+// Scan and fold into output_dir/output.pde like the command line tool does, incrementally
+// and through fold_cache if the config says so. output_dir must exist. Returns 0, or -1 if output.pde could not
+// be written or out of memory.
+FOLDCESSING_API int foldcessing_fold_folder(FoldcessingSketch *sketch, const char *output_dir);
+
+// Definitions found more than once by the last fold, one "file:line: Duplicate ..." line
+// each; the text stays valid until the next fold
+FOLDCESSING_API int foldcessing_duplicates(const FoldcessingSketch *sketch, const char **report);
+
+// The line map of the last fold, or one saved next to a sketch (.foldcessing.linemap);
+// NULL if there is none or out of memory
+FOLDCESSING_API FoldcessingMap *foldcessing_map(const FoldcessingSketch *sketch);
+FOLDCESSING_API FoldcessingMap *foldcessing_map_load(const char *path);
+FOLDCESSING_API void foldcessing_map_free(FoldcessingMap *map);
+
+// Lines of output.pde
+FOLDCESSING_API int foldcessing_map_lines(const FoldcessingMap *map);
+
+// Where output.pde line came from: fills in the first source file and its line, returns
+// how many places it could be (more than one once Java's line numbers wrapped at 65536)
+FOLDCESSING_API int foldcessing_map_lookup(const FoldcessingMap *map, int line, const char **file, int *file_line);
+
+// Translate compiler or sketch output: every "output.pde:LINE" (and "output.java:LINE" if
+// java_line_offset is configured) is replaced by the source file and line. The text is
+// passed through otherwise, line endings included. A translator takes the output in pieces
+// as it arrives; it holds back what may be an unfinished reference until the next piece.
+// The map must outlive the translator, and counts as in use by its thread meanwhile.
+FOLDCESSING_API FoldcessingTranslator *foldcessing_translator_new(FoldcessingMap *map, FoldcessingWrite write, void *user);
+FOLDCESSING_API int foldcessing_translator_feed(FoldcessingTranslator *translator, const char *data, size_t len);
+
+// Write out what was held back and free the translator, returns nonzero if a write failed
+FOLDCESSING_API int foldcessing_translator_finish(FoldcessingTranslator *translator);
+
+// All of it at once
+FOLDCESSING_API int foldcessing_translate(FoldcessingMap *map, const char *data, size_t len,
+                                          FoldcessingWrite write, void *user);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
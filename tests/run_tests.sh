@@ -0,0 +1,411 @@
+#!/bin/sh
+# End-to-end tests of a POSIX foldcessing build against stub-processing-java.
+#
+#   tests/run_tests.sh path/to/foldcessing [test...]
+#
+# Runs the named tests, or all of them, each in a fresh sketch under a temporary folder.
+# Exits non-zero if any test fails.
+
+FOLDCESSING=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+STUB=$(cd "$(dirname "$0")" && pwd)/stub-processing-java
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/foldcessing-tests.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+failures=0
+current=
+
+fail() {
+    echo "  $current: $*"
+    failures=$((failures + 1))
+}
+
+# expect_output FILE TEXT: FILE must contain the line fragment TEXT
+expect_output() {
+    grep -qF -- "$2" "$1" || fail "expected '$2' in:" "$(cat "$1")"
+}
+
+# new_sketch NAME: a sketch with two files, s.pde lines 1-3 are output.pde lines 7-9
+new_sketch() {
+    mkdir -p "$WORK/$1"
+    cd "$WORK/$1" || exit 1
+    printf 'void setup() {\n  size(100, 100);\n}\n' > "$(basename "$1").pde"
+    printf 'int a = 1;\nint b = 2;\nint c = 3;\n' > a.pde
+}
+
+# gone PID: the process has exited (killed processes may linger as zombies of an init that
+# does not reap)
+gone() {
+    state=$(ps -o stat= -p "$1" 2>/dev/null)
+    case $state in
+        ""|Z*) return 0 ;;
+    esac
+    return 1
+}
+
+test_translate() {
+    new_sketch translate
+    "$FOLDCESSING" "$STUB" --fail=8 > out.txt 2>&1
+    code=$?
+    [ $code -eq 1 ] || fail "exit code $code instead of 1"
+    expect_output out.txt "Folded 2 source files."
+    expect_output out.txt "translate.pde:2:5: Syntax Error"
+    [ ! -d output ] || fail "output folder left behind"
+}
+
+test_exit_code() {
+    new_sketch exit_code
+    "$FOLDCESSING" "$STUB" --exit=7 > out.txt 2>&1
+    code=$?
+    [ $code -eq 7 ] || fail "exit code $code instead of 7"
+}
+
+test_ignore() {
+    new_sketch ignore
+    printf 'int skipped = 1;\n' > skip_me.pde
+    mkdir vendor && printf 'int vendored = 1;\n' > vendor/lib.pde
+    printf 'ignore=skip_*.pde, vendor/\nkeep_output=1\n' > .foldcessing
+    "$FOLDCESSING" "$STUB" --build > out.txt 2>&1 || fail "failed with exit code $?"
+    expect_output out.txt "Folded 2 source files."
+    grep -q "skipped\|vendored" output/output.pde && fail "ignored files were folded"
+    expect_output output/output.pde "int b = 2;"
+}
+
+test_incremental() {
+    new_sketch incremental
+    "$FOLDCESSING" --incremental > out.txt 2>&1 || fail "failed with exit code $?"
+    "$FOLDCESSING" --incremental > out.txt 2>&1 || fail "failed with exit code $?"
+    expect_output out.txt "(unchanged)"
+    printf 'int a = 10;\nint b = 20;\n' > a.pde
+    "$FOLDCESSING" --incremental > out.txt 2>&1 || fail "failed with exit code $?"
+    expect_output out.txt "(1 rewritten)"
+    expect_output output/output.pde "int b = 20;"
+    grep -q "int c = 3;" output/output.pde && fail "stale content in output.pde"
+}
+
+test_data_link() {
+    new_sketch data_link
+    mkdir data && printf 'x' > data/image.png
+    "$FOLDCESSING" "$STUB" --list-data > out.txt 2>&1 || fail "failed with exit code $?"
+    expect_output out.txt "image.png"
+    [ -d data ] && [ -f data/image.png ] || fail "data folder damaged"
+}
+
+test_stats() {
+    new_sketch stats
+    "$FOLDCESSING" --stats "$STUB" --build > out.txt 2>&1 || fail "failed with exit code $?"
+    expect_output out.txt "Foldcessing stats:"
+    expect_output .foldcessing-stats.json '"files_scanned":2'
+}
+
+test_translate_log() {
+    new_sketch translate_log
+    "$FOLDCESSING" > out.txt 2>&1 || fail "failed with exit code $?"
+    ! ls -A | grep -q linemap || fail "line map written without line_map"
+    printf 'at output.pde:8\n' | "$FOLDCESSING" --translate > out.txt 2>&1 && fail "translated without a line map"
+    echo "line_map=sketch.linemap" > .foldcessing
+    "$FOLDCESSING" > out.txt 2>&1 || fail "failed with exit code $?"
+    printf 'at output.pde:8\n' | "$FOLDCESSING" --translate > out.txt 2>&1 || fail "failed with exit code $?"
+    expect_output out.txt "at translate_log.pde:2"
+}
+
+test_process_tree() {
+    new_sketch process_tree
+    "$FOLDCESSING" "$STUB" --spawn="$WORK/orphan.pid" --build > out.txt 2>&1 || fail "failed with exit code $?"
+    expect_output out.txt "Finished."
+    sleep 1
+    gone "$(cat "$WORK/orphan.pid")" || fail "process left behind by processing-java still runs"
+}
+
+test_interrupt() {
+    new_sketch interrupt
+    "$FOLDCESSING" "$STUB" --spawn="$WORK/child.pid" --sleep=60 > out.txt 2>&1 &
+    pid=$!
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        [ -s "$WORK/child.pid" ] && break
+        sleep 0.5
+    done
+    kill -TERM "$pid"
+    wait "$pid"
+    sleep 1
+    gone "$(cat "$WORK/child.pid")" || fail "processing-java's children survived the interrupt"
+}
+
+test_batch() {
+    mkdir -p "$WORK/batch" && cd "$WORK/batch" || exit 1
+    printf '#!/bin/sh\nexec "%s" "$@" --exit=4\n' "$STUB" > failing-java
+    chmod +x failing-java
+    for sketch in one two nested/three; do
+        mkdir -p $sketch
+        printf 'void setup() {\n}\n' > $sketch/$(basename $sketch).pde
+        printf 'processing_path=%s\n' "$STUB" > $sketch/.foldcessing
+    done
+    printf 'processing_path=%s/failing-java\n' "$WORK/batch" > two/.foldcessing
+    "$FOLDCESSING" --batch --jobs 2 > out.txt 2>&1
+    code=$?
+    [ $code -eq 1 ] || fail "exit code $code instead of 1"
+    expect_output out.txt "[one] Finished."
+    expect_output out.txt "[nested/three] Finished."
+    expect_output out.txt "2 of 3 sketches passed"
+    expect_output out.txt "FAIL  two"
+    expect_output out.txt "(exit code 4)"
+}
+
+test_daemon() {
+    new_sketch daemon
+    export XDG_RUNTIME_DIR="$WORK"
+    "$FOLDCESSING" --daemon > daemon.txt 2>&1 &
+    pid=$!
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        grep -q "Daemon serving" daemon.txt && break
+        sleep 0.5
+    done
+
+    "$FOLDCESSING" "$STUB" --fail=8 > out.txt 2>&1
+    code=$?
+    [ $code -eq 1 ] || fail "exit code $code instead of 1"
+    expect_output out.txt "daemon.pde:2:5: Syntax Error"
+
+    # Changes are picked up by the watch, or at the latest by the next request
+    printf 'int d = 4;\n' > b.pde
+    sleep 1
+    "$FOLDCESSING" "$STUB" --build > out.txt 2>&1 || fail "failed with exit code $?"
+    expect_output out.txt "Folded 3 source files."
+    expect_output out.txt "Finished."
+
+    kill -TERM "$pid"
+    wait "$pid"
+    ls "$WORK"/foldcessing-daemon-*/*.sock > /dev/null 2>&1 && fail "daemon socket left behind"
+    case $(ls -ld "$WORK"/foldcessing-daemon-*) in
+        drwx------*) ;;
+        *) fail "socket folder not private:" "$(ls -ld "$WORK"/foldcessing-daemon-*)" ;;
+    esac
+
+    # A socket folder others can get into is not used
+    chmod 755 "$WORK"/foldcessing-daemon-*
+    "$FOLDCESSING" --daemon > daemon.txt 2>&1
+    code=$?
+    [ $code -eq 1 ] || fail "daemon exit code $code instead of 1"
+    expect_output daemon.txt "No private folder for the daemon socket"
+    unset XDG_RUNTIME_DIR
+}
+
+test_duplicates() {
+    new_sketch duplicates
+    mkdir -p ui tools
+    printf '// void drawHUD() {\n/* void drawHUD() */\nvoid drawHUD() {\n  text("void drawHUD() {", 0, 0);\n}\n' > ui/hud.pde
+    printf 'int scale = 2;\n\nvoid drawHUD() {\n}\nvoid drawHUD(int x) {\n}\n' > tools/debug.pde
+    "$FOLDCESSING" "$STUB" --build > out.txt 2>&1 || fail "failed with exit code $?"
+    expect_output out.txt "ui/hud.pde:3: Duplicate function drawHUD(), first defined at tools/debug.pde:3"
+    [ "$(grep -c Duplicate out.txt)" -eq 1 ] || fail "expected exactly one duplicate in:" "$(cat out.txt)"
+    expect_output out.txt "Finished."
+
+    printf 'duplicate_symbols=abort\n' > .foldcessing
+    "$FOLDCESSING" "$STUB" --build > out.txt 2>&1
+    code=$?
+    [ $code -eq 1 ] || fail "exit code $code instead of 1"
+    expect_output out.txt "Not starting processing-java, 1 duplicate definitions."
+    grep -q "Finished." out.txt && fail "processing-java was started"
+
+    printf 'duplicate_symbols=off\n' > .foldcessing
+    "$FOLDCESSING" "$STUB" --build > out.txt 2>&1 || fail "failed with exit code $?"
+    grep -q Duplicate out.txt && fail "checked for duplicates with duplicate_symbols=off"
+    expect_output out.txt "Finished."
+}
+
+test_resources() {
+    new_sketch resources
+    "$FOLDCESSING" --stats "$STUB" --spawn="$WORK/resources.pid" --build > out.txt 2>&1 || fail "failed with exit code $?"
+    expect_output out.txt "Foldcessing: processing-java ran"
+    expect_output out.txt "child processes"
+    grep -q '"child_processes":[1-9]' .foldcessing-stats.json || fail "no child processes in:" "$(cat .foldcessing-stats.json)"
+    grep -q '"child_peak_memory_bytes":[1-9]' .foldcessing-stats.json || fail "no peak memory in:" "$(cat .foldcessing-stats.json)"
+
+    printf 'memory_limit_mb=20\npriority=below_normal\ncpu_affinity=0x1\n' > .foldcessing
+    "$FOLDCESSING" "$STUB" --allocate=200 --sleep=10 --build > out.txt 2>&1
+    code=$?
+    [ $code -ne 0 ] || fail "exit code 0 after going over the memory limit"
+    expect_output out.txt "went over memory_limit_mb=20, killed."
+    grep -q "Finished." out.txt && fail "processing-java was not killed"
+    grep -q "Warning" out.txt && fail "limits not applied:" "$(cat out.txt)"
+}
+
+test_fold_cache() {
+    new_sketch fold_cache
+    printf 'fold_cache=%s/cache\nincremental=1\nkeep_output=1\n' "$WORK" > .foldcessing
+    "$FOLDCESSING" --stats "$STUB" --build > out.txt 2>&1 || fail "failed with exit code $?"
+    expect_output .foldcessing-stats.json '"fold_cache_misses":1'
+    ls "$WORK"/cache/*.pde > /dev/null 2>&1 || fail "nothing cached"
+
+    # Another checkout of the same sources folds from the cache and translates as before
+    mkdir -p "$WORK/checkout/fold_cache"
+    cp fold_cache.pde a.pde .foldcessing "$WORK/checkout/fold_cache"
+    cd "$WORK/checkout/fold_cache" || exit 1
+    "$FOLDCESSING" --stats "$STUB" --fail=8 > out.txt 2>&1
+    code=$?
+    [ $code -eq 1 ] || fail "exit code $code instead of 1"
+    expect_output out.txt "Folded 2 source files (from cache)."
+    expect_output out.txt "fold_cache.pde:2:5: Syntax Error"
+    expect_output .foldcessing-stats.json '"files_hashed":2'
+    "$FOLDCESSING" --stats "$STUB" --build > out.txt 2>&1 || fail "failed with exit code $?"
+    expect_output out.txt "(from cache)"
+    expect_output .foldcessing-stats.json '"files_hashed":0'
+
+    # output.pde is changed in place without touching the cached fold it came from
+    printf 'int a = 10;\nint b = 20;\n' > a.pde
+    "$FOLDCESSING" "$STUB" --build > out.txt 2>&1 || fail "failed with exit code $?"
+    expect_output out.txt "(1 rewritten)"
+    grep -l "int c = 3;" "$WORK"/cache/*.pde > /dev/null || fail "cached fold changed in place"
+
+    # Over fold_cache_mb, the folds used longest ago are dropped: a fold of big.pde and its
+    # manifest of 40000 symbols take more than half of it
+    printf 'fold_cache=%s/cache\nfold_cache_mb=1\n' "$WORK" > .foldcessing
+    awk 'BEGIN { for (i = 0; i < 40000; i++) print "int v" i " = " i ";" }' > big.pde
+    "$FOLDCESSING" --stats "$STUB" --build > out.txt 2>&1 || fail "failed with exit code $?"
+    expect_output .foldcessing-stats.json '"fold_cache_evicted":2'
+    echo "int w = 0;" >> big.pde
+    "$FOLDCESSING" --stats "$STUB" --build > out.txt 2>&1 || fail "failed with exit code $?"
+    expect_output .foldcessing-stats.json '"fold_cache_evicted":1'
+    [ "$(ls "$WORK"/cache/*.pde | wc -l)" -eq 1 ] || fail "expected one fold left in:" "$(ls -l "$WORK"/cache)"
+    grep -q "int w = 0;" "$WORK"/cache/*.pde || fail "the newest fold was evicted"
+}
+
+# fold_with SCAN: fold with scan=SCAN, keeping output.pde as SCAN.txt
+fold_with() {
+    printf 'scan=%s\nignore=skip_*.pde, Vendor/\nkeep_output=1\n' "$1" > .foldcessing
+    "$FOLDCESSING" --stats "$STUB" --build > out.txt 2>&1 || fail "scan=$1 failed with exit code $?"
+    cp output/output.pde "$1.txt"
+}
+
+# The sketch in a folder of a git checkout: scan=git folds what the walk would of the files
+# git knows, scan=git_untracked also of those next to them
+test_git_index() {
+    if ! command -v git > /dev/null; then
+        echo "  $current: git not found, skipped"
+        return
+    fi
+    new_sketch repo/sketches/git_index
+    mkdir -p sub/deeper sub/output Vendor
+    printf 'int sub = 1;\n' > sub/B.pde
+    printf 'int deeper = 1;\n' > sub/deeper/c.pde
+    printf 'int second = 1;\n' > sub/a.pde
+    printf 'int skipped = 1;\n' > skip_me.pde
+    printf 'int folded = 1;\n' > sub/output/folded.pde
+    printf 'int vendored = 1;\n' > Vendor/lib.pde
+    printf 'int gone = 1;\n' > gone.pde
+    (cd "$WORK/repo" && git init -q && git add -A) || fail "git failed"
+    rm gone.pde
+
+    fold_with walk
+    fold_with git
+    expect_output .foldcessing-stats.json '"git_index":true'
+    cmp -s walk.txt git.txt || fail "scan=git folded differently:" "$(diff walk.txt git.txt)"
+    grep -q "skipped\|vendored\|folded\|gone" git.txt && fail "ignored or missing files were folded"
+
+    printf 'int untracked = 1;\n' > untracked.pde
+    printf 'int untracked_deeper = 1;\n' > sub/deeper/new.pde
+    fold_with git
+    grep -q "untracked" git.txt && fail "scan=git folded untracked files"
+    fold_with walk
+    fold_with git_untracked
+    cmp -s walk.txt git_untracked.txt || fail "scan=git_untracked folded differently:" "$(diff walk.txt git_untracked.txt)"
+
+    # Version 4 compresses the paths
+    (cd "$WORK/repo" && git add -A && git update-index --index-version 4) || fail "git failed"
+    fold_with git
+    cmp -s walk.txt git.txt || fail "index version 4 folded differently:" "$(diff walk.txt git.txt)"
+
+    # Outside a checkout it walks
+    rm -rf "$WORK/repo/.git"
+    fold_with git
+    expect_output .foldcessing-stats.json '"git_index":false'
+    cmp -s walk.txt git.txt || fail "the walk folded differently"
+}
+
+# Linked folders are folded like any other, but a link back up is not followed round
+test_links() {
+    new_sketch links
+    mkdir -p sub "$WORK/shared"
+    printf 'int shared = 1;\n' > "$WORK/shared/shared.pde"
+    ln -s "$WORK/shared" lib
+    ln -s .. sub/up
+    printf 'keep_output=1\n' > .foldcessing
+    "$FOLDCESSING" "$STUB" --build > out.txt 2>&1 || fail "failed with exit code $?"
+    expect_output out.txt "Folded 3 source files."
+    expect_output output/output.pde "//>/>/>lib/shared.pde"
+}
+
+# Eight readers prefetching into 1 MB keep waiting for the writer to free some, and files
+# over half of it are left to the writer; output.pde must still be what one thread folds
+test_read_threads() {
+    new_sketch read_threads
+    mkdir -p lib/big lib/medium lib/small
+    awk 'BEGIN {
+        for (f = 0; f < 300; f++) {
+            file = sprintf("lib/small/f%03d.pde", f)
+            for (i = 0; i <= f % 40; i++) print "int f" f "_" i " = " i ";" > file
+            if (f % 3 == 0) printf "void draw%d() {\n}", f > file
+            close(file)
+        }
+        for (f = 0; f < 20; f++) {
+            file = sprintf("lib/medium/m%02d.pde", f)
+            for (i = 0; i < 2000 + f * 400; i++) print "float medium" f "_" i " = " i " * 0.5;" > file
+            close(file)
+        }
+        for (f = 0; f < 2; f++) {
+            file = "lib/big/b" f ".pde"
+            for (i = 0; i < 30000; i++) print "float big" f "_" i " = " i " * 0.5;" > file
+            close(file)
+        }
+    }'
+    printf 'read_threads=1\nkeep_output=1\n' > .foldcessing
+    "$FOLDCESSING" "$STUB" --build > out.txt 2>&1 || fail "read_threads=1 failed with exit code $?"
+    cp output/output.pde serial.txt
+    printf 'read_threads=8\nread_buffer_mb=1\nkeep_output=1\n' > .foldcessing
+    "$FOLDCESSING" "$STUB" --build > out.txt 2>&1 || fail "read_threads=8 failed with exit code $?"
+    expect_output out.txt "Folded 324 source files."
+    cmp -s serial.txt output/output.pde || fail "read_threads=8 folded differently:" "$(diff serial.txt output/output.pde | head)"
+}
+
+# 100000 files in one folder, named in mixed case: all of them folded, in the order of their
+# lowercased names (ties by exact name)
+test_large_folder() {
+    new_sketch large_folder
+    mkdir -p many
+    awk 'BEGIN {
+        split("Shader shader_ SHADER a Z", prefixes, " ")
+        for (i = 0; i < 100000; i++) {
+            file = sprintf("many/%s%05d.pde", prefixes[i % 5 + 1], (i * 7919) % 100000)
+            print "int v" i ";" > file
+            close(file)
+        }
+    }'
+    printf 'int upper;\n' > many/Tie.pde
+    printf 'int lower;\n' > many/tie.pde
+    printf 'keep_output=1\n' > .foldcessing
+    "$FOLDCESSING" "$STUB" --build > out.txt 2>&1 || fail "failed with exit code $?"
+    expect_output out.txt "Folded 100004 source files."
+    grep '^//>/>/>many/' output/output.pde | cut -c 13- > listed.txt
+    [ "$(wc -l < listed.txt)" -eq 100002 ] || fail "expected 100002 files of many/, got $(wc -l < listed.txt)"
+    awk '{ print tolower($0) "/" $0 }' listed.txt > keys.txt
+    LC_ALL=C sort -c keys.txt 2> sort.txt || fail "out of order:" "$(cat sort.txt)"
+    grep -A 1 -x "Tie.pde" listed.txt | tail -n 1 | grep -qx "tie.pde" || fail "Tie.pde does not come right before tie.pde"
+}
+
+if [ $# -eq 0 ]; then
+    set -- translate exit_code ignore incremental data_link stats translate_log process_tree \
+           interrupt batch daemon duplicates resources fold_cache git_index links read_threads large_folder
+fi
+
+for name in "$@"; do
+    current=$name
+    before=$failures
+    test_$name
+    if [ $failures -eq $before ]; then
+        echo "PASS $name"
+    else
+        echo "FAIL $name"
+    fi
+done
+
+[ $failures -eq 0 ]
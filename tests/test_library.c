@@ -0,0 +1,342 @@
+/*
+ * test_library - Tests of libfoldcessing through foldcessing.h
+ *
+ * Copyright (C) 2025 Foldcessing Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Links against the library and uses nothing but its header, like an IDE plugin would.
+// Folds sketches made under a temporary folder, the same two files tests/run_tests.sh
+// starts from, so their line 2 is output.pde line 8. POSIX only, as the shell tests are.
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "../foldcessing.h"
+
+#define THREADS 4
+
+int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "  %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+// Output collected from a FoldcessingWrite
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} Buffer;
+
+int buffer_write(void *user, const char *data, size_t len) {
+    Buffer *buffer = (Buffer*)user;
+    if (buffer->len + len + 1 > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 256;
+        while (buffer->len + len + 1 > capacity) capacity *= 2;
+        char *grown = realloc(buffer->data, capacity);
+        if (!grown) return 1;
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    buffer->data[buffer->len] = '\0';
+    return 0;
+}
+
+int failing_write(void *user, const char *data, size_t len) {
+    (void)user;
+    (void)data;
+    (void)len;
+    return 1;
+}
+
+void write_text(const char *path, const char *text) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    fputs(text, f);
+    fclose(f);
+}
+
+// A sketch folder named name under work
+void new_sketch(const char *work, const char *name, char *folder, size_t size) {
+    char path[4096];
+    snprintf(folder, size, "%s/%s", work, name);
+    mkdir(folder, 0755);
+    snprintf(path, sizeof(path), "%s/%s.pde", folder, name);
+    write_text(path, "void setup() {\n  size(100, 100);\n}\n");
+    snprintf(path, sizeof(path), "%s/a.pde", folder);
+    write_text(path, "int a = 1;\nint b = 2;\nint c = 3;\n");
+}
+
+int count_lines(const Buffer *buffer) {
+    int lines = 0;
+    for (size_t i = 0; i < buffer->len; i++) lines += (buffer->data[i] == '\n');
+    return lines;
+}
+
+void test_fold(const char *work) {
+    char folder[4096];
+    new_sketch(work, "fold", folder, sizeof(folder));
+
+    CHECK(foldcessing_open("/nonexistent/sketch", NULL) == NULL);
+    FoldcessingSketch *sketch = foldcessing_open(folder, NULL);
+    CHECK(sketch != NULL);
+    if (!sketch) return;
+    CHECK(foldcessing_map(sketch) == NULL);
+
+    Buffer source = {0};
+    FoldcessingMap *map = foldcessing_fold(sketch, buffer_write, &source);
+    CHECK(map != NULL);
+    if (!map) return;
+    CHECK(strstr(source.data, "int b = 2;") != NULL);
+    CHECK(strstr(source.data, "size(100, 100);") != NULL);
+    CHECK(foldcessing_map_lines(map) == count_lines(&source));
+
+    const char *file = NULL;
+    int file_line = 0;
+    CHECK(foldcessing_map_lookup(map, 8, &file, &file_line) == 1);
+    CHECK(file && strcmp(file, "fold.pde") == 0);
+    CHECK(file_line == 2);
+    CHECK(foldcessing_map_lookup(map, foldcessing_map_lines(map) + 100, NULL, NULL) == 0);
+
+    const char *report = NULL;
+    CHECK(foldcessing_duplicates(sketch, &report) == 0);
+    CHECK(report && report[0] == '\0');
+
+    CHECK(foldcessing_fold(sketch, failing_write, NULL) == NULL);
+
+    // The map stays usable after the sketch is gone
+    foldcessing_close(sketch);
+    file = NULL;
+    CHECK(foldcessing_map_lookup(map, 8, &file, &file_line) == 1);
+    CHECK(file && strcmp(file, "fold.pde") == 0);
+    foldcessing_map_free(map);
+    free(source.data);
+}
+
+void test_translate(const char *work) {
+    char folder[4096];
+    new_sketch(work, "translate", folder, sizeof(folder));
+    FoldcessingSketch *sketch = foldcessing_open(folder, NULL);
+    CHECK(sketch != NULL);
+    if (!sketch) return;
+    Buffer source = {0};
+    FoldcessingMap *map = foldcessing_fold(sketch, buffer_write, &source);
+    CHECK(map != NULL);
+    if (!map) return;
+
+    const char *log = "output.pde:8:5: Syntax Error\r\nno reference here\nat output.pde:8";
+    const char *expected = "translate.pde:2:5: Syntax Error\r\nno reference here\nat translate.pde:2";
+
+    Buffer whole = {0};
+    CHECK(foldcessing_translate(map, log, strlen(log), buffer_write, &whole) == 0);
+    CHECK(whole.data && strcmp(whole.data, expected) == 0);
+
+    // A byte at a time, references split anywhere
+    Buffer pieces = {0};
+    FoldcessingTranslator *translator = foldcessing_translator_new(map, buffer_write, &pieces);
+    CHECK(translator != NULL);
+    for (size_t i = 0; translator && log[i]; i++) {
+        CHECK(foldcessing_translator_feed(translator, log + i, 1) == 0);
+    }
+    if (translator) CHECK(foldcessing_translator_finish(translator) == 0);
+    CHECK(pieces.data && strcmp(pieces.data, expected) == 0);
+
+    Buffer untranslated = {0};
+    CHECK(foldcessing_translate(NULL, log, strlen(log), buffer_write, &untranslated) == 0);
+    CHECK(untranslated.data && strcmp(untranslated.data, log) == 0);
+
+    CHECK(foldcessing_translate(map, log, strlen(log), failing_write, NULL) != 0);
+
+    foldcessing_map_free(map);
+    foldcessing_close(sketch);
+    free(source.data);
+    free(whole.data);
+    free(pieces.data);
+    free(untranslated.data);
+}
+
+void test_duplicates(const char *work) {
+    char folder[4096], path[4096];
+    new_sketch(work, "duplicates", folder, sizeof(folder));
+    snprintf(path, sizeof(path), "%s/b.pde", folder);
+    write_text(path, "void setup() {\n}\n");
+
+    FoldcessingSketch *sketch = foldcessing_open(folder, NULL);
+    CHECK(sketch != NULL);
+    if (!sketch) return;
+    Buffer source = {0};
+    FoldcessingMap *map = foldcessing_fold(sketch, buffer_write, &source);
+    CHECK(map != NULL);
+
+    const char *report = NULL;
+    CHECK(foldcessing_duplicates(sketch, &report) == 1);
+    CHECK(report && strstr(report, "Duplicate function setup()") != NULL);
+
+    foldcessing_map_free(map);
+    foldcessing_close(sketch);
+    free(source.data);
+}
+
+void test_fold_folder(const char *work) {
+    char folder[4096], output_dir[4096], path[4096];
+    new_sketch(work, "folder", folder, sizeof(folder));
+    snprintf(output_dir, sizeof(output_dir), "%s/output", folder);
+    mkdir(output_dir, 0755);
+    snprintf(path, sizeof(path), "%s/.foldcessing", folder);
+    write_text(path, "line_map=folder.linemap\n");
+
+    FoldcessingSketch *sketch = foldcessing_open(folder, NULL);
+    CHECK(sketch != NULL);
+    if (!sketch) return;
+    CHECK(foldcessing_fold_folder(sketch, output_dir) == 0);
+
+    snprintf(path, sizeof(path), "%s/output.pde", output_dir);
+    struct stat st;
+    CHECK(stat(path, &st) == 0 && st.st_size > 0);
+
+    // The sidecar --translate reads
+    snprintf(path, sizeof(path), "%s/folder.linemap", folder);
+    FoldcessingMap *loaded = foldcessing_map_load(path);
+    CHECK(loaded != NULL);
+    if (loaded) {
+        const char *file = NULL;
+        int file_line = 0;
+        CHECK(foldcessing_map_lookup(loaded, 8, &file, &file_line) == 1);
+        CHECK(file && strcmp(file, "folder.pde") == 0);
+        CHECK(file_line == 2);
+        foldcessing_map_free(loaded);
+    }
+
+    snprintf(path, sizeof(path), "%s/missing", output_dir);
+    CHECK(foldcessing_fold_folder(sketch, path) == -1);
+    foldcessing_close(sketch);
+}
+
+// Sketches of their own on separate threads at once, each reading an ignore list
+typedef struct {
+    char folder[4096];
+    int failures;
+} Worker;
+
+void *fold_repeatedly(void *argument) {
+    Worker *worker = (Worker*)argument;
+    char expected[64];
+    snprintf(expected, sizeof(expected), "%s.pde", strrchr(worker->folder, '/') + 1);
+
+    for (int i = 0; i < 20; i++) {
+        FoldcessingSketch *sketch = foldcessing_open(worker->folder, NULL);
+        if (!sketch) {
+            worker->failures++;
+            continue;
+        }
+        Buffer source = {0};
+        FoldcessingMap *map = foldcessing_fold(sketch, buffer_write, &source);
+        const char *file = NULL;
+        int file_line = 0;
+        if (!map || foldcessing_map_lookup(map, 8, &file, &file_line) != 1 ||
+            strcmp(file, expected) != 0 || file_line != 2) {
+            worker->failures++;
+        }
+        // Every pattern of the ignore list applies, however the threads interleave
+        if (!source.data || strstr(source.data, "skipped") || strstr(source.data, "vendored") ||
+            strstr(source.data, "noted")) {
+            worker->failures++;
+        }
+        foldcessing_map_free(map);
+        foldcessing_close(sketch);
+        free(source.data);
+    }
+    return NULL;
+}
+
+void test_threads(const char *work) {
+    Worker workers[THREADS];
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "thread%d", i);
+        new_sketch(work, name, workers[i].folder, sizeof(workers[i].folder));
+        workers[i].failures = 0;
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/.foldcessing", workers[i].folder);
+        write_text(path, "ignore=skip_*.pde, vendor/, *.bak, notes_*.pde\n");
+        snprintf(path, sizeof(path), "%s/skip_me.pde", workers[i].folder);
+        write_text(path, "int skipped = 1;\n");
+        snprintf(path, sizeof(path), "%s/notes_todo.pde", workers[i].folder);
+        write_text(path, "int noted = 1;\n");
+        snprintf(path, sizeof(path), "%s/vendor", workers[i].folder);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/vendor/lib.pde", workers[i].folder);
+        write_text(path, "int vendored = 1;\n");
+    }
+    for (int i = 0; i < THREADS; i++) pthread_create(&threads[i], NULL, fold_repeatedly, &workers[i]);
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        CHECK(workers[i].failures == 0);
+    }
+}
+
+int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+int main(void) {
+    const char *tmp = getenv("TMPDIR");
+    char work[4096];
+    snprintf(work, sizeof(work), "%s/foldcessing-library.XXXXXX", tmp ? tmp : "/tmp");
+    if (!mkdtemp(work)) {
+        perror(work);
+        return 1;
+    }
+
+    struct {
+        const char *name;
+        void (*run)(const char *work);
+    } tests[] = {
+        {"fold", test_fold},
+        {"translate", test_translate},
+        {"duplicates", test_duplicates},
+        {"fold_folder", test_fold_folder},
+        {"threads", test_threads},
+    };
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        int before = failures;
+        tests[i].run(work);
+        printf("%s %s\n", failures == before ? "PASS" : "FAIL", tests[i].name);
+    }
+
+    nftw(work, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return failures != 0;
+}
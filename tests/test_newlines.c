@@ -0,0 +1,122 @@
+/*
+ * test_newlines - Tests of the vector newline counters against the scalar one
+ *
+ * Copyright (C) 2025 Foldcessing Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Builds foldcessing.c into itself, like the benchmarks, to reach the kernels. Every kernel
+// the processor runs is given random buffers at every alignment within a cache line, with
+// every tail length up to 63 bytes and lengths past the 255 blocks the vector kernels sum
+// their lanes after, and must count what count_newlines_scalar counts.
+
+#define main foldcessing_main
+#include "../foldcessing.c"
+#undef main
+
+#define BUFFER_SIZE (64 * 1024)
+
+int failures = 0;
+
+typedef struct {
+    const char *name;
+    size_t (*count)(const char *data, size_t len);
+} Kernel;
+
+unsigned int rng_state = 1;
+
+unsigned int next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// Bytes with newlines in one of percent, the rest text with a '\r' now and then
+void fill(char *data, size_t len, int percent) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned int r = next_random() % 100;
+        data[i] = ((int)r < percent) ? '\n' : (r % 7 == 0) ? '\r' : (char)('a' + r % 26);
+    }
+}
+
+void check(const Kernel *kernel, const char *data, size_t len, int percent) {
+    size_t expected = count_newlines_scalar(data, len);
+    size_t counted = kernel->count(data, len);
+    if (counted != expected && failures < 20) {
+        fprintf(stderr, "  %s: %lu newlines instead of %lu in %lu bytes at offset %d, %d%% newlines\n",
+                kernel->name, (unsigned long)counted, (unsigned long)expected, (unsigned long)len,
+                (int)((size_t)data % 64), percent);
+    }
+    failures += counted != expected;
+}
+
+void test_kernel(const Kernel *kernel, char *buffer) {
+    static const int percents[] = {0, 1, 10, 50, 100};
+    // Around the block sizes, and past 255 blocks of 16 and 32 bytes
+    static const size_t lengths[] = {0, 1, 15, 16, 17, 31, 32, 33, 64, 100, 255, 256, 1000,
+                                     255 * 16, 255 * 16 + 1, 255 * 32 - 1, 255 * 32, 255 * 32 + 1,
+                                     4096, 20000, BUFFER_SIZE - 64};
+    char *aligned = (char*)(((size_t)buffer + 63) & ~(size_t)63);
+
+    for (size_t p = 0; p < sizeof(percents) / sizeof(percents[0]); p++) {
+        fill(buffer, BUFFER_SIZE + 128, percents[p]);
+        for (int offset = 0; offset < 64; offset++) {
+            for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+                check(kernel, aligned + offset, lengths[l], percents[p]);
+            }
+            // Every tail after whole 32-byte blocks
+            for (size_t tail = 0; tail < 64; tail++) {
+                check(kernel, aligned + offset, 256 + tail, percents[p]);
+            }
+        }
+    }
+
+    // Random lengths and offsets over random contents
+    for (int i = 0; i < 2000; i++) {
+        int percent = (int)(next_random() % 101);
+        size_t offset = next_random() % 64;
+        size_t len = next_random() % (BUFFER_SIZE - 64);
+        fill(aligned + offset, len, percent);
+        check(kernel, aligned + offset, len, percent);
+    }
+}
+
+int main(void) {
+    Kernel kernels[3];
+    int kernel_count = 0;
+#ifdef HAVE_X86_SIMD
+    if (cpu_has_sse2()) {
+        kernels[kernel_count].name = "sse2";
+        kernels[kernel_count++].count = count_newlines_sse2;
+    }
+    if (cpu_has_avx2()) {
+        kernels[kernel_count].name = "avx2";
+        kernels[kernel_count++].count = count_newlines_avx2;
+    }
+#endif
+    kernels[kernel_count].name = "count_newlines";
+    kernels[kernel_count++].count = count_newlines;
+
+    char *buffer = malloc(BUFFER_SIZE + 128);
+    if (!buffer) return 1;
+    for (int k = 0; k < kernel_count; k++) {
+        int before = failures;
+        test_kernel(&kernels[k], buffer);
+        printf("%s %s\n", failures == before ? "PASS" : "FAIL", kernels[k].name);
+    }
+    free(buffer);
+    return failures != 0;
+}